@@ -24,7 +24,8 @@ from enum import Enum
 import subprocess
 import sys
 import time
-from typing import List
+from typing import List, Tuple
+import zlib
 
 # Third-party imports
 from serial import Serial
@@ -88,6 +89,10 @@ class Preamp:
     AMP_TEMP1       = 0x11
     HV1_TEMP        = 0x12
     AMP_TEMP2       = 0x13
+    UPDATE          = 0xE0
+    UPDATE_LEN_H    = 0xE1
+    UPDATE_LEN_L    = 0xE2
+    UPDATE_CRC_3    = 0xE3
     VERSION_MAJOR   = 0xFA
     VERSION_MINOR   = 0xFB
     GIT_HASH_27_20  = 0xFC
@@ -95,6 +100,19 @@ class Preamp:
     GIT_HASH_11_04  = 0xFE
     GIT_HASH_STATUS = 0xFF
 
+  class UpdateStatus(Enum):
+    """ Firmware update status, read from the UPDATE register """
+    IDLE        = 0
+    ERASING     = 1
+    READY       = 2
+    RECEIVING   = 3
+    DONE        = 4
+    ERR_CRC     = 5
+    ERR_SIZE    = 6
+    ERR_FLASH   = 7
+    ERR_OVERRUN = 8
+    ERR_TIMEOUT = 9
+
   def __init__(self, unit: int, bus: SMBus):
     """ Preamp constructor
 
@@ -183,6 +201,26 @@ class Preamp:
       reg_val &= ~0x04
     self.bus.write_byte_data(self.addr, self.Reg.EXPANSION.value, reg_val)
 
+  def update_command(self, cmd: int) -> None:
+    """ Write a firmware update command: 0=abort, 1=start, 2=apply """
+    self.bus.write_byte_data(self.addr, self.Reg.UPDATE.value, cmd)
+
+  def read_update(self) -> Tuple['Preamp.UpdateStatus', int, int]:
+    """ Read the firmware update status
+
+      Returns:
+        status: The update's progress
+        length: Number of image bytes received so far
+        crc:    CRC-32 of the image bytes received so far
+    """
+    status = self.UpdateStatus(self.bus.read_byte_data(self.addr, self.Reg.UPDATE.value))
+    length = self.bus.read_byte_data(self.addr, self.Reg.UPDATE_LEN_H.value) << 8
+    length |= self.bus.read_byte_data(self.addr, self.Reg.UPDATE_LEN_L.value)
+    crc = 0
+    for i in range(4):
+      crc = (crc << 8) | self.bus.read_byte_data(self.addr, self.Reg.UPDATE_CRC_3.value + i)
+    return status, length, crc
+
 
 class Preamps:
   """ AmpliPi Preamp Board manager """
@@ -223,7 +261,7 @@ class Preamps:
   def __len__(self) -> int:
     return len(self.preamps)
 
-  def reset(self, unit: int = 0, bootloader: bool = False) -> None:
+  def reset(self, unit: int = 0, bootloader: bool = False, baud: int = 9600) -> None:
     """ Resets the master unit's preamp board.
         Any expansion preamps will be reset one-by-one by the previous preamp.
         After resetting, an I2C address is assigned.
@@ -231,6 +269,9 @@ class Preamps:
       Args:
         unit:       Reset from the given unit number onward. 0=master
         bootloader: If True, set BOOT0 pin high to enter bootloader mode after reset
+        baud:       Baud rate to send the I2C address at. Preamps with
+                    auto-baud firmware forward it, and later passthrough
+                    traffic, at the same rate.
     """
 
     if unit == 0:
@@ -241,7 +282,7 @@ class Preamps:
         return
 
       # Send I2C address over UART
-      self.set_i2c_address()
+      self.set_i2c_address(baud)
 
     else:
       self.preamps[unit - 1].reset_expander(bootloader)
@@ -282,8 +323,16 @@ class Preamps:
     assert baud in self.BAUD_RATES
     addr_arr = bytes((0x41, 0x10, 0x0A))
     try:
-      with Serial(PI_SERIAL_PORT, baudrate=baud, timeout=1) as ser:
+      with Serial(PI_SERIAL_PORT, baudrate=baud, timeout=0.01) as ser:
+        ser.reset_input_buffer()
         ser.write(addr_arr)
+        # Wait for the master's ready reply, which comes after every other
+        # unit's, so none are left to confuse the bootloader when flashing.
+        # Older firmware doesn't reply.
+        replies = b''
+        end = time.time() + 0.3
+        while b'R\x10\n' not in replies and time.time() < end:
+          replies += ser.read(ser.in_waiting or 1)
         return True
     except SerialException as ser_err:
       print(ser_err)
@@ -318,15 +367,15 @@ class Preamps:
       for p in range(unit): # Set UART passthrough on any previous units
         print(f'Setting unit {p} as passthrough')
         self.preamps[p].uart_passthrough(True)
-      if unit > 0: # For now the firmware can only pass through 9600 buad to expanders
-        baud = 9600
+      # Units already flashed detect the flashing baud rate when put in
+      # passthrough, so expanders can be flashed at the full rate too
       flash_result = subprocess.run([f'stm32flash -vb {baud} -w {filepath} {PI_SERIAL_PORT}'], shell=True, check=False)
       success = flash_result.returncode == 0
       if not success:
         # TODO: Error handling
         print(f'Error flashing unit {unit}, stopping programming')
       print('Resetting all preamps and starting execution in user flash')
-      self.reset()
+      self.reset(baud = baud)
 
       # If the programming was successful it was just added to the list of preamps
       if unit < len(self.preamps):
@@ -340,6 +389,67 @@ class Preamps:
         break
     return success
 
+  def update(self, filepath: str, baud: int = 115200) -> bool:
+    """ Update all available preamps at once with a given file, using the
+        firmware's own update instead of the bootloader. Every preamp must
+        already be running firmware that supports it.
+    """
+    if baud not in self.BAUD_RATES:
+      raise ValueError(f'Baud rate must be one of {self.BAUD_RATES}')
+    if len(self.preamps) == 0:
+      print('No preamps found to update')
+      return False
+
+    with open(filepath, 'rb') as fw_file:
+      image = fw_file.read()
+    crc = zlib.crc32(image)
+
+    print(f'Erasing the staging area of {len(self.preamps)} preamp(s)')
+    for p in self.preamps:
+      p.update_command(1)
+    # Erasing stretches I2C transfers, so wait for it to finish before polling
+    time.sleep(1.5)
+    if not self._wait_update(Preamp.UpdateStatus.READY, timeout = 2):
+      return False
+
+    print(f'Sending {len(image)} bytes at {baud} baud')
+    header = bytes((0x7F,)) + len(image).to_bytes(4, 'little') + crc.to_bytes(4, 'little')
+    try:
+      with Serial(PI_SERIAL_PORT, baudrate=baud, timeout=1) as ser:
+        ser.write(header + image)
+        ser.flush()
+    except SerialException as ser_err:
+      print(ser_err)
+      return False
+    if not self._wait_update(Preamp.UpdateStatus.DONE, timeout = 2):
+      for p in self.preamps:
+        p.update_command(0)
+      return False
+
+    # The last unit applies first, so no unit resets while still forwarding
+    print('Applying the update')
+    for p in reversed(self.preamps):
+      p.update_command(2)
+    time.sleep(1)
+    print('Resetting all preamps')
+    self.reset(baud = baud)
+    for unit, p in enumerate(self.preamps):
+      print(f"Unit {unit}'s new version: {p.read_version()}")
+    return True
+
+  def _wait_update(self, status: Preamp.UpdateStatus, timeout: float) -> bool:
+    """ Wait for every preamp to reach an update status, printing any that fail """
+    end = time.time() + timeout
+    while True:
+      results = [p.read_update() for p in self.preamps]
+      if all(r[0] == status for r in results):
+        return True
+      if time.time() > end or any(r[0].name.startswith('ERR') for r in results):
+        for unit, (stat, length, crc) in enumerate(results):
+          print(f'Unit {unit}: {stat.name}, received {length} bytes with CRC 0x{crc:08X}')
+        return False
+      time.sleep(0.05)
+
 
 #class PeakDetect:
   #""" """
@@ -381,6 +491,9 @@ if __name__ == '__main__':
                       help='reset the preamp(s) before communicating over I2C')
   parser.add_argument('--flash', metavar='FW.bin',
                       help='update the preamp(s) with the firmware in a .bin file')
+  parser.add_argument('--update', metavar='FW.bin',
+                      help='update all preamps at once with the firmware in a .bin file,'
+                           ' the preamps must already support in-application updates')
   parser.add_argument('-b', '--baud', type=int, default=115200,
                       help='baud rate to use for UART communication')
   parser.add_argument('-v', '--version', action='store_true', default=False,
@@ -405,6 +518,10 @@ if __name__ == '__main__':
     if not preamps.flash(filepath = args.flash, num_units = num_units, baud = args.baud):
       sys.exit(2)
 
+  if args.update is not None:
+    if not preamps.update(filepath = args.update, baud = args.baud):
+      sys.exit(2)
+
 
   if len(preamps) == 0:
     print('No preamps found, exiting')
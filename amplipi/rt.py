@@ -22,15 +22,15 @@ import math
 import io
 import os
 import time
-from enum import Enum
+from enum import Enum, IntFlag
 
-from typing import Dict, List, Tuple, Union
+from typing import Dict, List, Set, Tuple, Union
 
 # TODO: move constants like this to their own file
 DEBUG_PREAMPS = False # print out preamp state after register write
 
 from serial import Serial
-from smbus2 import SMBus
+from smbus2 import SMBus, i2c_msg
 
 # Preamp register addresses
 _REG_ADDRS = {
@@ -57,6 +57,24 @@ _REG_ADDRS = {
   'PI_TEMP'         : 0x14,
   'FAN_DUTY'        : 0x15,
   'FAN_VOLTS'       : 0x16,
+  'DIRTY'           : 0x17,
+  'SNAP_SEQ'        : 0x20,
+  'PEC'             : 0x2E,
+  'PEC_ERRORS'      : 0x2F,
+  'CHAIN'           : 0x3C,
+  'RESET_CAUSE'     : 0x92,
+  'WATCHDOG'        : 0x93,
+  'UPTIME_3'        : 0x94,
+  'UPTIME_2'        : 0x95,
+  'UPTIME_1'        : 0x96,
+  'UPTIME_0'        : 0x97,
+  'LOOPS_3'         : 0x98,
+  'LOOPS_2'         : 0x99,
+  'LOOPS_1'         : 0x9A,
+  'LOOPS_0'         : 0x9B,
+  'PWR_BOARD'       : 0xD3,
+  'CAPABILITIES_2'  : 0xF8,
+  'CAPABILITIES'    : 0xF9,
   'VERSION_MAJOR'   : 0xFA,
   'VERSION_MINOR'   : 0xFB,
   'GIT_HASH_27_20'  : 0xFC,
@@ -69,9 +87,55 @@ _SRC_TYPES = {
   0 : 'Analog',
 }
 _DEV_ADDRS = [0x08, 0x10, 0x18, 0x20, 0x28, 0x30]
+_GROUP_ADDR = 0x38 # Every preamp in the chain, if it supports PreampCap.GROUP
+
+# Status registers in the order of the telemetry snapshot, between SNAP_SEQ
+# and its checksum
+_SNAP_REGS = ['POWER', 'FANS', 'HV1_VOLTAGE', 'AMP_TEMP1', 'HV1_TEMP',
+              'AMP_TEMP2', 'PI_TEMP', 'FAN_DUTY', 'FAN_VOLTS']
 
 MAX_ZONES = 6 * len(_DEV_ADDRS)
 
+class PreampCap(IntFlag):
+  """ Features reported by the preamp's CAPABILITIES register """
+  NONE     = 0x00
+  BURST    = 0x01 # Multi-byte register transfers
+  SNAPSHOT = 0x02 # Telemetry snapshot registers
+  COMMIT   = 0x04 # Staged audio control registers
+  GROUP    = 0x08 # Group address shared by all preamps
+  DIRTY    = 0x10 # Changed status register bitmap
+  FM       = 0x20 # 400 kHz I2C
+  RAMP     = 0x40 # Volume ramps
+
+class PreampCap2(IntFlag):
+  """ Features reported by the preamp's CAPABILITIES_2 register """
+  NONE  = 0x00
+  PEC   = 0x01 # SMBus packet error checking
+  CHAIN = 0x02 # Expansion unit telemetry kept by the master
+  PWR_BOARD = 0x04 # Detected Power Board revision
+
+# Expansion unit entries in the master's CHAIN table are each an age in 128 ms
+# units then the unit's snapshot. Units send at least every second, so an
+# older entry means the unit stopped sending and is read directly instead.
+_CHAIN_ENTRY_LEN = len(_SNAP_REGS) + 3
+_CHAIN_MAX_AGE = 12
+_CHAIN_REFRESH_S = 0.25 # Units send changes at most this often
+
+# How often read_status() checks each preamp's uptime for a reset
+_RESET_CHECK_S = 1.0
+
+class ResetCause(IntFlag):
+  """ Causes of a preamp's last reset, from its RESET_CAUSE register """
+  NONE   = 0x00
+  V18PWR = 0x01 # 1.8 V domain reset
+  OBL    = 0x02 # Option byte load
+  PIN    = 0x04 # NRST pin, also set by every other cause
+  POR    = 0x08 # Power on or power down
+  SFT    = 0x10 # Software reset, e.g. after a firmware update
+  IWDG   = 0x20 # Independent watchdog
+  WWDG   = 0x40 # Window watchdog
+  LPWR   = 0x80 # Low-power management
+
 class FanCtrl(Enum):
   MAX6644 = 0
   PWM     = 1
@@ -120,9 +184,22 @@ class _Preamps:
   """
 
   preamps: Dict[int, List[int]] # Key: i2c address, Val: register values
+  synced: Dict[int, List[bool]] # Key: i2c address, Val: preamp holds the value in preamps
+  caps: Dict[int, PreampCap] # Key: i2c address, Val: firmware features
+  caps2: Dict[int, PreampCap2] # Key: i2c address, Val: more firmware features
+  status: Dict[int, Dict[str, int]] # Key: i2c address, Val: last snapshot read
+  uptime: Dict[int, int] # Key: i2c address, Val: uptime_ms at the last reset check
 
   def __init__(self, reset: bool = True, set_addr: bool = True, bootloader: bool = False, debug = True):
     self.preamps = dict()
+    self.synced = dict()
+    self.caps = dict()
+    self.caps2 = dict()
+    self.status = dict()
+    self.uptime = dict()
+    self._chain_read = 0.0 # time.monotonic() of the last CHAIN table read
+    self._reset_check: Dict[int, float] = dict() # time.monotonic() of each preamp's last reset check
+    self._restore: Set[int] = set() # Preamps that reset and still need their registers written
     if not is_amplipi():
       self.bus = None # TODO: Use i2c-stub
       print('Not running on AmpliPi hardware, mocking preamp connection')
@@ -140,6 +217,8 @@ class _Preamps:
         if self.probe_preamp(p):
           if debug:
             print(f'Preamp found at address {p}')
+          self.caps[p] = self.read_capabilities(p // 8)
+          self.caps2[p] = self.read_capabilities2(p // 8)
           self.new_preamp(p)
         else:
           if p == _DEV_ADDRS[0] and debug:
@@ -184,12 +263,17 @@ class _Preamps:
         The master preamp will set any expansion unit addresses
     """
     # Setup serial connection via UART pins
-    with Serial('/dev/serial0', baudrate=9600) as ser:
+    with Serial('/dev/serial0', baudrate=9600, timeout=0.01) as ser:
+      ser.reset_input_buffer()
       ser.write((0x41, 0x10, 0x0D, 0x0A))
 
-    # Delay to account for addresses being set
-    # Each box theoretically takes ~5ms to receive its address. Again, estimate for six boxes and include some padding
-    time.sleep(0.1)
+      # Each preamp replies 'R' + its address + '\n' once every unit below it
+      # has its address, the master last. Older firmware doesn't reply,
+      # so give up after long enough for a full chain to be addressed.
+      replies = b''
+      end = time.time() + 0.3
+      while b'R\x10\n' not in replies and time.time() < end:
+        replies += ser.read(ser.in_waiting or 1)
 
   def reset_expander(self, preamp: int, bootload: bool = False):
     """ Resets an expansion unit's preamp board.
@@ -204,7 +288,12 @@ class _Preamps:
     # TODO: release firmware and add support here
 
   def new_preamp(self, addr: int):
-    """ Populate initial register values """
+    """ Populate initial register values, read from the preamp if connected
+
+      A preamp restores its saved config at startup and may have been reset
+      by its watchdog, so its registers can't be assumed to hold their
+      defaults. The mock starts with the defaults.
+    """
     self.preamps[addr] = [
                             0x0F,
                             0x00,
@@ -218,12 +307,44 @@ class _Preamps:
                             0x4F,
                             0x4F,
                           ]
+    self.synced[addr] = [False] * len(self.preamps[addr])
+    if self.bus is not None:
+      self.preamps[addr] = self.read_regs(addr, 0, len(self.preamps[addr]))
+      self.synced[addr] = [True] * len(self.preamps[addr])
+      self.uptime[addr] = self._read32(addr, 'UPTIME_3')
 
-  def write_byte_data(self, preamp_addr, reg, data):
+  def invalidate(self, preamp_addr: int):
+    """ Forget what a preamp's registers hold, so they're all written again
+    """
+    if preamp_addr in self.synced:
+      self.synced[preamp_addr] = [False] * len(self.synced[preamp_addr])
+    self.status.pop(preamp_addr, None)
+
+  def _bus_write(self, addr: int, reg: int, data: List[int]):
+    """ Write one register, or consecutive registers in a single burst """
+    def write():
+      if len(data) == 1:
+        self.bus.write_byte_data(addr, reg, data[0])
+      else:
+        self.bus.write_i2c_block_data(addr, reg, data)
+    try:
+      time.sleep(0.001) # space out sequential calls to avoid bus errors
+      write()
+    except Exception:
+      time.sleep(0.001)
+      self.bus = SMBus(1)
+      write()
+
+  def write_regs(self, preamp_addr: int, reg: int, data: List[int]):
+    """ Write consecutive registers, skipping those the preamp already holds
+
+      The registers that changed are written in a single burst if the
+      firmware supports it, otherwise one at a time.
+    """
     assert preamp_addr in _DEV_ADDRS
     assert type(preamp_addr) == int
     assert type(reg) == int
-    assert type(data) == int
+    assert all(type(d) == int for d in data)
     # dynamically update preamps (to support mock)
     if preamp_addr not in self.preamps:
       if self.bus is None:
@@ -231,18 +352,120 @@ class _Preamps:
       else:
         return None # Preamp is not connected, do nothing
 
-    if DEBUG_PREAMPS:
-      print("writing to 0x{:02x} @ 0x{:02x} with 0x{:02x}".format(preamp_addr, reg, data))
-    self.preamps[preamp_addr][reg] = data
+    regs = self.preamps[preamp_addr]
+    synced = self.synced[preamp_addr]
+    changed = [i for i, d in enumerate(data) if reg + i >= len(regs)
+               or not synced[reg + i] or regs[reg + i] != d]
+    for i, d in enumerate(data):
+      if reg + i < len(regs):
+        regs[reg + i] = d
     # TODO: need to handle volume modifying mute state in mock
-    if self.bus is not None:
-      try:
-        time.sleep(0.001) # space out sequential calls to avoid bus errors
-        self.bus.write_byte_data(preamp_addr, reg, data)
-      except Exception:
-        time.sleep(0.001)
-        self.bus = SMBus(1)
-        self.bus.write_byte_data(preamp_addr, reg, data)
+    if self.bus is None or not changed:
+      return None
+
+    if DEBUG_PREAMPS:
+      for i in changed:
+        print("writing to 0x{:02x} @ 0x{:02x} with 0x{:02x}".format(preamp_addr, reg + i, data[i]))
+    if PreampCap.BURST in self.caps.get(preamp_addr, PreampCap.NONE):
+      first, last = changed[0], changed[-1]
+      self._bus_write(preamp_addr, reg + first, data[first:last + 1])
+      written = range(first, last + 1)
+    else:
+      for i in changed:
+        self._bus_write(preamp_addr, reg + i, [data[i]])
+      written = changed
+    for i in written:
+      if reg + i < len(synced):
+        synced[reg + i] = True
+    return None
+
+  def write_byte_data(self, preamp_addr, reg, data):
+    """ Write a register, unless the preamp already holds the value """
+    self.write_regs(preamp_addr, reg, [data])
+
+  def write_all(self, reg: int, data: int):
+    """ Write a register on every preamp, with a single write to the group
+        address if they all support it
+    """
+    addrs = list(self.preamps.keys())
+    group = self.bus is not None and len(addrs) > 1 and \
+      all(PreampCap.GROUP in self.caps.get(a, PreampCap.NONE) for a in addrs)
+    if not group:
+      for addr in addrs:
+        self.write_byte_data(addr, reg, data)
+      return
+    if all(self.synced[a][reg] and self.preamps[a][reg] == data for a in addrs):
+      return
+    if DEBUG_PREAMPS:
+      print("writing to all @ 0x{:02x} with 0x{:02x}".format(reg, data))
+    self._bus_write(_GROUP_ADDR, reg, [data])
+    for addr in addrs:
+      self.preamps[addr][reg] = data
+      self.synced[addr][reg] = True
+
+  def read_regs(self, addr: int, reg: int, length: int) -> List[int]:
+    """ Read consecutive registers, in a single burst if supported """
+    if PreampCap.BURST in self.caps.get(addr, PreampCap.NONE):
+      return self.bus.read_i2c_block_data(addr, reg, length)
+    return [self.bus.read_byte_data(addr, reg + i) for i in range(length)]
+
+  def read_status(self, addr: int) -> Dict[str, int]:
+    """ Read every status register in _SNAP_REGS
+
+      Firmware with the telemetry snapshot returns them all in one checked
+      burst, and with DIRTY a single read finds whether the last snapshot
+      is still current. Older firmware reads each register.
+      Each preamp is also checked for a reset, see check_reset().
+    """
+    self.check_reset(addr)
+    caps = self.caps.get(addr, PreampCap.NONE)
+    master = _DEV_ADDRS[0]
+    if addr != master and PreampCap2.CHAIN in self.caps2.get(master, PreampCap2.NONE):
+      # Every expansion unit's snapshot comes from one burst read of the master
+      if time.monotonic() - self._chain_read >= _CHAIN_REFRESH_S:
+        self._chain_read = time.monotonic()
+        self.status.update(self.read_chain())
+      if addr in self.status:
+        return self.status[addr]
+    if PreampCap.SNAPSHOT in caps:
+      cached = self.status.get(addr)
+      if PreampCap.DIRTY in caps:
+        # Read first, so a change while the snapshot is read shows next time
+        dirty = self.bus.read_byte_data(addr, _REG_ADDRS['DIRTY'])
+        if cached is not None and dirty == 0:
+          return cached
+      for _ in range(2):
+        snap = self.bus.read_i2c_block_data(addr, _REG_ADDRS['SNAP_SEQ'], len(_SNAP_REGS) + 2)
+        if sum(snap) & 0xFF == 0:
+          status = dict(zip(_SNAP_REGS, snap[1:-1]))
+          self.status[addr] = status
+          return status
+    # Cached like a snapshot, since a DIRTY read above may have cleared the
+    # bits for what changed
+    status = {reg: self.bus.read_byte_data(addr, _REG_ADDRS[reg]) for reg in _SNAP_REGS}
+    self.status[addr] = status
+    return status
+
+  def read_chain(self) -> Dict[int, Dict[str, int]]:
+    """ Read the master's CHAIN table of expansion unit snapshots
+
+      Entries too old or failing their checksum are left out, and any left
+      in self.status from before are dropped so those units are read
+      directly instead.
+    """
+    length = _CHAIN_ENTRY_LEN * (len(_DEV_ADDRS) - 1)
+    # Longer than an SMBus block read, so a plain I2C write then read
+    write = i2c_msg.write(_DEV_ADDRS[0], [_REG_ADDRS['CHAIN']])
+    read = i2c_msg.read(_DEV_ADDRS[0], length)
+    self.bus.i2c_rdwr(write, read)
+    table = list(read)
+    chain = dict()
+    for i, addr in enumerate(_DEV_ADDRS[1:]):
+      entry = table[i*_CHAIN_ENTRY_LEN:(i + 1)*_CHAIN_ENTRY_LEN]
+      self.status.pop(addr, None)
+      if entry[0] <= _CHAIN_MAX_AGE and sum(entry[1:]) & 0xFF == 0:
+        chain[addr] = dict(zip(_SNAP_REGS, entry[2:-1]))
+    return chain
 
   def probe_preamp(self, addr: int):
     # Scan for preamps, and set source registers to be completely digital
@@ -276,17 +499,106 @@ class _Preamps:
     """
     assert 1 <= preamp <= 6
     if self.bus is not None:
-      major = self.bus.read_byte_data(preamp*8, _REG_ADDRS['VERSION_MAJOR'])
-      minor = self.bus.read_byte_data(preamp*8, _REG_ADDRS['VERSION_MINOR'])
-      git_hash = self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_27_20']) << 20
-      git_hash |= (self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_19_12']) << 12)
-      git_hash |= (self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_11_04']) << 4)
-      git_hash4_stat = self.bus.read_byte_data(preamp*8, _REG_ADDRS['GIT_HASH_STATUS'])
+      major, minor, hash_27_20, hash_19_12, hash_11_04, git_hash4_stat = \
+        self.read_regs(preamp*8, _REG_ADDRS['VERSION_MAJOR'], 6)
+      git_hash = hash_27_20 << 20
+      git_hash |= (hash_19_12 << 12)
+      git_hash |= (hash_11_04 << 4)
       git_hash |= (git_hash4_stat >> 4)
       dirty = (git_hash4_stat & 0x01) != 0
       return major, minor, git_hash, dirty
     return None, None, None, None
 
+  def read_capabilities(self, preamp: int = 1) -> PreampCap:
+    """ Read the features supported by a preamp's firmware
+
+      Firmware without the register reads 0xFF, reported as no features.
+    """
+    assert 1 <= preamp <= 6
+    if self.bus is not None:
+      caps = self.bus.read_byte_data(preamp*8, _REG_ADDRS['CAPABILITIES'])
+      return PreampCap(caps) if caps != 0xFF else PreampCap.NONE
+    return PreampCap.NONE
+
+  def read_capabilities2(self, preamp: int = 1) -> PreampCap2:
+    """ Read the features listed in a preamp's CAPABILITIES_2 register
+
+      Firmware without the register reads 0xFF, reported as no features.
+    """
+    assert 1 <= preamp <= 6
+    if self.bus is not None:
+      caps2 = self.bus.read_byte_data(preamp*8, _REG_ADDRS['CAPABILITIES_2'])
+      return PreampCap2(caps2) if caps2 != 0xFF else PreampCap2.NONE
+    return PreampCap2.NONE
+
+  def read_uptime(self, preamp: int = 1) -> Tuple[Union[int, None],
+    Union[ResetCause, None], Union[int, None]]:
+    """ Read how long a preamp has run since its last reset, and why it reset
+
+      The high byte of each 32-bit count latches the rest, so the bytes are
+      read high to low. Firmware without these registers reads 0xFFFFFFFF.
+
+      Returns:
+        uptime_ms: Time since the last reset in ms, wraps after 49.7 days
+        cause:     What caused the last reset
+        loops:     Main loop busy periods since the last reset
+    """
+    assert 1 <= preamp <= 6
+    if self.bus is not None:
+      addr = preamp*8
+      cause = ResetCause(self.bus.read_byte_data(addr, _REG_ADDRS['RESET_CAUSE']))
+      return self._read32(addr, 'UPTIME_3'), cause, self._read32(addr, 'LOOPS_3')
+    return None, None, None
+
+  def _read32(self, addr: int, high: str) -> int:
+    """ Read a 32-bit count, high byte first so it latches the rest """
+    val = 0
+    for byte in self.read_regs(addr, _REG_ADDRS[high], 4):
+      val = (val << 8) | byte
+    return val
+
+  def reset_since(self, preamp: int, uptime_ms: int) -> bool:
+    """ True if a preamp has reset since it reported uptime_ms, in which case
+        its state needs restoring. Also True if the preamp doesn't respond, and
+        once every 49.7 days when the uptime wraps. The cached registers are
+        then invalidated, so restoring the state writes them all. The uptime
+        read is kept in self.uptime.
+    """
+    if self.bus is None:
+      return False
+    addr = preamp*8
+    try:
+      now_ms = self._read32(addr, 'UPTIME_3')
+      reset = now_ms < uptime_ms
+      self.uptime[addr] = now_ms
+    except OSError:
+      reset = True
+    if reset:
+      self.invalidate(addr)
+    return reset
+
+  def check_reset(self, addr: int):
+    """ Restore a preamp's zone state if it has reset since the last check
+
+      Checked at most every _RESET_CHECK_S. The preamp may have come back
+      with its defaults or an older saved config, so every cached audio
+      register is written back, again at each check until it succeeds.
+    """
+    if self.bus is None or addr not in self.preamps:
+      return
+    now = time.monotonic()
+    if now - self._reset_check.get(addr, 0.0) < _RESET_CHECK_S:
+      return
+    self._reset_check[addr] = now
+    if self.reset_since(addr // 8, self.uptime.get(addr, 0)):
+      self._restore.add(addr)
+    if addr in self._restore:
+      try:
+        self.write_regs(addr, 0, list(self.preamps[addr]))
+        self._restore.discard(addr)
+      except OSError:
+        pass # Still not responding, retried at the next check
+
   def read_power_status(self, preamp: int = 1) -> Tuple[Union[bool, None],
     Union[bool, None], Union[bool, None], Union[bool, None], Union[float, None]]:
     """ Read the status of the power supplies
@@ -300,12 +612,13 @@ class _Preamps:
     """
     assert 1 <= preamp <= 6
     if self.bus is not None:
-      pstat = self.bus.read_byte_data(preamp*8, _REG_ADDRS['POWER'])
+      status = self.read_status(preamp*8)
+      pstat = status['POWER']
       en_12v = (pstat & 0x08) != 0
       pg_12v = (pstat & 0x04) != 0
       en_9v = (pstat & 0x02) != 0
       pg_9v = (pstat & 0x01) != 0
-      fvstat = self.bus.read_byte_data(preamp*8, _REG_ADDRS['FAN_VOLTS'])
+      fvstat = status['FAN_VOLTS']
       v12 = fvstat / 2**4
       return pg_9v, en_9v, pg_12v, en_12v, v12
     return None, None, None, None, None
@@ -322,7 +635,7 @@ class _Preamps:
     """
     assert 1 <= preamp <= 6
     if self.bus is not None:
-      fstat = self.bus.read_byte_data(preamp*8, _REG_ADDRS['FANS'])
+      fstat = self.read_status(preamp*8)['FANS']
       ctrl = FanCtrl(fstat & 0x03)
       fans_on = (fstat & 0x04) != 0
       ovr_tmp = (fstat & 0x08) != 0
@@ -338,7 +651,7 @@ class _Preamps:
     """
     assert 1 <= preamp <= 6
     if self.bus is not None:
-      duty = self.bus.read_byte_data(preamp*8, _REG_ADDRS['FAN_DUTY'])
+      duty = self.read_status(preamp*8)['FAN_DUTY']
       return duty / (1 << 7)
     return None
 
@@ -365,9 +678,10 @@ class _Preamps:
         amp2: Temperature of the heatsink over zones 4-6 in degrees C
     """
     if self.bus is not None:
-      temp_hv1_f = self.bus.read_byte_data(preamp*8, _REG_ADDRS['HV1_TEMP'])
-      temp_amp1_f = self.bus.read_byte_data(preamp*8, _REG_ADDRS['AMP_TEMP1'])
-      temp_amp2_f = self.bus.read_byte_data(preamp*8, _REG_ADDRS['AMP_TEMP2'])
+      status = self.read_status(preamp*8)
+      temp_hv1_f = status['HV1_TEMP']
+      temp_amp1_f = status['AMP_TEMP1']
+      temp_amp2_f = status['AMP_TEMP2']
       temp_hv1 = self._fix2temp(temp_hv1_f)
       temp_amp1 = self._fix2temp(temp_amp1_f)
       temp_amp2 = self._fix2temp(temp_amp2_f)
@@ -385,7 +699,7 @@ class _Preamps:
     """
     assert 1 <= preamp <= 6
     if self.bus is not None:
-      hv1_f = self.bus.read_byte_data(preamp*8, _REG_ADDRS['HV1_VOLTAGE'])
+      hv1_f = self.read_status(preamp*8)['HV1_VOLTAGE']
       hv1 = hv1_f / 4 # Convert from UQ6.2 format
       return hv1
     return None
@@ -576,14 +890,12 @@ class Rpi:
     all_muted = False not in mutes
     if self._all_muted != all_muted:
       if all_muted:
-        for p in self._bus.preamps.keys():
-          # Standby all preamps
-          self._bus.write_byte_data(p, _REG_ADDRS['STANDBY'], 0x00)
+        # Standby all preamps
+        self._bus.write_all(_REG_ADDRS['STANDBY'], 0x00)
         time.sleep(0.1)
       else:
-        for p in self._bus.preamps.keys():
-          # Unstandby all preamps
-          self._bus.write_byte_data(p, _REG_ADDRS['STANDBY'], 0x3F)
+        # Unstandby all preamps
+        self._bus.write_all(_REG_ADDRS['STANDBY'], 0x3F)
         time.sleep(0.3)
       self._all_muted = all_muted
     return True
@@ -612,8 +924,8 @@ class Rpi:
         source_cfg123 = source_cfg123 | (src << (z*2))
       else:
         source_cfg456 = source_cfg456 | (src << ((z-3)*2))
-    self._bus.write_byte_data(_DEV_ADDRS[preamp], _REG_ADDRS['ZONE123_SRC'], source_cfg123)
-    self._bus.write_byte_data(_DEV_ADDRS[preamp], _REG_ADDRS['ZONE456_SRC'], source_cfg456)
+    self._bus.write_regs(_DEV_ADDRS[preamp], _REG_ADDRS['ZONE123_SRC'],
+                         [source_cfg123, source_cfg456])
 
     # TODO: Add error checking on successful write
     return True
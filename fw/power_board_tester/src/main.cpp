@@ -94,12 +94,45 @@
 #include <Arduino.h>
 #include <Wire.h>
 
+#include "thermistor.h"
+#include "twi.h"
+
 // Enables debug printing and test timing
 //#define DEBUG
 
+// Production mode. Instead of re-running every test each TEST_PERIOD_MS, the
+// tests are run once each time a board is inserted, stopping at the first
+// failure. The result and each test's duration in us are sent over SerialUSB
+// as a CSV line.
+//#define PRODUCTION
+
+// I2C benchmark, run once at reset with a board connected. Each bus clock in
+// BENCH_CLOCKS is swept over the loopback and the Power Board's devices, and
+// the results are sent over SerialUSB as CSV lines.
+//#define I2C_BENCH
+
 // How often to run the tests
 #define TEST_PERIOD_MS 500
 
+// A board is inserted once Ctrl 5VD has been above BOARD_PRESENT_V for
+// BOARD_SETTLE_MS, and removed when it falls below BOARD_ABSENT_V
+#define BOARD_PRESENT_V 4.5
+#define BOARD_ABSENT_V  1.0
+#define BOARD_SETTLE_MS 500
+
+// Time for the +12VD supply to settle after the DPOT changes
+#define DPOT_SETTLE_MS 50
+
+// Time for FAN_ON to settle after it's written, and for Wire1 to receive the
+// loopback, both from when the transaction is submitted
+#define FAN_ON_SETTLE_US    1000
+#define LOOPBACK_TIMEOUT_US 2000
+
+// Sample every rail continuously with the ADC in free-running mode, the PDC
+// storing each scan. Otherwise each rail is read with analogRead() when
+// tested, taking most of the test period.
+#define ADC_SCAN
+
 // TFT display parameters
 #define TFT_CS       10
 #define TFT_DC       11
@@ -111,12 +144,30 @@ Adafruit_ILI9341 tft = Adafruit_ILI9341(TFT_CS, TFT_DC);
 #define TFT_FONT_WIDTH  6
 #define TFT_FONT_HEIGHT 8
 #define TEXT_MARGIN     4
+#define TEXT_SIZE       2  // Font scale
+
+// Characters in each test value cell
+static constexpr uint8_t CELL_CHARS = 6;
+
+// Last text and color drawn in a test value cell. The display is only
+// written where a glyph changes, redrawing every cell each test period took
+// most of the period over SPI.
+struct Cell {
+  char     text[CELL_CHARS];  // Padded with spaces, not null-terminated
+  uint16_t color;
+};
+
+// Off-screen glyph, sent to the display in a single window write
+static constexpr int16_t GLYPH_WIDTH  = TEXT_SIZE * TFT_FONT_WIDTH;
+static constexpr int16_t GLYPH_HEIGHT = TEXT_SIZE * TFT_FONT_HEIGHT;
+GFXcanvas16              glyph_(GLYPH_WIDTH, GLYPH_HEIGHT);
 
 // I2C loopback test
 static constexpr uint8_t I2C_TEST_VAL = 0xA4;
 
 // I2C GPIO
 static constexpr uint8_t MCP23008_REG_IODIR = 0x00;
+static constexpr uint8_t MCP23008_REG_GPIO  = 0x09;
 static constexpr uint8_t MCP23008_REG_OLAT  = 0x0A;
 
 // I2C digital potentiometer values to loop through
@@ -156,18 +207,17 @@ constexpr float adcToVolts(uint32_t adc_val, uint8_t bits, float v_ref,
 }
 
 // Returns false if outside of [min, max], disconnected, or shorted
+// Uses the preamp firmware's thermistor table so both convert identically.
 bool adcToTempStr(uint8_t ntc_adc, float min, float max, char* str) {
-  if (ntc_adc == 0) {
-    // 0 causes divide-by-zero
+  int16_t temp_q7_8 = thermToQ7_8(ntc_adc << 8);
+  if (temp_q7_8 == THERM_DISCONNECTED) {
     sprintf(str, "%s", " D/C");
     return false;
-  } else if (ntc_adc == 255) {
-    // 255 causes Rt=0 which leads to ln(0)
+  } else if (temp_q7_8 == THERM_SHORTED) {
     sprintf(str, "%s", "SHORT");
     return false;
   } else {
-    float rt   = 4.7 * (255 / (float)ntc_adc - 1);
-    float temp = 1.0 / (log(rt / 10) / 3900 + 1.0 / (25.0 + 273.5)) - 273.15;
+    float temp = temp_q7_8 / 256.0;
     sprintf(str, "%5.1fC", temp);
     return min < temp && temp < max;
   }
@@ -186,61 +236,156 @@ uint16_t rgb565(float red, float green, float blue) {
   return (r5 << 11) | (g6 << 5) | b5;
 }
 
-bool readI2CADC(uint8_t* ch0, uint8_t* ch1, uint8_t* ch2, uint8_t* ch3) {
-  Wire.beginTransmission(SlaveAddr::adc);
-  Wire.write((uint8_t)0b00000111);  // Send configuration byte, set CS=0x2
-  Wire.endTransmission();
+/* Power Board I2C transactions, run by twiUpdate() while the tests continue.
+ * Each is used by one test at a time.
+ */
+
+// Configure the MAX11601 to scan channels 0 to 3 (CS=0x2), then read them
+static const uint8_t adc_cfg_[] = {0b00000111};
+static uint8_t       adc_data_[4];
+static TwiXfer       adc_xfer_ = {
+    SlaveAddr::adc, adc_cfg_, 1, adc_data_, 4, TwiState::idle, TwiStatus::ok};
+
+// FAN_ON = GP7
+// EN_12V = GP1 (Removed on Power Board Rev4)
+// EN_9V  = GP0 (Removed on Power Board Rev3)
+// Set GP7, GP1, and GP0 as outputs, always enabling 9V and 12V for old boards
+static const uint8_t gpio_dir_[]     = {MCP23008_REG_IODIR, 0x7C};
+static const uint8_t gpio_fan_on_[]  = {MCP23008_REG_OLAT, 0x83};
+static const uint8_t gpio_fan_off_[] = {MCP23008_REG_OLAT, 0x03};
+static TwiXfer       gpio_dir_xfer_  = {
+    SlaveAddr::gpio, gpio_dir_, 2, NULL, 0, TwiState::idle, TwiStatus::ok};
+static TwiXfer       gpio_olat_xfer_ = {
+    SlaveAddr::gpio, gpio_fan_on_, 2, NULL, 0, TwiState::idle, TwiStatus::ok};
+
+// PG_12V   = GP3
+// PG_5VA   = GP2
+static const uint8_t gpio_reg_[]     = {MCP23008_REG_GPIO};
+static uint8_t       gpio_pins_      = 0;
+static TwiXfer       gpio_read_xfer_ = {
+    SlaveAddr::gpio, gpio_reg_, 1, &gpio_pins_, 1, TwiState::idle,
+    TwiStatus::ok};
+
+static uint8_t dpot_tx_[] = {0x00, 0x00};  // Instruction byte, value
+static TwiXfer dpot_xfer_ = {
+    SlaveAddr::dpot, dpot_tx_, 2, NULL, 0, TwiState::idle, TwiStatus::ok};
+
+static const uint8_t loopback_tx_[] = {I2C_TEST_VAL};
+static TwiXfer       loopback_xfer_ = {
+    SlaveAddr::due, loopback_tx_, 1, NULL, 0, TwiState::idle, TwiStatus::ok};
+
+bool xferDone(const TwiXfer& xfer) {
+  return xfer.state == TwiState::done;
+}
+
+bool xferOk(const TwiXfer& xfer) {
+  return xfer.status == TwiStatus::ok;
+}
+
+#ifdef ADC_SCAN
+// Analog pins scanned, A7 is a digital input. SAM3X ADC channels are in
+// reverse order, A0 is channel 7.
+static constexpr uint8_t  ADC_PINS[]   = {A0, A1, A2, A3, A4, A5, A6};
+static constexpr size_t   ADC_NUM_PINS = sizeof(ADC_PINS);
+static constexpr size_t   ADC_CHANNELS = 16;
+static constexpr uint32_t ADC_SAMPLES  = 16;  // Samples summed per channel
 
-  Wire.requestFrom(SlaveAddr::adc, 4);
-  if (Wire.available() >= 4) {
-    *ch0 = (uint8_t)Wire.read();
-    *ch1 = (uint8_t)Wire.read();
-    *ch2 = (uint8_t)Wire.read();
-    *ch3 = (uint8_t)Wire.read();
-    return true;
-  } else {
-    *ch0 = 0;
-    *ch1 = 0;
-    *ch2 = 0;
-    *ch3 = 0;
-    return false;
+// ADC at 84 MHz / ((PRESCAL + 1) * 2) = 4.2 MHz. Each conversion takes 16
+// clocks tracking (the rails' dividers are up to 25k source impedance) and 20
+// converting, so a buffer of scans completes every ~1 ms.
+static constexpr uint32_t ADC_PRESCAL  = 9;
+static constexpr uint32_t ADC_TRACKTIM = 15;
+
+// The PDC fills one buffer while the last one filled is summed
+static constexpr size_t ADC_BUF_LEN = ADC_SAMPLES * ADC_NUM_PINS;
+static uint16_t         adc_buf_[2][ADC_BUF_LEN];
+static uint8_t          adc_filling_ = 0;
+
+// Latest sum of ADC_SAMPLES 12-bit samples for each channel, set by the ADC
+// interrupt
+static volatile uint32_t adc_sums_[ADC_CHANNELS];
+
+// Sums copied from adc_sums_ by adcSnapshot(), so every rail tested in a
+// period was sampled within the same ~1 ms
+static uint32_t adc_snapshot_[ADC_CHANNELS];
+
+void ADC_Handler() {
+  if (!(ADC->ADC_ISR & ADC_ISR_ENDRX)) {
+    return;
+  }
+  // The PDC has moved on to the next buffer, queue the one just filled after
+  // it. It isn't written again until the other is full.
+  uint16_t* done = adc_buf_[adc_filling_];
+  adc_filling_ ^= 1;
+  ADC->ADC_RNPR = (uint32_t)done;
+  ADC->ADC_RNCR = ADC_BUF_LEN;
+
+  // Each sample is tagged with its channel in bits 15:12
+  uint32_t sums[ADC_CHANNELS]   = {0};
+  uint32_t counts[ADC_CHANNELS] = {0};
+  for (size_t i = 0; i < ADC_BUF_LEN; i++) {
+    uint8_t ch = done[i] >> 12;
+    sums[ch] += done[i] & 0x0FFF;
+    counts[ch]++;
+  }
+  for (size_t ch = 0; ch < ADC_CHANNELS; ch++) {
+    if (counts[ch]) {
+      adc_sums_[ch] = sums[ch] * ADC_SAMPLES / counts[ch];
+    }
   }
 }
 
-void writeI2CGPIO(bool fan_on) {
-  // FAN_ON = GP7
-  // EN_12V = GP1 (Removed on Power Board Rev4)
-  // EN_9V  = GP0 (Removed on Power Board Rev3)
-  Wire.beginTransmission(SlaveAddr::gpio);
-  Wire.write(MCP23008_REG_IODIR);
-  Wire.write((uint8_t)0x7C);  // Set GP7, GP1, and GP0 as outputs
-  Wire.endTransmission();
+// Start free-running conversions of every pin in ADC_PINS into adc_buf_
+void initADCScan() {
+  uint32_t chans = 0;
+  for (uint8_t pin : ADC_PINS) {
+    chans |= 1 << g_APinDescription[pin].ulADCChannelNumber;
+  }
 
-  // Always enable 9V and 12V for old boards
-  Wire.beginTransmission(SlaveAddr::gpio);
-  Wire.write(MCP23008_REG_OLAT);
-  Wire.write(fan_on ? 0x83 : 0x03);
-  Wire.endTransmission();
+  pmc_enable_periph_clk(ID_ADC);
+  ADC->ADC_CR   = ADC_CR_SWRST;
+  ADC->ADC_MR   = ADC_MR_FREERUN_ON | ADC_MR_PRESCAL(ADC_PRESCAL) |
+                  ADC_MR_STARTUP_SUT64 | ADC_MR_SETTLING_AST3 |
+                  ADC_MR_TRACKTIM(ADC_TRACKTIM) | ADC_MR_TRANSFER(1);
+  ADC->ADC_EMR  = ADC_EMR_TAG;
+  ADC->ADC_CHDR = ~chans;
+  ADC->ADC_CHER = chans;
+
+  ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+  ADC->ADC_RPR  = (uint32_t)adc_buf_[0];
+  ADC->ADC_RCR  = ADC_BUF_LEN;
+  ADC->ADC_RNPR = (uint32_t)adc_buf_[1];
+  ADC->ADC_RNCR = ADC_BUF_LEN;
+  ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+
+  ADC->ADC_IDR = ~ADC_IDR_ENDRX;
+  ADC->ADC_IER = ADC_IER_ENDRX;
+  NVIC_EnableIRQ(ADC_IRQn);
+  ADC->ADC_CR = ADC_CR_START;
 }
 
-// Gets PG_12V and PG_5VA's status
-// Returns true on I2C read success, false on failure
-bool readI2CGPIO(bool& pg_12v, bool& pg_5va) {
-  // PG_12V   = GP3
-  // PG_5VA   = GP2
-  Wire.beginTransmission(SlaveAddr::gpio);
-  Wire.write(MCP23008_REG_OLAT);
-  Wire.requestFrom(SlaveAddr::gpio, 1);
-  Wire.endTransmission();
-  if (Wire.available()) {
-    uint8_t gpio = Wire.read();
-    pg_12v       = gpio & 0x08;
-    pg_5va       = gpio & 0x04;
-    return true;
+// Take the latest samples of every rail for readAna16()
+void adcSnapshot() {
+  noInterrupts();
+  for (size_t ch = 0; ch < ADC_CHANNELS; ch++) {
+    adc_snapshot_[ch] = adc_sums_[ch];
   }
-  return false;
+  interrupts();
+}
+
+// Sum of 16 ADC reads, resulting in a 16-bit ADC read, from the last snapshot
+uint32_t readAna16(uint8_t pin) {
+  return adc_snapshot_[g_APinDescription[pin].ulADCChannelNumber];
 }
 
+// As readAna16(), from the latest samples rather than the snapshot
+uint32_t readAna16Now(uint8_t pin) {
+  return adc_sums_[g_APinDescription[pin].ulADCChannelNumber];
+}
+#else
+void initADCScan() {}
+void adcSnapshot() {}
+
 // Sum 16 ADC reads, resulting in a 16-bit ADC read
 uint32_t readAna16(uint8_t pin) {
   uint32_t ana = 0;
@@ -250,17 +395,49 @@ uint32_t readAna16(uint8_t pin) {
   return ana;
 }
 
+uint32_t readAna16Now(uint8_t pin) {
+  return readAna16(pin);
+}
+#endif
+
+// Clear a cell's cache to match a cell cleared on the display
+void clearCell(Cell& cell) {
+  memset(cell.text, ' ', CELL_CHARS);
+  cell.color = ILI9341_BLACK;
+}
+
+// Draw text at (x, y) and update the cell's cache, writing only the glyphs
+// that differ from the ones already on the display. A glyph's background is
+// drawn with it, so nothing needs clearing first.
+void drawCell(Cell& cell, int16_t x, int16_t y, const char* text,
+              uint16_t color) {
+  bool end = false;
+  for (uint8_t i = 0; i < CELL_CHARS; i++) {
+    end    = end || text[i] == '\0';
+    char c = end ? ' ' : text[i];
+    // Spaces look the same in any color
+    bool recolor = color != cell.color && c != ' ';
+    if (c != cell.text[i] || recolor) {
+      glyph_.drawChar(0, 0, c, color, ILI9341_BLACK, TEXT_SIZE);
+      tft.drawRGBBitmap(x + i * GLYPH_WIDTH, y, glyph_.getBuffer(),
+                        GLYPH_WIDTH, GLYPH_HEIGHT);
+      cell.text[i] = c;
+    }
+  }
+  cell.color = color;
+}
+
 // N = test number, AKA what line # on the screen
 template <uint8_t N>
 void drawTest(const char* desc, const char* val1, bool ok1, const char* val2,
               bool ok2) {
   static constexpr uint8_t n1 = 12;  // Number of characters in first column
-  static constexpr uint8_t n2 = 6;   // Number of characters in second column
-  static constexpr uint8_t n3 = 6;   // Number of characters in third column
+  static constexpr uint8_t n2 = CELL_CHARS;  // Characters in second column
+  static constexpr uint8_t n3 = CELL_CHARS;  // Characters in third column
 
-  // Font size (doubled)
-  static constexpr int16_t fw = 2 * TFT_FONT_WIDTH;
-  static constexpr int16_t fh = 2 * TFT_FONT_HEIGHT;
+  // Font size
+  static constexpr int16_t fw = GLYPH_WIDTH;
+  static constexpr int16_t fh = GLYPH_HEIGHT;
 
   // Column starts and ends
   static constexpr int16_t c1xl  = TEXT_MARGIN - 1;      // Leftmost pixel
@@ -282,6 +459,8 @@ void drawTest(const char* desc, const char* val1, bool ok1, const char* val2,
   static constexpr int16_t ytb = ytt + fh;                    // Text end
   static constexpr int16_t yb  = ytb + TEXT_MARGIN;  // Bottommost pixel
 
+  static Cell cell2;
+  static Cell cell3;
   static bool init = true;
   if (init) {
     // Clear entire area
@@ -300,22 +479,504 @@ void drawTest(const char* desc, const char* val1, bool ok1, const char* val2,
     tft.drawLine(c2xl, yt, c2xl, yb, ILI9341_LIGHTGREY);
     tft.drawLine(c3xl, yt, c3xl, yb, ILI9341_LIGHTGREY);
     tft.drawLine(c3xr, yt, c3xr, yb, ILI9341_LIGHTGREY);
+    clearCell(cell2);
+    clearCell(cell3);
     init = false;
-  } else {
-    // Clear the area that will be re-written with voltage text
-    tft.fillRect(c2xtl, ytt, n2 * fw, fh, ILI9341_BLACK);
-    tft.fillRect(c3xtl, ytt, n3 * fw, fh, ILI9341_BLACK);
   }
 
   // Update test result text
-  tft.setCursor(c2xtl, ytt);
-  tft.setTextColor(ok1 ? ILI9341_GREEN : ILI9341_RED);
-  tft.println(val1);
-  tft.setCursor(c3xtl, ytt);
-  tft.setTextColor(ok2 ? ILI9341_GREEN : ILI9341_RED);
-  tft.println(val2);
+  drawCell(cell2, c2xtl, ytt, val1, ok1 ? ILI9341_GREEN : ILI9341_RED);
+  drawCell(cell3, c3xtl, ytt, val2, ok2 ? ILI9341_GREEN : ILI9341_RED);
+}
+
+enum class Result : uint8_t
+{
+  pending,
+  pass,
+  fail,
+};
+
+Result result(bool ok) {
+  return ok ? Result::pass : Result::fail;
+}
+
+/* Tests, run in steps by runTests(). Each is called with its step, 0 on the
+ * first call, and returns pending until it has drawn its row. Tests waiting
+ * on the bus or a settling supply return straight away, so the others run
+ * meanwhile. Analog values are from the adcSnapshot() taken at the start.
+ */
+
+Result testCtrl5V(const char* desc, uint8_t& step) {
+  (void)step;
+  char  strbuf1[7] = {0};
+  char  strbuf2[7] = {0};
+  float ctrl5va    = adcToVolts(readAna16(A0), 16, 3.3, 33, 100);
+  float ctrl5vd    = adcToVolts(readAna16(A1), 16, 3.3, 33, 100);
+  sprintf(strbuf1, "%5.2fV", ctrl5va);
+  sprintf(strbuf2, "%5.2fV", ctrl5vd);
+  bool ok1 = ctrl5va < 5.5 && ctrl5va > 4.5;
+  bool ok2 = ctrl5vd < 5.5 && ctrl5va > 4.5;
+  drawTest<0>(desc, strbuf1, ok1, strbuf2, ok2);
+  return result(ok1 && ok2);
+}
+
+Result testPreamp(const char* desc, uint8_t& step) {
+  (void)step;
+  char  strbuf1[7] = {0};
+  char  strbuf2[7] = {0};
+  float preamp9v   = adcToVolts(readAna16(A2), 16, 3.3, 33, 100);
+  float preamp5v   = adcToVolts(readAna16(A3), 16, 3.3, 33, 100);
+  sprintf(strbuf1, "%5.2fV", preamp9v);
+  sprintf(strbuf2, "%5.2fV", preamp5v);
+  bool ok1 = preamp9v < 9.5 && preamp9v > 8.5;
+  bool ok2 = preamp5v < 5.5 && preamp5v > 4.5;
+  drawTest<1>(desc, strbuf1, ok1, strbuf2, ok2);
+  return result(ok1 && ok2);
+}
+
+Result testPreout(const char* desc, uint8_t& step) {
+  (void)step;
+  char  strbuf1[7] = {0};
+  float preout9v   = adcToVolts(readAna16(A4), 16, 3.3, 33, 100);
+  sprintf(strbuf1, "%5.2fV", preout9v);
+  bool ok1 = preout9v < 9.5 && preout9v > 8.5;
+  drawTest<2>(desc, strbuf1, ok1, "", true);
+  return result(ok1);
+}
+
+// Check I2C loopback, sending the test byte and waiting for Wire1 to get it
+Result testI2COut(const char* desc, uint8_t& step) {
+  static uint32_t sent_us = 0;
+  if (step == 0) {
+    i2c_loopback_ok_ = false;
+    if (twiSubmit(&loopback_xfer_)) {
+      sent_us = micros();
+      step    = 1;
+    }
+    return Result::pending;
+  }
+  if (!xferDone(loopback_xfer_)) {
+    return Result::pending;
+  }
+  bool rx_ok = i2c_loopback_ok_ && xferOk(loopback_xfer_);
+  if (!rx_ok && micros() - sent_us < LOOPBACK_TIMEOUT_US) {
+    return Result::pending;
+  }
+
+  char  strbuf1[7] = {0};
+  float i2c3v3     = adcToVolts(readAna16(A5), 16, 3.3, 100, 100);
+  sprintf(strbuf1, "%5.2fV", i2c3v3);
+  bool ok1 = i2c3v3 < 3.6 && i2c3v3 > 3.0;
+  drawTest<3>(desc, strbuf1, ok1, rx_ok ? " PASS" : " FAIL", rx_ok);
+  return result(ok1 && rx_ok);
+}
+
+// Read I2C ADC, the temperatures are checked by testI2CTemps()
+static bool adc_read_ = false;
+
+Result testI2CADC(const char* desc, uint8_t& step) {
+  if (step == 0) {
+    adc_read_ = false;
+    if (twiSubmit(&adc_xfer_)) {
+      step = 1;
+    }
+    return Result::pending;
+  }
+  if (!xferDone(adc_xfer_)) {
+    return Result::pending;
+  }
+  if (!xferOk(adc_xfer_)) {
+    memset(adc_data_, 0, sizeof(adc_data_));
+  }
+  adc_read_ = true;
+
+  // Channels 0 to 3: HV1, amp NTC 1, HV1 NTC and amp NTC 2
+  char  strbuf1[7] = {0};
+  char  strbuf2[7] = {0};
+  float hv1        = adcToVolts(adc_data_[0], 8, 3.3, 4.7, 100);
+  sprintf(strbuf1, "%5.2fV", hv1);
+  bool ok1        = hv1 < 28 && hv1 > 20;
+  bool hv1_ntc_ok = adcToTempStr(adc_data_[2], 15, 30, strbuf2);
+  drawTest<4>(desc, strbuf1, ok1, strbuf2, hv1_ntc_ok);
+  return result(ok1 && hv1_ntc_ok);
+}
+
+Result testI2CTemps(const char* desc, uint8_t& step) {
+  (void)step;
+  if (!adc_read_) {
+    return Result::pending;
+  }
+  char strbuf1[7] = {0};
+  char strbuf2[7] = {0};
+  bool temp1_ok   = adcToTempStr(adc_data_[1], 24, 26, strbuf1);
+  bool temp2_ok   = adcToTempStr(adc_data_[3], 24, 26, strbuf2);
+  drawTest<5>(desc, strbuf1, temp1_ok, strbuf2, temp2_ok);
+  return result(temp1_ok && temp2_ok);
+}
+
+// Check the 12V power supply
+Result testPowerGood(const char* desc, uint8_t& step) {
+  if (step == 0) {
+    if (twiSubmit(&gpio_read_xfer_)) {
+      step = 1;
+    }
+    return Result::pending;
+  }
+  if (!xferDone(gpio_read_xfer_)) {
+    return Result::pending;
+  }
+  bool i2c_ok = xferOk(gpio_read_xfer_);
+  bool pg_12v = i2c_ok && (gpio_pins_ & 0x08);
+  bool pg_5va = i2c_ok && (gpio_pins_ & 0x04);
+  drawTest<6>(desc, pg_12v ? " PASS" : " FAIL", pg_12v,
+              pg_5va ? " PASS" : " FAIL", pg_5va);
+  return result(pg_12v && pg_5va);
+}
+
+// Check the 12V fan power supply at each of DPOT_VALS, then that the fan
+// control output works
+Result testFan(const char* desc, uint8_t& step) {
+  enum : uint8_t
+  {
+    start,
+    set_dpot,
+    measure,
+    set_dir,
+    fan_on,
+    check_on,
+    fan_off,
+    check_off,
+  };
+  static uint8_t  dpot_idx = 0;
+  static uint32_t wait_us  = 0;  // Start of the current wait
+  static float    fan12v   = 0;
+  static bool     ok1      = true;
+  static bool     ok2      = true;
+
+  switch (step) {
+    case start:
+      dpot_idx = 0;
+      ok1      = true;
+      step     = set_dpot;
+      // fall through
+    case set_dpot:
+      dpot_tx_[1] = DPOT_VALS[dpot_idx];
+      if (twiSubmit(&dpot_xfer_)) {
+        wait_us = micros();
+        step    = measure;
+      }
+      return Result::pending;
+
+    case measure: {
+      if (!xferDone(dpot_xfer_) ||
+          micros() - wait_us < DPOT_SETTLE_MS * 1000) {
+        return Result::pending;
+      }
+      fan12v        = adcToVolts(readAna16Now(A6), 16, 3.3, 10, 100);
+      float volts   = DPOT_VOLTS[dpot_idx];
+      bool in_range = fan12v < volts * 1.1 && fan12v > volts * 0.9;
+      ok1           = ok1 && xferOk(dpot_xfer_) && in_range;
+      step = ++dpot_idx < sizeof(DPOT_VALS) ? set_dpot : set_dir;
+      return Result::pending;
+    }
+
+    case set_dir:
+      if (twiSubmit(&gpio_dir_xfer_)) {
+        step = fan_on;
+      }
+      return Result::pending;
+
+    case fan_on:
+    case fan_off:
+      gpio_olat_xfer_.tx = step == fan_on ? gpio_fan_on_ : gpio_fan_off_;
+      if (twiSubmit(&gpio_olat_xfer_)) {
+        wait_us = micros();
+        step += 1;
+      }
+      return Result::pending;
+
+    case check_on:
+    case check_off: {
+      if (!xferDone(gpio_olat_xfer_) ||
+          micros() - wait_us < FAN_ON_SETTLE_US) {
+        return Result::pending;
+      }
+      bool i2c_ok = xferOk(gpio_dir_xfer_) && xferOk(gpio_olat_xfer_);
+      if (step == check_on) {
+        ok2  = i2c_ok && digitalRead(A7) == HIGH;
+        step = fan_off;
+        return Result::pending;
+      }
+      ok2 = ok2 && i2c_ok && digitalRead(A7) == LOW;
+      break;
+    }
+  }
+
+  char strbuf1[7] = {0};
+  sprintf(strbuf1, "%5.2fV", fan12v);
+  drawTest<7>(desc, strbuf1, ok1, ok2 ? " PASS" : " FAIL", ok2);
+  return result(ok1 && ok2);
+}
+
+// Blank a test's values, for tests not run
+template <uint8_t N>
+void clearTest(const char* desc) {
+  drawTest<N>(desc, "", true, "", true);
+}
+
+struct Test {
+  const char* name;  // CSV column name
+  const char* desc;  // Displayed name
+  Result (*run)(const char* desc, uint8_t& step);
+  void (*clear)(const char* desc);
+};
+
+static const Test TESTS[] = {
+    {"ctrl_5v", "Ctrl 5VA/5VD", testCtrl5V, clearTest<0>},
+    {"preamp", "Preamp 9V/5V", testPreamp, clearTest<1>},
+    {"preout", "Preout 9V", testPreout, clearTest<2>},
+    {"i2c_out", "I2C out (J3)", testI2COut, clearTest<3>},
+    {"i2c_adc", "I2C ADC HV", testI2CADC, clearTest<4>},
+    {"i2c_temps", "I2C ADC temp", testI2CTemps, clearTest<5>},
+    {"power_good", "PG_12V/PG_5V", testPowerGood, clearTest<6>},
+    {"fan", "12V/FAN_ON", testFan, clearTest<7>},
+};
+static constexpr size_t NUM_TESTS = sizeof(TESTS) / sizeof(TESTS[0]);
+
+// Run every test to its result, stepping through them in turn and running
+// the I2C transactions between steps. With abort set, the tests left are
+// blanked at the first failure. Sets each test's result and the time from its
+// first step to the result, and returns the first test that failed or
+// NUM_TESTS.
+size_t runTests(bool abort, Result* results, uint32_t* durations_us) {
+  uint8_t  steps[NUM_TESTS] = {0};
+  uint32_t start_us[NUM_TESTS];
+  size_t   failed = NUM_TESTS;
+  size_t   left   = NUM_TESTS;
+
+  // Finish any transactions left by an aborted run first
+  while (!twiIdle()) {
+    twiUpdate();
+  }
+  adcSnapshot();
+  for (size_t i = 0; i < NUM_TESTS; i++) {
+    results[i]      = Result::pending;
+    durations_us[i] = 0;
+  }
+
+  bool first = true;
+  while (left && !(abort && failed < NUM_TESTS)) {
+    for (size_t i = 0; i < NUM_TESTS && !(abort && failed < NUM_TESTS); i++) {
+      if (results[i] != Result::pending) {
+        continue;
+      }
+      if (first) {
+        start_us[i] = micros();
+      }
+      twiUpdate();
+      results[i] = TESTS[i].run(TESTS[i].desc, steps[i]);
+      if (results[i] != Result::pending) {
+        durations_us[i] = micros() - start_us[i];
+        left--;
+        if (results[i] == Result::fail && failed == NUM_TESTS) {
+          failed = i;
+        }
+      }
+    }
+    first = false;
+  }
+
+  for (size_t i = 0; i < NUM_TESTS; i++) {
+    if (results[i] == Result::pending) {
+      TESTS[i].clear(TESTS[i].desc);
+    }
+  }
+  return failed;
+}
+
+#ifdef I2C_BENCH
+static constexpr uint32_t BENCH_CLOCKS[]      = {100000, 400000, 1000000};
+static constexpr size_t   BENCH_XFERS         = 200;   // Per clock and size
+static constexpr uint32_t BENCH_RX_TIMEOUT_US = 2000;  // For Wire1 to receive
+static constexpr uint32_t BENCH_PERCENTILES[] = {0, 50, 90, 99, 100};
+
+enum class BenchResult
+{
+  ok,
+  nack,     // NACK or lost arbitration, Wire can't tell them apart
+  timeout,  // No STOP completion
+  corrupt,  // Loopback data wrong or missing
+};
+
+// Loopback data received by Wire1, bench_rx_len_ is -1 until it arrives
+static volatile uint8_t bench_rx_[BUFFER_LENGTH];
+static volatile int     bench_rx_len_ = -1;
+void benchSlaveRx(int rxBufLen) {
+  int len = 0;
+  while (Wire1.available() && len < BUFFER_LENGTH) {
+    bench_rx_[len++] = Wire1.read();
+  }
+  bench_rx_len_ = len;
+  (void)rxBufLen;
+}
+
+BenchResult writeResult(uint8_t status) {
+  switch (status) {
+    case 0:
+      return BenchResult::ok;
+    case 4:
+      return BenchResult::timeout;
+    default:
+      return BenchResult::nack;
+  }
+}
+
+// Run one transaction of len data bytes, setting us to its bus time
+typedef BenchResult (*BenchXfer)(uint8_t len, uint8_t seq, uint32_t& us);
+
+// Wire to Wire1 through the LED board connector, checked byte by byte
+BenchResult benchLoopback(uint8_t len, uint8_t seq, uint32_t& us) {
+  bench_rx_len_ = -1;
+  Wire.beginTransmission(SlaveAddr::due);
+  for (uint8_t i = 0; i < len; i++) {
+    Wire.write((uint8_t)(seq + i));
+  }
+  uint32_t start  = micros();
+  uint8_t  status = Wire.endTransmission();
+  us              = micros() - start;
+  if (status) {
+    return writeResult(status);
+  }
+
+  while (bench_rx_len_ < 0 && micros() - start < BENCH_RX_TIMEOUT_US) {}
+  if (bench_rx_len_ != len) {
+    return BenchResult::corrupt;
+  }
+  for (uint8_t i = 0; i < len; i++) {
+    if (bench_rx_[i] != (uint8_t)(seq + i)) {
+      return BenchResult::corrupt;
+    }
+  }
+  return BenchResult::ok;
+}
+
+BenchResult benchRead(uint8_t dev, uint8_t len, uint32_t iaddr, uint8_t isize,
+                      uint32_t& us) {
+  uint32_t start = micros();
+  uint8_t  n     = Wire.requestFrom(dev, len, iaddr, isize, true);
+  us             = micros() - start;
+  while (Wire.available()) {
+    Wire.read();
+  }
+  return n == len ? BenchResult::ok : BenchResult::nack;
 }
 
+// MAX11601 conversions, each byte read is the next channel
+BenchResult benchADC(uint8_t len, uint8_t seq, uint32_t& us) {
+  (void)seq;
+  return benchRead(SlaveAddr::adc, len, 0, 0, us);
+}
+
+// MCP23008 sequential register reads, from IODIR
+BenchResult benchGPIORead(uint8_t len, uint8_t seq, uint32_t& us) {
+  (void)seq;
+  return benchRead(SlaveAddr::gpio, len, MCP23008_REG_IODIR, 1, us);
+}
+
+// MCP23008 IODIR writes of the value testFan() sets
+BenchResult benchGPIOWrite(uint8_t len, uint8_t seq, uint32_t& us) {
+  (void)len;
+  (void)seq;
+  Wire.beginTransmission(SlaveAddr::gpio);
+  Wire.write(MCP23008_REG_IODIR);
+  Wire.write((uint8_t)0x7C);
+  uint32_t start  = micros();
+  uint8_t  status = Wire.endTransmission();
+  us              = micros() - start;
+  return writeResult(status);
+}
+
+BenchResult benchDPOT(uint8_t len, uint8_t seq, uint32_t& us) {
+  (void)seq;
+  return benchRead(SlaveAddr::dpot, len, 0, 0, us);
+}
+
+struct Bench {
+  const char* name;
+  BenchXfer   xfer;
+  uint8_t     sizes[4];  // Data bytes per transaction, 0 ends the list early
+};
+
+static const Bench BENCHES[] = {
+    {"loopback", benchLoopback, {1, 4, 16, BUFFER_LENGTH}},
+    {"adc_read", benchADC, {1, 4}},
+    {"gpio_read", benchGPIORead, {1, 4, 11}},
+    {"gpio_write", benchGPIOWrite, {1}},
+    {"dpot_read", benchDPOT, {1}},
+};
+
+int compareU32(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Run every benchmark at each clock. Each CSV line has the transactions'
+// results, the data bytes per second of successful transactions over the
+// total bus time, and the latency distribution in us.
+void runBenchmarks() {
+  static uint32_t latencies_us[BENCH_XFERS];
+  Wire1.onReceive(benchSlaveRx);
+  SerialUSB.println(
+      "clock_hz,target,size,xfers,ok,nack,timeout,corrupt,bytes_per_s,"
+      "min_us,p50_us,p90_us,p99_us,max_us");
+  for (uint32_t clock : BENCH_CLOCKS) {
+    Wire.setClock(clock);
+    for (const Bench& bench : BENCHES) {
+      for (uint8_t len : bench.sizes) {
+        if (len == 0) {
+          break;
+        }
+        uint32_t results[4] = {0};
+        uint64_t total_us   = 0;
+        for (size_t i = 0; i < BENCH_XFERS; i++) {
+          uint32_t    us     = 0;
+          BenchResult result = bench.xfer(len, i, us);
+          results[(size_t)result]++;
+          latencies_us[i] = us;
+          total_us += us;
+        }
+        qsort(latencies_us, BENCH_XFERS, sizeof(latencies_us[0]), compareU32);
+        uint32_t ok = results[(size_t)BenchResult::ok];
+        uint64_t bytes_per_s =
+            total_us ? (uint64_t)ok * len * 1000000 / total_us : 0;
+
+        SerialUSB.print(clock);
+        SerialUSB.print(",");
+        SerialUSB.print(bench.name);
+        SerialUSB.print(",");
+        SerialUSB.print(len);
+        SerialUSB.print(",");
+        SerialUSB.print(BENCH_XFERS);
+        for (uint32_t count : results) {
+          SerialUSB.print(",");
+          SerialUSB.print(count);
+        }
+        SerialUSB.print(",");
+        SerialUSB.print((uint32_t)bytes_per_s);
+        for (uint32_t pct : BENCH_PERCENTILES) {
+          SerialUSB.print(",");
+          SerialUSB.print(latencies_us[(BENCH_XFERS - 1) * pct / 100]);
+        }
+        SerialUSB.println();
+      }
+    }
+  }
+  Wire.setClock(400000);
+  Wire1.onReceive(i2cSlaveRx);
+}
+#endif
+
 void setup() {
   // Setup GPIO
   pinMode(LED_BUILTIN, OUTPUT);
@@ -323,6 +984,7 @@ void setup() {
 
   // Setup ADC
   analogReadResolution(12);
+  initADCScan();
 
   // Setup I2C master
   Wire.begin();
@@ -333,8 +995,10 @@ void setup() {
   Wire1.onReceive(i2cSlaveRx);  // Register event in I2C1
 
   // Setup emulated UART output
-#ifdef DEBUG
+#if defined(DEBUG) || defined(PRODUCTION) || defined(I2C_BENCH)
   SerialUSB.begin(0);
+#endif
+#ifdef DEBUG
   SerialUSB.println("Welcome to the Power Board Tester");
 #endif
 
@@ -342,11 +1006,68 @@ void setup() {
   tft.begin(TFT_SPI_FREQ);
   tft.setRotation(3);
   tft.fillScreen(ILI9341_BLACK);
-  tft.setTextSize(2);
+  tft.setTextSize(TEXT_SIZE);
   // tft.setFont(&FreeMono9pt7b);
   // tft.setCursor(0, FreeMono9pt7b.yAdvance);
+
+#ifdef I2C_BENCH
+  // Wait for the host to open the port, so no results are lost
+  while (!SerialUSB) {}
+  runBenchmarks();
+#endif
+
+#ifdef PRODUCTION
+  // CSV header
+  SerialUSB.print("board,result,failed,total_us");
+  for (size_t i = 0; i < NUM_TESTS; i++) {
+    SerialUSB.print(",");
+    SerialUSB.print(TESTS[i].name);
+    SerialUSB.print("_us");
+  }
+  SerialUSB.println();
+  drawTest<8>("Result    ms", "INSERT", true, "", true);
+#endif
 }
 
+#ifdef PRODUCTION
+enum class Board
+{
+  absent,
+  settling,
+  tested,
+};
+
+// Test an inserted board once, stopping at the first failure. The CSV line
+// records how long each test took, tests that didn't finish are left empty on
+// the display and in the CSV line.
+void testBoard() {
+  static uint32_t board_num = 0;
+  Result          results[NUM_TESTS];
+  uint32_t        durations_us[NUM_TESTS];
+  uint32_t        start = micros();
+  size_t          failed = runTests(true, results, durations_us);
+  uint32_t        total_us = micros() - start;
+
+  char strbuf1[7] = {0};
+  sprintf(strbuf1, "%6lu", (unsigned long)(total_us / 1000));
+  drawTest<8>("Result    ms", failed == NUM_TESTS ? "  PASS" : "  FAIL",
+              failed == NUM_TESTS, strbuf1, true);
+
+  SerialUSB.print(++board_num);
+  SerialUSB.print(failed == NUM_TESTS ? ",PASS," : ",FAIL,");
+  SerialUSB.print(failed == NUM_TESTS ? "" : TESTS[failed].name);
+  SerialUSB.print(",");
+  SerialUSB.print(total_us);
+  for (size_t i = 0; i < NUM_TESTS; i++) {
+    SerialUSB.print(",");
+    if (results[i] != Result::pending) {
+      SerialUSB.print(durations_us[i]);
+    }
+  }
+  SerialUSB.println();
+}
+#endif
+
 void loop() {
   uint32_t loopStartTime = millis();
 
@@ -359,103 +1080,56 @@ void loop() {
     led_timer += led_state == HIGH ? 100 : 900;
   }
 
-  static uint8_t  dpot_val_idx = 0;
-  static uint32_t test_timer   = 0;
-  if (millis() > test_timer) {
-    char strbuf1[7] = {0};
-    char strbuf2[7] = {0};
-
-    // Measure ADCs
-    float ctrl5va = adcToVolts(readAna16(A0), 16, 3.3, 33, 100);
-    float ctrl5vd = adcToVolts(readAna16(A1), 16, 3.3, 33, 100);
-    sprintf(strbuf1, "%5.2fV", ctrl5va);
-    sprintf(strbuf2, "%5.2fV", ctrl5vd);
-    bool ok1 = ctrl5va < 5.5 && ctrl5va > 4.5;
-    bool ok2 = ctrl5vd < 5.5 && ctrl5va > 4.5;
-    drawTest<0>("Ctrl 5VA/5VD", strbuf1, ok1, strbuf2, ok2);
-
-    float preamp9v = adcToVolts(readAna16(A2), 16, 3.3, 33, 100);
-    float preamp5v = adcToVolts(readAna16(A3), 16, 3.3, 33, 100);
-    sprintf(strbuf1, "%5.2fV", preamp9v);
-    sprintf(strbuf2, "%5.2fV", preamp5v);
-    ok1 = preamp9v < 9.5 && preamp9v > 8.5;
-    ok2 = preamp5v < 5.5 && preamp5v > 4.5;
-    drawTest<1>("Preamp 9V/5V", strbuf1, ok1, strbuf2, ok2);
-
-    float preout9v = adcToVolts(readAna16(A4), 16, 3.3, 33, 100);
-    sprintf(strbuf1, "%5.2fV", preout9v);
-    ok1 = preout9v < 9.5 && preout9v > 8.5;
-    drawTest<2>("Preout 9V", strbuf1, ok1, "", true);
-
-    // Check I2C loopback
-    // Update from previous transmission
-    float i2c3v3 = adcToVolts(readAna16(A5), 16, 3.3, 100, 100);
-    sprintf(strbuf1, "%5.2fV", i2c3v3);
-    drawTest<3>("I2C out (J3)", strbuf1, i2c3v3 < 3.6 && i2c3v3 > 3.0,
-                i2c_loopback_ok_ ? " PASS" : " FAIL", i2c_loopback_ok_);
-
-    // TODO: Don't lock up on I2C failure
-    // Read I2C ADC
-    uint8_t hv1_adc;
-    uint8_t hv1_ntc_adc;
-    uint8_t amp_ntc1_adc;
-    uint8_t amp_ntc2_adc;
-    readI2CADC(&hv1_adc, &amp_ntc1_adc, &hv1_ntc_adc, &amp_ntc2_adc);
-    float hv1 = adcToVolts(hv1_adc, 8, 3.3, 4.7, 100);
-    sprintf(strbuf1, "%5.2fV", hv1);
-    bool hv1_ntc_ok = adcToTempStr(hv1_ntc_adc, 15, 30, strbuf2);
-    drawTest<4>("I2C ADC HV", strbuf1, hv1 < 28 && hv1 > 20, strbuf2,
-                hv1_ntc_ok);
-
-    bool temp1_ok = adcToTempStr(amp_ntc1_adc, 24, 26, strbuf1);
-    bool temp2_ok = adcToTempStr(amp_ntc2_adc, 24, 26, strbuf2);
-    drawTest<5>("I2C ADC temp", strbuf1, temp1_ok, strbuf2, temp2_ok);
-
-    // Check the 12V power supply
-    bool pg_12v;
-    bool pg_5va;
-    bool i2c_success = readI2CGPIO(pg_12v, pg_5va);
-    drawTest<6>("PG_12V/PG_5V", pg_12v ? " PASS" : " FAIL", pg_12v,
-                pg_5va ? " PASS" : " FAIL", pg_5va);
-
-    // Check the 12V fan power supply and that the fan control output works
-    float fan12v = adcToVolts(readAna16(A6), 16, 3.3, 10, 100);
-    sprintf(strbuf1, "%5.2fV", fan12v);
-    ok1 = fan12v < DPOT_VOLTS[dpot_val_idx] * 1.1 &&
-          fan12v > DPOT_VOLTS[dpot_val_idx] * 0.9;
-    writeI2CGPIO(true);
-    delay(1);
-    ok2 = digitalRead(A7) == HIGH;
-    writeI2CGPIO(false);
-    delay(1);
-    ok2 &= digitalRead(A7) == LOW;
-    drawTest<7>("12V/FAN_ON", strbuf1, ok1, ok2 ? " PASS" : " FAIL", ok2);
-
-    // Adjust DPOT to control +12V
-    dpot_val_idx += 1;
-    if (dpot_val_idx >= sizeof(DPOT_VALS)) {
-      dpot_val_idx = 0;
-    }
-    Wire.beginTransmission(SlaveAddr::dpot);
-    Wire.write((uint8_t)0x00);            // Instruction byte
-    Wire.write(DPOT_VALS[dpot_val_idx]);  // Value
-    Wire.endTransmission();
+#ifdef PRODUCTION
+  // Wait for a board, test it once, then wait for it to be removed
+  static Board    board       = Board::absent;
+  static uint32_t inserted_ms = 0;
+  adcSnapshot();
+  float ctrl5vd = adcToVolts(readAna16(A1), 16, 3.3, 33, 100);
+  switch (board) {
+    case Board::absent:
+      if (ctrl5vd > BOARD_PRESENT_V) {
+        inserted_ms = millis();
+        board       = Board::settling;
+        drawTest<8>("Result    ms", "  TEST", true, "", true);
+      }
+      break;
 
-    // Start a new transmission
-    i2c_loopback_ok_ = false;
-    Wire.beginTransmission(SlaveAddr::due);
-    Wire.write((uint8_t)I2C_TEST_VAL);
-    Wire.endTransmission();
+    case Board::settling:
+      if (ctrl5vd < BOARD_PRESENT_V) {
+        board = Board::absent;
+      } else if (millis() - inserted_ms >= BOARD_SETTLE_MS) {
+        testBoard();
+        board = Board::tested;
+      }
+      break;
+
+    case Board::tested:
+      if (ctrl5vd < BOARD_ABSENT_V) {
+        board = Board::absent;
+        drawTest<8>("Result    ms", "INSERT", true, "", true);
+      }
+      break;
+  }
+  (void)loopStartTime;
+#else
+  static uint32_t test_timer = 0;
+  if (millis() > test_timer) {
+    Result   results[NUM_TESTS];
+    uint32_t durations_us[NUM_TESTS];
+    runTests(false, results, durations_us);
 
 #ifdef DEBUG
+    char     strbuf1[7]  = {0};
     uint32_t elapsedTime = millis() - loopStartTime;
     SerialUSB.print("Test took ");
     SerialUSB.print(elapsedTime);
     SerialUSB.println(" ms");
     sprintf(strbuf1, "%6d", elapsedTime);
-    ok1 = elapsedTime < TEST_PERIOD_MS;
+    bool ok1 = elapsedTime < TEST_PERIOD_MS;
     drawTest<8>("Test time ms", strbuf1, ok1, "", true);
 #endif
     test_timer += TEST_PERIOD_MS;
   }
+#endif
 }
@@ -0,0 +1,187 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Non-blocking I2C transactions on the Due's Wire bus (TWI1).
+ *
+ * Each transaction follows the SAM3X TWI master sequences with the PDC. The
+ * last bytes of a read are handled without the PDC, so STOP can be set while
+ * the second-to-last byte is held in RHR. The TWI then NACKs the last byte.
+ */
+
+#include "twi.h"
+
+#include <Arduino.h>
+
+// Queued transactions, the active one first
+#define TWI_QUEUE_SIZE 8
+
+// Time after which a transaction is abandoned. Far longer than any of the
+// tester's transactions, even at 100 kHz and with slow polling.
+#define TWI_TIMEOUT_US 20000
+
+static Twi* const twi_ = WIRE_INTERFACE;
+
+enum class Phase : uint8_t
+{
+  pdc,          // PDC moving all but the last byte(s)
+  second_last,  // Read: set STOP once the second-to-last byte is received
+  last,         // Write: send the last byte. Read: receive it
+  complete,     // Waiting for TXCOMP
+};
+
+static TwiXfer* queue_[TWI_QUEUE_SIZE];
+static uint8_t  head_       = 0;
+static uint8_t  count_      = 0;
+static Phase    phase_      = Phase::complete;
+static bool     nack_       = false;  // SR.NACK is cleared on read
+static uint32_t started_us_ = 0;
+
+static void start(TwiXfer* xfer) {
+  xfer->state = TwiState::active;
+  nack_       = false;
+  started_us_ = micros();
+  twi_->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+
+  if (xfer->rx_len) {
+    // Any tx as the internal address, sent before a repeated start
+    uint32_t iadr = 0;
+    for (uint8_t i = 0; i < xfer->tx_len; i++) {
+      iadr = (iadr << 8) | xfer->tx[i];
+    }
+    twi_->TWI_MMR  = TWI_MMR_DADR(xfer->addr) | TWI_MMR_MREAD |
+                     (xfer->tx_len << TWI_MMR_IADRSZ_Pos);
+    twi_->TWI_IADR = iadr;
+    (void)twi_->TWI_RHR;  // Discard anything left from the last transaction
+    if (xfer->rx_len == 1) {
+      twi_->TWI_CR = TWI_CR_START | TWI_CR_STOP;
+      phase_       = Phase::last;
+    } else if (xfer->rx_len == 2) {
+      twi_->TWI_CR = TWI_CR_START;
+      phase_       = Phase::second_last;
+    } else {
+      twi_->TWI_RPR  = (uint32_t)xfer->rx;
+      twi_->TWI_RCR  = xfer->rx_len - 2;
+      twi_->TWI_PTCR = TWI_PTCR_RXTEN;
+      twi_->TWI_CR   = TWI_CR_START;
+      phase_         = Phase::pdc;
+    }
+  } else {
+    // Writing THR starts the transfer
+    twi_->TWI_MMR  = TWI_MMR_DADR(xfer->addr);
+    twi_->TWI_IADR = 0;
+    if (xfer->tx_len == 1) {
+      twi_->TWI_THR = xfer->tx[0];
+      twi_->TWI_CR  = TWI_CR_STOP;
+      phase_        = Phase::complete;
+    } else {
+      twi_->TWI_TPR  = (uint32_t)xfer->tx;
+      twi_->TWI_TCR  = xfer->tx_len - 1;
+      twi_->TWI_PTCR = TWI_PTCR_TXTEN;
+      phase_         = Phase::pdc;
+    }
+  }
+}
+
+static void finish(TwiXfer* xfer, TwiStatus status) {
+  twi_->TWI_PTCR = TWI_PTCR_RXTDIS | TWI_PTCR_TXTDIS;
+  xfer->status   = status;
+  xfer->state    = TwiState::done;
+  head_          = (head_ + 1) % TWI_QUEUE_SIZE;
+  count_--;
+}
+
+bool twiSubmit(TwiXfer* xfer) {
+  bool busy = xfer->state == TwiState::queued ||
+              xfer->state == TwiState::active;
+  if (busy || count_ >= TWI_QUEUE_SIZE ||
+      (xfer->rx_len && xfer->tx_len > 3) ||
+      (!xfer->rx_len && !xfer->tx_len)) {
+    return false;
+  }
+  xfer->state = TwiState::queued;
+  queue_[(head_ + count_++) % TWI_QUEUE_SIZE] = xfer;
+  if (count_ == 1) {
+    start(xfer);
+  }
+  return true;
+}
+
+void twiUpdate() {
+  if (!count_) {
+    return;
+  }
+  TwiXfer* xfer = queue_[head_];
+  uint32_t sr   = twi_->TWI_SR;
+  nack_         = nack_ || (sr & TWI_SR_NACK);
+
+  if (nack_) {
+    // The TWI ends the transaction itself after a NACK
+    if (sr & TWI_SR_TXCOMP) {
+      finish(xfer, TwiStatus::nack);
+    }
+  } else if (micros() - started_us_ > TWI_TIMEOUT_US) {
+    twi_->TWI_CR = TWI_CR_STOP;
+    finish(xfer, TwiStatus::timeout);
+  } else {
+    bool read = xfer->rx_len;
+    switch (phase_) {
+      case Phase::pdc:
+        if (read && (sr & TWI_SR_ENDRX)) {
+          twi_->TWI_PTCR = TWI_PTCR_RXTDIS;
+          phase_         = Phase::second_last;
+        } else if (!read && (sr & TWI_SR_ENDTX)) {
+          twi_->TWI_PTCR = TWI_PTCR_TXTDIS;
+          phase_         = Phase::last;
+        }
+        break;
+
+      case Phase::second_last:
+        if (sr & TWI_SR_RXRDY) {
+          twi_->TWI_CR               = TWI_CR_STOP;
+          xfer->rx[xfer->rx_len - 2] = twi_->TWI_RHR;
+          phase_                     = Phase::last;
+        }
+        break;
+
+      case Phase::last:
+        if (read && (sr & TWI_SR_RXRDY)) {
+          xfer->rx[xfer->rx_len - 1] = twi_->TWI_RHR;
+          phase_                     = Phase::complete;
+        } else if (!read && (sr & TWI_SR_TXRDY)) {
+          twi_->TWI_THR = xfer->tx[xfer->tx_len - 1];
+          twi_->TWI_CR  = TWI_CR_STOP;
+          phase_        = Phase::complete;
+        }
+        break;
+
+      case Phase::complete:
+        if (sr & TWI_SR_TXCOMP) {
+          finish(xfer, TwiStatus::ok);
+        }
+        break;
+    }
+  }
+
+  if (count_ && queue_[head_]->state == TwiState::queued) {
+    start(queue_[head_]);
+  }
+}
+
+bool twiIdle() {
+  return count_ == 0;
+}
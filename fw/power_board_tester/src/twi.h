@@ -0,0 +1,72 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Non-blocking I2C transactions on the Due's Wire bus (TWI1).
+ *
+ * Transactions are queued with twiSubmit() and run one at a time by
+ * twiUpdate(), which must be called often, e.g. between test steps. The PDC
+ * moves the data bytes, so only the start and end of each transaction wait
+ * on the polling. The TWI holds SCL low whenever it is not serviced in
+ * time, so a late poll only slows the bus.
+ *
+ * Wire must be initialized first, it configures the pins and bus clock.
+ * Blocking Wire calls must not be made while transactions are queued.
+ */
+
+#ifndef TWI_H_
+#define TWI_H_
+
+#include <stdint.h>
+
+enum class TwiState : uint8_t
+{
+  idle,
+  queued,
+  active,
+  done,  // Result in status, can be submitted again
+};
+
+enum class TwiStatus : uint8_t
+{
+  ok,
+  nack,
+  timeout,
+};
+
+// Write tx, then if rx_len is set read rx after a repeated start. Reads send
+// at most 3 bytes of tx, as the TWI's internal address.
+struct TwiXfer {
+  uint8_t           addr;  // 7-bit address
+  const uint8_t*    tx;
+  uint8_t           tx_len;
+  uint8_t*          rx;
+  uint8_t           rx_len;
+  volatile TwiState state;
+  TwiStatus         status;
+};
+
+// Returns false if the transaction is already queued or the queue is full
+bool twiSubmit(TwiXfer* xfer);
+
+// Advance the active transaction, starting the next one when it completes
+void twiUpdate();
+
+// True if no transaction is queued or active
+bool twiIdle();
+
+#endif /* TWI_H_ */
@@ -57,6 +57,7 @@
   */
 
 extern uint32_t SystemCoreClock;          /*!< System Clock Frequency (Core Clock) */
+extern uint32_t SystemInitCycles;         /*!< SysTick cycles spent in SystemInit() */
 
 /**
   * @}
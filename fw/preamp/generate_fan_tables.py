@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# Generate look-up tables for fan voltage control through the Power Board's
+# MCP4017 digital potentiometer, so that fans.c doesn't need any division.
+# The Cortex-M0 has no hardware divider.
+#
+# The DPOT sets the fan power supply's feedback resistance:
+#   Rpot (kOhms) = 10k * DPOT_VAL / 127 + 0.1
+#   V = 100k / (Rpot + 9k) + 1
+# Fans are run from 100 / 19.1 + 1 = 6.2 V (DPOT_VAL = 127) up to
+# 100 / 9.1 + 1 = 12 V (DPOT_VAL = 0).
+
+import math
+
+V_MIN = 100 / 19.1 + 1
+V_MAX = 100 / 9.1 + 1
+DPOT_MAX = 127
+
+def volts2dpot(volts: float) -> float:
+  """ 10k / 127 * DPOT_VAL + 9.1k = 100k / (V - 1)
+      DPOT_VAL = 1270 / (V - 1) - 115.57
+  """
+  return 1270 / (volts - 1) - 115.57
+
+def dpot2volts(dpot_val: int) -> float:
+  return 100000 / (10000 * dpot_val / 127 + 9100) + 1
+
+def pcnt2dpot(pcnt_f8: int) -> int:
+  """ Fan percent in Q7.8 in [0.0, 1.0] to the DPOT value, scaling the
+      voltage linearly from V_MIN to V_MAX. Rounded down, as the voltage is
+      then at least the one wanted.
+  """
+  volts = V_MIN + (V_MAX - V_MIN) * pcnt_f8 / 256
+  return max(0, min(DPOT_MAX, math.floor(volts2dpot(volts))))
+
+# Each zone's share of the amplifiers' dissipation for each volume (dB of
+# attenuation, 0 is the loudest), in units such that all 6 zones at full
+# volume sum to 252. A class D amp dissipates roughly in proportion to its
+# output power, which falls by 10 dB for every 10 dB of attenuation.
+NUM_ZONES = 6
+LOAD_MAX = 252 // NUM_ZONES
+def vol2load(vol: int) -> int:
+  return round(LOAD_MAX * 10**(-vol / 10))
+
+DPOT_LUT = [pcnt2dpot(p) for p in range(257)]
+VOLTS_LUT_F4 = [min(255, math.floor(16 * dpot2volts(d))) for d in range(DPOT_MAX + 1)]
+LOAD_LUT = [vol2load(v) for v in range(80)]
+
+HEADER = """/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fan voltage control look-up tables.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAN_TABLES_H_
+#define FAN_TABLES_H_
+
+#include <stdint.h>
+
+// MCP4017 DPOT value for each fan percent in Q7.8, from 0.0 to 1.0.
+// Table generated by generate_fan_tables.py script
+const uint8_t FAN_DPOT_LUT_[] = {
+{dpot}
+};
+
+// Fan power supply voltage in UQ4.4 for each DPOT value.
+// Table generated by generate_fan_tables.py script
+const uint8_t FAN_VOLTS_LUT_F4_[] = {
+{volts}
+};
+
+// Estimated amplifier dissipation of a playing zone for each volume, all 6
+// zones at full volume sum to 252.
+// Table generated by generate_fan_tables.py script
+const uint8_t FAN_ZONE_LOAD_LUT_[] = {
+{load}
+};
+
+#endif /* FAN_TABLES_H_ */"""
+
+def table(vals: list, cols: int) -> str:
+  rows = []
+  for row in range(math.ceil(len(vals) / cols)):
+    rows.append('   ' + ''.join(f' {v:3},' for v in vals[row*cols:(row + 1)*cols]))
+  return '\n'.join(rows)
+
+# Print the full header, to be redirected to src/fan_tables.h
+print(HEADER.replace('{dpot}', table(DPOT_LUT, 12))
+            .replace('{volts}', table(VOLTS_LUT_F4, 12))
+            .replace('{load}', table(LOAD_LUT, 12)))
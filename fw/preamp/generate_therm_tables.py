@@ -133,20 +133,89 @@ THERM_LUT_NCP = [round(adc2temp_interp(x)) for x in range(256)]
 THERM_LUT_NCP_B = [round(adc2temp(x, B_NCP)) for x in range(256)]
 #print(max([abs(t1 - t2) for t1, t2 in zip(THERM_LUT_PSU[30:-1], THERM_LUT_NCP_B[30:-1])]))
 
+def adc2temp_q7_8(adc_val: int, b: int) -> int:
+  """ Convert an ADC reading to degC in Q7.8, the full range of which is
+      usable. The minimum and maximum values are reserved for a
+      disconnected (ADC_VAL = 0) or shorted (ADC_VAL = 255) thermistor.
+  """
+  if adc_val < 1:
+    return -0x8000
+  if adc_val > 254:
+    return 0x7FFF
+  rt = 4.7 * (255 / adc_val - 1)
+  temp = round(256 * r2temp(rt, b))
+  return max(-0x7FFF, min(0x7FFE, temp))
+
 # THERM_LUT_NCP_B errs slightly on the side of warmer, but is no more than
 # 1.5 degC different than any other LUT
-print('const uint8_t THERM_LUT_[] = {')
-for row in range(16):
-  print('  ', end='')
-  for col in range(16):
-    print(f'0x{THERM_LUT_NCP_B[row*16 + col]:02X}, ', end='')
-  print()
-print('};')
+THERM_LUT_Q7_8 = [adc2temp_q7_8(x, B_NCP) for x in range(256)]
+
+HEADER = """/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Thermistor temperature conversion look-up tables.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef THERMISTOR_H_
+#define THERMISTOR_H_
+
+#include <stdint.h>
+
+// Table values reserved for a disconnected or shorted thermistor
+#define THERM_DISCONNECTED INT16_MIN
+#define THERM_SHORTED      INT16_MAX
+
+// NCP21XV103J03RA - 0805 SMD, R0 = 10k @ 25 degC, B = 3900K
+// Temperature in Q7.8 degC for each 8-bit ADC reading.
+// Table generated by generate_therm_tables.py script
+const int16_t THERM_LUT_Q7_8_[] = {
+{table}
+}};
+
+/* Convert a UQ8.8 ADC reading to degC in Q7.8, interpolating between table
+ * entries. Readings below 1 are a disconnected thermistor and readings of
+ * 255 a short.
+ */
+static inline int16_t thermToQ7_8(uint16_t reading) {{
+  uint8_t i    = reading >> 8;
+  uint8_t frac = reading & 0xFF;
+  if (i == 0 || i >= UINT8_MAX - 1) {{
+    return THERM_LUT_Q7_8_[i];
+  }}
+  int16_t lo = THERM_LUT_Q7_8_[i];
+  int16_t hi = THERM_LUT_Q7_8_[i + 1];
+  return lo + (((int32_t)(hi - lo) * frac) >> 8);
+}}
+
+#endif /* THERMISTOR_H_ */"""
+
+# Print the full header, to be redirected to src/thermistor.h
+COLS = 8
+rows = []
+for row in range(256 // COLS):
+  vals = THERM_LUT_Q7_8[row*COLS:(row + 1)*COLS]
+  rows.append('   ' + ''.join(f' {v:6},' for v in vals))
+print(HEADER.replace('{table}', '\n'.join(rows)).replace('{{', '{').replace('}}', '}'))
 
 if PLOT:
   plt.plot(THERM_LUT_PSU, label='PSU')
   plt.plot(THERM_LUT_NCP, label='NCP_LUT')
   plt.plot(THERM_LUT_NCP_B, label='NCP_B')
+  plt.plot([t / 128 + 40 for t in THERM_LUT_Q7_8[1:-1]], label='NCP_B Q7.8')
   plt.legend()
   plt.ylabel('2*(Temp + 20)')
   plt.xlabel('ADC Value')
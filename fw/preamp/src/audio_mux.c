@@ -28,6 +28,8 @@
 
 #include "audio_mux.h"
 
+#include "i2c2.h"
+#include "i2c2_shadow.h"
 #include "port_defs.h"
 #include "ports.h"
 #include "systick.h"
@@ -38,82 +40,208 @@
 // The source to connect all zones to at startup
 #define DEFAULT_SOURCE 0
 
-const I2CReg zone_left_[NUM_ZONES] = {
-    {0x88, 0x00}, {0x88, 0x02}, {0x88, 0x04},
-    {0x8A, 0x00}, {0x8A, 0x02}, {0x8A, 0x04},
-};
+// Each TDA7448 controls 3 zones, with the left and right channels of zone N
+// at subaddresses 2N and 2N + 1.
+#define VOL_IC_ZONES 3
+#define NUM_VOL_ICS  (NUM_ZONES / VOL_IC_ZONES)
 
-const I2CReg zone_right_[NUM_ZONES] = {
-    {0x88, 0x01}, {0x88, 0x03}, {0x88, 0x05},
-    {0x8A, 0x01}, {0x8A, 0x03}, {0x8A, 0x05},
-};
+static const uint8_t vol_ic_dev_[NUM_VOL_ICS] = {DEV_VOL1, DEV_VOL2};
+
+// Setting bit 4 of the subaddress auto-increments it after each byte written
+#define TDA7448_AUTO_INC 0x10
 
 // Keep track of volumes so they are not lost when we standby
 uint8_t volumes[NUM_ZONES];
 
+/* The mux, mute and standby pins are only ever written here, so their state
+ * is kept in bitmasks updated by the setters and queries never read the pins.
+ * Each zone's source takes 2 bits of zone_srcs_, zone N at bits 2N and 2N + 1.
+ */
+#define ZONE_MASK    ((1 << NUM_ZONES) - 1)
+#define SRC_BITS     2
+#define SRC_MASK     ((1 << SRC_BITS) - 1)
+static uint8_t  mutes_       = ZONE_MASK;  // Each bit set is a muted zone
+static uint16_t zone_srcs_   = 0;          // Source connected to each zone
+static uint8_t  src_digital_ = 0;  // Each bit set is a source's digital input
+static bool     standby_     = true;
+
+/* Volume writes are queued on the internal I2C bus as one burst per TDA7448,
+ * covering the range of zones that changed, so setting all zones takes one
+ * transfer per IC. Zones are only written when the volume to send differs
+ * from the last one written, tracked by the shadow of each zone's left
+ * channel. setZoneVolume() only records the volume wanted, and
+ * sendVolumeChanges() queues the bursts once a batch of register writes has
+ * been applied, so a burst write of every zone's volume is still sent as one
+ * transfer per IC. If volumes change while a burst is in progress the
+ * remaining changes are sent once that completes.
+ */
+static uint8_t     vol_want_[NUM_ZONES];  // Latest volume to send
+static I2C2Shadow* vol_shadow_[NUM_ZONES];
+static uint8_t     vol_buf_[NUM_VOL_ICS][1 + 2 * VOL_IC_ZONES];
+static I2C2Xfer    vol_xfer_[NUM_VOL_ICS];
+
+static bool volDirty(size_t zone) {
+  return shadowDiffers(vol_shadow_[zone], vol_want_[zone]);
+}
+
+static void volDone(I2C2Xfer* xfer);
+
+// Send any changed volumes for a volume IC, if it isn't already busy. Nothing
+// is sent in standby, when the volume ICs are powered down.
+static void sendVolumes(size_t ic) {
+  I2C2Xfer* xfer = &vol_xfer_[ic];
+  if (xfer->state != XFER_IDLE || inStandby()) {
+    return;
+  }
+
+  // Find the range of zones to write
+  size_t first = VOL_IC_ZONES;
+  size_t last  = 0;
+  for (size_t i = 0; i < VOL_IC_ZONES; i++) {
+    if (volDirty(ic * VOL_IC_ZONES + i)) {
+      first = i < first ? i : first;
+      last  = i;
+    }
+  }
+  if (first == VOL_IC_ZONES) {
+    return;
+  }
+
+  uint8_t* buf = vol_buf_[ic];
+  buf[0]       = TDA7448_AUTO_INC | (2 * first);
+  for (size_t i = first; i <= last; i++) {
+    uint8_t vol              = vol_want_[ic * VOL_IC_ZONES + i];
+    buf[1 + 2 * (i - first)] = vol;  // Left
+    buf[2 + 2 * (i - first)] = vol;  // Right
+  }
+  xfer->dev    = vol_ic_dev_[ic];
+  xfer->prio   = I2C2_PRIO_VOLUME;
+  xfer->tx     = buf;
+  xfer->tx_len = 1 + 2 * (last - first + 1);
+  xfer->done   = volDone;
+  i2c2Submit(xfer);
+}
+
+static void volDone(I2C2Xfer* xfer) {
+  size_t ic    = xfer - vol_xfer_;
+  size_t first = (xfer->tx[0] & ~TDA7448_AUTO_INC) / 2;
+  size_t count = (xfer->tx_len - 1) / 2;
+  if (xfer->status != 0) {
+    // The IC's volumes are unknown now, retry on the next volume change
+    shadowInvalidateDev(xfer->dev);
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    shadowSet(vol_shadow_[ic * VOL_IC_ZONES + first + i], xfer->tx[1 + 2 * i]);
+  }
+  sendVolumes(ic);
+}
+
+/* Volume ramps. Each zone's volume is stepped by 1 dB towards its target every
+ * ramp_rate_ ms. All zones are stepped together so their writes share bursts.
+ * A rate of 0 moves straight to the target.
+ */
+static uint8_t  ramp_target_[NUM_ZONES];
+static uint8_t  ramp_rate_[NUM_ZONES];
+static uint32_t ramp_next_[NUM_ZONES];  // Time of each zone's next step (ms)
+
+// Wait for all queued volume writes to complete
+static void flushVolumes() {
+  for (size_t ic = 0; ic < NUM_VOL_ICS; ic++) {
+    while (vol_xfer_[ic].state != XFER_IDLE) {
+      i2c2Update();
+    }
+  }
+}
+
 // Returns true if zone is unmuted
 bool isOn(size_t zone) {
-  return readPin(zone_mute_[zone]);
+  return !(mutes_ & (1 << zone));
 }
 
 // Returns true if any zone is unmuted
 bool anyOn() {
-  bool on = false;
-  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
-    on = on | isOn(zone);
+  return mutes_ != ZONE_MASK;
+}
+
+// Add muting or unmuting a zone to a batch of pin writes
+static void batchMute(PinBatch* batch, size_t zone, bool mute) {
+  // Set pin low to mute
+  batchWritePin(batch, zone_mute_[zone], !mute);
+  if (mute) {
+    mutes_ |= 1 << zone;
+  } else {
+    mutes_ &= ~(1 << zone);
   }
-  return on;
-  // TODO: Shortcut
 }
 
 // Mute the specified zone
 void mute(size_t zone, bool mute) {
-  // Set pin low to mute
-  writePin(zone_mute_[zone], !mute);
+  PinBatch batch = {0};
+  batchMute(&batch, zone, mute);
+  applyPinBatch(&batch);
 }
 
 bool muted(size_t zone) {
-  return !readPin(zone_mute_[zone]);
+  return mutes_ & (1 << zone);
 }
 
-// Writes volume level to the volume ICs via the internal I2C bus
+// Sets the volume level to write to the volume ICs, see sendVolumeChanges()
 void writeVolume(size_t zone, uint8_t vol) {
   // We can't write to the volume registers if they are disabled
   if (!inStandby()) {
-    writeI2C2(zone_left_[zone], vol);
-    writeI2C2(zone_right_[zone], vol);
+    vol_want_[zone] = vol;
+  }
+}
+
+void sendVolumeChanges() {
+  for (size_t ic = 0; ic < NUM_VOL_ICS; ic++) {
+    sendVolumes(ic);
   }
 }
 
 // Standby all amps at once
 void standby(bool standby) {
-  bool prev_stby_state = inStandby();
+  bool     prev_stby_state = inStandby();
+  PinBatch batch           = {0};
   for (size_t zone = 0; zone < NUM_ZONES; zone++) {
     // Set pin low to standby
-    writePin(zone_standby_[zone], !standby);
+    batchWritePin(&batch, zone_standby_[zone], !standby);
   }
+  applyPinBatch(&batch);
+  standby_ = standby;
   // After returning from standby we need to configure each of the volumes again
+  // in one burst per IC.
   if (prev_stby_state && !standby) {
+    for (size_t ic = 0; ic < NUM_VOL_ICS; ic++) {
+      shadowInvalidateDev(vol_ic_dev_[ic]);
+    }
     for (size_t zone = 0; zone < NUM_ZONES; zone++) {
-      writeVolume(zone, volumes[zone]);
+      vol_want_[zone] = volumes[zone];
+    }
+    for (size_t ic = 0; ic < NUM_VOL_ICS; ic++) {
+      sendVolumes(ic);
     }
+    flushVolumes();
   }
 }
 
 // Checks if any of the zones are in standby
 bool inStandby() {
-  bool in_stby = false;
-  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
-    in_stby = in_stby || (!readPin(zone_standby_[zone]));
-  }
-  return in_stby;
-  // TODO: Shortcut
+  return standby_;
 }
 
 // Initialize each zone's volume state (does not write to volume control ICs)
 void initZones() {
   for (size_t zone = 0; zone < NUM_ZONES; zone++) {
-    volumes[zone] = DEFAULT_VOL;
+    I2CReg left = {
+        .dev = vol_ic_dev_[zone / VOL_IC_ZONES],
+        .reg = 2 * (zone % VOL_IC_ZONES),
+    };
+    vol_shadow_[zone]  = i2c2Shadow(left);
+    volumes[zone]      = DEFAULT_VOL;
+    vol_want_[zone]    = DEFAULT_VOL;
+    ramp_target_[zone] = DEFAULT_VOL;
     mute(zone, true);
     setZoneSource(zone, DEFAULT_SOURCE);
   }
@@ -134,6 +262,9 @@ void setZoneVolume(size_t zone, uint8_t vol) {
   // Keep track of the volume so it is not lost when we standby
   volumes[zone] = vol;
 
+  // Setting the volume directly cancels any ramp
+  ramp_target_[zone] = vol;
+
   // Actually write the volume to the volume control IC
   writeVolume(zone, vol);
 }
@@ -142,34 +273,89 @@ uint8_t getZoneVolume(size_t zone) {
   return volumes[zone];
 }
 
-// Connect a Zone to a Source
-void setZoneSource(size_t zone, size_t src) {
-  // Mute the zone during the switch to avoid an audible pop
-  bool was_muted = !isOn(zone);
-  mute(zone, !was_muted);
+// Start ramping a zone's volume towards a target
+void setZoneTarget(size_t zone, uint8_t vol) {
+  ramp_target_[zone] = vol;
+  ramp_next_[zone]   = millis();
+}
 
-  // Disconnect zone from all sources first
-  for (size_t src = 0; src < NUM_SRCS; src++) {
-    writePin(zone_src_[zone][src], false);
+uint8_t getZoneTarget(size_t zone) {
+  return ramp_target_[zone];
+}
+
+// Set the time in ms per 1 dB step when ramping a zone's volume
+void setZoneRampRate(size_t zone, uint8_t ms) {
+  ramp_rate_[zone] = ms;
+}
+
+uint8_t getZoneRampRate(size_t zone) {
+  return ramp_rate_[zone];
+}
+
+// Step all ramping zones that are due, run every ms
+void updateRamps() {
+  uint32_t now                  = millis();
+  bool     stby                 = inStandby();
+  bool     stepped[NUM_VOL_ICS] = {false};
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    uint8_t vol    = volumes[zone];
+    uint8_t target = ramp_target_[zone];
+    if (vol == target || !timeReached(now, ramp_next_[zone])) {
+      continue;
+    }
+    if (ramp_rate_[zone] == 0) {
+      vol = target;
+    } else {
+      vol = vol < target ? vol + 1 : vol - 1;
+    }
+    ramp_next_[zone] += ramp_rate_[zone];
+    volumes[zone] = vol;
+    if (!stby) {
+      vol_want_[zone]              = vol;
+      stepped[zone / VOL_IC_ZONES] = true;
+    }
   }
+  for (size_t ic = 0; ic < NUM_VOL_ICS; ic++) {
+    if (stepped[ic]) {
+      sendVolumes(ic);
+    }
+  }
+}
 
-  // Connect a zone to a source
+// Add switching a zone's source mux, without muting, to a batch of pin writes
+static void batchConnectZone(PinBatch* batch, size_t zone, size_t src) {
+  // Connect the selected source and disconnect all others in the same write
+  for (size_t s = 0; s < NUM_SRCS; s++) {
+    batchWritePin(batch, zone_src_[zone][s], s == src);
+  }
+
+  // A disconnected zone reads back as source 0
+  zone_srcs_ &= ~(SRC_MASK << (SRC_BITS * zone));
   if (src < NUM_SRCS) {
-    writePin(zone_src_[zone][src], true);
+    zone_srcs_ |= src << (SRC_BITS * zone);
+  }
+}
+
+// Connect a Zone to a Source
+void setZoneSource(size_t zone, size_t src) {
+  // Mute the zone during the switch to avoid an audible pop
+  bool on = isOn(zone);
+  if (on) {
+    mute(zone, true);
   }
 
+  PinBatch batch = {0};
+  batchConnectZone(&batch, zone, src);
+  applyPinBatch(&batch);
+
   // Restore mute status
-  mute(zone, was_muted);
+  if (on) {
+    mute(zone, false);
+  }
 }
 
 size_t getZoneSource(size_t zone) {
-  // Assume only one source is ever selected
-  for (size_t src = 0; src < NUM_SRCS; src++) {
-    if (readPin(zone_src_[zone][src])) {
-      return src;
-    }
-  }
-  return 0;  // Should never be reached
+  return (zone_srcs_ >> (SRC_BITS * zone)) & SRC_MASK;
 }
 
 // Initialize each source's analog/digital state
@@ -179,20 +365,111 @@ void initSources() {
   }
 }
 
+// Add selecting a source's input to a batch of pin writes
+static void batchSourceAD(PinBatch* batch, size_t src, InputType type) {
+  batchWritePin(batch, src_ad_[src][IT_ANALOG], type == IT_ANALOG);
+  batchWritePin(batch, src_ad_[src][IT_DIGITAL], type == IT_DIGITAL);
+  if (type == IT_DIGITAL) {
+    src_digital_ |= 1 << src;
+  } else {
+    src_digital_ &= ~(1 << src);
+  }
+}
+
 // Each source can select between a digital or analog input
 void setSourceAD(size_t src, InputType type) {
-  // Disable both mux inputs first
-  writePin(src_ad_[src][IT_ANALOG], false);
-  writePin(src_ad_[src][IT_DIGITAL], false);
-
-  // Enable selected input
-  writePin(src_ad_[src][type], true);
+  PinBatch batch = {0};
+  batchSourceAD(&batch, src, type);
+  applyPinBatch(&batch);
 }
 
 InputType getSourceAD(size_t src) {
-  // Assume only one input is ever selected
-  if (readPin(src_ad_[src][IT_DIGITAL])) {
-    return IT_DIGITAL;
+  return src_digital_ & (1 << src) ? IT_DIGITAL : IT_ANALOG;
+}
+
+// Get the current configuration of every zone and source
+void getAudioConfig(AudioConfig* cfg) {
+  cfg->src_ad = src_digital_;
+  cfg->mutes  = mutes_;
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    cfg->zone_src[zone] = getZoneSource(zone);
+    cfg->vols[zone]     = volumes[zone];
+  }
+  cfg->standby = standby_;
+}
+
+/* Apply a full configuration in one pass.
+ * Only what changed is written. Any zone that is switching sources or
+ * input types is muted once for the whole switch instead of once per zone,
+ * and volumes are written once after any change in standby. The mutes, the
+ * mux switching and the unmutes are each applied with one write per GPIO port.
+ */
+void setAudioConfig(const AudioConfig* cfg) {
+  AudioConfig cur;
+  getAudioConfig(&cur);
+
+  // Determine which zones' audio paths are changing
+  uint8_t src_ad_changed = (cfg->src_ad ^ cur.src_ad) & ((1 << NUM_SRCS) - 1);
+  uint8_t switching      = 0;
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    size_t src = cfg->zone_src[zone];
+    if (src != cur.zone_src[zone] || (src_ad_changed & (1 << src)) ||
+        (src_ad_changed & (1 << cur.zone_src[zone]))) {
+      switching |= 1 << zone;
+    }
+  }
+
+  // Mute everything that is switching or will end up muted
+  PinBatch batch = {0};
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    if ((switching | cfg->mutes) & (1 << zone) && isOn(zone)) {
+      batchMute(&batch, zone, true);
+    }
+  }
+  applyPinBatch(&batch);
+
+  // Switch input types and sources
+  PinBatch mux = {0};
+  for (size_t src = 0; src < NUM_SRCS; src++) {
+    if (src_ad_changed & (1 << src)) {
+      batchSourceAD(&mux, src,
+                    cfg->src_ad & (1 << src) ? IT_DIGITAL : IT_ANALOG);
+    }
+  }
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    if (cfg->zone_src[zone] != cur.zone_src[zone]) {
+      batchConnectZone(&mux, zone, cfg->zone_src[zone]);
+    }
+  }
+  applyPinBatch(&mux);
+
+  // Update volumes. Returning from standby rewrites all of them anyways.
+  if (cfg->standby && !cur.standby) {
+    standby(true);
+  }
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    volumes[zone]      = cfg->vols[zone];
+    ramp_target_[zone] = cfg->vols[zone];
+    if (!cur.standby && !cfg->standby) {
+      vol_want_[zone] = volumes[zone];
+    }
+  }
+  if (!cur.standby && !cfg->standby) {
+    for (size_t ic = 0; ic < NUM_VOL_ICS; ic++) {
+      sendVolumes(ic);
+    }
+  }
+  if (!cfg->standby && cur.standby) {
+    standby(false);
+  }
+
+  // Finally unmute, once the new volumes are set
+  flushVolumes();
+  PinBatch unmute = {0};
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    if (!(cfg->mutes & (1 << zone)) && !isOn(zone)) {
+      batchMute(&unmute, zone, false);
+    }
   }
-  return IT_ANALOG;
+  applyPinBatch(&unmute);
 }
@@ -36,12 +36,23 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "port_defs.h"
+
 typedef enum
 {
   IT_ANALOG,
   IT_DIGITAL
 } InputType;
 
+// A full audio configuration, to be applied all at once
+typedef struct {
+  uint8_t src_ad;               // Each bit set selects a source's digital in
+  uint8_t zone_src[NUM_ZONES];  // Source connected to each zone
+  uint8_t mutes;                // Each bit set mutes a zone
+  uint8_t vols[NUM_ZONES];      // Attenuation of each zone
+  bool    standby;              // All amps in standby
+} AudioConfig;
+
 bool isOn(size_t zone);
 bool anyOn();
 
@@ -51,8 +62,16 @@ void standby(bool standby);
 bool inStandby();
 
 void    initZones();
+// Volumes set are only sent by sendVolumeChanges(), which queues one burst per
+// volume IC for all the zones set since the last call
 void    setZoneVolume(size_t zone, uint8_t vol);
+void    sendVolumeChanges();
 uint8_t getZoneVolume(size_t zone);
+void    setZoneTarget(size_t zone, uint8_t vol);
+uint8_t getZoneTarget(size_t zone);
+void    setZoneRampRate(size_t zone, uint8_t ms);
+uint8_t getZoneRampRate(size_t zone);
+void    updateRamps();
 void    setZoneSource(size_t zone, size_t src);
 size_t  getZoneSource(size_t zone);
 
@@ -60,4 +79,7 @@ void      initSources();
 void      setSourceAD(size_t src, InputType type);
 InputType getSourceAD(size_t src);
 
+void getAudioConfig(AudioConfig* cfg);
+void setAudioConfig(const AudioConfig* cfg);
+
 #endif /* AUDIO_MUX_H_ */
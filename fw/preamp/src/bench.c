@@ -0,0 +1,152 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Microbenchmarks of the bus and math primitives, for PREAMP_BENCH builds
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fans.h"
+#include "i2c2.h"
+#include "idle.h"
+#include "int_i2c.h"
+#include "port_defs.h"
+#include "systick.h"
+
+// MCP23008 registers
+#define MCP_GPIO 0x09
+#define MCP_OLAT 0x0A
+
+static uint16_t cycles_[NUM_BENCHES];
+
+static AmpliPiState* state_;
+static AdcVals       adc_;
+static uint8_t       dpot_[1];
+static uint8_t       mcp_buf_[2];
+
+// Temperatures in Q7.8 halfway into the amps' fan range, so fans are partly on
+#define BENCH_AMP_TEMP (52 << 8)
+#define BENCH_PSU_TEMP (30 << 8)
+#define BENCH_RPI_TEMP (40 << 8)
+
+static void benchAdcScan() {
+  I2C2Xfer xfer = {
+      .dev    = DEV_ADC,
+      .prio   = I2C2_PRIO_ADC,
+      .rx_len = sizeof(adc_),
+      .rx     = adc_.ch,
+  };
+  i2c2Transfer(&xfer);
+}
+
+static void benchPwrRead() {
+  mcp_buf_[0]   = MCP_GPIO;
+  I2C2Xfer xfer = {
+      .dev    = DEV_PWR_GPIO,
+      .prio   = I2C2_PRIO_GPIO,
+      .tx_len = 1,
+      .rx_len = 1,
+      .tx     = mcp_buf_,
+      .rx     = &mcp_buf_[1],
+  };
+  i2c2Transfer(&xfer);
+}
+
+static void benchLedWrite() {
+  mcp_buf_[0]   = MCP_OLAT;
+  mcp_buf_[1]   = state_->leds.data;
+  I2C2Xfer xfer = {
+      .dev    = DEV_LED_GPIO,
+      .prio   = I2C2_PRIO_LED,
+      .tx_len = 2,
+      .tx     = mcp_buf_,
+  };
+  i2c2Transfer(&xfer);
+}
+
+static void benchDpotWrite() {
+  I2C2Xfer xfer = {
+      .dev    = DEV_DPOT,
+      .prio   = I2C2_PRIO_ADC,
+      .tx_len = 1,
+      .tx     = dpot_,
+  };
+  i2c2Transfer(&xfer);
+}
+
+static void benchUpdateAdc() {
+  updateAdc(state_, &adc_, ADC_MS);
+}
+
+static void benchFansPwm() {
+  updateFans(BENCH_AMP_TEMP, BENCH_PSU_TEMP, BENCH_RPI_TEMP, 0, false, true,
+             false, false, ADC_MS);
+}
+
+static void benchFansLinear() {
+  updateFans(BENCH_AMP_TEMP, BENCH_PSU_TEMP, BENCH_RPI_TEMP, 0, false, true,
+             true, false, ADC_MS);
+}
+
+static void benchDpotVal() {
+  // Sweep the table's whole range of percents
+  static int16_t pcnt_f8 = 0;
+  pcnt_f8                = (pcnt_f8 + 4) & 0xFF;
+  volatile uint8_t val   = dpotValFromPercent(pcnt_f8);
+  (void)val;
+}
+
+static void (*const benches_[NUM_BENCHES])() = {
+    [BENCH_ADC_SCAN]    = benchAdcScan,
+    [BENCH_PWR_READ]    = benchPwrRead,
+    [BENCH_LED_WRITE]   = benchLedWrite,
+    [BENCH_DPOT_WRITE]  = benchDpotWrite,
+    [BENCH_UPDATE_ADC]  = benchUpdateAdc,
+    [BENCH_FANS_PWM]    = benchFansPwm,
+    [BENCH_FANS_LINEAR] = benchFansLinear,
+    [BENCH_DPOT_VAL]    = benchDpotVal,
+};
+
+void benchRun(AmpliPiState* state) {
+  state_ = state;
+
+  // Write back the DPOT's current value, and feed updateAdc() a real scan
+  I2C2Xfer dpot_read = {
+      .dev    = DEV_DPOT,
+      .prio   = I2C2_PRIO_ADC,
+      .rx_len = 1,
+      .rx     = dpot_,
+  };
+  i2c2Transfer(&dpot_read);
+  benchAdcScan();
+
+  for (size_t i = 0; i < NUM_BENCHES; i++) {
+    uint32_t start = cycles();
+    for (size_t run = 0; run < BENCH_RUNS; run++) {
+      benches_[i]();
+    }
+    uint32_t avg = (cycles() - start) / BENCH_RUNS;
+    cycles_[i]   = avg > UINT16_MAX ? UINT16_MAX : avg;
+  }
+}
+
+uint16_t benchCycles(BenchId bench) {
+  return cycles_[bench];
+}
@@ -0,0 +1,55 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Microbenchmarks of the bus and math primitives, for PREAMP_BENCH builds
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#include "ctrl_i2c.h"
+
+// Each benchmark runs its primitive this many times
+#define BENCH_RUNS 64
+
+// In register order, see REG_BENCH_ADC_SCAN_H
+typedef enum
+{
+  BENCH_ADC_SCAN,     // Reading all 4 ADC channels
+  BENCH_PWR_READ,     // Reading the Power Board's GPIO
+  BENCH_LED_WRITE,    // Writing the LED Board's LEDs
+  BENCH_DPOT_WRITE,   // Writing the fan DPOT
+  BENCH_UPDATE_ADC,   // updateAdc(), filtering and converting a scan
+  BENCH_FANS_PWM,     // updateFans() with FAN_ON PWM control
+  BENCH_FANS_LINEAR,  // updateFans() with DPOT control
+  BENCH_DPOT_VAL,     // dpotValFromPercent()
+  NUM_BENCHES,
+} BenchId;
+
+/* Run every benchmark once at startup, after the internal I2C bus is
+ * initialized. Bus transfers are made one at a time with i2c2Transfer() and
+ * only write the values already in the devices, so the benchmarks leave the
+ * preamp as they found it.
+ */
+void benchRun(AmpliPiState* state);
+
+// Average CPU cycles of one run of a benchmark, saturated at 0xFFFF
+uint16_t benchCycles(BenchId bench);
+
+#endif /* BENCH_H_ */
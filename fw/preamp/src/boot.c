@@ -0,0 +1,65 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Boot timeline
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "boot.h"
+
+#include "stm32f0xx.h"
+#include "systick.h"
+
+// SystemInit() runs from the 8 MHz HSI until it switches to the PLL, if used
+#define HSI_HZ 8000000
+
+#define BOOT_TICK_US 10
+
+static volatile uint16_t times_[NUM_BOOT_STEPS] = {0};
+static uint8_t           reset_cause_           = 0;
+
+void bootInit() {
+  uint32_t csr = RCC->CSR;
+  reset_cause_ = ((csr >> 24) & ~RESET_CAUSE_V18PWR) |
+                 (csr & RCC_CSR_V18PWRRSTF ? RESET_CAUSE_V18PWR : 0);
+  // Clear the flags so the next reset reports only its own cause
+  RCC->CSR |= RCC_CSR_RMVF;
+}
+
+uint8_t bootResetCause() {
+  return reset_cause_;
+}
+
+// Time from reset to systickInit(), which restarts micros() from 0
+static uint32_t clockUs() {
+  return SystemInitCycles / (HSI_HZ / 1000000);
+}
+
+void bootMark(BootStep step) {
+  if (times_[step]) {
+    return;
+  }
+  uint32_t us = clockUs();
+  if (step != BOOT_CLOCK) {
+    us += micros();
+  }
+  uint32_t ticks = us / BOOT_TICK_US + 1;  // Never 0 once reached
+  times_[step]   = ticks > 0xFFFF ? 0xFFFF : ticks;
+}
+
+uint16_t bootTime(BootStep step) {
+  return times_[step];
+}
@@ -0,0 +1,62 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Boot timeline
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOOT_H_
+#define BOOT_H_
+
+#include <stdint.h>
+
+// Steps in bringing up a preamp, in the order they normally happen
+typedef enum
+{
+  BOOT_CLOCK,  // System clock configured by SystemInit()
+  BOOT_I2C2,   // Internal I2C devices initialized
+  BOOT_ADDR,   // I2C address received over the UART
+  BOOT_CHAIN,  // Every expansion unit below this one reported ready
+  BOOT_CTRL,   // First control I2C transaction addressed to this preamp
+  NUM_BOOT_STEPS,
+} BootStep;
+
+/* Cause of the last reset, the RCC_CSR reset flags [31:25] in bits [7:1] and
+ * the 1.8 V domain reset flag in bit 0.
+ */
+#define RESET_CAUSE_V18PWR 0x01
+#define RESET_CAUSE_OBL    0x02  // Option byte load
+#define RESET_CAUSE_PIN    0x04  // NRST pin, also set by every other reset
+#define RESET_CAUSE_POR    0x08  // Power on or power down
+#define RESET_CAUSE_SFT    0x10  // Software reset, e.g. after an update
+#define RESET_CAUSE_IWDG   0x20  // Independent watchdog
+#define RESET_CAUSE_WWDG   0x40  // Window watchdog
+#define RESET_CAUSE_LPWR   0x80  // Low-power management
+
+// Read and clear the reset flags, call once at startup
+void bootInit();
+
+// The reset flags read by bootInit()
+uint8_t bootResetCause();
+
+// Record the time a step was first reached, may be called from interrupts
+void bootMark(BootStep step);
+
+// Time from reset a step was reached in units of 10 us, rounded up and
+// saturated at 0xFFFF, or 0 if it hasn't been reached yet
+uint16_t bootTime(BootStep step);
+
+#endif /* BOOT_H_ */
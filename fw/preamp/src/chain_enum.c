@@ -0,0 +1,97 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Enumeration of a chain of preamps over their UARTs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "chain_enum.h"
+
+/* Once a preamp has its address it forwards the next address to its
+ * expansion unit, which replies 'R' + its address + '\n' once both it and
+ * every unit below it are ready. Replies from further down the chain are
+ * passed up, so the Pi receives one from every preamp, finishing with the
+ * master's. The address is sent again if the expansion unit doesn't reply in
+ * time, since it may still be starting up, and a unit ignores the repeat if
+ * it already has that address.
+ *
+ * An expansion unit only replies once the rest of the chain below it has, so
+ * after the last try a preamp waits long enough for every unit that could be
+ * below it: ENUM_HOP_MS for each, covering that unit's tries plus the
+ * messages to and from it. Only then is this preamp taken to be the last in
+ * the chain. The master of a full chain of 6 waits at most 180 ms.
+ */
+#define ENUM_TIMEOUT_MS 10
+#define ENUM_TRIES      3
+#define ENUM_LINK_MS    10  // Longest to send an address down and a reply up
+#define ENUM_HOP_MS     ((ENUM_TRIES - 1) * ENUM_TIMEOUT_MS + ENUM_LINK_MS)
+#define ENUM_LAST_ADDR  0x60  // Address of the 6th preamp, the most in a chain
+
+// Time to wait for a reply after sending the address down
+static uint32_t enumTimeout(const ChainEnum* e) {
+  if (e->tries < ENUM_TRIES || e->addr >= ENUM_LAST_ADDR) {
+    return ENUM_TIMEOUT_MS;
+  }
+  uint8_t below = (ENUM_LAST_ADDR - e->addr) >> 4;
+  return ENUM_TIMEOUT_MS + below * ENUM_HOP_MS;
+}
+
+bool enumAddress(ChainEnum* e, uint8_t addr) {
+  if (e->state == ENUM_WAITING && addr == e->addr) {
+    // Resent by the preamp above before this one's chain replied
+    return false;
+  }
+  // Start again even if already enumerated, the chain may have been reset
+  e->addr      = addr;
+  e->state     = ENUM_WAITING;
+  e->tries     = 0;
+  e->exp_ready = false;
+  e->units     = 0;
+  return true;
+}
+
+bool enumReady(ChainEnum* e, uint8_t addr) {
+  if (addr <= e->addr) {
+    return false;
+  }
+  if (addr == e->addr + 0x10) {
+    e->exp_ready = true;
+  }
+  if ((addr - e->addr) >> 4 > e->units) {
+    e->units = (addr - e->addr) >> 4;
+  }
+  return true;
+}
+
+EnumSend enumCheck(ChainEnum* e, uint32_t now_ms) {
+  if (e->state != ENUM_WAITING) {
+    return ENUM_SEND_NONE;
+  }
+  if (e->exp_ready) {
+    e->state = ENUM_DONE;
+    return ENUM_SEND_READY;
+  }
+  if (e->tries && now_ms - e->sent_ms < enumTimeout(e)) {
+    return ENUM_SEND_NONE;
+  }
+  if (e->tries < ENUM_TRIES) {
+    e->tries++;
+    e->sent_ms = now_ms;
+    return ENUM_SEND_ADDR;
+  }
+  e->state = ENUM_LAST;
+  return ENUM_SEND_READY;
+}
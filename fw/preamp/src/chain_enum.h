@@ -0,0 +1,65 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Enumeration of a chain of preamps over their UARTs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHAIN_ENUM_H_
+#define CHAIN_ENUM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum
+{
+  ENUM_NO_ADDR,  // Waiting for this preamp's address
+  ENUM_WAITING,  // Waiting for the expansion unit to report ready
+  ENUM_DONE,     // Every expansion unit below this one reported ready
+  ENUM_LAST,     // No expansion unit replied, this is the last in the chain
+} EnumState;
+
+// What to send next, down the chain to the expansion unit or up the chain
+typedef enum
+{
+  ENUM_SEND_NONE,
+  ENUM_SEND_ADDR,   // 'A' + addr + 0x10 + '\n' to the expansion unit
+  ENUM_SEND_READY,  // 'R' + addr + '\n' up the chain
+} EnumSend;
+
+typedef struct {
+  volatile uint8_t addr;       // This preamp's address, 0 until received
+  EnumState        state;
+  uint8_t          tries;      // Times the address was sent down
+  uint32_t         sent_ms;    // Time the address was last sent down
+  volatile bool    exp_ready;  // The expansion unit reported ready
+  volatile uint8_t units;      // Units below that reported ready
+} ChainEnum;
+
+// An address received from up the chain. Returns true if it's new and should
+// be applied, a repeat of the address already being enumerated is ignored.
+bool enumAddress(ChainEnum* e, uint8_t addr);
+
+// A ready reply 'R' + addr received from the expansion unit. Returns true if
+// it came from below this preamp and should be passed up the chain. Can be
+// called from an interrupt.
+bool enumReady(ChainEnum* e, uint8_t addr);
+
+// Returns the message to send now, if any. Call every millisecond, the first
+// call after enumAddress() always sends the address down.
+EnumSend enumCheck(ChainEnum* e, uint32_t now_ms);
+
+#endif /* CHAIN_ENUM_H_ */
@@ -24,12 +24,24 @@
 
 #include "ctrl_i2c.h"
 
+#include <string.h>
+
 #include "audio_mux.h"
+#include "bench.h"
+#include "boot.h"
+#include "i2c2.h"
 #include "int_i2c.h"
+#include "pec.h"
+#include "persist.h"
 #include "port_defs.h"
+#include "profile.h"
 #include "serial.h"
 #include "stm32f0xx.h"
+#include "systick.h"
+#include "trace.h"
+#include "update.h"
 #include "version.h"
+#include "watchdog.h"
 
 /* Measured rise and fal times of the controller I2C bus
  *
@@ -42,23 +54,219 @@
  * Two expansion units:
  *  t_r = ~600 ns
  *  t_f = ~9.4 ns
+ *
+ * The rise time is set by the bus capacitance and the Pi's pull-ups, so the
+ * preamp can't improve it. At 400 kHz the Pi drives SCL low and releases it
+ * for ~1.25 us each, so even with two expansion units SCL is high for
+ * ~650 ns, just over the Fast-mode minimum t_HIGH of 600 ns.
+ * Fast-mode Plus (1 MHz) needs t_r < 120 ns, which would require stronger
+ * pull-ups on the controller board, so it isn't supported at any SYSCLK.
  */
 
-void ctrlI2CInit(uint8_t addr) {
-  // addr must be a 7-bit I2C address shifted left by one, ie: 0bXXXXXXX0
+// I2C1 is clocked by SYSCLK. For a slave, the minimum I2CCLK with the analog
+// filter on and no digital filter is 8 MHz for Fast-mode.
+#define CTRL_I2C_CLK_HZ SYSCLK_HZ
+
+// Clocks aren't generated in slave mode, but SCLDEL sets the data setup time
+// when sending, (SCLDEL + 1) I2CCLK periods. Fast-mode requires 100 ns, so
+// round up to whole periods: 0 (125 ns) at 8 MHz, 4 (104 ns) at 48 MHz.
+#define CTRL_I2C_SCLDEL ((CTRL_I2C_CLK_HZ + 9999999) / 10000000 - 1)
+
+// Bits of REG_CAPABILITIES, so the Pi can detect which features this firmware
+// supports. Firmware without REG_CAPABILITIES reads 0xFF, as any unknown
+// register does, so bit 7 is always clear here.
+#define CAP_BURST    0x01  // Auto-incrementing multi-byte transfers
+#define CAP_SNAPSHOT 0x02  // Telemetry snapshot registers
+#define CAP_COMMIT   0x04  // Staged audio control registers and COMMIT
+#define CAP_GROUP    0x08  // Group address
+#define CAP_DIRTY    0x10  // REG_DIRTY
+#define CAP_FM       0x20  // Fast-mode, 400 kHz
+#define CAP_RAMP     0x40  // Volume ramps
+
+#define CAPABILITIES                                                           \
+  (CAP_BURST | CAP_SNAPSHOT | CAP_COMMIT | CAP_GROUP | CAP_DIRTY | CAP_FM |    \
+   CAP_RAMP)
+
+// Bits of REG_CAPABILITIES_2, which firmware without it reads as 0xFF, so
+// bit 7 is always clear here
+#define CAP2_PEC       0x01  // SMBus packet error checking, REG_PEC
+#define CAP2_CHAIN     0x02  // Expansion unit telemetry, REG_CHAIN
+#define CAP2_PWR_BOARD 0x04  // Detected Power Board revision, REG_PWR_BOARD
+
+#define CAPABILITIES_2 (CAP2_PEC | CAP2_CHAIN | CAP2_PWR_BOARD)
+
+// Progress of the current transaction, tracked by the I2C1 interrupt handler
+typedef enum
+{
+  CTRL_IDLE,      // Waiting for a slave address match
+  CTRL_REG_ADDR,  // Addressed for writing, next byte is the register address
+  CTRL_WRITE,     // Next byte received is written to the current register
+  CTRL_READ,      // Sending the current register's value
+} CtrlXferState;
+
+static volatile CtrlXferState xfer_state_ = CTRL_IDLE;
+static volatile uint32_t      xfer_start_ = 0;  // Time of address match (ms)
+
+// Register address of the next byte read or written. Set by the first byte of
+// a write transaction and automatically incremented after each data byte,
+// so that sequential registers can be read or written in a single transfer.
+static volatile uint8_t reg_addr_ = 0;
+
+// Group-call address ACKed by every preamp in a chain, so that a write can be
+// sent to all preamps at once. Addresses are assigned 0x10, 0x20, ..., 0x60 by
+// checkForNewAddress(), so use the next one after the maximum of 6 preamps.
+// Group reads are answered with 0xFF, which leaves the bus released.
+#define CTRL_I2C_GROUP_ADDR 0x70
+
+// Group transactions keep their own register address so they don't disturb
+// an unaddressed (current address) read from the Pi.
+static volatile bool    group_xfer_     = false;
+static volatile uint8_t group_reg_addr_ = 0;
+
+// The current value of all registers from REG_SRC_AD to REG_ENUM (except
+// REG_DIRTY), kept up to date by the main loop so that reads never have to
+// wait for them to be computed.
+#define REG_FILE_LEN (REG_ENUM + 1)
+
+static uint8_t reg_file_[REG_FILE_LEN] = {0};
+
+// High-resolution telemetry, also kept up to date by the main loop
+#define HIRES_LEN ((REG_AMP_TEMP2_L - REG_HV1_VOLTAGE_H + 1) / 2)
+
+static volatile uint16_t hires_[HIRES_LEN] = {0};
+
+// Profile registers are 16-bit too, latched within the block by readProf()
+#define PROF_REGS_PER_STAGE (2 * PROF_NUM_STATS)
+
+static uint8_t prof_low_ = 0;
+
+// Internal I2C device counts, in register block order. Also latched.
+#define I2C2_STATS_REGS_PER_DEV 8
+
+static const uint8_t i2c2_stats_devs_[] = {
+    DEV_VOL1, DEV_VOL2, DEV_PWR_GPIO, DEV_LED_GPIO, DEV_ADC, DEV_DPOT,
+};
+
+static uint8_t i2c2_stats_low_ = 0;
+
+// Main loop busy periods, kept up to date by the main loop
+static volatile uint32_t loops_ = 0;
+
+// 32-bit counters, latched by reading their high byte so the other 3 bytes
+// read after it are consistent, even in separate transactions
+static uint32_t uptime_latch_ = 0;
+static uint32_t loops_latch_  = 0;
+
+// SMBus packet error checking, see REG_PEC. Enabled from the main loop, and
+// latched at the start of each transaction by the I2C1 interrupt.
+#define PEC_ENABLE 0x01
+
+static volatile bool    pec_enable_ = false;
+static volatile uint8_t pec_errors_ = 0;
+
+static bool    xfer_pec_   = false;  // The current transaction is checked
+static uint8_t pec_crc_    = 0;      // Of the transaction so far
+static uint8_t pec_rx_     = 0;      // Data bytes written, the last the PEC
+static uint8_t pec_head_   = 0;      // End of the writes not yet checked
+static bool    pec_queued_ = false;  // The last byte written was queued
+static uint8_t pec_tx_     = 0;      // Register bytes to send before the PEC
+
+#define PEC_TX_DONE 0xFF  // pec_tx_ once the PEC has been sent
+
+// Whether the byte in I2C_TXDR advanced reg_addr_, rather than being a PEC
+static bool txdr_reg_ = false;
+
+// Register writes are received in the interrupt handler and queued to later be
+// applied from the main loop. Reads are responded to immediately.
+#define CMD_QUEUE_SIZE 32  // Must be a power of 2
+
+typedef struct {
+  uint8_t reg;
+  uint8_t data;
+} CtrlCmd;
+
+static volatile CtrlCmd cmd_queue_[CMD_QUEUE_SIZE];
+static volatile uint8_t cmd_head_ = 0;  // Next slot to fill, written by ISR
+static volatile uint8_t cmd_tail_ = 0;  // Next slot to apply, written by main
+
+// Telemetry snapshot, updated by the main loop. Copied to snap_tx_ by the first
+// read of the snapshot registers in each transaction, so that a burst read of
+// the whole snapshot is always self-consistent.
+#define SNAP_LEN CTRL_I2C_SNAP_LEN
+
+static const uint8_t snap_regs_[SNAP_LEN - 2] = {
+    REG_POWER,     REG_FANS,      REG_HV1_VOLTAGE, REG_AMP_TEMP1, REG_HV1_TEMP,
+    REG_AMP_TEMP2, REG_PI_TEMP,   REG_FAN_DUTY,    REG_FAN_VOLTS,
+};
+
+// Bit set in REG_DIRTY when each of snap_regs_ changes. The Pi writes PI_TEMP
+// so doesn't need to be notified of changes to it.
+static const uint8_t snap_dirty_bits_[SNAP_LEN - 2] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x00, 0x40, 0x80,
+};
+
+static uint8_t snapshot_[SNAP_LEN] = {0};
+static uint8_t snap_tx_[SNAP_LEN]  = {0};
+static bool    snap_latched_       = false;
+
+// Expansion unit snapshots received by the UART interrupt, and when (ms).
+// Copied to chain_tx_ along with their ages by the first read of REG_CHAIN in
+// each transaction, then read out a byte at a time from chain_pos_. Entries
+// never received stay all 0xFF, which fails the checksum.
+#define CHAIN_ENTRY_LEN (1 + SNAP_LEN)
+#define CHAIN_LEN       (CTRL_I2C_CHAIN_UNITS * CHAIN_ENTRY_LEN)
+#define CHAIN_AGE_SHIFT 7  // 128 ms units, without a division in the interrupt
+#define CHAIN_AGE_MAX   0xFE
+#define CHAIN_AGE_NONE  0xFF
+
+static uint8_t  chain_[CTRL_I2C_CHAIN_UNITS][SNAP_LEN];
+static uint32_t chain_ms_[CTRL_I2C_CHAIN_UNITS];
+static bool     chain_valid_[CTRL_I2C_CHAIN_UNITS];
+static uint8_t  chain_tx_[CHAIN_LEN];
+static uint8_t  chain_pos_ = 0;  // Next byte of chain_tx_, 0 before latching
+
+// Status registers changed since REG_DIRTY was last read. Set by the main loop,
+// cleared by the I2C1 interrupt once REG_DIRTY has actually been sent, which
+// may be after it was loaded into I2C_TXDR.
+static volatile uint8_t dirty_      = 0;
+static volatile uint8_t dirty_txdr_ = 0;  // Value of REG_DIRTY in I2C_TXDR
+
+// The trace entry being read is likewise only marked read once
+// REG_TRACE_DATA_LAST has been sent, not when it's loaded into I2C_TXDR
+static bool trace_txdr_ = false;  // REG_TRACE_DATA_LAST is in I2C_TXDR
+
+// Staged audio control registers, written by the main loop and applied by a
+// write to REG_COMMIT. Bits in stage_mask_ mark which registers are staged.
+#define STAGE_LEN (REG_STAGE_VOL_ZONE6 - REG_STAGE_SRC_AD + 1)
+
+static volatile uint8_t  stage_regs_[STAGE_LEN] = {0};
+static volatile uint16_t stage_mask_            = 0;
+
+// SMBus limits how long a slave may be held in a single transaction to 25 ms.
+// If a transaction takes longer than this assume the master (Pi) was reset or
+// otherwise stopped mid-transaction, and reset I2C1 to release the bus.
+#define CTRL_I2C_TIMEOUT_MS 25
+
+static void updateRegFile(const AmpliPiState* state);
+
+void ctrlI2CInit(AmpliPiState* state) {
+  // state->i2c_addr must be a 7-bit I2C address shifted left by one,
+  // ie: 0bXXXXXXX0
 
   // Enable peripheral clock for I2C1
+  RCC_I2CCLKConfig(RCC_I2C1CLK_SYSCLK);
   RCC_APB1PeriphClockCmd(RCC_APB1Periph_I2C1, ENABLE);
 
   // Connect pins to alternate function for I2C1
   GPIO_PinAFConfig(GPIOB, GPIO_PinSource6, GPIO_AF_1);  // I2C1_SCL
   GPIO_PinAFConfig(GPIOB, GPIO_PinSource7, GPIO_AF_1);  // I2C1_SDA
 
-  // Config I2C GPIO pins
+  // Config I2C GPIO pins. The slew rate must allow a t_f of 20-300 ns at
+  // 400 kHz, 10 MHz gives ~25 ns.
   GPIO_InitTypeDef GPIO_InitStructureI2C;
   GPIO_InitStructureI2C.GPIO_Pin   = pSCL | pSDA;
   GPIO_InitStructureI2C.GPIO_Mode  = GPIO_Mode_AF;
-  GPIO_InitStructureI2C.GPIO_Speed = GPIO_Speed_2MHz;
+  GPIO_InitStructureI2C.GPIO_Speed = GPIO_Speed_10MHz;
   GPIO_InitStructureI2C.GPIO_OType = GPIO_OType_OD;
   GPIO_InitStructureI2C.GPIO_PuPd  = GPIO_PuPd_NOPULL;
   GPIO_Init(GPIOB, &GPIO_InitStructureI2C);
@@ -68,276 +276,1166 @@ void ctrlI2CInit(uint8_t addr) {
   I2C_InitStructure1.I2C_Mode                = I2C_Mode_I2C;
   I2C_InitStructure1.I2C_AnalogFilter        = I2C_AnalogFilter_Enable;
   I2C_InitStructure1.I2C_DigitalFilter       = 0x00;
-  I2C_InitStructure1.I2C_OwnAddress1         = addr;
+  I2C_InitStructure1.I2C_OwnAddress1         = state->i2c_addr;
   I2C_InitStructure1.I2C_Ack                 = I2C_Ack_Enable;
   I2C_InitStructure1.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
-  I2C_InitStructure1.I2C_Timing = 0;  // Clocks not generated in slave mode
+  I2C_InitStructure1.I2C_Timing = CTRL_I2C_SCLDEL << 20;
+  NVIC_DisableIRQ(I2C1_IRQn);
   I2C_Init(I2C1, &I2C_InitStructure1);
+
+  // Also respond to the group address. OA2 can only be changed while disabled.
+  I2C_DualAddressCmd(I2C1, DISABLE);
+  I2C_OwnAddress2Config(I2C1, CTRL_I2C_GROUP_ADDR, I2C_OA2_NoMask);
+  I2C_DualAddressCmd(I2C1, ENABLE);
+  xfer_state_ = CTRL_IDLE;
+  updateRegFile(state);
+
+  // All transfers are handled in the I2C1 interrupt
+  I2C_ITConfig(I2C1,
+               I2C_IT_ADDRI | I2C_IT_RXI | I2C_IT_TXI | I2C_IT_NACKI |
+                   I2C_IT_STOPI | I2C_IT_ERRI,
+               ENABLE);
   I2C_Cmd(I2C1, ENABLE);
+  NVIC_EnableIRQ(I2C1_IRQn);
 }
 
-bool ctrlI2CAddrMatch() {
-  return I2C_GetFlagStatus(I2C1, I2C_FLAG_ADDR);
+// How each register is read and written, the read and write columns of
+// ctrl_regs.def, and how a register file value is computed, the file column
+typedef enum
+{
+  RD_NONE,  // Not a register, reads 0xFF
+  RD_FILE,
+  RD_DIRTY,
+  RD_SNAP,
+  RD_STAGE,
+  RD_COMMIT,
+  RD_CHAIN,
+  RD_VOL_TARGET,
+  RD_VOL_RATE,
+  RD_HIRES,
+  RD_TRACE_DATA,
+  RD_PROF,
+  RD_ZERO,  // Write-only, reads 0x00
+  RD_I2C2_STATS,
+  RD_I2C2_RECOVERIES,
+  RD_PEC,
+  RD_PEC_ERRORS,
+  RD_PERSIST,
+  RD_PWR_BOARD,
+  RD_RESET_CAUSE,
+  RD_WATCHDOG,
+  RD_UPTIME,
+  RD_LOOPS,
+  RD_TRACE_SEQ,
+  RD_TRACE,
+  RD_BOOT,
+  RD_UPDATE,
+  RD_UPDATE_LEN,
+  RD_UPDATE_CRC,
+  RD_BENCH,
+  RD_CAPABILITIES_2,
+  RD_CAPABILITIES,
+  RD_VERSION,
+  RD_GIT_HASH,
+  RD_NUM,
+} RegRead;
+
+typedef enum
+{
+  WR_NONE,  // Read-only, writes aren't queued
+  WR_SRC_AD,
+  WR_ZONE_SRC,
+  WR_MUTE,
+  WR_STANDBY,
+  WR_VOL,
+  WR_POWER,
+  WR_FANS,
+  WR_LED_CTRL,
+  WR_LED_VAL,
+  WR_EXPANSION,
+  WR_PI_TEMP,
+  WR_PEC,
+  WR_STAGE,
+  WR_COMMIT,
+  WR_VOL_TARGET,
+  WR_VOL_RATE,
+  WR_PROF_RESET,
+  WR_TRACE,
+  WR_I2C2_STATS_RESET,
+  WR_PERSIST,
+  WR_UPDATE,
+  WR_NUM,
+} RegWrite;
+
+typedef enum
+{
+  RF_NONE,  // Not in the register file
+  RF_SRC_AD,
+  RF_ZONE_SRC,
+  RF_MUTE,
+  RF_STANDBY,
+  RF_VOL,
+  RF_POWER,
+  RF_FANS,
+  RF_LED_CTRL,
+  RF_LED_VAL,
+  RF_EXPANSION,
+  RF_HV1,
+  RF_AMP_TEMP1,
+  RF_HV1_TEMP,
+  RF_AMP_TEMP2,
+  RF_PI_TEMP,
+  RF_FAN_DUTY,
+  RF_FAN_VOLTS,
+  RF_LOOP_OVERRUNS,
+  RF_INT_I2C_OVERRUNS,
+  RF_FAN_PWM_DUTY,
+  RF_UART_DOWN_DROPS,
+  RF_UART_UP_DROPS,
+  RF_ENUM,
+  RF_NUM,
+} RegFile;
+
+// The access column of ctrl_regs.def
+#define ACC_HIGH    0x01  // High byte of a 16-bit value, latches the low byte
+#define ACC_LOW     0x02  // Low byte, the value latched by the high byte
+#define ACC_UNICAST 0x04  // Can't be written with the group address
+#define ACC_STREAM  0x08  // Reads don't advance the register address
+
+typedef struct {
+  uint8_t read;    // RegRead
+  uint8_t write;   // RegWrite
+  uint8_t access;  // ACC_ bits
+  uint8_t file;    // RegFile
+} RegDesc;
+
+// Every register address, so both the I2C1 interrupt and the main loop find a
+// register with a single lookup. Unlisted addresses are all zero: RD_NONE,
+// WR_NONE, RF_NONE.
+static const RegDesc reg_table_[256] = {
+#define REG(name, addr, read, write, access) \
+  [addr] = {RD_##read, WR_##write, access, RF_NONE},
+#define REG_FILE(name, addr, file, write, access) \
+  [addr] = {RD_FILE, WR_##write, access, RF_##file},
+#define REG_BLOCK(name, first, last, read, write, access) \
+  [first ... last] = {RD_##read, WR_##write, access, RF_NONE},
+#include "ctrl_regs.def"
+#undef REG
+#undef REG_FILE
+#undef REG_BLOCK
+};
+
+// Low byte latched by the last ACC_HIGH register read, and its address
+static uint8_t latch_low_  = 0;
+static uint8_t latch_addr_ = 0;
+
+/* Register reads, called from the I2C1 interrupt so must not compute anything,
+ * all values are ready in the register file or wherever they are kept. Each
+ * returns the value of the register at addr, or for a 16-bit pair the whole
+ * value given the address of its high byte.
+ */
+typedef uint16_t (*RegReadFn)(uint8_t addr);
+
+static uint16_t readNone(uint8_t addr) {
+  (void)addr;
+  return 0xFF;
 }
 
-uint8_t readReg(const AmpliPiState* state, uint8_t addr) {
-  uint8_t out_msg = 0;
-  switch (addr) {
-    case REG_SRC_AD:
-      for (size_t src = 0; src < NUM_SRCS; src++) {
-        if (getSourceAD(src)) {
-          out_msg |= (1 << src);
-        }
-      }
-      break;
+static uint16_t readFile(uint8_t addr) {
+  return reg_file_[addr];
+}
 
-    case REG_ZONE321:
-    case REG_ZONE654: {
-      size_t offset = 3 * (addr - REG_ZONE321);
-      for (size_t zone = 0; zone < 3; zone++) {
-        size_t src = getZoneSource(zone + offset) & 0x3;
-        out_msg |= (src << (2 * zone));
+static uint16_t readDirty(uint8_t addr) {
+  (void)addr;
+  return dirty_;
+}
+
+static uint16_t readSnap(uint8_t addr) {
+  // Only called from the I2C1 interrupt, which the main loop can't interrupt
+  // while updating the snapshot
+  if (!snap_latched_) {
+    memcpy(snap_tx_, snapshot_, SNAP_LEN);
+    snap_latched_ = true;
+  }
+  return snap_tx_[addr - REG_SNAP_SEQ];
+}
+
+static uint16_t readStage(uint8_t addr) {
+  // Registers that haven't been staged read back the live value
+  size_t i = addr - REG_STAGE_SRC_AD;
+  if (stage_mask_ & (1 << i)) {
+    return stage_regs_[i];
+  }
+  return reg_file_[REG_SRC_AD + i];
+}
+
+static uint16_t readCommit(uint8_t addr) {
+  (void)addr;
+  return stage_mask_ ? 1 : 0;
+}
+
+static uint16_t readChain(uint8_t addr) {
+  (void)addr;
+  // The UART interrupt that stores entries has the same priority as the I2C1
+  // interrupt, so can't change them while they're copied
+  if (chain_pos_ == 0) {
+    uint32_t now = millis();
+    for (size_t i = 0; i < CTRL_I2C_CHAIN_UNITS; i++) {
+      uint8_t* entry = &chain_tx_[i * CHAIN_ENTRY_LEN];
+      if (chain_valid_[i]) {
+        uint32_t age = (now - chain_ms_[i]) >> CHAIN_AGE_SHIFT;
+        entry[0]     = age < CHAIN_AGE_MAX ? age : CHAIN_AGE_MAX;
+        memcpy(&entry[1], chain_[i], SNAP_LEN);
+      } else {
+        memset(entry, CHAIN_AGE_NONE, CHAIN_ENTRY_LEN);
       }
+    }
+  }
+  return chain_pos_ < CHAIN_LEN ? chain_tx_[chain_pos_++] : 0xFF;
+}
+
+static uint16_t readVolTarget(uint8_t addr) {
+  return getZoneTarget(addr - REG_VOL_TARGET_ZONE1);
+}
+
+static uint16_t readVolRate(uint8_t addr) {
+  return getZoneRampRate(addr - REG_VOL_RATE_ZONE1);
+}
+
+static uint16_t readHires(uint8_t addr) {
+  return hires_[(addr - REG_HV1_VOLTAGE_H) / 2];
+}
+
+static uint16_t readTraceData(uint8_t addr) {
+#ifdef PREAMP_TRACE
+  static TraceEntry entry;
+  if (addr == REG_TRACE_DATA_FIRST) {
+    traceRead(&entry);
+  }
+  return ((const uint8_t*)&entry)[addr - REG_TRACE_DATA_FIRST];
+#else
+  (void)addr;
+  return 0xFF;
+#endif
+}
+
+static uint16_t readProf(uint8_t addr) {
+  size_t i = addr - REG_PROF_FIRST;
+  if (i & 1) {
+    return prof_low_;
+  }
+  uint16_t val = profGet(i / PROF_REGS_PER_STAGE,
+                         (i % PROF_REGS_PER_STAGE) / 2);
+  prof_low_    = val & 0xFF;
+  return val >> 8;
+}
+
+static uint16_t readZero(uint8_t addr) {
+  (void)addr;
+  return 0;
+}
+
+// Read one of a device's internal I2C count registers
+static uint16_t readI2C2Stats(uint8_t addr) {
+  static const I2C2Stats none = {0};
+
+  size_t                    i = addr - REG_I2C2_STATS_FIRST;
+  const volatile I2C2Stats* s =
+      i2c2Stats(i2c2_stats_devs_[i / I2C2_STATS_REGS_PER_DEV]);
+  if (!s) {
+    s = &none;
+  }
+  uint16_t val;
+  switch (i % I2C2_STATS_REGS_PER_DEV) {
+    case 0:
+      val = s->xfers;
       break;
+    case 2:
+      return s->nacks;
+    case 3:
+      return s->arlos;
+    case 4:
+      return s->berrs;
+    case 5:
+      return s->timeouts;
+    case 6:
+      val = s->max_us;
+      break;
+    default:
+      return i2c2_stats_low_;
+  }
+  i2c2_stats_low_ = val & 0xFF;
+  return val >> 8;
+}
+
+static uint16_t readI2C2Recoveries(uint8_t addr) {
+  (void)addr;
+  return i2c2Recoveries();
+}
+
+static uint16_t readPec(uint8_t addr) {
+  (void)addr;
+  return pec_enable_ ? PEC_ENABLE : 0;
+}
+
+static uint16_t readPecErrors(uint8_t addr) {
+  (void)addr;
+  return pec_errors_;
+}
+
+static uint16_t readPersist(uint8_t addr) {
+  (void)addr;
+  return persistStatus();
+}
+
+static uint16_t readPwrBoard(uint8_t addr) {
+  (void)addr;
+  return pwrBoardRev();
+}
+
+static uint16_t readResetCause(uint8_t addr) {
+  (void)addr;
+  return bootResetCause();
+}
+
+static uint16_t readWatchdog(uint8_t addr) {
+  (void)addr;
+  return watchdogLastReset();
+}
+
+// Uptime and loops are two 16-bit pairs each, UPTIME_3 and LOOPS_3 the high
+static uint16_t readUptime(uint8_t addr) {
+  if (addr == REG_UPTIME_3) {
+    uptime_latch_ = millis();
+  }
+  return uptime_latch_ >> (8 * (REG_UPTIME_1 - addr));
+}
+
+static uint16_t readLoops(uint8_t addr) {
+  if (addr == REG_LOOPS_3) {
+    loops_latch_ = loops_;
+  }
+  return loops_latch_ >> (8 * (REG_LOOPS_1 - addr));
+}
+
+static uint16_t readTraceSeq(uint8_t addr) {
+  (void)addr;
+#ifdef PREAMP_TRACE
+  return traceSeq();
+#else
+  return UINT16_MAX;
+#endif
+}
+
+static uint16_t readTrace(uint8_t addr) {
+  (void)addr;
+#ifdef PREAMP_TRACE
+  return traceUnread();
+#else
+  return 0xFF;
+#endif
+}
+
+static uint16_t readBoot(uint8_t addr) {
+  return bootTime((addr - REG_BOOT_CLOCK_H) / 2);
+}
+
+static uint16_t readUpdate(uint8_t addr) {
+  (void)addr;
+  return updateStatus();
+}
+
+static uint16_t readUpdateLen(uint8_t addr) {
+  (void)addr;
+  return updateLength();
+}
+
+// The CRC is two 16-bit pairs, CRC_3 the high one
+static uint16_t readUpdateCrc(uint8_t addr) {
+  return updateCrc() >> (8 * (REG_UPDATE_CRC_1 - addr));
+}
+
+static uint16_t readBench(uint8_t addr) {
+#ifdef PREAMP_BENCH
+  return benchCycles((addr - REG_BENCH_ADC_SCAN_H) / 2);
+#else
+  (void)addr;
+  return UINT16_MAX;
+#endif
+}
+
+static uint16_t readCapabilities2(uint8_t addr) {
+  (void)addr;
+  return CAPABILITIES_2;
+}
+
+static uint16_t readCapabilities(uint8_t addr) {
+  (void)addr;
+  return CAPABILITIES;
+}
+
+static uint16_t readVersion(uint8_t addr) {
+  return addr == REG_VERSION_MAJOR ? VERSION_MAJOR_ : VERSION_MINOR_;
+}
+
+static uint16_t readGitHash(uint8_t addr) {
+  return GIT_HASH_[addr - REG_GIT_HASH_6_5];
+}
+
+static const RegReadFn readers_[RD_NUM] = {
+    [RD_NONE]            = readNone,
+    [RD_FILE]            = readFile,
+    [RD_DIRTY]           = readDirty,
+    [RD_SNAP]            = readSnap,
+    [RD_STAGE]           = readStage,
+    [RD_COMMIT]          = readCommit,
+    [RD_CHAIN]           = readChain,
+    [RD_VOL_TARGET]      = readVolTarget,
+    [RD_VOL_RATE]        = readVolRate,
+    [RD_HIRES]           = readHires,
+    [RD_TRACE_DATA]      = readTraceData,
+    [RD_PROF]            = readProf,
+    [RD_ZERO]            = readZero,
+    [RD_I2C2_STATS]      = readI2C2Stats,
+    [RD_I2C2_RECOVERIES] = readI2C2Recoveries,
+    [RD_PEC]             = readPec,
+    [RD_PEC_ERRORS]      = readPecErrors,
+    [RD_PERSIST]         = readPersist,
+    [RD_PWR_BOARD]       = readPwrBoard,
+    [RD_RESET_CAUSE]     = readResetCause,
+    [RD_WATCHDOG]        = readWatchdog,
+    [RD_UPTIME]          = readUptime,
+    [RD_LOOPS]           = readLoops,
+    [RD_TRACE_SEQ]       = readTraceSeq,
+    [RD_TRACE]           = readTrace,
+    [RD_BOOT]            = readBoot,
+    [RD_UPDATE]          = readUpdate,
+    [RD_UPDATE_LEN]      = readUpdateLen,
+    [RD_UPDATE_CRC]      = readUpdateCrc,
+    [RD_BENCH]           = readBench,
+    [RD_CAPABILITIES_2]  = readCapabilities2,
+    [RD_CAPABILITIES]    = readCapabilities,
+    [RD_VERSION]         = readVersion,
+    [RD_GIT_HASH]        = readGitHash,
+};
+
+// Read any register, from the I2C1 interrupt
+static uint8_t readReg(uint8_t addr) {
+  const RegDesc* reg = &reg_table_[addr];
+  if (reg->access & ACC_LOW) {
+    // Normally right after its high byte, otherwise read the pair again
+    if (latch_addr_ == addr) {
+      return latch_low_;
     }
+    return readers_[reg->read](addr - 1) & 0xFF;
+  }
 
-    case REG_MUTE:
-      for (size_t zone = 0; zone < NUM_ZONES; zone++) {
-        if (muted(zone)) {
-          out_msg |= (1 << zone);
+  uint16_t val = readers_[reg->read](addr);
+  if (reg->access & ACC_HIGH) {
+    latch_low_  = val & 0xFF;
+    latch_addr_ = addr + 1;
+    return val >> 8;
+  }
+  return val;
+}
+
+// Apply all staged audio control registers at once
+static void commitStaged() {
+  AudioConfig cfg;
+  getAudioConfig(&cfg);
+  for (size_t i = 0; i < STAGE_LEN; i++) {
+    if (!(stage_mask_ & (1 << i))) {
+      continue;
+    }
+    uint8_t data = stage_regs_[i];
+    uint8_t addr = REG_SRC_AD + i;
+    switch (addr) {
+      case REG_SRC_AD:
+        cfg.src_ad = data;
+        break;
+
+      case REG_ZONE321:
+      case REG_ZONE654: {
+        size_t start = 3 * (addr - REG_ZONE321);
+        for (size_t zone = start; zone < start + 3; zone++) {
+          cfg.zone_src[zone] = data & 0x3;
+          data               = data >> 2;
         }
+        break;
       }
-      break;
 
-    case REG_STANDBY:
-      out_msg = inStandby() ? 1 : 0;
-      break;
+      case REG_MUTE:
+        cfg.mutes = data & ((1 << NUM_ZONES) - 1);
+        break;
 
-    case REG_VOL_ZONE1:
-    case REG_VOL_ZONE2:
-    case REG_VOL_ZONE3:
-    case REG_VOL_ZONE4:
-    case REG_VOL_ZONE5:
-    case REG_VOL_ZONE6:
-      out_msg = getZoneVolume(addr - REG_VOL_ZONE1);
-      break;
+      case REG_STANDBY:
+        // Same as REG_STANDBY, active-low
+        cfg.standby = data == 0;
+        break;
 
-    case REG_POWER: {
-      PwrMsg msg = {
-          .pg_9v    = state->pwr_gpio.pg_9v,
-          .en_9v    = state->pwr_gpio.en_9v,
-          .pg_12v   = state->pwr_gpio.pg_12v,
-          .en_12v   = state->pwr_gpio.en_12v,
-          .reserved = 0,
-      };
-      out_msg = msg.data;
-      break;
+      default:  // REG_VOL_ZONE1-6
+        cfg.vols[addr - REG_VOL_ZONE1] = data;
+        break;
     }
+  }
+  stage_mask_ = 0;
+  setAudioConfig(&cfg);
+}
 
-    case REG_FANS: {
-      FanMsg msg = {
-          .ctrl     = state->fans->ctrl,
-          .on       = state->fans->duty_f7 > 0,
-          .ovr_tmp  = !state->pwr_gpio.ovr_tmp_n || state->fans->ovr_temp,
-          .fail     = !state->pwr_gpio.fan_fail_n,
-          .reserved = 0,
-      };
-      out_msg = msg.data;
-      break;
-    }
+// Register writes, applied from the main loop
+typedef void (*RegWriteFn)(AmpliPiState* state, uint8_t addr, uint8_t data);
 
-    case REG_LED_CTRL:
-      out_msg = state->led_override ? 1 : 0;
-      break;
+static void writeSrcAD(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  for (size_t src = 0; src < NUM_SRCS; src++) {
+    // Analog = low, Digital = high
+    InputType type = data & 0x1 ? IT_DIGITAL : IT_ANALOG;
+    setSourceAD(src, type);
+    data = data >> 1;
+  }
+}
 
-    case REG_LED_VAL:
-      out_msg = state->leds.data;
-      break;
+static void writeZoneSrc(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  size_t start = 3 * (addr - REG_ZONE321);
+  for (size_t zone = start; zone < start + 3; zone++) {
+    // Connect the zone to the specified source
+    size_t src = data & 0x3;
+    setZoneSource(zone, src);
+    data = data >> 2;
+  }
+}
 
-    case REG_EXPANSION:
-      out_msg = state->expansion.data;
-      break;
+static void writeMute(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    mute(zone, data & (0x1 << zone));
+  }
+}
 
-    case REG_HV1_VOLTAGE:
-      out_msg = state->hv1;
-      break;
+static void writeStandby(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  // Standby is active-low and all channels must be put in standby at once
+  standby(data == 0);
+}
 
-    case REG_HV1_TEMP:
-      out_msg = state->hv1_temp;
-      break;
+static void writeVol(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  setZoneVolume(addr - REG_VOL_ZONE1, data);
+}
 
-    case REG_AMP_TEMP1:
-      out_msg = state->amp_temp1;
-      break;
+static void writePower(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)addr;
+  state->pwr_gpio.en_9v  = ((PwrMsg)data).en_9v;
+  state->pwr_gpio.en_12v = ((PwrMsg)data).en_12v;
+}
 
-    case REG_AMP_TEMP2:
-      out_msg = state->amp_temp2;
-      break;
+static void writeFans(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)addr;
+  state->fan_override = ((FanMsg)data).ctrl == FAN_CTRL_FORCED;
+  state->fan_pi       = ((FanMsg)data).pi;
+}
 
-    case REG_PI_TEMP:
-      out_msg = state->pi_temp;
-      break;
+static void writeLedCtrl(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)addr;
+  state->led_override = data & 0x01;
+}
 
-    case REG_FAN_DUTY:
-      out_msg = state->fans->duty_f7;
-      break;
+static void writeLedVal(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)addr;
+  state->leds.data = data;
+}
 
-    case REG_FAN_VOLTS: {
-      out_msg = state->fans->volts_f4;
-      break;
-    }
+static void writeExpansion(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)addr;
+  // Control expansion port's NRST and BOOT0 pins
+  state->expansion.nrst  = (data & 0x01) != 0;
+  state->expansion.boot0 = (data & 0x02) != 0;
 
-    case REG_VERSION_MAJOR:
-      out_msg = VERSION_MAJOR_;
-      break;
+  // TODO: Move these out of i2c handler
+  writePin(exp_nrst_, state->expansion.nrst);
+  writePin(exp_boot0_, state->expansion.boot0);
 
-    case REG_VERSION_MINOR:
-      out_msg = VERSION_MINOR_;
-      break;
+  // Allow UART messages to be forwarded to expansion units
+  state->expansion.uart_passthrough = (data & 0x04) != 0;
+  setUartPassthrough(state->expansion.uart_passthrough);
+}
 
-    case REG_GIT_HASH_6_5:
-    case REG_GIT_HASH_4_3:
-    case REG_GIT_HASH_2_1:
-    case REG_GIT_HASH_0_D:
-      out_msg = GIT_HASH_[addr - REG_GIT_HASH_6_5];
-      break;
+static void writePiTemp(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)addr;
+  state->pi_temp = data;
+}
 
-    default:
-      // Return 0xFF if a non-existent register is selected
-      out_msg = 0xFF;
+static void writePec(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  pec_enable_ = data & PEC_ENABLE;
+}
+
+static void writeStage(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  size_t i       = addr - REG_STAGE_SRC_AD;
+  stage_regs_[i] = data;
+  stage_mask_ |= 1 << i;
+}
+
+static void writeCommit(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  (void)data;
+  commitStaged();
+}
+
+static void writeVolTarget(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  setZoneTarget(addr - REG_VOL_TARGET_ZONE1, data);
+}
+
+static void writeVolRate(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  setZoneRampRate(addr - REG_VOL_RATE_ZONE1, data);
+}
+
+static void writeProfReset(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  (void)data;
+  profReset();
+}
+
+static void writeTrace(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  (void)data;
+  traceRewind();
+}
+
+static void writeI2C2StatsReset(AmpliPiState* state, uint8_t addr,
+                                uint8_t data) {
+  (void)state;
+  (void)addr;
+  (void)data;
+  i2c2ResetStats();
+}
+
+static void writePersist(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  persistEnable(data & PERSIST_ENABLE);
+}
+
+static void writeUpdate(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  (void)state;
+  (void)addr;
+  updateCommand(data);
+}
+
+// WR_NONE registers are never queued
+static const RegWriteFn writers_[WR_NUM] = {
+    [WR_SRC_AD]           = writeSrcAD,
+    [WR_ZONE_SRC]         = writeZoneSrc,
+    [WR_MUTE]             = writeMute,
+    [WR_STANDBY]          = writeStandby,
+    [WR_VOL]              = writeVol,
+    [WR_POWER]            = writePower,
+    [WR_FANS]             = writeFans,
+    [WR_LED_CTRL]         = writeLedCtrl,
+    [WR_LED_VAL]          = writeLedVal,
+    [WR_EXPANSION]        = writeExpansion,
+    [WR_PI_TEMP]          = writePiTemp,
+    [WR_PEC]              = writePec,
+    [WR_STAGE]            = writeStage,
+    [WR_COMMIT]           = writeCommit,
+    [WR_VOL_TARGET]       = writeVolTarget,
+    [WR_VOL_RATE]         = writeVolRate,
+    [WR_PROF_RESET]       = writeProfReset,
+    [WR_TRACE]            = writeTrace,
+    [WR_I2C2_STATS_RESET] = writeI2C2StatsReset,
+    [WR_PERSIST]          = writePersist,
+    [WR_UPDATE]           = writeUpdate,
+};
+
+// Whether a write to a register is queued by the I2C1 interrupt. Writes to
+// read-only registers are dropped there, so they don't use up the queue. The
+// expansion register controls each preamp's next expansion unit, so must be
+// written to a single preamp rather than with the group address.
+static bool writable(uint8_t addr, bool group) {
+  const RegDesc* reg = &reg_table_[addr];
+  return reg->write != WR_NONE && !(group && (reg->access & ACC_UNICAST));
+}
+
+static void writeReg(AmpliPiState* state, uint8_t addr, uint8_t data) {
+  traceCtrlWrite(addr, data);
+  writers_[reg_table_[addr].write](state, addr, data);
+}
+
+/* Register file values, computed from the current state by the main loop.
+ * Each returns the value of the register at addr.
+ */
+typedef uint8_t (*RegFileFn)(const AmpliPiState* state, uint8_t addr);
+
+static uint8_t fileNone(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  return 0;
+}
+
+static uint8_t fileSrcAD(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  uint8_t out_msg = 0;
+  for (size_t src = 0; src < NUM_SRCS; src++) {
+    if (getSourceAD(src)) {
+      out_msg |= (1 << src);
+    }
   }
   return out_msg;
 }
 
-void writeReg(AmpliPiState* state, uint8_t addr, uint8_t data) {
-  switch (addr) {
-    case REG_SRC_AD:
-      for (size_t src = 0; src < NUM_SRCS; src++) {
-        // Analog = low, Digital = high
-        InputType type = data & 0x1 ? IT_DIGITAL : IT_ANALOG;
-        setSourceAD(src, type);
-        data = data >> 1;
-      }
-      break;
+static uint8_t fileZoneSrc(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  uint8_t out_msg = 0;
+  size_t  offset  = 3 * (addr - REG_ZONE321);
+  for (size_t zone = 0; zone < 3; zone++) {
+    size_t src = getZoneSource(zone + offset) & 0x3;
+    out_msg |= (src << (2 * zone));
+  }
+  return out_msg;
+}
 
-    case REG_ZONE321:
-    case REG_ZONE654: {
-      size_t start = 3 * (addr - REG_ZONE321);
-      for (size_t zone = start; zone < start + 3; zone++) {
-        // Connect the zone to the specified source
-        size_t src = data & 0x3;
-        setZoneSource(zone, src);
-        data = data >> 2;
-      }
-      break;
+static uint8_t fileMute(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  uint8_t out_msg = 0;
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    if (muted(zone)) {
+      out_msg |= (1 << zone);
     }
+  }
+  return out_msg;
+}
 
-    case REG_MUTE:
-      for (size_t zone = 0; zone < NUM_ZONES; zone++) {
-        mute(zone, data & (0x1 << zone));
-      }
-      break;
+static uint8_t fileStandby(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  return inStandby() ? 1 : 0;
+}
 
-    case REG_STANDBY:
-      // Standby is active-low and all channels must be put in standby at once
-      standby(data == 0);
-      break;
+static uint8_t fileVol(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  return getZoneVolume(addr - REG_VOL_ZONE1);
+}
 
-    case REG_VOL_ZONE1:
-    case REG_VOL_ZONE2:
-    case REG_VOL_ZONE3:
-    case REG_VOL_ZONE4:
-    case REG_VOL_ZONE5:
-    case REG_VOL_ZONE6: {
-      size_t zone = addr - REG_VOL_ZONE1;
-      setZoneVolume(zone, data);
-      break;
-    }
+static uint8_t filePower(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  PwrMsg msg = {
+      .pg_9v    = state->pwr_gpio.pg_9v,
+      .en_9v    = state->pwr_gpio.en_9v,
+      .pg_12v   = state->pwr_gpio.pg_12v,
+      .en_12v   = state->pwr_gpio.en_12v,
+      .reserved = 0,
+  };
+  return msg.data;
+}
 
-    case REG_POWER:
-      state->pwr_gpio.en_9v  = ((PwrMsg)data).en_9v;
-      state->pwr_gpio.en_12v = ((PwrMsg)data).en_12v;
-      break;
+static uint8_t fileFans(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  FanMsg msg = {
+      .ctrl     = state->fans->ctrl,
+      .on       = state->fans->duty_f7 > 0,
+      .ovr_tmp  = !state->pwr_gpio.ovr_tmp_n || state->fans->ovr_temp,
+      .fail     = !state->pwr_gpio.fan_fail_n,
+      .pi       = state->fan_pi,
+      .reserved = 0,
+  };
+  return msg.data;
+}
 
-    case REG_FANS:
-      state->fan_override = false;
-      if (((FanMsg)data).ctrl == FAN_CTRL_FORCED) {
-        state->fan_override = true;
-      }
-      break;
+static uint8_t fileLedCtrl(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->led_override ? 1 : 0;
+}
 
-    case REG_LED_CTRL:
-      state->led_override = data & 0x01;
-      break;
+static uint8_t fileLedVal(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->leds.data;
+}
 
-    case REG_LED_VAL:
-      state->leds.data = data;
-      break;
+static uint8_t fileExpansion(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->expansion.data;
+}
 
-    case REG_EXPANSION:
-      // Control expansion port's NRST and BOOT0 pins
-      state->expansion.nrst  = (data & 0x01) != 0;
-      state->expansion.boot0 = (data & 0x02) != 0;
+static uint8_t fileHv1(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->hv1;
+}
 
-      // TODO: Move these out of i2c handler
-      writePin(exp_nrst_, state->expansion.nrst);
-      writePin(exp_boot0_, state->expansion.boot0);
+static uint8_t fileAmpTemp1(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->amp_temp1;
+}
 
-      // Allow UART messages to be forwarded to expansion units
-      state->expansion.uart_passthrough = (data & 0x04) != 0;
-      setUartPassthrough(state->expansion.uart_passthrough);
-      break;
+static uint8_t fileHv1Temp(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->hv1_temp;
+}
 
-    case REG_PI_TEMP:
-      state->pi_temp = data;
-      break;
+static uint8_t fileAmpTemp2(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->amp_temp2;
+}
 
-    default:
-      // Do nothing
-      break;
+static uint8_t filePiTemp(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->pi_temp;
+}
+
+static uint8_t fileFanDuty(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->fans->duty_f7;
+}
+
+static uint8_t fileFanVolts(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->fans->volts_f4;
+}
+
+static uint8_t fileLoopOverruns(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->loop_overruns;
+}
+
+static uint8_t fileIntI2COverruns(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  return i2c2Overruns();
+}
+
+static uint8_t fileFanPwmDuty(const AmpliPiState* state, uint8_t addr) {
+  (void)addr;
+  return state->fan_pwm_duty_f7;
+}
+
+static uint8_t fileUartDownDrops(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  return uartDownDrops();
+}
+
+static uint8_t fileUartUpDrops(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  return uartUpDrops();
+}
+
+static uint8_t fileEnum(const AmpliPiState* state, uint8_t addr) {
+  (void)state;
+  (void)addr;
+  return uartChainUnits() << 4 | uartEnumState();
+}
+
+static const RegFileFn files_[RF_NUM] = {
+    [RF_NONE]             = fileNone,
+    [RF_SRC_AD]           = fileSrcAD,
+    [RF_ZONE_SRC]         = fileZoneSrc,
+    [RF_MUTE]             = fileMute,
+    [RF_STANDBY]          = fileStandby,
+    [RF_VOL]              = fileVol,
+    [RF_POWER]            = filePower,
+    [RF_FANS]             = fileFans,
+    [RF_LED_CTRL]         = fileLedCtrl,
+    [RF_LED_VAL]          = fileLedVal,
+    [RF_EXPANSION]        = fileExpansion,
+    [RF_HV1]              = fileHv1,
+    [RF_AMP_TEMP1]        = fileAmpTemp1,
+    [RF_HV1_TEMP]         = fileHv1Temp,
+    [RF_AMP_TEMP2]        = fileAmpTemp2,
+    [RF_PI_TEMP]          = filePiTemp,
+    [RF_FAN_DUTY]         = fileFanDuty,
+    [RF_FAN_VOLTS]        = fileFanVolts,
+    [RF_LOOP_OVERRUNS]    = fileLoopOverruns,
+    [RF_INT_I2C_OVERRUNS] = fileIntI2COverruns,
+    [RF_FAN_PWM_DUTY]     = fileFanPwmDuty,
+    [RF_UART_DOWN_DROPS]  = fileUartDownDrops,
+    [RF_UART_UP_DROPS]    = fileUartUpDrops,
+    [RF_ENUM]             = fileEnum,
+};
+
+// Recompute the register file from the current state
+static void updateRegFile(const AmpliPiState* state) {
+  for (size_t addr = 0; addr < REG_FILE_LEN; addr++) {
+    reg_file_[addr] = files_[reg_table_[addr].file](state, addr);
   }
+  hires_[0] = state->hv1_f8;
+  hires_[1] = state->amp_temp1_f8;
+  hires_[2] = state->hv1_temp_f8;
+  hires_[3] = state->amp_temp2_f8;
+  loops_    = state->loops;
 }
 
-void ctrlI2CTransact(AmpliPiState* state) {
-  // Setting I2C_ICR.ADDRCF releases the clock stretch if any then acks
-  I2C_ClearFlag(I2C1, I2C_FLAG_ADDR);
-  // I2C_ISR.DIR is assumed to be 0 (write)
+void ctrlI2CUpdate(AmpliPiState* state) {
+  // Apply all register writes received since the last update
+  if (cmd_tail_ != cmd_head_) {
+    while (cmd_tail_ != cmd_head_) {
+      CtrlCmd cmd = cmd_queue_[cmd_tail_ & (CMD_QUEUE_SIZE - 1)];
+      writeReg(state, cmd.reg, cmd.data);
+      cmd_tail_++;
+    }
+    sendVolumeChanges();
+    updateRegFile(state);
+  }
 
-  // Wait for register address to be written by master (Pi)
-  while (I2C_GetFlagStatus(I2C1, I2C_FLAG_RXNE) == RESET) {}
+  // Reset the bus if a transaction has stalled. Checked and reset with IRQs
+  // masked, so a transaction the ISR starts in between isn't killed.
+  __disable_irq();
+  if (xfer_state_ != CTRL_IDLE &&
+      millis() - xfer_start_ > CTRL_I2C_TIMEOUT_MS) {
+    // Disabling the peripheral releases SCL and SDA, then re-enable to wait
+    // for the next transaction.
+    I2C_Cmd(I2C1, DISABLE);
+    xfer_state_ = CTRL_IDLE;
+    I2C_Cmd(I2C1, ENABLE);
+  }
+  __enable_irq();
+}
 
-  // Reading I2C_RXDR releases the clock stretch if any then acks
-  uint8_t reg_addr = I2C_ReceiveData(I2C1);
+bool ctrlI2CPending() {
+  return cmd_tail_ != cmd_head_;
+}
 
-  // Wait for either another slave address match (read),
-  // or data in the RX register (write)
-  uint32_t i2c_isr_val;
-  do {
-    i2c_isr_val = I2C1->ISR;
-  } while (!(i2c_isr_val & (I2C_FLAG_ADDR | I2C_FLAG_RXNE)));
+void ctrlI2CUpdateRegs(const AmpliPiState* state) {
+  updateRegFile(state);
 
-  if (i2c_isr_val & I2C_ISR_DIR) {  // Reading
-    // Just received a repeated start and slave address again,
-    // clear address flag to ACK
-    I2C_ClearFlag(I2C1, I2C_FLAG_ADDR);
+  // Gather the current status registers
+  uint8_t frame[SNAP_LEN];
+  for (size_t i = 0; i < SNAP_LEN - 2; i++) {
+    frame[i + 1] = reg_file_[snap_regs_[i]];
+  }
 
-    // Make sure the I2C_TXDR register is empty before filling it with new
-    // data to write
-    while (I2C_GetFlagStatus(I2C1, I2C_FLAG_TXE) == RESET) {}
+  // Only publish a new snapshot if something changed
+  uint8_t dirty = 0;
+  for (size_t i = 0; i < SNAP_LEN - 2; i++) {
+    if (frame[i + 1] != snapshot_[i + 1]) {
+      dirty |= snap_dirty_bits_[i];
+    }
+  }
+  if (memcmp(&frame[1], &snapshot_[1], SNAP_LEN - 2) == 0) {
+    return;
+  }
+  frame[0]     = snapshot_[0] + 1;
+  uint8_t csum = 0;
+  for (size_t i = 0; i < SNAP_LEN - 1; i++) {
+    csum += frame[i];
+  }
+  frame[SNAP_LEN - 1] = -csum;
 
-    // Send a response based on the register address
-    uint8_t response = readReg(state, reg_addr);
-    I2C_SendData(I2C1, response);
+  __disable_irq();
+  memcpy(snapshot_, frame, SNAP_LEN);
+  dirty_ |= dirty;
+  __enable_irq();
+}
+
+void ctrlI2CSnapshot(uint8_t* snap) {
+  __disable_irq();
+  memcpy(snap, snapshot_, SNAP_LEN);
+  __enable_irq();
+}
+
+void ctrlI2CChainTelem(uint8_t unit, const volatile uint8_t* snap) {
+  if (unit == 0 || unit > CTRL_I2C_CHAIN_UNITS) {
+    return;
+  }
+  for (size_t i = 0; i < SNAP_LEN; i++) {
+    chain_[unit - 1][i] = snap[i];
+  }
+  chain_ms_[unit - 1]    = millis();
+  chain_valid_[unit - 1] = true;
+}
+
+/* The end of a checked write, at a STOP or repeated START. Its writes were
+ * queued after cmd_head_ without being applied, and the last byte was the PEC
+ * rather than a write. Release them if the PEC is correct, otherwise drop them
+ * all. A write of only a register address has nothing to check.
+ */
+static void pecEndWrite() {
+  if (!xfer_pec_ || xfer_state_ != CTRL_WRITE || !pec_rx_) {
+    return;
+  }
+  if (pec_crc_ == 0) {
+    cmd_head_ = pec_head_ - (pec_queued_ ? 1 : 0);
+    if (group_xfer_) {
+      group_reg_addr_--;
+    } else {
+      reg_addr_--;
+    }
+  } else {
+    pec_errors_++;
+  }
+  pec_rx_   = 0;
+  pec_head_ = cmd_head_;
+}
+
+// The byte loaded into I2C_TXDR has been sent, clear the DIRTY bits it
+// reported or mark the trace entry it ended as read
+static void txdrSent() {
+  dirty_ &= ~dirty_txdr_;
+  if (trace_txdr_) {
+    traceAdvance();
+  }
+}
 
-    // We only allow reading 1 byte at a time for now, here we are assuming
-    // a NACK was sent by the master to signal the end of the read request.
-  } else {  // Writing
-    // Just received data from the master (Pi),
-    // get it from the I2C_RXDR register
-    uint8_t data = I2C_ReceiveData(I2C1);
-    writeReg(state, reg_addr, data);
+static void handleCtrlI2C(void) {
+  uint32_t isr = I2C1->ISR;
 
-    // We only allow writing 1 byte at a time for now, here we assume the
-    // master stops transmitting and sends a STOP condition to end the write.
+  // Handle any received data first, since both a repeated start and the last
+  // byte of a write can be pending at once.
+  if (isr & I2C_ISR_RXNE) {
+    // Reading I2C_RXDR releases the clock stretch if any then ACKs
+    uint8_t           data = I2C_ReceiveData(I2C1);
+    volatile uint8_t* addr = group_xfer_ ? &group_reg_addr_ : &reg_addr_;
+    pec_crc_               = pecUpdate(pec_crc_, data);
+    if (xfer_state_ == CTRL_REG_ADDR) {
+      // The first byte written by the master (Pi) is the register address
+      *addr       = data;
+      xfer_state_ = CTRL_WRITE;
+    } else if (xfer_state_ == CTRL_WRITE) {
+      // Any further bytes are data to write starting at that register. When
+      // checked they're held back until the PEC at the end.
+      uint8_t head   = xfer_pec_ ? pec_head_ : cmd_head_;
+      uint8_t used   = head - cmd_tail_;
+      bool    queued = used < CMD_QUEUE_SIZE && writable(*addr, group_xfer_);
+      if (queued) {
+        volatile CtrlCmd* cmd = &cmd_queue_[head & (CMD_QUEUE_SIZE - 1)];
+        cmd->reg              = *addr;
+        cmd->data             = data;
+        head++;
+        used++;
+      }
+      if (xfer_pec_) {
+        pec_head_   = head;
+        pec_queued_ = queued;
+        pec_rx_++;
+      } else {
+        cmd_head_ = head;
+      }
+      (*addr)++;
+      if (used >= CMD_QUEUE_SIZE) {
+        // No room for another write, NACK the next byte
+        I2C1->CR2 |= I2C_CR2_NACK;
+      }
+    }
   }
+
+  if (isr & I2C_ISR_NACKF) {
+    // The master (Pi) NACKs the last byte it wants to read. The next byte was
+    // already loaded into I2C_TXDR but will never be sent, so don't count it.
+    I2C1->ICR = I2C_ICR_NACKCF;
+    if (!group_xfer_ && !(I2C1->ISR & I2C_ISR_TXE)) {
+      if (txdr_reg_) {
+        reg_addr_--;
+      }
+    } else {
+      txdrSent();
+    }
+    dirty_txdr_ = 0;
+    trace_txdr_ = false;
+  }
+
+  if (isr & I2C_ISR_STOPF) {
+    I2C1->ICR = I2C_ICR_STOPCF;
+    pecEndWrite();
+    xfer_state_ = CTRL_IDLE;
+  }
+
+  if (isr & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR)) {
+    // Bus error, drop the current transaction along with any checked writes
+    I2C1->ICR = I2C_ICR_BERRCF | I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+    if (xfer_pec_ && xfer_state_ == CTRL_WRITE && pec_rx_) {
+      pec_errors_++;
+    }
+    xfer_state_ = CTRL_IDLE;
+  }
+
+  if (isr & I2C_ISR_ADDR) {
+    bool    read      = isr & I2C_ISR_DIR;
+    uint8_t addr_byte = (isr & I2C_ISR_ADDCODE) >> 16;
+    if (xfer_state_ == CTRL_IDLE) {
+      xfer_start_ = millis();
+      bootMark(BOOT_CTRL);
+      xfer_pec_ = pec_enable_;
+      pec_crc_  = 0;
+      pec_rx_   = 0;
+      pec_head_ = cmd_head_;
+    } else {
+      pecEndWrite();
+    }
+    // The PEC covers each address byte, including its read/write bit
+    pec_crc_      = pecUpdate(pec_crc_, addr_byte | (read ? 1 : 0));
+    snap_latched_ = false;
+    chain_pos_    = 0;
+    group_xfer_   = addr_byte == CTRL_I2C_GROUP_ADDR;
+    if (read) {
+      // Reading, either after a repeated start or without first writing a
+      // register address, which continues from the last register accessed.
+      // Flush the I2C_TXDR register in case data is left over from a previous
+      // read. A checked read is of one register, a 16-bit pair from its high
+      // byte or the whole REG_CHAIN table, then the PEC.
+      uint8_t access = reg_table_[reg_addr_].access;
+      I2C1->ISR      = I2C_ISR_TXE;
+      dirty_txdr_    = 0;
+      trace_txdr_    = false;
+      txdr_reg_      = false;
+      pec_tx_        = access & ACC_HIGH ? 2 : 1;
+      if (access & ACC_STREAM) {
+        pec_tx_ = CHAIN_LEN;
+      }
+      xfer_state_ = CTRL_READ;
+    } else {
+      xfer_state_ = CTRL_REG_ADDR;
+    }
+    // Clearing the address flag releases the clock stretch then ACKs
+    I2C1->ICR = I2C_ICR_ADDRCF;
+  } else if (isr & I2C_ISR_TXIS) {
+    // Send the current register, then the next register, etc. until the master
+    // NACKs. This flag will be set again right away after a new read request's
+    // address is cleared above, so handle it on the next interrupt then.
+    // The previous byte is now being sent, so clear any bits it reported.
+    txdrSent();
+    dirty_txdr_ = 0;
+    trace_txdr_ = false;
+    if (group_xfer_) {
+      I2C_SendData(I2C1, 0xFF);
+    } else if (xfer_pec_ && pec_tx_ == 0) {
+      I2C_SendData(I2C1, pec_crc_);
+      txdr_reg_ = false;
+      pec_tx_   = PEC_TX_DONE;
+    } else if (xfer_pec_ && pec_tx_ == PEC_TX_DONE) {
+      // Anything read after the PEC
+      I2C_SendData(I2C1, 0xFF);
+    } else {
+      uint8_t data   = readReg(reg_addr_);
+      bool    stream = reg_table_[reg_addr_].access & ACC_STREAM;
+      if (reg_addr_ == REG_DIRTY) {
+        dirty_txdr_ = data;
+      }
+      trace_txdr_ = reg_addr_ == REG_TRACE_DATA_LAST;
+      I2C_SendData(I2C1, data);
+      if (!stream) {
+        reg_addr_++;
+      }
+      txdr_reg_ = !stream;
+      pec_crc_  = pecUpdate(pec_crc_, data);
+      pec_tx_--;
+    }
+  }
+}
+
+void I2C1_IRQHandler(void) {
+  uint32_t start = profStart();
+  handleCtrlI2C();
+  profEnd(PROF_CTRL_I2C_IRQ, start);
 }
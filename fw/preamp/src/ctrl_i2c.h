@@ -41,14 +41,41 @@ typedef struct {
     };
     uint8_t temps[4];  // All temperatures in 1 array
   };
-  uint8_t   i2c_addr;      // Slave I2C1 address
-  bool      led_override;  // Override LED Board logic and force to 'leds'
-  bool      fan_override;  // Override fan control logic and force 100% on
+  uint16_t  hv1_f8;           // Filtered high-voltage in UQ8.8 Volts
+  int16_t   hv1_temp_f8;      // Filtered temps in Q7.8 degC
+  int16_t   amp_temp1_f8;
+  int16_t   amp_temp2_f8;
+  uint8_t   i2c_addr;         // Slave I2C1 address
+  bool      led_override;     // Override LED Board logic and force to 'leds'
+  bool      fan_override;     // Override fan control logic and force 100% on
+  bool      fan_pi;           // Add integral control to the fan temp curve
   FanState* fans;
+  uint8_t   fan_pwm_duty_f7;  // Achieved FAN_ON duty in UQ1.7
+  uint8_t   loop_overruns;    // Main loop iterations that took over 1 ms
+  uint32_t  loops;            // Main loop busy periods, see schedLoops()
 } AmpliPiState;
 
-void ctrlI2CInit(uint8_t addr);
-bool ctrlI2CAddrMatch();
-void ctrlI2CTransact(AmpliPiState* state);
+// Set the slave address to state->i2c_addr and start handling transactions
+void ctrlI2CInit(AmpliPiState* state);
+// Apply any register writes received, call regularly from the main loop
+void ctrlI2CUpdate(AmpliPiState* state);
+// True if register writes have been received and not yet applied
+bool ctrlI2CPending();
+// Update all registers from the current state, call after any state changes
+void ctrlI2CUpdateRegs(const AmpliPiState* state);
+
+// The telemetry snapshot, REG_SNAP_SEQ through REG_SNAP_CHECKSUM
+#define CTRL_I2C_SNAP_LEN (REG_SNAP_CHECKSUM - REG_SNAP_SEQ + 1)
+
+// Expansion units whose telemetry the first preamp keeps, the most in a chain
+#define CTRL_I2C_CHAIN_UNITS 5
+
+// Copy the current telemetry snapshot, CTRL_I2C_SNAP_LEN bytes
+void ctrlI2CSnapshot(uint8_t* snap);
+
+// Keep an expansion unit's telemetry snapshot received up the UART chain, for
+// the Pi to read from REG_CHAIN. unit is 1 for the first expansion unit. Call
+// from the UART interrupt.
+void ctrlI2CChainTelem(uint8_t unit, const volatile uint8_t* snap);
 
 #endif /* CTRL_I2C_H_ */
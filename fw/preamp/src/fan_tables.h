@@ -0,0 +1,82 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fan voltage control look-up tables.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAN_TABLES_H_
+#define FAN_TABLES_H_
+
+#include <stdint.h>
+
+// MCP4017 DPOT value for each fan percent in Q7.8, from 0.0 to 1.0.
+// Table generated by generate_fan_tables.py script
+const uint8_t FAN_DPOT_LUT_[] = {
+    127, 125, 124, 123, 122, 121, 120, 119, 118, 117, 117, 116,
+    115, 114, 113, 112, 111, 110, 109, 108, 107, 106, 106, 105,
+    104, 103, 102, 101, 100, 100,  99,  98,  97,  96,  96,  95,
+     94,  93,  92,  92,  91,  90,  89,  89,  88,  87,  87,  86,
+     85,  84,  84,  83,  82,  82,  81,  80,  79,  79,  78,  77,
+     77,  76,  76,  75,  74,  74,  73,  72,  72,  71,  70,  70,
+     69,  69,  68,  67,  67,  66,  66,  65,  64,  64,  63,  63,
+     62,  62,  61,  61,  60,  59,  59,  58,  58,  57,  57,  56,
+     56,  55,  55,  54,  54,  53,  53,  52,  52,  51,  51,  50,
+     50,  49,  49,  48,  48,  47,  47,  46,  46,  45,  45,  44,
+     44,  44,  43,  43,  42,  42,  41,  41,  40,  40,  40,  39,
+     39,  38,  38,  38,  37,  37,  36,  36,  35,  35,  35,  34,
+     34,  33,  33,  33,  32,  32,  31,  31,  31,  30,  30,  30,
+     29,  29,  28,  28,  28,  27,  27,  27,  26,  26,  26,  25,
+     25,  25,  24,  24,  23,  23,  23,  22,  22,  22,  21,  21,
+     21,  20,  20,  20,  19,  19,  19,  18,  18,  18,  18,  17,
+     17,  17,  16,  16,  16,  15,  15,  15,  14,  14,  14,  14,
+     13,  13,  13,  12,  12,  12,  12,  11,  11,  11,  10,  10,
+     10,  10,   9,   9,   9,   8,   8,   8,   8,   7,   7,   7,
+      7,   6,   6,   6,   5,   5,   5,   5,   4,   4,   4,   4,
+      3,   3,   3,   3,   2,   2,   2,   2,   1,   1,   1,   1,
+      0,   0,   0,   0,   0,
+};
+
+// Fan power supply voltage in UQ4.4 for each DPOT value.
+// Table generated by generate_fan_tables.py script
+const uint8_t FAN_VOLTS_LUT_F4_[] = {
+    191, 190, 188, 187, 185, 184, 183, 181, 180, 179, 177, 176,
+    175, 174, 172, 171, 170, 169, 168, 166, 165, 164, 163, 162,
+    161, 160, 159, 158, 157, 156, 155, 154, 153, 152, 151, 150,
+    150, 149, 148, 147, 146, 145, 144, 144, 143, 142, 141, 140,
+    140, 139, 138, 137, 137, 136, 135, 135, 134, 133, 133, 132,
+    131, 131, 130, 129, 129, 128, 127, 127, 126, 126, 125, 124,
+    124, 123, 123, 122, 122, 121, 120, 120, 119, 119, 118, 118,
+    117, 117, 116, 116, 115, 115, 114, 114, 113, 113, 112, 112,
+    112, 111, 111, 110, 110, 109, 109, 108, 108, 108, 107, 107,
+    106, 106, 106, 105, 105, 104, 104, 104, 103, 103, 102, 102,
+    102, 101, 101, 101, 100, 100, 100,  99,
+};
+
+// Estimated amplifier dissipation of a playing zone for each volume, all 6
+// zones at full volume sum to 252.
+// Table generated by generate_fan_tables.py script
+const uint8_t FAN_ZONE_LOAD_LUT_[] = {
+     42,  33,  27,  21,  17,  13,  11,   8,   7,   5,   4,   3,
+      3,   2,   2,   1,   1,   1,   1,   1,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+};
+
+#endif /* FAN_TABLES_H_ */
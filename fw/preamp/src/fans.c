@@ -20,11 +20,7 @@
 
 #include "fans.h"
 
-#include "systick.h"
-
-// 2-wire fan control PWM works well around 30 Hz
-// 1000 Hz systick / 32 = 31.25 Hz
-#define FAN_PERIOD_MS 32
+#include "fan_tables.h"
 
 #define C_TO_Q7_8(x) ((int16_t)x << 8)
 
@@ -58,6 +54,17 @@
 #define TEMP_RPI_THRESH_HIGH_Q7_8 C_TO_Q7_8(TEMP_RPI_THRESH_HIGH_C)
 #define TEMP_RPI_THRESH_OVR_Q7_8  C_TO_Q7_8(TEMP_RPI_THRESH_OVR_C)
 
+/* The Cortex-M0 has no hardware divider, so no division is done here.
+ * Dividing by a threshold range is instead a multiply by its reciprocal in
+ * UQ0.16, rounded up so that a temp at the high threshold gives exactly 1.0.
+ */
+#define RANGE_RECIP_F16(low_c, high_c) \
+  (((1 << 16) + ((high_c) - (low_c)) - 1) / ((high_c) - (low_c)))
+
+static int16_t pcntInRange(int16_t temp, int16_t low_q7_8, int32_t recip_f16) {
+  return ((int32_t)(temp - low_q7_8) * recip_f16) >> 16;
+}
+
 /* Calculates the desired fan percent based on the current system temps
  *
  * Inputs
@@ -72,12 +79,15 @@ int16_t fanPercentFromTemps(int16_t amp_temp, int16_t psu_temp,
                             int16_t rpi_temp) {
   // Calculate fan percent for each temp
   // measurement in Q7.8 format, 1.0 = 100%
-  int16_t amp_pcnt = (amp_temp - TEMP_AMP_THRESH_LOW_Q7_8) /
-                     (TEMP_AMP_THRESH_HIGH_C - TEMP_AMP_THRESH_LOW_C);
-  int16_t psu_pcnt = (psu_temp - TEMP_PSU_THRESH_LOW_Q7_8) /
-                     (TEMP_PSU_THRESH_HIGH_C - TEMP_PSU_THRESH_LOW_C);
-  int16_t rpi_pcnt = (rpi_temp - TEMP_RPI_THRESH_LOW_Q7_8) /
-                     (TEMP_RPI_THRESH_HIGH_C - TEMP_RPI_THRESH_LOW_C);
+  int16_t amp_pcnt = pcntInRange(
+      amp_temp, TEMP_AMP_THRESH_LOW_Q7_8,
+      RANGE_RECIP_F16(TEMP_AMP_THRESH_LOW_C, TEMP_AMP_THRESH_HIGH_C));
+  int16_t psu_pcnt = pcntInRange(
+      psu_temp, TEMP_PSU_THRESH_LOW_Q7_8,
+      RANGE_RECIP_F16(TEMP_PSU_THRESH_LOW_C, TEMP_PSU_THRESH_HIGH_C));
+  int16_t rpi_pcnt = pcntInRange(
+      rpi_temp, TEMP_RPI_THRESH_LOW_Q7_8,
+      RANGE_RECIP_F16(TEMP_RPI_THRESH_LOW_C, TEMP_RPI_THRESH_HIGH_C));
 
   // Take the max percentage requested.
   int16_t max_pcnt1   = amp_pcnt > psu_pcnt ? amp_pcnt : psu_pcnt;
@@ -100,7 +110,8 @@ uint8_t dutyFromPercent(int16_t pcnt_f8) {
 }
 
 /* Calculates the digital potentiometer value to use to achieve the desired
- * voltage. The dpot is nominally 10k Ohms.
+ * voltage, scaled linearly between the minimum and maximum fan voltages.
+ * See generate_fan_tables.py for the conversion.
  *
  * Inputs
  *    pcnt_f8: Desired fan percent in Q7.8 fixed-point format.
@@ -108,21 +119,72 @@ uint8_t dutyFromPercent(int16_t pcnt_f8) {
  * Returns the dpot value in the range [0x00,0x7F]
  */
 uint8_t dpotValFromPercent(int16_t pcnt_f8) {
-  // Fans partially on, convert [0.0,1.0] in Q7.8 to [0x00,0x7F] dpot val
-  // Rpot (kOhms) = 10k * DPOT_VAL / 127 + 0.1
-  // V = 100k / (Rpot + 9k) + 1
-  //   = 100k / (10k * DPOT_VAL / 127 + 0.1 + 9k) + 1
-  //   = 100k / (10k / 127 * DPOT_VAL + 9.1k) + 1
-  // 10k / 127 * DPOT_VAL + 9.1k = 100k / (V - 1)
-  // DPOT_VAL = 127 / 10k * [100k / (V - 1) - 9.1k]
-  // DPOT_VAL = 1270 / (V - 1) - 115.57
-  const int32_t v_scale_f8  = (100 / 9.1 - 100 / 19.1) * (1 << 8);
-  const int32_t v_min_f16   = (100 / 19.1 + 1) * (1 << 16);
-  int32_t       v_fan_f16   = v_scale_f8 * pcnt_f8 + v_min_f16;
-  const int32_t numer_f20   = 1270 * (1 << 20);
-  const int32_t offset_f4   = 115.57 * (1 << 4);
-  int32_t       dpot_val_f4 = numer_f20 / (v_fan_f16 - (1 << 16)) - offset_f4;
-  return (uint8_t)(dpot_val_f4 >> 4);
+  if (pcnt_f8 <= 0) {
+    return FAN_DPOT_LUT_[0];
+  }
+  if (pcnt_f8 >= 1 << 8) {
+    return FAN_DPOT_LUT_[1 << 8];
+  }
+  return FAN_DPOT_LUT_[pcnt_f8];
+}
+
+/* Feed-forward from the amplifiers' load. Music heats the amps well before
+ * their heatsinks' thermistors see it, so a loud system gets the fans started
+ * early. The sum of fanZoneLoad() over all playing zones, at most 252 with
+ * every zone at full volume, scales to at most about 60% fan. Quiet
+ * listening is left to the temps, so the fans can stay off at idle.
+ */
+#define FAN_FF_MIN_F8 (int16_t)(0.1 * (1 << 8))  // Ignore below 10%
+
+static int16_t feedForward(uint8_t amp_load) {
+  int16_t ff_f8 = ((int16_t)amp_load * 5) >> 3;
+  return ff_f8 < FAN_FF_MIN_F8 ? 0 : ff_f8;
+}
+
+/* Optional PI control on the filtered temps. The temps' fan percent is the
+ * proportional term, and an integral of its error from halfway between the
+ * low and high thresholds is added to it. A system held warm then settles
+ * with the hottest temp mid-range, rather than resting at whatever speed the
+ * fixed curve gives. The integral is in Q7.24 and updated on every ADC scan
+ * by the error times the ms since the previous scan, so a constant error of
+ * 1.0 takes about 65 s to integrate to 1.0 whether the ADC is scanned every
+ * 8 ms or every 32 ms while idle. It stops integrating while the output is
+ * saturated and is cleared whenever the fans turn off.
+ */
+#define FAN_PI_SETPOINT_F8 (1 << 7)  // 0.5 in Q7.8
+#define FAN_PI_I_MAX_F24   (1 << 24)  // 1.0 in Q7.24
+
+static int32_t pi_i_f24_ = 0;
+
+static int16_t piUpdate(int16_t pcnt_f8, uint8_t dt_ms) {
+  int32_t err_f8 = pcnt_f8 - FAN_PI_SETPOINT_F8;
+  int32_t out_f8 = pcnt_f8 + (pi_i_f24_ >> 16);
+  if ((out_f8 < (1 << 8) || err_f8 < 0) && (out_f8 > 0 || err_f8 > 0)) {
+    pi_i_f24_ += err_f8 * dt_ms;
+    if (pi_i_f24_ > FAN_PI_I_MAX_F24) {
+      pi_i_f24_ = FAN_PI_I_MAX_F24;
+    } else if (pi_i_f24_ < -FAN_PI_I_MAX_F24) {
+      pi_i_f24_ = -FAN_PI_I_MAX_F24;
+    }
+    out_f8 = pcnt_f8 + (pi_i_f24_ >> 16);
+  }
+  // Just past 1.0 is enough to run the fans at full speed
+  if (out_f8 > (1 << 8) + 1) {
+    out_f8 = (1 << 8) + 1;
+  } else if (out_f8 < 0) {
+    out_f8 = 0;
+  }
+  return (int16_t)out_f8;
+}
+
+/* Estimated amplifier load of a playing zone at a volume (dB of attenuation),
+ * summed over the playing zones for updateFans().
+ */
+uint8_t fanZoneLoad(uint8_t vol) {
+  if (vol >= sizeof(FAN_ZONE_LOAD_LUT_)) {
+    return 0;
+  }
+  return FAN_ZONE_LOAD_LUT_[vol];
 }
 
 /* Updates the fan state based on the current temp
@@ -131,14 +193,18 @@ uint8_t dpotValFromPercent(int16_t pcnt_f8) {
  *    amp_temp: Temperature of the amplifier heatsinks
  *    psu_temp: Temperature of the high-voltage PSU
  *    pi_temp:  Temperature of the Raspberry Pi
+ *    amp_load: Sum of fanZoneLoad() for each playing zone
  *    force:    Force fans on 100%
  *    linear:   Digital potentiometer for linear voltage control is available
+ *    pi:       Add integral control on the temps
+ *    dt_ms:    Time since the previous update, for the integral
  * All temps are in Q7.8 fixed-point format.
  *
  * Returns the current fan state.
  */
 FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
-                     bool force, bool thermistors, bool linear) {
+                     uint8_t amp_load, bool force, bool thermistors,
+                     bool linear, bool pi, uint8_t dt_ms) {
 #define FAN_DUTY_ON    (1 << 7)  // 1.0 in UQ1.7, 100% duty cycle
 #define FAN_DUTY_OFF   0         // 0% duty cycle
 #define DPOT_MAX_VOLTS 0         // Min resistance = max voltage
@@ -152,7 +218,8 @@ FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
       .volts_f4 = 0,
   };
   // Leave at max by default in case a dpot is detected later
-  state.dpot_val = DPOT_MAX_VOLTS;
+  uint8_t last_dpot = state.dpot_val;
+  state.dpot_val    = DPOT_MAX_VOLTS;
 
   state.ovr_temp = amp_temp > TEMP_AMP_THRESH_OVR_Q7_8 ||
                    psu_temp > TEMP_PSU_THRESH_OVR_Q7_8 ||
@@ -163,6 +230,7 @@ FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
    * Toff < T <= Ton  | duty = duty (unchanged)
    * Ton  < T <= Tmax | duty = [38, 128) ([0.3, 1.0) in Q1.7)
    * Tmax < T         | duty = 128 (1.0 in Q1.7)
+   * The amps' load can raise the fan percent in any region.
    */
 
   // Determine appropriate control method
@@ -175,23 +243,38 @@ FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
     state.ctrl    = FAN_CTRL_MAX6644;
     state.duty_f7 = FAN_DUTY_OFF;  // Release control to MAX6644.
   } else {
-    state.ctrl = linear ? FAN_CTRL_LINEAR : FAN_CTRL_PWM;
-    if (amp_temp <= TEMP_AMP_THRESH_OFF_Q7_8 &&
+    state.ctrl    = linear ? FAN_CTRL_LINEAR : FAN_CTRL_PWM;
+    int16_t ff_f8 = feedForward(amp_load);
+    if (ff_f8 == 0 && amp_temp <= TEMP_AMP_THRESH_OFF_Q7_8 &&
         psu_temp <= TEMP_PSU_THRESH_OFF_Q7_8 &&
         rpi_temp <= TEMP_RPI_THRESH_OFF_Q7_8) {
-      // Cool enough that fans can be left off
+      // Cool and quiet enough that fans can be left off
       state.duty_f7  = FAN_DUTY_OFF;
       state.dpot_val = DPOT_MIN_VOLTS;
+      pi_i_f24_      = 0;
     } else {
       // Fans on at some percentage, update duty cycle or voltage
       int16_t pcnt_f8 = fanPercentFromTemps(amp_temp, psu_temp, rpi_temp);
+      if (pi) {
+        pcnt_f8 = piUpdate(pcnt_f8, dt_ms);
+      }
+      pcnt_f8 = pcnt_f8 > ff_f8 ? pcnt_f8 : ff_f8;
       if (pcnt_f8 > (1 << 8)) {  // 1.0 in Q7.8
         // Temp high, max fan voltage and duty cycle
         state.duty_f7 = FAN_DUTY_ON;
       } else if (linear) {
         if (pcnt_f8 > 0) {
-          state.dpot_val = dpotValFromPercent(pcnt_f8);
-          state.duty_f7  = FAN_DUTY_ON;
+          // Ignore a single step either way, short of the ends of the
+          // range, so that noise on the temps doesn't rewrite the DPOT on
+          // every scan
+          state.dpot_val   = dpotValFromPercent(pcnt_f8);
+          int16_t dpot_chg = (int16_t)state.dpot_val - last_dpot;
+          if (dpot_chg >= -1 && dpot_chg <= 1 &&
+              state.dpot_val != DPOT_MAX_VOLTS &&
+              state.dpot_val != DPOT_MIN_VOLTS) {
+            state.dpot_val = last_dpot;
+          }
+          state.duty_f7 = FAN_DUTY_ON;
         } else {
           // Hysteresis region, use old duty cycle and min dpot value
           state.dpot_val = DPOT_MIN_VOLTS;
@@ -212,9 +295,7 @@ FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
   // If no dpot present, fans nominally receive 12V.
   if (linear) {
     // V = 100,000 / (10,000 / 127 * DPOT_VAL + 9,100) + 1
-    uint32_t volts_f12 =
-        (100000 << 12) / (10000 * state.dpot_val / 127 + 9100) + (1 << 12);
-    state.volts_f4 = (uint8_t)(volts_f12 >> 8);
+    state.volts_f4 = FAN_VOLTS_LUT_F4_[state.dpot_val];
   } else {
     state.volts_f4 = 12 << 4;
   }
@@ -222,16 +303,38 @@ FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
   return &state;
 }
 
+/* FAN_ON is behind the Power Board's GPIO expander, so each PWM edge costs an
+ * internal I2C write. Rather than evaluating the pin every tick this gives the
+ * time of the next edge, so FAN_ON only needs to be written then. The duty
+ * cycle is latched at the start of each period so that a duty change never
+ * causes a short pulse. Periods start FAN_PWM_PHASE_MS after a multiple of
+ * FAN_PERIOD_MS, away from the ticks the Power Board's ADC is read on.
+ */
+#define FAN_PWM_PHASE_MS 4
+
+static uint32_t pwm_start_ = 0;  // Start of the current period (ms)
+static uint32_t pwm_on_ms_ = 0;  // FAN_ON time in the current period
+
 /* Determines the GPIO expander's FAN_ON pin state.
- * Call every millisecond tick.
+ * Call at or after the time of each edge.
  *
  * Inputs
- *    duty_f7: Fan duty cycle in the range [0,1] in UQ1.7 format
+ *    now:       Current time in ms
+ *    duty_f7:   Fan duty cycle in the range [0,1] in UQ1.7 format
+ *    next_edge: Set to the time FAN_ON next needs to be updated
  *
  * Returns boolean FAN_ON pin state
  */
-bool getFanOnFromDuty(uint8_t duty_f7) {
-  uint32_t duty_ms = (FAN_PERIOD_MS * duty_f7) >> 7;
-  uint32_t ms32    = millis() & (FAN_PERIOD_MS - 1);
-  return ms32 < duty_ms;
+bool updateFanPwm(uint32_t now, uint8_t duty_f7, uint32_t* next_edge) {
+  if (now - pwm_start_ >= FAN_PERIOD_MS) {
+    // New period, latch the duty for all of it
+    pwm_start_ = now - ((now - FAN_PWM_PHASE_MS) & (FAN_PERIOD_MS - 1));
+    pwm_on_ms_ = (FAN_PERIOD_MS * duty_f7) >> 7;
+  }
+  if (now - pwm_start_ < pwm_on_ms_) {
+    *next_edge = pwm_start_ + pwm_on_ms_;
+    return true;
+  }
+  *next_edge = pwm_start_ + FAN_PERIOD_MS;
+  return false;
 }
@@ -24,6 +24,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// 2-wire fan control PWM works well around 30 Hz
+// 1000 Hz systick / 32 = 31.25 Hz
+#define FAN_PERIOD_MS 32
+
 // Possible fan control methods:
 // - MAX6644 (5 developer units with Power Board 2.A)
 // - Thermistors with FAN_ON PWM control (Power Board 3.A)
@@ -45,8 +49,15 @@ typedef struct {
   uint8_t volts_f4;  // Fan power supply voltage in UQ4.4 format
 } FanState;
 
+// Digital pot setting for a fan percent in Q7.8, in the range [0x00,0x7F]
+uint8_t dpotValFromPercent(int16_t pcnt_f8);
+
+// Estimated amplifier load of a zone playing at a volume, see updateFans()
+uint8_t fanZoneLoad(uint8_t vol);
+
 FanState* updateFans(int16_t amp_temp, int16_t psu_temp, int16_t rpi_temp,
-                     bool force, bool thermistors, bool linear);
-bool      getFanOnFromDuty(uint8_t duty_f7);
+                     uint8_t amp_load, bool force, bool thermistors,
+                     bool linear, bool pi, uint8_t dt_ms);
+bool      updateFanPwm(uint32_t now, uint8_t duty_f7, uint32_t* next_edge);
 
 #endif /* FANS_H_ */
@@ -0,0 +1,61 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Erasing and programming the internal flash
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "flash.h"
+
+#include "stm32f0xx.h"
+
+// Flash is programmed with the registers directly, the StdPeriph flash driver
+// isn't part of this build.
+void flashUnlock() {
+  if (FLASH->CR & FLASH_CR_LOCK) {
+    FLASH->KEYR = FLASH_FKEY1;
+    FLASH->KEYR = FLASH_FKEY2;
+  }
+}
+
+void flashLock() {
+  FLASH->CR |= FLASH_CR_LOCK;
+}
+
+// Wait for an erase or program to finish, returns false if it failed
+static bool flashWait() {
+  while (FLASH->SR & FLASH_SR_BSY) {}
+  uint32_t sr = FLASH->SR;
+  FLASH->SR   = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR;
+  return !(sr & (FLASH_SR_PGERR | FLASH_SR_WRPERR));
+}
+
+bool flashErasePage(uint32_t addr) {
+  FLASH->CR |= FLASH_CR_PER;
+  FLASH->AR = addr;
+  FLASH->CR |= FLASH_CR_STRT;
+  bool ok = flashWait();
+  FLASH->CR &= ~FLASH_CR_PER;
+  return ok;
+}
+
+bool flashProgram(uint32_t addr, uint16_t data) {
+  FLASH->CR |= FLASH_CR_PG;
+  *(volatile uint16_t*)addr = data;
+  bool ok = flashWait();
+  FLASH->CR &= ~FLASH_CR_PG;
+  return ok && *(volatile uint16_t*)addr == data;
+}
@@ -0,0 +1,51 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Erasing and programming the internal flash
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FLASH_H_
+#define FLASH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Flash layout, see LinkerScript.ld which limits the firmware to APP_SIZE:
+ *   0x08000000 - 0x08007BFF  Running firmware
+ *   0x08007C00 - 0x0800F7FF  Staging area for a new image, see update.h
+ *   0x0800F800 - 0x0800FFFF  Persistent settings, see persist.h
+ */
+#define FLASH_PAGE_SIZE     1024
+#define FLASH_APP_START     0x08000000
+#define FLASH_APP_SIZE      (31 * FLASH_PAGE_SIZE)
+#define FLASH_STAGING_START (FLASH_APP_START + FLASH_APP_SIZE)
+#define FLASH_PERSIST_START (FLASH_STAGING_START + FLASH_APP_SIZE)
+#define FLASH_PERSIST_PAGES 2
+
+// Flash must be unlocked before erasing or programming
+void flashUnlock();
+void flashLock();
+
+// Erase a page, stalling the CPU (and any interrupts) for ~20-40 ms.
+// Returns false if it failed.
+bool flashErasePage(uint32_t addr);
+
+// Program an erased halfword, stalling the CPU for ~50 us. Returns false if it
+// failed or doesn't read back.
+bool flashProgram(uint32_t addr, uint16_t data);
+
+#endif /* FLASH_H_ */
@@ -0,0 +1,641 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt and DMA driven transfers on the internal I2C bus
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "i2c2.h"
+
+#include <stddef.h>
+
+#include "port_defs.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+#include "trace.h"
+
+/* Transfers are queued by the main loop and run back-to-back by the I2C2
+ * interrupt, with DMA moving the data so the CPU is only interrupted at the
+ * start, restart and end of each transfer. I2C2_TX and I2C2_RX are on DMA
+ * channels 4 and 5, shared with USART2 which doesn't use DMA.
+ *
+ * Completed transfers are handed back to the main loop, which runs their
+ * callbacks from i2c2Update() so they never run concurrently with other
+ * main loop code.
+ *
+ * After a bus error (arbitration lost, misplaced START/STOP or a timeout) no
+ * more transfers start until i2c2Update() has recovered the bus, then the
+ * failed transfer is retried first.
+ */
+#define I2C2_DMA_TX DMA1_Channel4
+#define I2C2_DMA_RX DMA1_Channel5
+
+// The longest transfer (ADC scan) takes ~250 us, so this only catches devices
+// stretching the clock or a bus stuck by a device holding SDA low. Timed by
+// micros() since i2c2Update() runs every ms.
+#define I2C2_TIMEOUT_US 1000
+
+// Half of an SCL period while recovering the bus, slow enough for any device
+#define I2C2_RECOVER_US 5
+
+/* Each priority has its own queue. Other than volume writes, transfers are
+ * limited to a bus time budget per 1 ms tick so that telemetry can't hold up
+ * a volume change for long. The budget is counted in bytes on the bus,
+ * ~22.5 us each at 400 kHz, and a transfer is always allowed to start if
+ * nothing else has run yet this tick.
+ */
+#define I2C2_QUEUE_SIZE  16  // Per priority, must be a power of 2
+#define I2C2_TICK_BUDGET 20  // Bytes, ~450 us
+
+typedef struct {
+  I2C2Xfer* volatile xfers[I2C2_QUEUE_SIZE];
+  volatile uint8_t   head;  // Next slot to fill, by main
+  volatile uint8_t   tail;  // Next transfer to start, by ISR
+} I2C2Queue;
+
+static I2C2Queue queues_[I2C2_NUM_PRIOS];
+
+static volatile uint32_t tick_       = 0;  // Current budget period (ms)
+static volatile uint8_t  tick_bytes_ = 0;  // Bytes used so far this tick
+static volatile uint8_t  overruns_   = 0;
+
+#define I2C2_DONE_SIZE (I2C2_NUM_PRIOS * I2C2_QUEUE_SIZE)
+
+static I2C2Xfer* volatile done_[I2C2_DONE_SIZE];
+static volatile uint8_t   done_head_ = 0;  // Next slot to fill, by ISR
+static volatile uint8_t   done_tail_ = 0;  // Next callback to run, by main
+
+static I2C2Xfer* volatile cur_       = NULL;  // Transfer in progress
+static volatile uint32_t  cur_start_ = 0;     // Time it started (us)
+static volatile uint32_t  cur_err_   = 0;     // Error seen before STOP
+
+// Set after a bus error, no transfers start until i2c2Update() recovers it
+static volatile bool stuck_      = false;
+static uint8_t       recoveries_ = 0;
+
+// Per-device counts, allocated by i2c2Submit() and updated by the I2C2
+// interrupt. Also read by the controller I2C interrupt, which may interrupt an
+// update, so each field is written with a single store.
+#define I2C2_STATS_DEVS 8
+
+static volatile I2C2Stats stats_[I2C2_STATS_DEVS];
+static volatile size_t    num_stats_ = 0;
+
+static void stopDma() {
+  I2C2_DMA_TX->CCR = 0;
+  I2C2_DMA_RX->CCR = 0;
+  I2C2->CR1 &= ~(I2C_CR1_TXDMAEN | I2C_CR1_RXDMAEN);
+}
+
+static void startDma(DMA_Channel_TypeDef* ch, volatile uint32_t* reg,
+                     const uint8_t* buf, uint8_t len, uint32_t dir) {
+  ch->CCR   = 0;
+  ch->CPAR  = (uint32_t)reg;
+  ch->CMAR  = (uint32_t)buf;
+  ch->CNDTR = len;
+  ch->CCR   = DMA_CCR_MINC | dir | DMA_CCR_EN;  // 8-bit, memory increment
+}
+
+static void startRead(I2C2Xfer* xfer) {
+  startDma(I2C2_DMA_RX, &I2C2->RXDR, xfer->rx, xfer->rx_len, 0);
+  I2C2->CR1 |= I2C_CR1_RXDMAEN;
+  I2C_TransferHandling(I2C2, xfer->dev, xfer->rx_len, I2C_AutoEnd_Mode,
+                       I2C_Generate_Start_Read);
+}
+
+// Bytes a transfer takes on the bus, including addresses
+static uint8_t xferBytes(const I2C2Xfer* xfer) {
+  return 1 + xfer->tx_len + (xfer->rx_len ? 1 + xfer->rx_len : 0);
+}
+
+// Start the highest priority queued transfer if the bus is free and it fits in
+// this tick's budget. Must be called with the I2C2 interrupt disabled or from
+// the interrupt itself.
+static void startNext() {
+  if (cur_ || stuck_) {
+    return;
+  }
+  if (I2C2->ISR & I2C_ISR_BUSY) {
+    // Nothing of ours is on the bus, so a device must be holding SDA or SCL
+    stuck_ = true;
+    return;
+  }
+  uint32_t now = millis();
+  if (now != tick_) {
+    tick_       = now;
+    tick_bytes_ = 0;
+  }
+
+  I2C2Xfer* xfer = NULL;
+  for (size_t prio = 0; prio < I2C2_NUM_PRIOS && !xfer; prio++) {
+    I2C2Queue* q = &queues_[prio];
+    if (q->tail == q->head) {
+      continue;
+    }
+    I2C2Xfer* next  = q->xfers[q->tail & (I2C2_QUEUE_SIZE - 1)];
+    uint8_t   bytes = xferBytes(next);
+    if (prio != I2C2_PRIO_VOLUME && tick_bytes_ &&
+        tick_bytes_ + bytes > I2C2_TICK_BUDGET) {
+      // Out of time this tick, i2c2Update() will start it in the next one
+      return;
+    }
+    q->tail++;
+    tick_bytes_ += bytes;
+    xfer = next;
+  }
+  if (!xfer) {
+    return;
+  }
+
+  cur_        = xfer;
+  cur_start_  = micros();
+  cur_err_    = 0;
+  xfer->state = XFER_ACTIVE;
+
+  // Flush anything left in I2C_TXDR from a transfer that was NACKed
+  I2C2->ISR = I2C_ISR_TXE;
+  if (xfer->tx_len || !xfer->rx_len) {
+    // Write, then restart to read if required. A transfer with no data at all
+    // only addresses the device, to check that it is present.
+    uint32_t end_mode = xfer->rx_len ? I2C_SoftEnd_Mode : I2C_AutoEnd_Mode;
+    if (xfer->tx_len) {
+      startDma(I2C2_DMA_TX, &I2C2->TXDR, xfer->tx, xfer->tx_len, DMA_CCR_DIR);
+      I2C2->CR1 |= I2C_CR1_TXDMAEN;
+    }
+    I2C_TransferHandling(I2C2, xfer->dev, xfer->tx_len, end_mode,
+                         I2C_Generate_Start_Write);
+  } else {
+    startRead(xfer);
+  }
+}
+
+static volatile I2C2Stats* findStats(uint8_t dev) {
+  for (size_t i = 0; i < num_stats_; i++) {
+    if (stats_[i].dev == dev) {
+      return &stats_[i];
+    }
+  }
+  return NULL;
+}
+
+// Count an attempt at the current transfer
+static void count(uint32_t status) {
+  uint32_t us = micros() - cur_start_;
+  traceI2C2(cur_->dev, cur_->tx_len ? cur_->tx[0] : 0xFF, status, us);
+
+  volatile I2C2Stats* s = findStats(cur_->dev);
+  if (!s) {
+    return;
+  }
+  s->xfers++;
+  switch (status) {
+    case I2C_ISR_NACKF:
+      s->nacks++;
+      break;
+    case I2C_ISR_ARLO:
+      s->arlos++;
+      break;
+    case I2C_ISR_BERR:
+      s->berrs++;
+      break;
+    case I2C_ISR_TIMEOUT:
+      s->timeouts++;
+      break;
+    default:
+      break;
+  }
+  if (us > s->max_us) {
+    s->max_us = us > UINT16_MAX ? UINT16_MAX : us;
+  }
+}
+
+// Complete the current transfer. Must be called with the I2C2 interrupt
+// disabled or from the interrupt itself.
+static void finish(uint32_t status) {
+  count(status);
+  stopDma();
+  I2C2Xfer* xfer = cur_;
+  cur_           = NULL;
+  xfer->status   = status;
+  xfer->state    = XFER_DONE;
+  done_[done_head_ & (I2C2_DONE_SIZE - 1)] = xfer;
+  done_head_++;
+}
+
+// End the current transfer after a bus error, putting it back at the front of
+// its queue to retry once the bus is recovered. Must be called with the I2C2
+// interrupt disabled or from the interrupt itself.
+static void busError(uint32_t status) {
+  I2C2Xfer*  xfer = cur_;
+  I2C2Queue* q    = &queues_[xfer->prio];
+  stuck_          = true;
+  if (xfer->tries || (uint8_t)(q->head - q->tail) >= I2C2_QUEUE_SIZE) {
+    finish(status);
+    return;
+  }
+  count(status);
+  stopDma();
+  cur_        = NULL;
+  xfer->state = XFER_QUEUED;
+  xfer->tries++;
+  q->tail--;
+  q->xfers[q->tail & (I2C2_QUEUE_SIZE - 1)] = xfer;
+}
+
+void initI2C2() {
+  /* I2C-2 is internal to a single AmpliPi unit.
+   * The STM32 is the master and controls the volume chips, power, fans,
+   * and front panel LEDs.
+   *
+   * Bus Capacitance
+   * | Device           | Capacitance (pF)
+   * | STM32            | 5
+   * | MAX11601 (ADC)   | 15 (t_HD.STA>.6 t_LOW>1.3 t_HIGH>0.6 t_SU.STA>.6
+   *                          t_HD.DAT<.15? t_SU.DAT>0.1 t_r<.3 t_f<.3)
+   * | MCP23008 (Power) | ?? (t_HD.STA>.6 t_LOW>1.3 t_HIGH>0.6 t_SU.STA>.6
+   *                          t_HD.DAT<.9   t_SU.DAT>0.1 t_r<.3 t_f<.3)
+   * | MCP23008 (LEDs)  | ??
+   * | MCP4017 (DPot)   | 10 (t_HD.STA>.6 t_LOW>1.3 t_HIGH>0.6 t_SU.STA>.6
+   *                          t_HD.DAT<.9   t_SU.DAT>0.1 t_r<.3 t_f<.04)
+   * | TDA7448 (Vol1)   | ??????????????
+   * | TDA7448 (Vol2)   | Doesn't even specify max frequency...
+   * ~70 pF for all devices, plus say ~20 pF for all traces and wires = ~90 pF
+   * Rise time t_r = 0.8473*Rp*Cb ~= 0.8473 * 1 kOhm * 90 pF = 76 ns
+   * Measured rise time: 72 ns
+   * Measured fall time:  4 ns
+   *
+   * Pullup Resistor Values
+   *   Max output current for I2C Standard/Fast mode is 3 mA, so min pullup is:
+   *    Rp > [V_DD - V_OL(max)] / I_OL = (3.3 V - 0.4 V) / 3 mA = 967 Ohm
+   *   Max bus capacitance (with only resistor for pullup) is 200 pF.
+   *   Standard mode rise-time t_r(max) = 1000 ns
+   *    Rp_std < t_r(max) / (0.8473 * Cb) = 1000 / (0.8473 * 0.2) = 5901 Ohm
+   *   Fast mode rise-time t_r(max) = 300 ns
+   *    Rp_fast < t_r(max) / (0.8473 * Cb) = 1000 / (0.8473 * 0.2) = 1770 Ohm
+   *   For Standard mode: 1k <= Rp <= 5.6k
+   *   For Fast mode: 1k <= Rp <= 1.6k
+   */
+
+  // Enable peripheral clocks for I2C2 and its DMA channels
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_I2C2, ENABLE);
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+
+  // Enable SDA1, SDA2, SCL1, SCL2 clocks
+  // Enabled here since this is called before I2C1
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOB, ENABLE);
+
+  // Connect pins to alternate function for I2C2
+  GPIO_PinAFConfig(GPIOB, GPIO_PinSource10, GPIO_AF_1);  // I2C2_SCL
+  GPIO_PinAFConfig(GPIOB, GPIO_PinSource11, GPIO_AF_1);  // I2C2_SDA
+
+  // Config I2C GPIO pins
+  GPIO_InitTypeDef GPIO_InitStructureI2C;
+  GPIO_InitStructureI2C.GPIO_Pin   = pSCL_VOL | pSDA_VOL;
+  GPIO_InitStructureI2C.GPIO_Mode  = GPIO_Mode_AF;
+  GPIO_InitStructureI2C.GPIO_Speed = GPIO_Speed_2MHz;
+  GPIO_InitStructureI2C.GPIO_OType = GPIO_OType_OD;
+  GPIO_InitStructureI2C.GPIO_PuPd  = GPIO_PuPd_NOPULL;
+  GPIO_Init(GPIOB, &GPIO_InitStructureI2C);
+
+  // Setup I2C2
+  I2C_InitTypeDef I2C_InitStructure2;
+  I2C_InitStructure2.I2C_Mode                = I2C_Mode_I2C;
+  I2C_InitStructure2.I2C_AnalogFilter        = I2C_AnalogFilter_Enable;
+  I2C_InitStructure2.I2C_DigitalFilter       = 0x00;
+  I2C_InitStructure2.I2C_OwnAddress1         = 0x00;
+  I2C_InitStructure2.I2C_Ack                 = I2C_Ack_Enable;
+  I2C_InitStructure2.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
+
+  // See the STM32F030 reference manual section 22.4.9 "I2C master mode" or
+  // AN4235 for I2C timing calculations.
+  // Excel tool, rise/fall 72/4 ns: 100 kHz: 0x00201D2C (0.5074% error)
+  //                                400 kHz: 0x0010020B (1.9992% error)
+
+  /* Common parameters
+   * t_I2CCLK = 1 / 8 MHz = 125 ns
+   * t_AF(min) = 50 ns  - Analog filter minimum input delay
+   * t_AF(max) = 260 ns - Analog filter maximum input delay
+   * t_DNF = 0          - Digital filter input delay
+   * t_r = 72 ns        - Rise time
+   *   For Standard mode (100 kHz), rise time < 1000 ns
+   *   For Fast mode (400 kHz), rise time < 300 ns
+   * t_f = 4 ns         - Fall time (must be < 300 ns)
+   *
+   * t_SYNC1(min) = t_f + t_AF(min) + t_DNF + 2*t_I2CCLK
+   * t_SYNC1(min) = 4 + 50 + 2*125 = 306 ns
+   * t_SYNC2(min) = t_r + t_AF(min) + t_DNF + 2*t_I2CCLK
+   * t_SYNC2(min) = 76 + 50 + 2*125 = 376 ns
+   */
+
+  /* Standard mode, max 100 kHz
+   * t_LOW > 4.7 us,t_HIGH > 4 us
+   * t_I2CCLK < [t_LOW - t_AF(min) - t_DNF] / 4 = (4700 - 50) / 4 = 1162.5 ns
+   * t_I2CCLK < t_HIGH = 4000 ns
+   * Set PRESC = 0, so t_I2CCLK = 1 / 8 MHz = 125 ns
+   * t_PRESC = t_I2CCLK / (PRESC + 1) = 125 / (0 + 1) = 125 ns
+   * SDADEL >= [t_f + t_HD;DAT(min) - t_AF(min) - t_DNF - 3*t_I2CCLK] / t_PRESC
+   * SDADEL >= [4 - 50 - 375] / 125 = -3.368 < 0, so SDASEL >= 0
+   * SDADEL <= [t_VD;DAT(max) - t_r - t_AF(max) - t_DNF - 4*t_I2CCLK] / t_PRESC
+   * SDADEL <= (3450 - 72 - 260 - 500) / 125 = 20.944
+   * SCLDEL >= {[t_r + t_SU;DAT(min)] / t_PRESC} - 1
+   * SCLDEL >= (72 + 250) / 125 - 1 = 1.576
+   * So 0 <= SDADEL <= 20, SCLDEL >= 2
+   * I2C_TIMINGR[31:16] = 0x0020
+   *
+   * t_HIGH(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLH + 1)
+   * 4000 <= 50 + 2*125 + 125*(SCLH + 1)
+   * 3575 <= 125*SCLH
+   * SCLH >= 28.6 = 0x1D
+   *
+   * t_LOW(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLL + 1)
+   * 4700 <= 50 + 2*125 + 125*(SCLL + 1)
+   * 4275 <= 125*SCLL
+   * SCLL >= 34.2 = 0x23
+   *
+   * Need to stay under 100 kHz in "worst" case. Keep SCLH at min,
+   * but here we determine final SCLL.
+   * t_SCL = t_SYNC1 + t_SYNC2 + t_LOW + t_HIGH >= 10000 ns (100 kHz max)
+   * t_LOW + t_HIGH >= 10000 - 304 - 372 ns = 9324 ns
+   * t_PRESC*(SCLL + 1) + t_PRESC*(SCLH + 1) >= 9324 ns
+   * 125*(SCLL + 1) + 125*30 >= 9324 ns
+   * SCLL >= 43.592 = 0x2C
+   *
+   * I2C_TIMINGR[31:0] = 0x00101D2C
+   */
+
+  /* Fast mode, max 400 kHz
+   * t_LOW > 1.3 us, t_HIGH > 0.6 us
+   * t_I2CCLK < [t_LOW - t_AF(min) - t_DNF] / 4 = (1300 - 50) / 4 = 312.5 ns
+   * t_I2CCLK < t_HIGH = 600 ns
+   * Set PRESC = 0, so t_I2CCLK = 1 / 8 MHz = 125 ns
+   * t_PRESC = t_I2CCLK / (PRESC + 1) = 125 / (0 + 1) = 125 ns
+   * SDADEL >= [t_f + t_HD;DAT(min) - t_AF(min) - t_DNF - 3*t_I2CCLK] / t_PRESC
+   * SDADEL >= [4 - 50 - 375] / 125 = -3.368 < 0, so SDASEL >= 0
+   * SDADEL <= [t_VD;DAT(max) - t_r - t_AF(max) - t_DNF - 4*t_I2CCLK] / t_PRESC
+   * SDADEL <= (900 - 72 - 260 - 500) / 125 = 0.544
+   * SCLDEL >= {[t_r + t_SU;DAT(min)] / t_PRESC} - 1
+   * SCLDEL >= (72 + 100) / 125 - 1 = 0.376
+   * So 0 <= SDADEL <= 0, SCLDEL >= 1
+   * I2C_TIMINGR[31:16] = 0x0010
+   *
+   * t_HIGH(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLH + 1)
+   * 600 <= 50 + 2*125 + 125*(SCLH + 1)
+   * 175 <= 125*SCLH
+   * SCLH >= 1.4 = 0x02
+   *
+   * t_LOW(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLL + 1)
+   * 1300 <= 50 + 2*125 + 125*(SCLL + 1)
+   * 875 <= 125*SCLL
+   * SCLL >= 7 = 0x07
+   *
+   * Need to stay under 400 kHz in "worst" case. Keep SCLH at min,
+   * but here we determine final SCLL.
+   * t_SCL = t_SYNC1 + t_SYNC2 + t_LOW + t_HIGH >= 2500 ns (400 kHz max)
+   * t_LOW + t_HIGH >= 2500 - 304 - 372 ns = 1824 ns
+   * t_PRESC*(SCLL + 1) + t_PRESC*(SCLH + 1) >= 1824 ns
+   * 125*(SCLL + 1) + 125*3 >= 1824 ns
+   * SCLL >= 10.592 = 0x0B
+   *
+   * I2C_TIMINGR[31:0] = 0x0010020B
+   */
+
+  /* Fast mode, max 400 kHz, with a 48 MHz I2CCLK
+   * t_I2CCLK = 1 / 48 MHz = 20.8 ns
+   * t_SYNC1(min) = 4 + 50 + 2*20.8 = 95.7 ns
+   * t_SYNC2(min) = 72 + 50 + 2*20.8 = 163.7 ns
+   * Set PRESC = 5, so t_PRESC = 6 * 20.8 = 125 ns, as at 8 MHz
+   * SDADEL >= [4 - 50 - 3*20.8] / 125 < 0, so SDADEL >= 0
+   * SDADEL <= (900 - 72 - 260 - 4*20.8) / 125 = 3.877
+   * SCLDEL >= (72 + 100) / 125 - 1 = 0.376
+   * So 0 <= SDADEL <= 3, SCLDEL >= 1
+   * I2C_TIMINGR[31:16] = 0x5010
+   *
+   * 600 <= 50 + 2*20.8 + 125*(SCLH + 1)
+   * SCLH >= 3.07 = 0x04
+   *
+   * 1300 <= 50 + 2*20.8 + 125*(SCLL + 1)
+   * SCLL >= 8.67 = 0x09
+   *
+   * t_LOW + t_HIGH >= 2500 - 95.7 - 163.7 ns = 2240.6 ns
+   * 125*(SCLL + 1) + 125*5 >= 2240.6 ns
+   * SCLL >= 11.925 = 0x0C
+   *
+   * I2C_TIMINGR[31:0] = 0x5010040C
+   */
+
+  // I2C2 is clocked by PCLK, which runs at SYSCLK_HZ
+#if SYSCLK_HZ == 48000000
+  I2C_InitStructure2.I2C_Timing = 0x5010040C;
+#else
+  I2C_InitStructure2.I2C_Timing = 0x0010020B;
+#endif
+  NVIC_DisableIRQ(I2C2_IRQn);
+  I2C_Init(I2C2, &I2C_InitStructure2);
+
+  // Abort anything in progress, then let the queue start over
+  stopDma();
+  if (cur_) {
+    finish(I2C_ISR_BERR);
+  }
+  stuck_ = false;
+
+  // Transfers are started, continued and completed in the I2C2 interrupt.
+  // The control bus (I2C1) takes priority.
+  I2C_ITConfig(I2C2, I2C_IT_TCI | I2C_IT_STOPI | I2C_IT_NACKI | I2C_IT_ERRI,
+               ENABLE);
+  I2C_Cmd(I2C2, ENABLE);
+  NVIC_SetPriority(I2C2_IRQn, 1);
+  startNext();
+  NVIC_EnableIRQ(I2C2_IRQn);
+}
+
+
+bool i2c2Submit(I2C2Xfer* xfer) {
+  bool       queued = false;
+  I2C2Queue* q      = &queues_[xfer->prio];
+  NVIC_DisableIRQ(I2C2_IRQn);
+  if (!findStats(xfer->dev) && num_stats_ < I2C2_STATS_DEVS) {
+    stats_[num_stats_].dev = xfer->dev;
+    num_stats_++;
+  }
+  if (xfer->state == XFER_IDLE &&
+      (uint8_t)(q->head - q->tail) < I2C2_QUEUE_SIZE) {
+    xfer->state                             = XFER_QUEUED;
+    xfer->tries                             = 0;
+    q->xfers[q->head & (I2C2_QUEUE_SIZE - 1)] = xfer;
+    q->head++;
+    queued = true;
+    startNext();
+  } else {
+    overruns_++;
+  }
+  NVIC_EnableIRQ(I2C2_IRQn);
+  return queued;
+}
+
+uint8_t i2c2Overruns() {
+  return overruns_;
+}
+
+void i2c2Update() {
+  // Abort a transfer that has stalled, likely a device holding SDA low
+  NVIC_DisableIRQ(I2C2_IRQn);
+  if (cur_ && micros() - cur_start_ > I2C2_TIMEOUT_US) {
+    busError(I2C_ISR_TIMEOUT);
+  }
+  // Start anything left waiting for the next tick's budget
+  startNext();
+  NVIC_EnableIRQ(I2C2_IRQn);
+
+  if (stuck_) {
+    i2c2Recover();
+  }
+
+  // Run callbacks of all completed transfers. A callback may submit another
+  // transfer, including the one that just completed.
+  while (done_tail_ != done_head_) {
+    I2C2Xfer* xfer = done_[done_tail_ & (I2C2_DONE_SIZE - 1)];
+    done_tail_++;
+    xfer->state = XFER_IDLE;
+    if (xfer->done) {
+      xfer->done(xfer);
+    }
+  }
+}
+
+void i2c2Recover() {
+  NVIC_DisableIRQ(I2C2_IRQn);
+  I2C_Cmd(I2C2, DISABLE);
+  stopDma();
+
+  // Take over the pins as open-drain outputs, starting released
+  writePin(i2c2_scl_, true);
+  writePin(i2c2_sda_, true);
+  GPIO_InitTypeDef GPIO_InitStructureI2C;
+  GPIO_InitStructureI2C.GPIO_Pin   = pSCL_VOL | pSDA_VOL;
+  GPIO_InitStructureI2C.GPIO_Mode  = GPIO_Mode_OUT;
+  GPIO_InitStructureI2C.GPIO_Speed = GPIO_Speed_2MHz;
+  GPIO_InitStructureI2C.GPIO_OType = GPIO_OType_OD;
+  GPIO_InitStructureI2C.GPIO_PuPd  = GPIO_PuPd_NOPULL;
+  GPIO_Init(GPIOB, &GPIO_InitStructureI2C);
+  delayUs(I2C2_RECOVER_US);
+
+  // A device part way through sending a byte releases SDA within 9 clocks
+  for (size_t i = 0; i < 9 && !readPinLevel(i2c2_sda_); i++) {
+    writePin(i2c2_scl_, false);
+    delayUs(I2C2_RECOVER_US);
+    writePin(i2c2_scl_, true);
+    delayUs(I2C2_RECOVER_US);
+  }
+
+  // STOP condition, SDA rising while SCL is high
+  writePin(i2c2_scl_, false);
+  writePin(i2c2_sda_, false);
+  delayUs(I2C2_RECOVER_US);
+  writePin(i2c2_scl_, true);
+  delayUs(I2C2_RECOVER_US);
+  writePin(i2c2_sda_, true);
+  delayUs(I2C2_RECOVER_US);
+
+  // Restore the pins to I2C2 and start any queued transfers
+  recoveries_++;
+  initI2C2();
+}
+
+uint8_t i2c2Recoveries() {
+  return recoveries_;
+}
+
+const volatile I2C2Stats* i2c2Stats(uint8_t dev) {
+  return findStats(dev);
+}
+
+void i2c2ResetStats() {
+  NVIC_DisableIRQ(I2C2_IRQn);
+  for (size_t i = 0; i < num_stats_; i++) {
+    stats_[i].max_us = 0;
+  }
+  NVIC_EnableIRQ(I2C2_IRQn);
+}
+
+uint32_t i2c2Transfer(I2C2Xfer* xfer) {
+  // Wait for the transfer to be idle, and for space in the queue
+  while (xfer->state != XFER_IDLE) {
+    i2c2Update();
+  }
+  while (!i2c2Submit(xfer)) {
+    i2c2Update();
+  }
+  while (xfer->state != XFER_IDLE) {
+    i2c2Update();
+  }
+  return xfer->status;
+}
+
+bool i2c2Idle() {
+  for (size_t prio = 0; prio < I2C2_NUM_PRIOS; prio++) {
+    if (queues_[prio].tail != queues_[prio].head) {
+      return false;
+    }
+  }
+  return !cur_ && done_tail_ == done_head_;
+}
+
+bool i2c2Pending() {
+  return done_tail_ != done_head_ || stuck_;
+}
+
+void I2C2_IRQHandler(void) {
+  uint32_t isr = I2C2->ISR;
+
+  if (!cur_) {
+    // Nothing in progress, just clear any flags
+    I2C2->ICR = I2C_ICR_NACKCF | I2C_ICR_STOPCF | I2C_ICR_BERRCF |
+                I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+    return;
+  }
+
+  if (isr & I2C_ISR_NACKF) {
+    // The device didn't respond. A STOP is automatically sent after a NACK
+    // in automatic end mode, otherwise it must be sent here.
+    I2C2->ICR = I2C_ICR_NACKCF;
+    cur_err_  = I2C_ISR_NACKF;
+    if (!(I2C2->CR2 & I2C_CR2_AUTOEND)) {
+      I2C2->CR2 |= I2C_CR2_STOP;
+    }
+  }
+
+  if (isr & (I2C_ISR_BERR | I2C_ISR_ARLO)) {
+    // Misplaced START/STOP or another master/device drove SDA. The peripheral
+    // releases the bus and no STOP will follow, so end the transfer now and
+    // leave i2c2Update() to recover the bus.
+    I2C2->ICR = I2C_ICR_BERRCF | I2C_ICR_ARLOCF;
+    busError(isr & I2C_ISR_BERR ? I2C_ISR_BERR : I2C_ISR_ARLO);
+    return;
+  }
+
+  if (isr & I2C_ISR_TC) {
+    // Write part of a write-then-read is done, restart to read
+    I2C2->CR1 &= ~I2C_CR1_TXDMAEN;
+    startRead(cur_);
+  }
+
+  if (isr & I2C_ISR_STOPF) {
+    I2C2->ICR = I2C_ICR_STOPCF;
+    finish(cur_err_);
+    startNext();
+  }
+}
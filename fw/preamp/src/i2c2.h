@@ -0,0 +1,123 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Interrupt and DMA driven transfers on the internal I2C bus
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef I2C2_H_
+#define I2C2_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum
+{
+  XFER_IDLE,    // Not queued, may be modified
+  XFER_QUEUED,  // Waiting for the bus
+  XFER_ACTIVE,  // In progress
+  XFER_DONE,    // Complete, waiting for i2c2Update() to call xfer->done
+} I2C2XferState;
+
+// Queued transfers are started highest priority first. Mutes are direct GPIO
+// so never wait on the bus.
+typedef enum
+{
+  I2C2_PRIO_VOLUME,  // User-facing changes, never delayed by the tick budget
+  I2C2_PRIO_GPIO,    // Power Board GPIO
+  I2C2_PRIO_ADC,     // Power Board ADC and fan DPOT
+  I2C2_PRIO_LED,     // LED Board
+  I2C2_NUM_PRIOS,
+} I2C2Prio;
+
+typedef struct I2C2Xfer I2C2Xfer;
+typedef void (*I2C2Callback)(I2C2Xfer* xfer);
+
+/* A single transfer: write tx_len bytes, then if rx_len > 0 restart and read
+ * rx_len bytes. The transfer and its buffers must stay valid until it is
+ * complete. Once done, status is 0 on success or one of the I2C_ISR flags
+ * I2C_ISR_NACKF, I2C_ISR_BERR, I2C_ISR_ARLO or I2C_ISR_TIMEOUT.
+ * A transfer that fails with a bus error (anything but a NACK) is retried
+ * once after the bus has been recovered, see i2c2Recover().
+ */
+struct I2C2Xfer {
+  uint8_t        dev;     // Device address, shifted left by one
+  uint8_t        tx_len;  // Bytes to write
+  uint8_t        rx_len;  // Bytes to read
+  I2C2Prio       prio;
+  const uint8_t* tx;
+  uint8_t*       rx;
+  I2C2Callback   done;  // Called from i2c2Update() when complete, may be NULL
+  void*          ctx;   // For use by the callback
+
+  volatile I2C2XferState state;
+  volatile uint32_t      status;
+  uint8_t                tries;  // Retries after bus errors, set by i2c2Submit()
+};
+
+/* Counts of transfers to a single device. Each attempt is counted, so a
+ * transfer retried after a bus error counts twice. Counts wrap, xfers at
+ * 65536 and the rest at 256.
+ */
+typedef struct {
+  uint8_t  dev;
+  uint16_t xfers;
+  uint8_t  nacks;
+  uint8_t  arlos;     // Arbitration lost
+  uint8_t  berrs;     // Misplaced START or STOP
+  uint8_t  timeouts;  // Stalled, or the bus was held when starting
+  uint16_t max_us;    // Longest attempt since i2c2ResetStats(), saturated
+} I2C2Stats;
+
+void initI2C2();
+
+// Queue a transfer, returns false if it is already queued or the queue is full
+bool i2c2Submit(I2C2Xfer* xfer);
+
+// Number of transfers not submitted because they were still queued from the
+// last time or the queue was full. Wraps at 256.
+uint8_t i2c2Overruns();
+
+// Time out stalled transfers, recover the bus after errors and run callbacks.
+// Call regularly from the main loop.
+void i2c2Update();
+
+/* Free a bus held by a device that was interrupted mid-transfer, by clocking
+ * SCL until the device releases SDA then sending a STOP, and reinitialize
+ * I2C2. Takes ~100 us. Called by i2c2Update() after a bus error.
+ */
+void i2c2Recover();
+
+// Number of times the bus has been recovered. Wraps at 256.
+uint8_t i2c2Recoveries();
+
+// Counts for a device, or NULL if nothing has been submitted to it yet
+const volatile I2C2Stats* i2c2Stats(uint8_t dev);
+
+// Restart the longest attempt time of all devices
+void i2c2ResetStats();
+
+// Submit a transfer and wait until it (and its callback) is complete
+uint32_t i2c2Transfer(I2C2Xfer* xfer);
+
+// True if no transfers are queued or in progress
+bool i2c2Idle();
+
+// True if i2c2Update() has work to do: callbacks of completed transfers to
+// run, or a bus to recover
+bool i2c2Pending();
+
+#endif /* I2C2_H_ */
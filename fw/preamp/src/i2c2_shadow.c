@@ -0,0 +1,77 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Shadow copies of internal I2C device registers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "i2c2_shadow.h"
+
+#include <stddef.h>
+
+// Six volumes, the LED and power GPIO outputs and the DPOT, with room to spare
+#define SHADOW_LEN 12
+
+static I2C2Shadow shadows_[SHADOW_LEN];
+static size_t     num_shadows_ = 0;
+
+I2C2Shadow* i2c2Shadow(I2CReg r) {
+  for (size_t i = 0; i < num_shadows_; i++) {
+    if (shadows_[i].reg.dev == r.dev && shadows_[i].reg.reg == r.reg) {
+      return &shadows_[i];
+    }
+  }
+  if (num_shadows_ >= SHADOW_LEN) {
+    return NULL;
+  }
+  I2C2Shadow* shadow = &shadows_[num_shadows_++];
+  shadow->reg        = r;
+  shadow->valid      = false;
+  return shadow;
+}
+
+bool shadowDiffers(const I2C2Shadow* shadow, uint8_t val) {
+  return !shadow || !shadow->valid || shadow->val != val;
+}
+
+void shadowSet(I2C2Shadow* shadow, uint8_t val) {
+  if (shadow) {
+    shadow->val   = val;
+    shadow->valid = true;
+  }
+}
+
+bool shadowGet(const I2C2Shadow* shadow, uint8_t* val) {
+  if (shadow && shadow->valid) {
+    *val = shadow->val;
+    return true;
+  }
+  return false;
+}
+
+void shadowInvalidate(I2C2Shadow* shadow) {
+  if (shadow) {
+    shadow->valid = false;
+  }
+}
+
+void shadowInvalidateDev(uint8_t dev) {
+  for (size_t i = 0; i < num_shadows_; i++) {
+    if (shadows_[i].reg.dev == dev) {
+      shadows_[i].valid = false;
+    }
+  }
+}
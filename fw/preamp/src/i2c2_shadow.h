@@ -0,0 +1,58 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Shadow copies of internal I2C device registers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef I2C2_SHADOW_H_
+#define I2C2_SHADOW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ports.h"
+
+/* The last value successfully written to (or read from) a register on the
+ * internal bus. Writes of an unchanged value can be skipped, and output
+ * latches can be read from the shadow instead of the device.
+ */
+typedef struct {
+  I2CReg  reg;
+  uint8_t val;
+  bool    valid;  // False until the register's value is known
+} I2C2Shadow;
+
+// Find or add the shadow of a register. Returns NULL if there is no room left,
+// which the functions below treat as a register that always needs writing.
+I2C2Shadow* i2c2Shadow(I2CReg r);
+
+// True if val needs to be written to the register
+bool shadowDiffers(const I2C2Shadow* shadow, uint8_t val);
+
+// Record a value written to or read from the register
+void shadowSet(I2C2Shadow* shadow, uint8_t val);
+
+// Get the register's value, returns false if it isn't known
+bool shadowGet(const I2C2Shadow* shadow, uint8_t* val);
+
+// Forget the register's value, e.g. after a failed write or a device reset
+void shadowInvalidate(I2C2Shadow* shadow);
+
+// Forget the values of all registers of a device
+void shadowInvalidateDev(uint8_t dev);
+
+#endif /* I2C2_SHADOW_H_ */
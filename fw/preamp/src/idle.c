@@ -0,0 +1,49 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Idle mode, slowing the telemetry and LED tasks while nothing plays
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "idle.h"
+
+#include "audio_mux.h"
+
+static Task* adc_task_    = NULL;
+static Task* pwr_in_task_ = NULL;
+static Task* leds_task_   = NULL;
+static bool  idle_        = false;
+
+void idleInit(Task* adc, Task* pwr_in, Task* leds) {
+  adc_task_    = adc;
+  pwr_in_task_ = pwr_in;
+  leds_task_   = leds;
+  idle_        = false;
+}
+
+void idleUpdate() {
+  bool idle = !anyOn() && inStandby();
+  if (idle != idle_) {
+    idle_ = idle;
+    schedPeriod(adc_task_, idle ? IDLE_ADC_MS : ADC_MS);
+    schedPeriod(pwr_in_task_, idle ? IDLE_PWR_IN_MS : PWR_IN_MS);
+    schedPeriod(leds_task_, idle ? IDLE_LEDS_MS : LEDS_MS);
+  }
+}
+
+bool isIdle() {
+  return idle_;
+}
@@ -0,0 +1,56 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Idle mode, slowing the telemetry and LED tasks while nothing plays
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IDLE_H_
+#define IDLE_H_
+
+#include <stdbool.h>
+
+#include "sched.h"
+
+/* While every zone is muted and the amps are in standby nothing audible
+ * depends on the Power Board's inputs or the LEDs, so the preamp is idle and
+ * they're polled at the IDLE_ periods instead, leaving the core asleep in
+ * schedRun() for most ticks. The fans are still controlled from each ADC
+ * scan, and controller writes still wake the core from I2C1's interrupt and
+ * are applied straight away.
+ */
+
+// Periods (ms) of the ADC, Power Board input and LED tasks, and their periods
+// while idle. Each idle period is a multiple of the normal one, so the tasks
+// keep their offsets from each other, see schedPeriod().
+#define ADC_MS         8
+#define PWR_IN_MS      2
+#define LEDS_MS        4
+#define IDLE_ADC_MS    32
+#define IDLE_PWR_IN_MS 32
+#define IDLE_LEDS_MS   64
+
+// The tasks whose periods are changed, each created with its normal period
+void idleInit(Task* adc, Task* pwr_in, Task* leds);
+
+// Enter or leave idle as the audio state requires. Called after controller
+// writes are applied, so a write that unmutes a zone or leaves standby
+// restores the normal periods before the next task runs.
+void idleUpdate();
+
+bool isIdle();
+
+#endif /* IDLE_H_ */
@@ -24,306 +24,329 @@
 
 #include "audio_mux.h"
 #include "fans.h"
+#include "i2c2.h"
+#include "i2c2_shadow.h"
 #include "port_defs.h"
 #include "ports.h"
+#include "profile.h"
 #include "stm32f0xx.h"
 #include "systick.h"
 #include "thermistor.h"
+#include "watchdog.h"
 
 // I2C GPIO registers
-const I2CReg pwr_io_dir_  = {0x42, 0x00};
-const I2CReg pwr_io_gpio_ = {0x42, 0x09};
-const I2CReg pwr_io_olat_ = {0x42, 0x0A};
+const I2CReg pwr_io_dir_  = {DEV_PWR_GPIO, 0x00};
+const I2CReg pwr_io_gpio_ = {DEV_PWR_GPIO, 0x09};
+const I2CReg pwr_io_olat_ = {DEV_PWR_GPIO, 0x0A};
 
 // LED Board registers
-const I2CReg led_dir_  = {0x40, 0x00};
-const I2CReg led_gpio_ = {0x40, 0x09};
-const I2CReg led_olat_ = {0x40, 0x0A};
+const I2CReg led_dir_  = {DEV_LED_GPIO, 0x00};
+const I2CReg led_gpio_ = {DEV_LED_GPIO, 0x09};
+const I2CReg led_olat_ = {DEV_LED_GPIO, 0x0A};
 
 // Power Board ADC register (no registers)
-const I2CReg adc_dev_ = {0xC8, 0xFF};
+const I2CReg adc_dev_ = {DEV_ADC, 0xFF};
 
 // DPOT register (no registers)
-const I2CReg dpot_dev_ = {0x5E, 0xFF};
-
-void initI2C2() {
-  /* I2C-2 is internal to a single AmpliPi unit.
-   * The STM32 is the master and controls the volume chips, power, fans,
-   * and front panel LEDs.
-   *
-   * Bus Capacitance
-   * | Device           | Capacitance (pF)
-   * | STM32            | 5
-   * | MAX11601 (ADC)   | 15 (t_HD.STA>.6 t_LOW>1.3 t_HIGH>0.6 t_SU.STA>.6
-   *                          t_HD.DAT<.15? t_SU.DAT>0.1 t_r<.3 t_f<.3)
-   * | MCP23008 (Power) | ?? (t_HD.STA>.6 t_LOW>1.3 t_HIGH>0.6 t_SU.STA>.6
-   *                          t_HD.DAT<.9   t_SU.DAT>0.1 t_r<.3 t_f<.3)
-   * | MCP23008 (LEDs)  | ??
-   * | MCP4017 (DPot)   | 10 (t_HD.STA>.6 t_LOW>1.3 t_HIGH>0.6 t_SU.STA>.6
-   *                          t_HD.DAT<.9   t_SU.DAT>0.1 t_r<.3 t_f<.04)
-   * | TDA7448 (Vol1)   | ??????????????
-   * | TDA7448 (Vol2)   | Doesn't even specify max frequency...
-   * ~70 pF for all devices, plus say ~20 pF for all traces and wires = ~90 pF
-   * Rise time t_r = 0.8473*Rp*Cb ~= 0.8473 * 1 kOhm * 90 pF = 76 ns
-   * Measured rise time: 72 ns
-   * Measured fall time:  4 ns
-   *
-   * Pullup Resistor Values
-   *   Max output current for I2C Standard/Fast mode is 3 mA, so min pullup is:
-   *    Rp > [V_DD - V_OL(max)] / I_OL = (3.3 V - 0.4 V) / 3 mA = 967 Ohm
-   *   Max bus capacitance (with only resistor for pullup) is 200 pF.
-   *   Standard mode rise-time t_r(max) = 1000 ns
-   *    Rp_std < t_r(max) / (0.8473 * Cb) = 1000 / (0.8473 * 0.2) = 5901 Ohm
-   *   Fast mode rise-time t_r(max) = 300 ns
-   *    Rp_fast < t_r(max) / (0.8473 * Cb) = 1000 / (0.8473 * 0.2) = 1770 Ohm
-   *   For Standard mode: 1k <= Rp <= 5.6k
-   *   For Fast mode: 1k <= Rp <= 1.6k
-   */
-
-  // Enable peripheral clock for I2C2
-  RCC_APB1PeriphClockCmd(RCC_APB1Periph_I2C2, ENABLE);
-
-  // Enable SDA1, SDA2, SCL1, SCL2 clocks
-  // Enabled here since this is called before I2C1
-  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_GPIOB, ENABLE);
-
-  // Connect pins to alternate function for I2C2
-  GPIO_PinAFConfig(GPIOB, GPIO_PinSource10, GPIO_AF_1);  // I2C2_SCL
-  GPIO_PinAFConfig(GPIOB, GPIO_PinSource11, GPIO_AF_1);  // I2C2_SDA
-
-  // Config I2C GPIO pins
-  GPIO_InitTypeDef GPIO_InitStructureI2C;
-  GPIO_InitStructureI2C.GPIO_Pin   = pSCL_VOL | pSDA_VOL;
-  GPIO_InitStructureI2C.GPIO_Mode  = GPIO_Mode_AF;
-  GPIO_InitStructureI2C.GPIO_Speed = GPIO_Speed_2MHz;
-  GPIO_InitStructureI2C.GPIO_OType = GPIO_OType_OD;
-  GPIO_InitStructureI2C.GPIO_PuPd  = GPIO_PuPd_NOPULL;
-  GPIO_Init(GPIOB, &GPIO_InitStructureI2C);
-
-  // Setup I2C2
-  I2C_InitTypeDef I2C_InitStructure2;
-  I2C_InitStructure2.I2C_Mode                = I2C_Mode_I2C;
-  I2C_InitStructure2.I2C_AnalogFilter        = I2C_AnalogFilter_Enable;
-  I2C_InitStructure2.I2C_DigitalFilter       = 0x00;
-  I2C_InitStructure2.I2C_OwnAddress1         = 0x00;
-  I2C_InitStructure2.I2C_Ack                 = I2C_Ack_Enable;
-  I2C_InitStructure2.I2C_AcknowledgedAddress = I2C_AcknowledgedAddress_7bit;
-
-  // See the STM32F030 reference manual section 22.4.9 "I2C master mode" or
-  // AN4235 for I2C timing calculations.
-  // Excel tool, rise/fall 72/4 ns: 100 kHz: 0x00201D2C (0.5074% error)
-  //                                400 kHz: 0x0010020B (1.9992% error)
-
-  /* Common parameters
-   * t_I2CCLK = 1 / 8 MHz = 125 ns
-   * t_AF(min) = 50 ns  - Analog filter minimum input delay
-   * t_AF(max) = 260 ns - Analog filter maximum input delay
-   * t_DNF = 0          - Digital filter input delay
-   * t_r = 72 ns        - Rise time
-   *   For Standard mode (100 kHz), rise time < 1000 ns
-   *   For Fast mode (400 kHz), rise time < 300 ns
-   * t_f = 4 ns         - Fall time (must be < 300 ns)
-   *
-   * t_SYNC1(min) = t_f + t_AF(min) + t_DNF + 2*t_I2CCLK
-   * t_SYNC1(min) = 4 + 50 + 2*125 = 306 ns
-   * t_SYNC2(min) = t_r + t_AF(min) + t_DNF + 2*t_I2CCLK
-   * t_SYNC2(min) = 76 + 50 + 2*125 = 376 ns
-   */
-
-  /* Standard mode, max 100 kHz
-   * t_LOW > 4.7 us,t_HIGH > 4 us
-   * t_I2CCLK < [t_LOW - t_AF(min) - t_DNF] / 4 = (4700 - 50) / 4 = 1162.5 ns
-   * t_I2CCLK < t_HIGH = 4000 ns
-   * Set PRESC = 0, so t_I2CCLK = 1 / 8 MHz = 125 ns
-   * t_PRESC = t_I2CCLK / (PRESC + 1) = 125 / (0 + 1) = 125 ns
-   * SDADEL >= [t_f + t_HD;DAT(min) - t_AF(min) - t_DNF - 3*t_I2CCLK] / t_PRESC
-   * SDADEL >= [4 - 50 - 375] / 125 = -3.368 < 0, so SDASEL >= 0
-   * SDADEL <= [t_VD;DAT(max) - t_r - t_AF(max) - t_DNF - 4*t_I2CCLK] / t_PRESC
-   * SDADEL <= (3450 - 72 - 260 - 500) / 125 = 20.944
-   * SCLDEL >= {[t_r + t_SU;DAT(min)] / t_PRESC} - 1
-   * SCLDEL >= (72 + 250) / 125 - 1 = 1.576
-   * So 0 <= SDADEL <= 20, SCLDEL >= 2
-   * I2C_TIMINGR[31:16] = 0x0020
-   *
-   * t_HIGH(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLH + 1)
-   * 4000 <= 50 + 2*125 + 125*(SCLH + 1)
-   * 3575 <= 125*SCLH
-   * SCLH >= 28.6 = 0x1D
-   *
-   * t_LOW(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLL + 1)
-   * 4700 <= 50 + 2*125 + 125*(SCLL + 1)
-   * 4275 <= 125*SCLL
-   * SCLL >= 34.2 = 0x23
-   *
-   * Need to stay under 100 kHz in "worst" case. Keep SCLH at min,
-   * but here we determine final SCLL.
-   * t_SCL = t_SYNC1 + t_SYNC2 + t_LOW + t_HIGH >= 10000 ns (100 kHz max)
-   * t_LOW + t_HIGH >= 10000 - 304 - 372 ns = 9324 ns
-   * t_PRESC*(SCLL + 1) + t_PRESC*(SCLH + 1) >= 9324 ns
-   * 125*(SCLL + 1) + 125*30 >= 9324 ns
-   * SCLL >= 43.592 = 0x2C
-   *
-   * I2C_TIMINGR[31:0] = 0x00101D2C
-   */
-
-  /* Fast mode, max 400 kHz
-   * t_LOW > 1.3 us, t_HIGH > 0.6 us
-   * t_I2CCLK < [t_LOW - t_AF(min) - t_DNF] / 4 = (1300 - 50) / 4 = 312.5 ns
-   * t_I2CCLK < t_HIGH = 600 ns
-   * Set PRESC = 0, so t_I2CCLK = 1 / 8 MHz = 125 ns
-   * t_PRESC = t_I2CCLK / (PRESC + 1) = 125 / (0 + 1) = 125 ns
-   * SDADEL >= [t_f + t_HD;DAT(min) - t_AF(min) - t_DNF - 3*t_I2CCLK] / t_PRESC
-   * SDADEL >= [4 - 50 - 375] / 125 = -3.368 < 0, so SDASEL >= 0
-   * SDADEL <= [t_VD;DAT(max) - t_r - t_AF(max) - t_DNF - 4*t_I2CCLK] / t_PRESC
-   * SDADEL <= (900 - 72 - 260 - 500) / 125 = 0.544
-   * SCLDEL >= {[t_r + t_SU;DAT(min)] / t_PRESC} - 1
-   * SCLDEL >= (72 + 100) / 125 - 1 = 0.376
-   * So 0 <= SDADEL <= 0, SCLDEL >= 1
-   * I2C_TIMINGR[31:16] = 0x0010
-   *
-   * t_HIGH(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLH + 1)
-   * 600 <= 50 + 2*125 + 125*(SCLH + 1)
-   * 175 <= 125*SCLH
-   * SCLH >= 1.4 = 0x02
-   *
-   * t_LOW(min) <= t_AF(min) + t_DNF + 2*t_I2CCLK + t_PRESC*(SCLL + 1)
-   * 1300 <= 50 + 2*125 + 125*(SCLL + 1)
-   * 875 <= 125*SCLL
-   * SCLL >= 7 = 0x07
-   *
-   * Need to stay under 400 kHz in "worst" case. Keep SCLH at min,
-   * but here we determine final SCLL.
-   * t_SCL = t_SYNC1 + t_SYNC2 + t_LOW + t_HIGH >= 2500 ns (400 kHz max)
-   * t_LOW + t_HIGH >= 2500 - 304 - 372 ns = 1824 ns
-   * t_PRESC*(SCLL + 1) + t_PRESC*(SCLH + 1) >= 1824 ns
-   * 125*(SCLL + 1) + 125*3 >= 1824 ns
-   * SCLL >= 10.592 = 0x0B
-   *
-   * I2C_TIMINGR[31:0] = 0x0010020B
-   */
-
-  I2C_InitStructure2.I2C_Timing = 0x0010020B;
-  I2C_Init(I2C2, &I2C_InitStructure2);
-  I2C_Cmd(I2C2, ENABLE);
-}
-
-typedef struct {
-  uint8_t hv1;
-  uint8_t amp_temp1;
-  uint8_t hv1_temp;
-  uint8_t amp_temp2;
-} AdcVals;
-
-AdcVals readAdc() {
-  /****************************************************************************
-   *  Configure ADC to scan all 4 channels
-   ****************************************************************************/
-
-  // Wait if I2C2 is busy
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_BUSY)) {}
+const I2CReg dpot_dev_ = {DEV_DPOT, 0xFF};
 
-  // Setup to send send start, addr, subaddr
-  I2C_TransferHandling(I2C2, adc_dev_.dev, 1, I2C_SoftEnd_Mode,
-                       I2C_Generate_Start_Write);
+// Give up configuring the Power Board at startup after this long, so a fault
+// doesn't hold up the rest of the chain (which is released after init).
+#define INIT_RETRY_MS 20
 
-  // Wait for transmit interrupted flag
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_TXIS) == RESET) {}
+#define ADC_CHANNELS sizeof(AdcVals)
 
-  // Configuration byte = { config=0b0, scan=0b11, cs=0b00XX, sgl=0b1 }
-  // Scan all 4 channels in single-ended mode
-  I2C_SendData(I2C2, 0x01 | (3 << 1));
-
-  // Wait for transfer complete flag
-  while (I2C_GetFlagStatus(I2C2, I2C_ISR_TC) == RESET) {}
-
-  /****************************************************************************
-   *  Read all 4 channels
-   ****************************************************************************/
-  AdcVals vals = {};
-  // Restart and setup a read transfer
-  I2C_TransferHandling(I2C2, adc_dev_.dev, 4, I2C_AutoEnd_Mode,
-                       I2C_Generate_Start_Read);
-
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET) {}
-  vals.hv1 = I2C_ReceiveData(I2C2);
+/* Each ADC channel is low-pass filtered as a UQ8.8 reading, with a time
+ * constant of 2^ADC_FILTER_SHIFT ms. Each reading is weighted by the time
+ * since the previous one, so the filter responds the same whether the ADC is
+ * scanned every 8 ms or every 32 ms while idle. All values are converted
+ * from the filtered readings with their fractional bits, so the results have
+ * more resolution than a single reading.
+ */
+#define ADC_FILTER_SHIFT 6
+#define ADC_FILTER_MS    (1 << ADC_FILTER_SHIFT)
+
+static uint16_t adc_filt_[ADC_CHANNELS];
+static bool     adc_filt_init_ = false;
+static uint32_t adc_read_ms_   = 0;  // Time of the last good scan
+static uint32_t fans_ms_       = 0;  // Time of the last fan update
+
+/* Transfers on the internal bus, all queued and completed in the background.
+ * The ADC scan writes a configuration byte then reads all 4 channels:
+ * Configuration byte = { config=0b0, scan=0b11, cs=0b00XX, sgl=0b1 }
+ * Scan all 4 channels in single-ended mode
+ */
+static uint8_t adc_cfg_     = 0x01 | (3 << 1);
+static AdcVals adc_vals_    = {0};
+static uint8_t dpot_val_    = 0;
+static uint8_t pwr_io_in_   = 0;
+static uint8_t pwr_io_out_[2];  // Register, value
+static uint8_t led_out_[2];     // Register, value
+
+static I2C2Xfer adc_xfer_;
+static I2C2Xfer dpot_xfer_;
+static I2C2Xfer pwr_in_xfer_;
+static I2C2Xfer pwr_out_xfer_;
+static I2C2Xfer led_xfer_;
+
+// Registers written through their shadows, so unchanged values aren't resent
+static I2C2Shadow* dpot_shadow_;
+static I2C2Shadow* pwr_out_shadow_;
+static I2C2Shadow* led_shadow_;
+
+/* The Power Board revision decides how the fans and its GPIO are handled, so
+ * is only changed by checkPwrBoard(). Each check takes the revision that the
+ * ADC scans and DPOT writes since the last one point to, and only switches to
+ * it once two checks in a row agree, so a glitch never changes fan control.
+ * Each check also sends one DPOT write, so a board without one NACKs a single
+ * write per check instead of fan control retrying it on every scan.
+ */
+#define PWR_BOARD_CHECK_MS 10000
 
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET) {}
-  vals.amp_temp1 = I2C_ReceiveData(I2C2);
+typedef struct {
+  bool thermistors;  // NTC inputs for fan control by the STM32
+  bool linear;       // MCP4017 DPOT setting the fan supply voltage
+  bool fan_status;   // FAN_FAIL_N and OVR_TMP_N driven by a MAX6644
+} PwrBoardProfile;
+
+static const PwrBoardProfile pwr_boards_[] = {
+    [PWR_BOARD_UNKNOWN] = {.thermistors = false, .fan_status = true},
+    [PWR_BOARD_2A]      = {.thermistors = false, .fan_status = true},
+    [PWR_BOARD_3A]      = {.thermistors = true},
+    [PWR_BOARD_4A]      = {.thermistors = true, .linear = true},
+};
+
+static PwrBoardRev pwr_board_    = PWR_BOARD_UNKNOWN;
+static PwrBoardRev pwr_pending_  = PWR_BOARD_UNKNOWN;  // Last check's finding
+static uint32_t    pwr_check_ms_ = 0;
+static bool        thermistors_  = false;  // Seen by a scan since the check
+static bool        dpot_acked_   = false;  // The last DPOT write was ACKed
+
+// FAN_ON PWM, only written at each edge. The achieved duty is measured from
+// the times the FAN_ON writes complete.
+static uint32_t fan_next_edge_ = 0;
+static bool     fan_on_        = false;
+static bool     fan_written_   = false;  // FAN_ON state last written
+static uint8_t  fan_edges_     = 0;      // Edges measured, up to 2
+static uint32_t fan_rise_      = 0;      // Time of the last rising edge
+static uint32_t fan_fall_      = 0;      // Time of the last falling edge
+static uint8_t  fan_duty_f7_   = 0;      // Achieved duty in UQ1.7
+
+// A shadowed register write completed, ctx is the register's shadow
+static void writeDone(I2C2Xfer* xfer) {
+  if (xfer->status == 0) {
+    shadowSet(xfer->ctx, xfer->tx[xfer->tx_len - 1]);
+  } else {
+    shadowInvalidate(xfer->ctx);
+  }
+}
 
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET) {}
-  vals.hv1_temp = I2C_ReceiveData(I2C2);
+// Queue a write of a register if its value changed. val_buf is the last byte
+// of the transfer's tx buffer, which is only modified while it is idle.
+static void writeIfChanged(I2C2Xfer* xfer, uint8_t* val_buf, uint8_t val) {
+  if (xfer->state == XFER_IDLE && shadowDiffers(xfer->ctx, val)) {
+    *val_buf = val;
+    i2c2Submit(xfer);
+  }
+}
 
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET) {}
-  vals.amp_temp2 = I2C_ReceiveData(I2C2);
+// The ms since *last, updated to now. Capped at the filter's time constant,
+// which a reading that late replaces outright.
+static uint8_t msSince(uint32_t* last, uint32_t now) {
+  uint32_t ms = now - *last;
+  *last       = now;
+  return ms > ADC_FILTER_MS ? ADC_FILTER_MS : (uint8_t)ms;
+}
 
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET) {}
-  I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
+// Filter a new ADC reading taken dt_ms after the previous one, the first
+// reading initializes the filter
+static void filterAdc(const AdcVals* adc, uint8_t dt_ms) {
+  for (size_t i = 0; i < ADC_CHANNELS; i++) {
+    int32_t in   = (int32_t)adc->ch[i] << 8;
+    int32_t step = (in - (int32_t)adc_filt_[i]) * dt_ms;
+    if (adc_filt_init_ && (step >= 1 << ADC_FILTER_SHIFT ||
+                           step <= -(1 << ADC_FILTER_SHIFT))) {
+      adc_filt_[i] += step >> ADC_FILTER_SHIFT;
+    } else {
+      // Settle exactly on the reading once within a step of it, so the
+      // extremes (disconnected and shorted thermistors) are still reached
+      adc_filt_[i] = in;
+    }
+  }
+  adc_filt_init_ = true;
+}
 
-  return vals;
+// Convert degC in Q7.8 to UQ7.1 + 20 degC, rounded
+static uint8_t q7_8ToUQ7_1(int16_t temp) {
+  int32_t t = ((int32_t)temp + (20 << 8) + (1 << 6)) >> 7;
+  return t < 0 ? 0 : t > UINT8_MAX ? UINT8_MAX : t;
 }
 
-// Returns true if thermistors are present, false otherwise
-bool updateAdc(AmpliPiState* state) {
+/* Filter a new ADC reading, taken dt_ms after the previous one, and update
+ * all voltages and temperatures.
+ * Returns true if thermistors are present, false otherwise.
+ */
+bool updateAdc(AmpliPiState* state, const AdcVals* adc, uint8_t dt_ms) {
 #define ADC_REF_VOLTS 3.3
 #define ADC_PD_KOHMS  4700
 #define ADC_PU_KOHMS  100000
-  // TODO: low-pass filter after intial reading
-  AdcVals adc = readAdc();
-
-  // Convert HV1 to Volts (multiply by 4 to add 2 fractional bits)
-  uint32_t num       = 4 * ADC_REF_VOLTS * (ADC_PU_KOHMS + ADC_PD_KOHMS);
-  uint32_t den       = UINT8_MAX * ADC_PD_KOHMS;
-  uint32_t hv1_raw_v = num * adc.hv1 / den;
-  state->hv1         = (uint8_t)(hv1_raw_v > UINT8_MAX ? UINT8_MAX : hv1_raw_v);
-
-  // Convert HV1 thermocouple to degC
-  state->hv1_temp = THERM_LUT_[adc.hv1_temp];
-
-  // Convert amplifier thermocouples to degC
-  state->amp_temp1 = THERM_LUT_[adc.amp_temp1];
-  state->amp_temp2 = THERM_LUT_[adc.amp_temp2];
+// HV1 Volts per ADC count, in UQ16.16
+#define ADC_HV1_SCALE                                                  \
+  ((uint32_t)(65536 * ADC_REF_VOLTS * (ADC_PU_KOHMS + ADC_PD_KOHMS) /  \
+                  (UINT8_MAX * ADC_PD_KOHMS) +                         \
+              0.5))
+  filterAdc(adc, dt_ms);
+
+  // Convert HV1 to Volts in UQ8.8, then round to UQ6.2
+  state->hv1_f8  = (adc_filt_[0] * ADC_HV1_SCALE) >> 16;
+  uint32_t hv1_v = (state->hv1_f8 + (1 << 5)) >> 6;
+  state->hv1     = (uint8_t)(hv1_v > UINT8_MAX ? UINT8_MAX : hv1_v);
+
+  // Convert thermistor readings to degC, interpolating the table
+  state->amp_temp1_f8 = thermToQ7_8(adc_filt_[1]);
+  state->hv1_temp_f8  = thermToQ7_8(adc_filt_[2]);
+  state->amp_temp2_f8 = thermToQ7_8(adc_filt_[3]);
+  state->amp_temp1    = q7_8ToUQ7_1(state->amp_temp1_f8);
+  state->hv1_temp     = q7_8ToUQ7_1(state->hv1_temp_f8);
+  state->amp_temp2    = q7_8ToUQ7_1(state->amp_temp2_f8);
 
   // Power Board 2.A doesn't have thermistors. Instead, it has HV2/NTC2 inputs.
   // Neither of those were used and are pulled low. So if either input measures
   // more than 0 assume thermistors are present, otherwise not.
-  return adc.amp_temp1 || adc.amp_temp2;
+  return adc->amp_temp1 || adc->amp_temp2;
 }
 
-uint32_t writeDpot(uint8_t val) {
-  // TODO: add more I2C read/write functions in ports.c and use here and ADC
+PwrBoardRev pwrBoardRev() {
+  return pwr_board_;
+}
 
-  // Wait if I2C2 is busy
-  while (I2C2->ISR & I2C_ISR_BUSY) {}
+// The revision found since the last check
+static PwrBoardRev findPwrBoard() {
+  if (!thermistors_) {
+    return PWR_BOARD_2A;
+  }
+  return dpot_acked_ ? PWR_BOARD_4A : PWR_BOARD_3A;
+}
 
-  // Setup to send send start, addr, subaddr
-  I2C_TransferHandling(I2C2, dpot_dev_.dev, 1, I2C_AutoEnd_Mode,
-                       I2C_Generate_Start_Write);
+// Check the revision after a successful ADC scan, right away at startup then
+// every PWR_BOARD_CHECK_MS
+static void checkPwrBoard() {
+  uint32_t now = millis();
+  if (pwr_board_ == PWR_BOARD_UNKNOWN) {
+    // The DPOT was probed by initInternalI2C()
+    pwr_board_    = findPwrBoard();
+    pwr_pending_  = pwr_board_;
+    pwr_check_ms_ = now;
+    thermistors_  = false;
+    return;
+  }
+  if (now - pwr_check_ms_ < PWR_BOARD_CHECK_MS) {
+    return;
+  }
+  PwrBoardRev rev = findPwrBoard();
+  if (rev == pwr_pending_) {
+    pwr_board_ = rev;
+  }
+  pwr_pending_  = rev;
+  pwr_check_ms_ = now;
+  thermistors_  = false;
+
+  // Resend the DPOT value to find whether it's there for the next check
+  if (dpot_xfer_.state == XFER_IDLE) {
+    shadowInvalidate(dpot_shadow_);
+    i2c2Submit(&dpot_xfer_);
+  }
+}
 
-  // Wait for transmit interrupted flag or an error
-  uint32_t isr = I2C2->ISR;
-  do {
-    if (isr & I2C_ISR_NACKF) {
-      I2C2->ICR = I2C_ICR_NACKCF;
-      return I2C_ISR_NACKF;
-    }
-    if (isr & I2C_ISR_BERR) {
-      I2C2->ICR = I2C_ICR_BERRCF;
-      return I2C_ISR_BERR;
-    }
-    if (isr & I2C_ISR_ARLO) {
-      I2C2->ICR = I2C_ICR_ARLOCF;
-      return I2C_ISR_ARLO;
+// An ADC scan completed, update the fans from the new temperatures
+static void adcDone(I2C2Xfer* xfer) {
+  AmpliPiState* state = xfer->ctx;
+  uint32_t      now   = millis();
+  if (xfer->status == 0) {
+    uint8_t  dt_ms = msSince(&adc_read_ms_, now);
+    uint32_t start = profStart();
+    thermistors_ |= updateAdc(state, &adc_vals_, dt_ms);
+    profEnd(PROF_ADC, start);
+    checkPwrBoard();
+  }
+  const PwrBoardProfile* board = &pwr_boards_[pwr_board_];
+
+  // The Pi's temperature is sent in UQ7.1 + 20, convert to Q7.8
+  int16_t rpi_temp_q7_8 = ((int16_t)state->pi_temp - (20 << 1)) << 7;
+
+  // The two amp heatsinks can be combined by simply taking the max
+  int16_t amp_temp_q7_8 = state->amp_temp1_f8 > state->amp_temp2_f8
+                              ? state->amp_temp1_f8
+                              : state->amp_temp2_f8;
+
+  // Estimate the amps' load from what's playing
+  uint8_t amp_load = 0;
+  if (!inStandby()) {
+    for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+      if (isOn(zone)) {
+        amp_load += fanZoneLoad(getZoneVolume(zone));
+      }
     }
-    isr = I2C2->ISR;
-  } while (!(isr & I2C_ISR_TXIS));
+  }
 
-  // Send subaddress and data
-  I2C_SendData(I2C2, val);
+  // No I2C reads/writes, just fan calculations
+  uint8_t  dt_ms = msSince(&fans_ms_, now);
+  uint32_t start = profStart();
+  state->fans    = updateFans(amp_temp_q7_8, state->hv1_temp_f8, rpi_temp_q7_8,
+                              amp_load, state->fan_override, board->thermistors,
+                              board->linear, state->fan_pi, dt_ms);
+  if (board->linear) {
+    writeIfChanged(&dpot_xfer_, &dpot_val_, state->fans->dpot_val);
+  }
+  profEnd(PROF_FANS, start);
+
+  // A failed read still means the bus and fan control are running
+  watchdogCheckIn(WDG_ADC);
+}
+
+static void dpotDone(I2C2Xfer* xfer) {
+  dpot_acked_ = xfer->status == 0;
+  writeDone(xfer);
+}
+
+// A Power Board GPIO write completed, measure the achieved FAN_ON duty
+static void pwrOutDone(I2C2Xfer* xfer) {
+  writeDone(xfer);
+  PwrGpio gpio = {.data = xfer->tx[1]};
+  if (xfer->status != 0 || gpio.fan_on == fan_written_) {
+    return;
+  }
+  fan_written_ = gpio.fan_on;
+  uint32_t now = millis();
+  if (gpio.fan_on) {
+    // A full period ends at each rising edge
+    if (fan_edges_ >= 2) {
+      fan_duty_f7_ = ((fan_fall_ - fan_rise_) << 7) / (now - fan_rise_);
+    }
+    fan_rise_ = now;
+  } else {
+    fan_fall_ = now;
+  }
+  fan_edges_ += fan_edges_ < 2 ? 1 : 0;
+}
 
-  // Wait for stop flag to be sent and then clear it
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET) {}
-  I2C2->ICR = I2C_ICR_STOPCF;
-  return 0;
+static void pwrInDone(I2C2Xfer* xfer) {
+  AmpliPiState* state = xfer->ctx;
+  if (xfer->status == 0) {
+    // Take the outputs from the output latch's shadow if known, since it may
+    // have been written after this read.
+    uint8_t olat = 0;
+    if (shadowGet(pwr_out_shadow_, &olat)) {
+      pwr_io_in_ &= ~PWR_GPIO_OUT_MASK;
+      pwr_io_in_ |= olat & PWR_GPIO_OUT_MASK;
+    }
+    state->pwr_gpio.data = pwr_io_in_;
+  }
+  if (!pwr_boards_[pwr_board_].fan_status) {
+    // No fan control IC to determine this
+    state->pwr_gpio.fan_fail_n = !false;
+    state->pwr_gpio.ovr_tmp_n  = !false;
+  }
 }
 
 LedGpio updateLeds(bool addr_set) {
@@ -348,134 +371,125 @@ LedGpio updateLeds(bool addr_set) {
 void initInternalI2C(AmpliPiState* state) {
   // Initialize the STM32's I2C2 bus as a master
   initI2C2();
+  dpot_shadow_    = i2c2Shadow(dpot_dev_);
+  pwr_out_shadow_ = i2c2Shadow(pwr_io_olat_);
+  led_shadow_     = i2c2Shadow(led_olat_);
+
+  adc_xfer_ = (I2C2Xfer){
+      .dev    = adc_dev_.dev,
+      .prio   = I2C2_PRIO_ADC,
+      .tx_len = 1,
+      .rx_len = sizeof(adc_vals_),
+      .tx     = &adc_cfg_,
+      .rx     = (uint8_t*)&adc_vals_,
+      .done   = adcDone,
+      .ctx    = state,
+  };
+  dpot_xfer_ = (I2C2Xfer){
+      .dev    = dpot_dev_.dev,
+      .prio   = I2C2_PRIO_ADC,
+      .tx_len = 1,
+      .tx     = &dpot_val_,
+      .done   = dpotDone,
+      .ctx    = dpot_shadow_,
+  };
+  pwr_in_xfer_ = (I2C2Xfer){
+      .dev    = pwr_io_gpio_.dev,
+      .prio   = I2C2_PRIO_GPIO,
+      .tx_len = 1,
+      .rx_len = 1,
+      .tx     = &pwr_io_gpio_.reg,
+      .rx     = &pwr_io_in_,
+      .done   = pwrInDone,
+      .ctx    = state,
+  };
+  // Writing the MCP23008's output latch is the same as writing its GPIO
+  pwr_io_out_[0] = pwr_io_olat_.reg;
+  pwr_out_xfer_  = (I2C2Xfer){
+      .dev    = pwr_io_olat_.dev,
+      .prio   = I2C2_PRIO_GPIO,
+      .tx_len = 2,
+      .tx     = pwr_io_out_,
+      .done   = pwrOutDone,
+      .ctx    = pwr_out_shadow_,
+  };
+  led_out_[0] = led_olat_.reg;
+  led_xfer_   = (I2C2Xfer){
+      .dev    = led_olat_.dev,
+      .prio   = I2C2_PRIO_LED,
+      .tx_len = 2,
+      .tx     = led_out_,
+      .done   = writeDone,
+      .ctx    = led_shadow_,
+  };
 
-  // Set the direction for the power board GPIO
-  // Retry if failed, the bus may be in a bad state if the micro was
-  // reset in the middle of a transaction.
-  uint32_t tries = 255;
-  while (tries--) {
-    uint32_t status = writeI2C2(pwr_io_dir_, 0x7C);  // 0=output, 1=input
-    if (status == I2C_ISR_NACKF) {
-      // Received a NACK, will try again
-    } else if (status == I2C_ISR_ARLO) {
-      // Arbitation lost (SDA low when master tried to set high).
-      // Reset I2C since the peripheral auto-sets itself into slave mode.
-      // Then, send 9 clocks to finish whichever slave transaction was ongoing.
-
-      // Disable I2C peripheral to reset it if previously enabled
-      I2C_Cmd(I2C2, DISABLE);
-
-      // Config I2C GPIO pins
-      GPIO_InitTypeDef GPIO_InitStructureI2C;
-      GPIO_InitStructureI2C.GPIO_Pin   = pSCL_VOL | pSDA_VOL;
-      GPIO_InitStructureI2C.GPIO_Mode  = GPIO_Mode_OUT;
-      GPIO_InitStructureI2C.GPIO_Speed = GPIO_Speed_2MHz;
-      GPIO_InitStructureI2C.GPIO_OType = GPIO_OType_OD;
-      GPIO_InitStructureI2C.GPIO_PuPd  = GPIO_PuPd_NOPULL;
-      GPIO_Init(GPIOB, &GPIO_InitStructureI2C);
-
-      // Generate 9 clocks to clear bus
-      writePin(i2c2_scl_, true);
-      writePin(i2c2_sda_, false);  // Keep SDA low even after slave releases it
-      for (size_t i = 0; i < 9; i++) {
-        delayMs(1);
-        writePin(i2c2_scl_, false);
-        delayMs(1);
-        writePin(i2c2_scl_, true);
-      }
-
-      // Stop condition
-      delayMs(1);
-      writePin(i2c2_sda_, true);
-
-      // Re-init I2C2 now that the bus is un-stuck
-      initI2C2();
-
-      /* TODO: Figure out why the below method doesn't work.
-      I2C_TransferHandling(I2C2, 0x00, 0, I2C_AutoEnd_Mode,
-                           I2C_Generate_Start_Write);
-
-      // Wait until the transaction is done then reset I2C again
-      delayMs(1);
-      initI2C2();
-      uint32_t isr = I2C2->ISR;
-      do {
-        if (isr & I2C_ISR_NACKF) {
-          I2C2->ICR = I2C_ICR_NACKCF;
-          break;
-        }
-        if (isr & I2C_ISR_ARLO) {
-          I2C2->ICR = I2C_ICR_ARLOCF;
-          break;
-        }
-        if (isr & I2C_FLAG_STOPF) {
-          I2C2->ICR = I2C_ICR_STOPCF;
-          break;
-        }
-        isr = I2C2->ISR;
-      } while (1);
-      */
-    } else {
-      tries = 0;
-    }
+  // The bus may be held by a device if the micro was reset in the middle of a
+  // transaction, free it before the first transfer.
+  if (!readPinLevel(i2c2_sda_)) {
+    i2c2Recover();
   }
 
+  // Set the direction for the power board GPIO, retrying for a while if it
+  // fails. Bus errors are recovered from by i2c2Update(). 0=output, 1=input
+  uint32_t start = millis();
+  while (writeI2C2(pwr_io_dir_, 0x7C) != 0 &&
+         millis() - start < INIT_RETRY_MS) {}
+
   // Set the LED Board's GPIO expander as all outputs
   writeI2C2(led_dir_, 0x00);  // 0=output, 1=input
-  writeI2C2(led_gpio_, state->leds.data);
+  if (writeI2C2(led_olat_, state->leds.data) == 0) {
+    shadowSet(led_shadow_, state->leds.data);
+  }
 
-  updateInternalI2C(state);
+  // Write the DPOT at its maximum fan voltage, which also finds if it's there,
+  // then get initial readings (so the Power Board revision and fan state)
+  // before the main loop starts
+  i2c2Transfer(&dpot_xfer_);
+  i2c2Transfer(&adc_xfer_);
+  i2c2Transfer(&pwr_in_xfer_);
+  writeLeds(state);
+  writePwrGpio(state);
 }
 
-void updateInternalI2C(AmpliPiState* state) {
-  uint32_t mod8 = millis() & ((1 << 3) - 1);
-  if (mod8 == 0) {
-    // Read ADC and update fans every 8 ms
-    // Reading the Power Board's ADC takes ~248 us
-    bool thermistors = updateAdc(state);
-
-    // In UQ7.1 + 20, convert to Q7.8
-    // TODO: do this conversion in ADC filter when added
-    int16_t amp_temp1_q7_8 = ((int16_t)state->amp_temp1 - (20 << 1)) << 7;
-    int16_t amp_temp2_q7_8 = ((int16_t)state->amp_temp1 - (20 << 1)) << 7;
-    int16_t hv1_temp_q7_8  = ((int16_t)state->hv1_temp - (20 << 1)) << 7;
-    int16_t rpi_temp_q7_8  = ((int16_t)state->pi_temp - (20 << 1)) << 7;
-
-    // The two amp heatsinks can be combined by simply taking the max
-    int16_t amp_temp_q7_8 =
-        amp_temp1_q7_8 > amp_temp2_q7_8 ? amp_temp1_q7_8 : amp_temp2_q7_8;
-
-    // No I2C reads/writes, just fan calculations
-    static bool dpot_present = false;
-    state->fans  = updateFans(amp_temp_q7_8, hv1_temp_q7_8, rpi_temp_q7_8,
-                             state->fan_override, thermistors, dpot_present);
-    dpot_present = writeDpot(state->fans->dpot_val) == 0;
-  } else {
-    state->pwr_gpio.data = readI2C2(pwr_io_gpio_);
-    if (state->fans->ctrl != FAN_CTRL_MAX6644) {
-      // No fan control IC to determine this
-      state->pwr_gpio.fan_fail_n = !false;
-      state->pwr_gpio.ovr_tmp_n  = !false;
-    }
+/* All transfers are queued by the functions below then complete in the
+ * background, so the values they read are used on a later call.
+ */
 
-    // Update the LED Board's LED state
-    if (!state->led_override) {
-      state->leds = updateLeds(state->i2c_addr != 0);
-    }
-    // TODO: only write on change
-    writeI2C2(led_gpio_, state->leds.data);
+void readAdc() {
+  i2c2Submit(&adc_xfer_);
+}
+
+void readPwrGpio() {
+  i2c2Submit(&pwr_in_xfer_);
+}
+
+void writeLeds(AmpliPiState* state) {
+  if (!state->led_override) {
+    state->leds = updateLeds(state->i2c_addr != 0);
   }
+  writeIfChanged(&led_xfer_, &led_out_[1], state->leds.data);
+}
+
+uint32_t writePwrGpio(AmpliPiState* state) {
+  // FAN_ON only changes at PWM edges. Without any edges for 2 periods the
+  // fans are fully on or off.
+  uint32_t now = millis();
+  if (timeReached(now, fan_next_edge_)) {
+    fan_on_ = updateFanPwm(now, state->fans->duty_f7, &fan_next_edge_);
+  }
+  uint32_t last_edge = fan_written_ ? fan_rise_ : fan_fall_;
+  if (now - last_edge > 2 * FAN_PERIOD_MS) {
+    fan_duty_f7_ = fan_written_ ? 1 << 7 : 0;
+    fan_edges_   = 0;
+  }
+  state->fan_pwm_duty_f7 = fan_duty_f7_;
 
   // Update the Power Board's GPIO state, only writing when necessary
   PwrGpio gpio_request = {
       .en_9v  = true,  // Always enable 9V
       .en_12v = true,  // Always enable 12V
-      .fan_on = getFanOnFromDuty(state->fans->duty_f7),
+      .fan_on = fan_on_,
   };
-  if (gpio_request.data != (PWR_GPIO_OUT_MASK & state->pwr_gpio.data)) {
-    writeI2C2(pwr_io_gpio_, gpio_request.data);
-  }
-
-  // TODO: Can the volume controllers be read?
-  // TODO: Write volumes
+  writeIfChanged(&pwr_out_xfer_, &pwr_io_out_[1], gpio_request.data);
+  return fan_next_edge_;
 }
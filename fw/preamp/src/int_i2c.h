@@ -21,11 +21,54 @@
 #ifndef INT_I2C_H_
 #define INT_I2C_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "ctrl_i2c.h"
 
+// One scan of the Power Board ADC's channels
+typedef union {
+  struct {
+    uint8_t hv1;
+    uint8_t amp_temp1;
+    uint8_t hv1_temp;
+    uint8_t amp_temp2;
+  };
+  uint8_t ch[4];
+} AdcVals;
+
+// Power Board revisions, see fans.h. Detected from the first ADC scan at
+// startup, then checked again every PWR_BOARD_CHECK_MS.
+typedef enum
+{
+  PWR_BOARD_UNKNOWN,  // No ADC scan has succeeded yet, handled as 2.A
+  PWR_BOARD_2A,       // MAX6644 fan controller, no thermistors
+  PWR_BOARD_3A,       // Thermistors and FAN_ON PWM
+  PWR_BOARD_4A,       // Thermistors and a DPOT setting the fan voltage
+} PwrBoardRev;
+
 void initInternalI2C(AmpliPiState* state);
-void updateInternalI2C(AmpliPiState* state);
+
+// The Power Board revision currently in use
+PwrBoardRev pwrBoardRev();
+
+// Queue a Power Board ADC scan, the fans are updated once it completes.
+// Reading the Power Board's ADC takes ~248 us.
+void readAdc();
+
+// Filter a new ADC reading, taken dt_ms after the previous one, and update
+// all voltages and temperatures.
+// Returns true if thermistors are present, false otherwise.
+bool updateAdc(AmpliPiState* state, const AdcVals* adc, uint8_t dt_ms);
+
+// Queue a read of the Power Board's GPIO
+void readPwrGpio();
+
+// Update the LED Board's LEDs, only writing them when they change
+void writeLeds(AmpliPiState* state);
+
+// Update the Power Board's GPIO outputs, including FAN_ON. Returns the time of
+// the next FAN_ON PWM edge, when this needs to be called again.
+uint32_t writePwrGpio(AmpliPiState* state);
 
 #endif /* INT_I2C_H_ */
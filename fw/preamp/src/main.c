@@ -21,12 +21,21 @@
 #include <string.h>
 
 #include "audio_mux.h"
+#include "bench.h"
+#include "boot.h"
 #include "ctrl_i2c.h"
+#include "i2c2.h"
+#include "idle.h"
 #include "int_i2c.h"
+#include "persist.h"
 #include "port_defs.h"
+#include "profile.h"
+#include "sched.h"
 #include "serial.h"
 #include "stm32f0xx.h"
 #include "systick.h"
+#include "update.h"
+#include "watchdog.h"
 
 // State of the AmpliPi hardware
 AmpliPiState state_;
@@ -97,9 +106,122 @@ void initGpio() {
   GPIO_Init(GPIOF, &GPIO_InitStructureF);
 }
 
-int main(void) {
-  // TODO: Setup watchdog
+/* Tasks run by the scheduler, see sched.h. Each task's execution time is
+ * profiled, see profile.h.
+ */
+
+// Control messages are received by the I2C1 interrupt handler, apply any
+// register writes received. Also times out stalled transactions.
+static void ctrlTask() {
+  uint32_t start = profStart();
+  ctrlI2CUpdate(&state_);
+  idleUpdate();
+  watchdogCheckIn(WDG_CTRL);
+  profEnd(PROF_CTRL_I2C, start);
+}
+
+// Internal I2C transfers run in the background, handle any that completed
+static void i2c2Task() {
+  uint32_t start = profStart();
+  i2c2Update();
+  watchdogCheckIn(WDG_I2C2);
+  profEnd(PROF_I2C2, start);
+}
+
+static void fanOnTask();
+
+static void rampTask() {
+  updateRamps();
+}
+
+// Check for incoming UART messages (setting the slave address), and send
+// telemetry up the chain
+static void uartTask() {
+  uint32_t start    = profStart();
+  uint8_t  new_addr = checkForNewAddress();
+  if (new_addr) {
+    state_.i2c_addr = new_addr;
+    ctrlI2CInit(&state_);
+  }
+  uartSendTelemetry();
+  watchdogCheckIn(WDG_UART);
+  profEnd(PROF_NEW_ADDRESS, start);
+}
+
+static void adcTask() {
+  uint32_t start = profStart();
+  readAdc();
+  profEnd(PROF_INT_I2C, start);
+}
+
+static void pwrInTask() {
+  uint32_t start = profStart();
+  readPwrGpio();
+  profEnd(PROF_INT_I2C, start);
+}
+
+static void ledTask() {
+  uint32_t start = profStart();
+  writeLeds(&state_);
+  profEnd(PROF_INT_I2C, start);
+}
+
+// Kick the watchdog once the critical tasks have all checked in, see
+// watchdog.h. The ADC checks in from its transfer's callback.
+static void regsTask() {
+  idleUpdate();
+  watchdogKick();
+  state_.loop_overruns = schedOverruns();
+  state_.loops         = schedLoops();
+  ctrlI2CUpdateRegs(&state_);
+}
+
+typedef enum
+{
+  TASK_CTRL,
+  TASK_I2C2,
+  TASK_FAN_ON,
+  TASK_RAMP,
+  TASK_UART,
+  TASK_ADC,
+  TASK_PWR_IN,
+  TASK_LEDS,
+  TASK_UPDATE,
+  TASK_REGS,
+  TASK_PERSIST,
+  NUM_TASKS,
+} TaskId;
+
+// In priority order. The initial next times offset the tasks with longer
+// periods from each other.
+static Task tasks_[NUM_TASKS] = {
+    [TASK_CTRL]    = {.run = ctrlTask, .ready = ctrlI2CPending, .period = 1},
+    [TASK_I2C2]    = {.run = i2c2Task, .ready = i2c2Pending, .period = 1},
+    [TASK_FAN_ON]  = {.run = fanOnTask, .waiting = true},
+    [TASK_RAMP]    = {.run = rampTask, .period = 1},
+    [TASK_UART]    = {.run = uartTask, .period = 1, .deadline = 5},
+    [TASK_ADC]     = {.run = adcTask, .period = ADC_MS, .deadline = 2},
+    [TASK_PWR_IN]  = {.run      = pwrInTask,
+                      .period   = PWR_IN_MS,
+                      .deadline = 1,
+                      .next     = 1},
+    [TASK_LEDS]    = {.run      = ledTask,
+                      .period   = LEDS_MS,
+                      .deadline = 4,
+                      .next     = 2},
+    [TASK_UPDATE]  = {.run = updateRun, .ready = updatePending, .period = 1},
+    [TASK_REGS]    = {.run = regsTask, .period = 1},
+    [TASK_PERSIST] = {.run = persistRun, .period = 100, .deadline = 100},
+};
 
+// Update the Power Board's GPIO, then wait for the next FAN_ON edge
+static void fanOnTask() {
+  uint32_t start = profStart();
+  schedAt(&tasks_[TASK_FAN_ON], writePwrGpio(&state_));
+  profEnd(PROF_INT_I2C, start);
+}
+
+int main(void) {
   // RESET AND PIN SETUP
   writePin(exp_nrst_, false);   // Low-pulse on NRST_OUT so expansion boards are
                                 // reset by the controller board
@@ -107,9 +229,12 @@ int main(void) {
                                 // board doesn't start in 'Boot Mode'
 
   // INIT
+  bootInit();
   memset(&state_, 0, sizeof(AmpliPiState));
+  profReset();
   systickInit();  // Initialize the clock ticks for delay_ms and other timing
                   // functionality
+  bootMark(BOOT_CLOCK);
   initGpio();     // UART and I2C require GPIO pins
   // Initialize each channel's volume state
   // (does not write to volume control ICs)
@@ -117,38 +242,30 @@ int main(void) {
   // Initialize each source's analog/digital state
   initSources();
   initUart1();  // The preamp will receive its I2C network address via UART
-  initUart2(9600);
+  initUart2(0);
   initInternalI2C(&state_);  // Setup the internal I2C bus
+  bootMark(BOOT_I2C2);
+
+  // Play the audio configuration saved before the last reset, if enabled
+  AudioConfig saved_cfg;
+  if (persistInit(&saved_cfg)) {
+    setAudioConfig(&saved_cfg);
+  }
+
+#ifdef PREAMP_BENCH
+  // Time the bus and math primitives, see the BENCH_ registers
+  benchRun(&state_);
+#endif
 
   // RELEASE EXPANSION RESET
   // Needs to be high so the subsequent preamp board is not held in 'Reset Mode'
   writePin(exp_nrst_, true);
   state_.expansion.nrst = true;
 
-  // Main loop, awaiting I2C commands
-  uint32_t next_loop_time = millis();
-  while (1) {
-    // TODO: Clear watchdog
-
-    // Use EXP_BOOT0 as a timer - 4.25 us just for pin set/reset
-    // writePin(exp_boot0_, true);
-
-    // Check for incoming UART messages (setting the slave address)
-    uint8_t new_addr = checkForNewAddress();
-    if (new_addr) {
-      state_.i2c_addr = new_addr;
-      ctrlI2CInit(state_.i2c_addr);
-    }
-
-    // Check for incoming control messages if a slave address has been set
-    if (state_.i2c_addr && ctrlI2CAddrMatch()) {
-      ctrlI2CTransact(&state_);
-    }
-
-    updateInternalI2C(&state_);
-
-    // writePin(exp_boot0_, false);
-    next_loop_time += 1;  // Loop currently takes ~800 us
-    while (millis() < next_loop_time) {}
-  }
+  // Run all tasks forever, awaiting I2C commands. The watchdog resets the
+  // preamp if they stop making progress.
+  watchdogInit();
+  idleInit(&tasks_[TASK_ADC], &tasks_[TASK_PWR_IN], &tasks_[TASK_LEDS]);
+  schedInit(tasks_, NUM_TASKS);
+  schedRun();
 }
@@ -0,0 +1,37 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * SMBus packet error checking
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PEC_H_
+#define PEC_H_
+
+#include <stdint.h>
+
+/* An SMBus PEC is the CRC-8 (polynomial x^8 + x^2 + x + 1, initially 0) of
+ * every byte of a transaction, addresses included. A table lookup per byte
+ * is cheap enough for the I2C1 interrupt. The CRC of bytes followed by their
+ * own PEC is 0, which is how a received PEC is checked.
+ */
+extern const uint8_t PEC_LUT_[256];
+
+static inline uint8_t pecUpdate(uint8_t crc, uint8_t data) {
+  return PEC_LUT_[crc ^ data];
+}
+
+#endif /* PEC_H_ */
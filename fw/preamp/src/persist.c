@@ -0,0 +1,213 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Audio configuration saved to flash, to be restored after a reset
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "persist.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "flash.h"
+#include "systick.h"
+#include "update.h"
+
+// Save once the configuration has been unchanged this long, but no more often
+// than every PERSIST_INTERVAL_MS. With the flash's 1k erase cycles a
+// configuration changing constantly wears out the pages in ~5 months.
+#define PERSIST_DELAY_MS    5000
+#define PERSIST_INTERVAL_MS 120000
+
+/* A saved configuration. The commit halfword is programmed last, so a record
+ * interrupted by a reset is never valid. Erased flash reads 0xFF.
+ */
+typedef struct {
+  uint16_t    seq;     // Incremented every save
+  AudioConfig cfg;
+  uint8_t     flags;   // PERSIST_ENABLE
+  uint16_t    commit;  // PERSIST_COMMIT and the sum of all bytes before
+} PersistRecord;
+
+_Static_assert(sizeof(PersistRecord) % 2 == 0, "Programmed in halfwords");
+
+#define PERSIST_COMMIT   0xA500
+#define RECORDS_PER_PAGE (FLASH_PAGE_SIZE / sizeof(PersistRecord))
+
+static const PersistRecord* latest_ = NULL;  // Last valid record, if any
+static uint32_t             next_;           // Address to try saving to next
+
+static uint8_t     status_ = 0;
+static AudioConfig saved_;       // Last configuration saved
+static AudioConfig changed_;     // Configuration waiting to be saved
+static uint32_t    changed_ms_;  // Time it last changed
+static uint32_t    saved_ms_;
+
+static uint16_t commitValue(const PersistRecord* rec) {
+  const uint8_t* b   = (const uint8_t*)rec;
+  uint8_t        sum = 0;
+  for (size_t i = 0; i < offsetof(PersistRecord, commit); i++) {
+    sum += b[i];
+  }
+  return PERSIST_COMMIT | sum;
+}
+
+static bool valid(const PersistRecord* rec) {
+  if (rec->commit != commitValue(rec)) {
+    return false;
+  }
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    if (rec->cfg.zone_src[zone] >= NUM_SRCS) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool erased(uint32_t addr) {
+  for (size_t i = 0; i < sizeof(PersistRecord); i += 2) {
+    if (*(const uint16_t*)(addr + i) != 0xFFFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Address of the record after addr, moving to the start of the next page
+static uint32_t nextSlot(uint32_t addr) {
+  uint32_t page = (addr - FLASH_PERSIST_START) / FLASH_PAGE_SIZE;
+  uint32_t slot = (addr - FLASH_PERSIST_START) % FLASH_PAGE_SIZE /
+                  sizeof(PersistRecord);
+  if (slot + 1 < RECORDS_PER_PAGE) {
+    return addr + sizeof(PersistRecord);
+  }
+  return FLASH_PERSIST_START +
+         (page + 1) % FLASH_PERSIST_PAGES * FLASH_PAGE_SIZE;
+}
+
+static bool save(const AudioConfig* cfg, uint8_t flags) {
+  PersistRecord rec = {
+      .seq   = latest_ ? latest_->seq + 1 : 0,
+      .cfg   = *cfg,
+      .flags = flags,
+  };
+  rec.commit = commitValue(&rec);
+
+  // Find an erased record, skipping any left half written by a reset, and
+  // erase the next page once this one is full. The latest record is always on
+  // the other page so is kept until replaced.
+  flashUnlock();
+  bool ok = true;
+  for (size_t i = 0; ok && !erased(next_); i++) {
+    if ((next_ - FLASH_PERSIST_START) % FLASH_PAGE_SIZE == 0) {
+      ok = flashErasePage(next_);
+    } else {
+      next_ = nextSlot(next_);
+    }
+    ok = ok && i < RECORDS_PER_PAGE;
+  }
+  const uint16_t* data = (const uint16_t*)&rec;
+  for (size_t i = 0; ok && i < sizeof(rec) / 2; i++) {
+    ok = flashProgram(next_ + 2 * i, data[i]);
+  }
+  flashLock();
+
+  // A failed save is retried after the interval
+  if (ok) {
+    latest_ = (const PersistRecord*)next_;
+    saved_  = *cfg;
+    status_ &= ~PERSIST_ERROR;
+  } else {
+    status_ |= PERSIST_ERROR;
+  }
+  next_     = nextSlot(next_);
+  saved_ms_ = millis();
+  return ok;
+}
+
+bool persistInit(AudioConfig* cfg) {
+  // The latest record has the highest sequence number, allowing for wrapping
+  for (size_t page = 0; page < FLASH_PERSIST_PAGES; page++) {
+    const PersistRecord* recs =
+        (const PersistRecord*)(FLASH_PERSIST_START + page * FLASH_PAGE_SIZE);
+    for (size_t i = 0; i < RECORDS_PER_PAGE; i++) {
+      if (valid(&recs[i]) &&
+          (!latest_ || (int16_t)(recs[i].seq - latest_->seq) > 0)) {
+        latest_ = &recs[i];
+      }
+    }
+  }
+  next_ = latest_ ? nextSlot((uint32_t)latest_) : FLASH_PERSIST_START;
+
+  if (!latest_ || !(latest_->flags & PERSIST_ENABLE)) {
+    return false;
+  }
+  status_   = PERSIST_ENABLE | PERSIST_RESTORED;
+  saved_    = latest_->cfg;
+  changed_  = saved_;
+  saved_ms_ = millis();
+  *cfg      = saved_;
+  return true;
+}
+
+void persistEnable(bool enable) {
+  if (enable == (bool)(status_ & PERSIST_ENABLE)) {
+    return;
+  }
+  AudioConfig cfg;
+  getAudioConfig(&cfg);
+  if (enable) {
+    // Save the current configuration once it's settled
+    status_ |= PERSIST_ENABLE | PERSIST_PENDING;
+    memset(&saved_, 0xFF, sizeof(saved_));
+    changed_    = cfg;
+    changed_ms_ = millis();
+    saved_ms_   = millis() - PERSIST_INTERVAL_MS;
+  } else {
+    status_ &= ~(PERSIST_ENABLE | PERSIST_PENDING);
+    if (latest_ && (latest_->flags & PERSIST_ENABLE) && !updateBusy()) {
+      save(&cfg, 0);
+    }
+  }
+}
+
+void persistRun() {
+  // The flash is busy while a firmware update is staged
+  if (!(status_ & PERSIST_ENABLE) || updateBusy()) {
+    return;
+  }
+  AudioConfig cfg;
+  getAudioConfig(&cfg);
+  uint32_t now = millis();
+  if (memcmp(&cfg, &changed_, sizeof(cfg)) != 0) {
+    changed_    = cfg;
+    changed_ms_ = now;
+  }
+  if (memcmp(&cfg, &saved_, sizeof(cfg)) == 0) {
+    status_ &= ~PERSIST_PENDING;
+    return;
+  }
+  status_ |= PERSIST_PENDING;
+  if (now - changed_ms_ >= PERSIST_DELAY_MS &&
+      now - saved_ms_ >= PERSIST_INTERVAL_MS && save(&cfg, PERSIST_ENABLE)) {
+    status_ &= ~PERSIST_PENDING;
+  }
+}
+
+uint8_t persistStatus() {
+  return status_;
+}
@@ -0,0 +1,54 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Audio configuration saved to flash, to be restored after a reset
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PERSIST_H_
+#define PERSIST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "audio_mux.h"
+
+/* While enabled, the audio configuration is saved to flash once it has been
+ * unchanged for a few seconds, at most every couple of minutes, so that after
+ * a reset (e.g. a brownout) the preamp plays again straight away instead of
+ * waiting for the Pi to notice and replay it. Each save is appended to one of
+ * two flash pages in turn, so a page is only erased every ~100 saves.
+ */
+
+// Status bits, read from REG_PERSIST
+#define PERSIST_ENABLE   0x01  // Saving enabled, also the only writable bit
+#define PERSIST_RESTORED 0x02  // The configuration was restored at startup
+#define PERSIST_PENDING  0x04  // Changes not saved yet
+#define PERSIST_ERROR    0x08  // The last save failed
+
+// Find the last saved configuration. Returns true and sets cfg if it should be
+// restored, when saving was enabled at the time.
+bool persistInit(AudioConfig* cfg);
+
+// Disabling saves straight away so the configuration isn't restored next time
+void persistEnable(bool enable);
+
+// Save the configuration once due, call periodically
+void persistRun();
+
+uint8_t persistStatus();
+
+#endif /* PERSIST_H_ */
@@ -26,42 +26,17 @@
 #define NUM_SRCS  4
 #define NUM_ZONES 6
 
+// Controller I2C register addresses, see ctrl_regs.def
 typedef enum
 {
-  // Audio control
-  REG_SRC_AD    = 0x00,
-  REG_ZONE321   = 0x01,
-  REG_ZONE654   = 0x02,
-  REG_MUTE      = 0x03,
-  REG_STANDBY   = 0x04,
-  REG_VOL_ZONE1 = 0x05,
-  REG_VOL_ZONE2 = 0x06,
-  REG_VOL_ZONE3 = 0x07,
-  REG_VOL_ZONE4 = 0x08,
-  REG_VOL_ZONE5 = 0x09,
-  REG_VOL_ZONE6 = 0x0A,
-
-  // Power/Fan control
-  REG_POWER       = 0x0B,
-  REG_FANS        = 0x0C,
-  REG_LED_CTRL    = 0x0D,  // OVERRIDE?
-  REG_LED_VAL     = 0x0E,  // ZONE[6,5,4,3,2,1], RED, GRN
-  REG_EXPANSION   = 0x0F,  // UART_PASSTHROUGH, BOOT0, NRST
-  REG_HV1_VOLTAGE = 0x10,  // Volts in UQ6.2 format (0.25 volt resolution)
-  REG_AMP_TEMP1   = 0x11,  // degC in UQ7.1 + 20 format (0.5 degC resolution)
-  REG_HV1_TEMP    = 0x12,  //   0x00 = disconnected, 0xFF = shorted
-  REG_AMP_TEMP2   = 0x13,  //   0x01 = -19.5C, 0x5E = 27C, 0xFE = 107C
-  REG_PI_TEMP     = 0x14,  // RPi's temp sent to the micro, in UQ7.1 + 20 format
-  REG_FAN_DUTY    = 0x15,  // Fan PWM duty, [0.0,1.0] in UQ1.7 format
-  REG_FAN_VOLTS   = 0x16,  // Fan voltage in UQ3.4 format
-
-  // Version info
-  REG_VERSION_MAJOR = 0xFA,
-  REG_VERSION_MINOR = 0xFB,
-  REG_GIT_HASH_6_5  = 0xFC,
-  REG_GIT_HASH_4_3  = 0xFD,
-  REG_GIT_HASH_2_1  = 0xFE,
-  REG_GIT_HASH_0_D  = 0xFF,
+#define REG(name, addr, read, write, access)      REG_##name = addr,
+#define REG_FILE(name, addr, file, write, access) REG_##name = addr,
+#define REG_BLOCK(name, first, last, read, write, access) \
+  REG_##name##_FIRST = first, REG_##name##_LAST = last,
+#include "ctrl_regs.def"
+#undef REG
+#undef REG_FILE
+#undef REG_BLOCK
 } CmdReg;
 
 extern const Pin zone_src_[NUM_ZONES][NUM_SRCS];  // Source[1-4]->Zone mux
@@ -73,6 +48,14 @@ extern const Pin exp_boot0_;            // Expansion connector BOOT0_OUT
 extern const Pin i2c2_scl_;             // Internal I2C bus SCL
 extern const Pin i2c2_sda_;             // Internal I2C bus SDA
 
+// Internal I2C bus devices, addresses shifted left by one
+#define DEV_VOL1     0x88  // TDA7448, zones 1-3
+#define DEV_VOL2     0x8A  // TDA7448, zones 4-6
+#define DEV_PWR_GPIO 0x42  // MCP23008 on the Power Board
+#define DEV_LED_GPIO 0x40  // MCP23008 on the LED Board
+#define DEV_ADC      0xC8  // MAX11601 on the Power Board
+#define DEV_DPOT     0x5E  // MCP4017 on the Power Board, sets the fan voltage
+
 #define PWR_GPIO_OUT_MASK 0x83
 
 typedef union {
@@ -107,7 +90,8 @@ typedef union {
     uint8_t on       : 1;  // R   - Fans status
     uint8_t ovr_tmp  : 1;  // R   - Unit over dangerous temperature threshold
     uint8_t fail     : 1;  // R   - Fan fail detection (Power Board 2.A only)
-    uint8_t reserved : 3;
+    uint8_t pi       : 1;  // R/W - Add integral control on the temps
+    uint8_t reserved : 2;
   };
   uint8_t data;
 } FanMsg;
@@ -20,113 +20,67 @@
 
 #include "ports.h"
 
-#include "stm32f0xx.h"
+#include <stddef.h>
 
-static GPIO_TypeDef* getPort(Pin pp) {
-  switch (pp.port) {
-    case 'A':
-      return GPIOA;
-    case 'B':
-      return GPIOB;
-    case 'C':
-      return GPIOC;
-    case 'D':
-      return GPIOD;
-    case 'F':
-      return GPIOF;
-    default:
-      return 0;
-  }
+#include "i2c2.h"
+
+// GPIO ports are 0x400 apart
+#define GPIO_PORT_SHIFT 10
+
+// Index of a pin's port in a PinBatch
+static size_t getPortIndex(Pin pp) {
+  return ((uintptr_t)pp.port - GPIOA_BASE) >> GPIO_PORT_SHIFT;
 }
 
-void writePin(Pin pp, bool set) {
-  GPIO_TypeDef* port = getPort(pp);
-  // getPort(pp)->BSRR = (1 << pp.pin)
+static GPIO_TypeDef* getBatchPort(size_t i) {
+  return (GPIO_TypeDef*)(GPIOA_BASE + (i << GPIO_PORT_SHIFT));
+}
+
+void batchWritePin(PinBatch* batch, Pin pp, bool set) {
+  size_t   i    = getPortIndex(pp);
+  uint16_t mask = pp.mask;
   if (set) {
-    // Lower 16 bits of BSRR used for setting, upper for clearing
-    port->BSRR = 1 << pp.pin;
+    batch->set[i] |= mask;
+    batch->clr[i] &= ~mask;
   } else {
-    // Lower 16 bits of BRR used for clearing
-    port->BRR = 1 << pp.pin;
+    batch->clr[i] |= mask;
+    batch->set[i] &= ~mask;
   }
 }
 
-bool readPin(Pin pp) {
-  GPIO_TypeDef* port = getPort(pp);
-  if (port->ODR & (1 << pp.pin)) {
-    return true;
-  } else {
-    return false;
+void applyPinBatch(const PinBatch* batch) {
+  for (size_t i = 0; i < NUM_PORTS; i++) {
+    if (batch->set[i] || batch->clr[i]) {
+      // Upper 16 bits of BSRR clear pins, lower 16 bits set them
+      uint32_t bsrr = ((uint32_t)batch->clr[i] << 16) | batch->set[i];
+#ifdef PREAMP_HOST
+      fakeGpioWrite(getBatchPort(i), bsrr);
+#else
+      getBatchPort(i)->BSRR = bsrr;
+#endif
+    }
   }
 }
 
 uint8_t readI2C2(I2CReg r) {
-  uint8_t data;
-
-  // Wait if I2C2 is busy
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_BUSY)) {}
-
-  // Setup to write start, addr, subaddr
-  I2C_TransferHandling(I2C2, r.dev, 1, I2C_SoftEnd_Mode,
-                       I2C_Generate_Start_Write);
-
-  // Wait for transmit flag
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_TXIS) == RESET) {}
-
-  // Send register address
-  I2C_SendData(I2C2, r.reg);
-
-  // Wait for transfer complete flag
-  while (I2C_GetFlagStatus(I2C2, I2C_ISR_TC) == RESET) {}
-
-  // This is the actual read transfer setup
-  I2C_TransferHandling(I2C2, r.dev, 1, I2C_AutoEnd_Mode,
-                       I2C_Generate_Start_Read);
-
-  // Wait until we get the rx data then read it out
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_RXNE) == RESET) {}
-  data = I2C_ReceiveData(I2C2);
-
-  // Wait for stop condition to get sent then clear it
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET) {}
-  I2C_ClearFlag(I2C2, I2C_FLAG_STOPF);
-
-  // Return data that was read
+  uint8_t  data = 0;
+  I2C2Xfer xfer = {
+      .dev    = r.dev,
+      .tx_len = 1,
+      .rx_len = 1,
+      .tx     = &r.reg,
+      .rx     = &data,
+  };
+  i2c2Transfer(&xfer);
   return data;
 }
 
 uint32_t writeI2C2(I2CReg r, uint8_t data) {
-  // Wait if I2C2 is busy
-  while (I2C2->ISR & I2C_ISR_BUSY) {}
-
-  // Setup to send start, addr, subaddr
-  I2C_TransferHandling(I2C2, r.dev, 2, I2C_AutoEnd_Mode,
-                       I2C_Generate_Start_Write);
-
-  // Wait for transmit interrupted flag or an error
-  uint32_t isr = I2C2->ISR;
-  do {
-    if (isr & I2C_ISR_NACKF) {
-      I2C2->ICR = I2C_ICR_NACKCF;
-      return I2C_ISR_NACKF;
-    }
-    if (isr & I2C_ISR_BERR) {
-      I2C2->ICR = I2C_ICR_BERRCF;
-      return I2C_ISR_BERR;
-    }
-    if (isr & I2C_ISR_ARLO) {
-      I2C2->ICR = I2C_ICR_ARLOCF;
-      return I2C_ISR_ARLO;
-    }
-    isr = I2C2->ISR;
-  } while (!(isr & I2C_ISR_TXIS));
-
-  // Send subaddress and data
-  I2C_SendData(I2C2, r.reg);
-  I2C_SendData(I2C2, data);
-
-  // Wait for stop flag to be sent and then clear it
-  while (I2C_GetFlagStatus(I2C2, I2C_FLAG_STOPF) == RESET) {}
-  I2C2->ICR = I2C_ICR_STOPCF;
-  return 0;
+  uint8_t  buf[2] = {r.reg, data};
+  I2C2Xfer xfer   = {
+      .dev    = r.dev,
+      .tx_len = 2,
+      .tx     = buf,
+  };
+  return i2c2Transfer(&xfer);
 }
@@ -24,19 +24,69 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "stm32f0xx.h"
+
+// A GPIO pin, resolved at build time so writes are a single register store
 typedef struct {
-  char    port;  // Valid ports in our case are A,B,C,D,F
-  uint8_t pin : 4;
+  GPIO_TypeDef* port;
+  uint16_t      mask;
 } Pin;
 
-void writePin(Pin pp, bool set);
-bool readPin(Pin pp);
+// Initializer for a Pin, e.g. PIN(A, 3) for PA3
+#define PIN(port, pin) \
+  { GPIO##port, 1 << (pin) }
+
+#ifdef PREAMP_HOST
+// Host builds record every write to a port's BSRR instead, see test/fake
+void fakeGpioWrite(GPIO_TypeDef* port, uint32_t bsrr);
+#endif
+
+static inline void writePin(Pin pp, bool set) {
+#ifdef PREAMP_HOST
+  fakeGpioWrite(pp.port, set ? pp.mask : (uint32_t)pp.mask << 16);
+#else
+  if (set) {
+    // Lower 16 bits of BSRR used for setting, upper for clearing
+    pp.port->BSRR = pp.mask;
+  } else {
+    // Lower 16 bits of BRR used for clearing
+    pp.port->BRR = pp.mask;
+  }
+#endif
+}
+
+// The value last written to an output pin
+static inline bool readPin(Pin pp) {
+  return pp.port->ODR & pp.mask;
+}
+
+// The level actually on a pin, e.g. an open-drain output held low externally
+static inline bool readPinLevel(Pin pp) {
+  return pp.port->IDR & pp.mask;
+}
+
+// Ports A through F, GPIOE is unused
+#define NUM_PORTS 6
+
+/* Pin writes accumulated per port, to be applied with a single BSRR write per
+ * port so each port's pins change at the same time. Zero-initialize before
+ * use. If a pin is written more than once the last write wins.
+ */
+typedef struct {
+  uint16_t set[NUM_PORTS];
+  uint16_t clr[NUM_PORTS];
+} PinBatch;
+
+void batchWritePin(PinBatch* batch, Pin pp, bool set);
+void applyPinBatch(const PinBatch* batch);
 
 typedef struct {
   uint8_t dev;
   uint8_t reg;
 } I2CReg;
 
+// Blocking single register transfers, see i2c2.h for non-blocking transfers.
+// writeI2C2 returns 0 on success or the I2C_ISR flag of the error.
 uint8_t  readI2C2(I2CReg r);
 uint32_t writeI2C2(I2CReg r, uint8_t data);
 
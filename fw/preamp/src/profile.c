@@ -0,0 +1,80 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Execution time profiling of the scheduled tasks and interrupt handlers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+
+#include <stddef.h>
+
+#include "systick.h"
+
+// The average is taken over blocks of 2^PROF_AVG_SHIFT runs
+#define PROF_AVG_SHIFT 10
+
+typedef struct {
+  uint16_t min;
+  uint16_t avg;
+  uint16_t max;
+  uint16_t count;  // Runs in the current average
+  uint32_t sum;    // Total time of the runs in the current average
+} ProfStats;
+
+// Call profReset() before profiling to initialize the minimums
+static volatile ProfStats stats_[PROF_NUM_STAGES];
+
+uint32_t profStart() {
+  return cycles();
+}
+
+void profEnd(ProfStage stage, uint32_t start) {
+  uint32_t t   = cycles() - start;
+  uint16_t t16 = t > UINT16_MAX ? UINT16_MAX : t;
+
+  volatile ProfStats* s = &stats_[stage];
+  s->min = t16 < s->min ? t16 : s->min;
+  s->max = t16 > s->max ? t16 : s->max;
+  s->sum += t16;
+  if (++s->count == 1 << PROF_AVG_SHIFT) {
+    s->avg   = s->sum >> PROF_AVG_SHIFT;
+    s->sum   = 0;
+    s->count = 0;
+  }
+}
+
+uint16_t profGet(ProfStage stage, ProfStat stat) {
+  volatile ProfStats* s = &stats_[stage];
+  switch (stat) {
+    case PROF_MIN:
+      return s->min;
+    case PROF_AVG:
+      // Until a full block is measured use the runs so far
+      return s->avg || !s->count ? s->avg : s->sum / s->count;
+    case PROF_MAX:
+      return s->max;
+    default:
+      return 0;
+  }
+}
+
+void profReset() {
+  for (size_t i = 0; i < PROF_NUM_STAGES; i++) {
+    stats_[i].min = UINT16_MAX;
+    stats_[i].max = 0;
+  }
+}
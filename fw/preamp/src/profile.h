@@ -0,0 +1,61 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Execution time profiling of the scheduled tasks and interrupt handlers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+// Each stage must only be profiled from one context (task or interrupt)
+typedef enum
+{
+  PROF_LOOP,          // One scheduler busy period, until all tasks are idle
+  PROF_NEW_ADDRESS,   // checkForNewAddress()
+  PROF_CTRL_I2C,      // ctrlI2CUpdate(), applying register writes
+  PROF_CTRL_I2C_IRQ,  // One controller I2C interrupt
+  PROF_I2C2,          // i2c2Update(), including transfer callbacks
+  PROF_INT_I2C,       // Queuing Power and LED Board reads and writes
+  PROF_ADC,           // updateAdc()
+  PROF_FANS,          // updateFans(), and queuing the DPOT write
+  PROF_NUM_STAGES,
+} ProfStage;
+
+typedef enum
+{
+  PROF_MIN,
+  PROF_AVG,  // Over the last 1024 runs
+  PROF_MAX,
+  PROF_NUM_STATS,
+} ProfStat;
+
+// Returns the start time of a stage, to pass to profEnd()
+uint32_t profStart();
+
+// Record the execution time of a stage
+void profEnd(ProfStage stage, uint32_t start);
+
+// Get a stage's execution time in CPU cycles, saturated at 0xFFFF. The minimum
+// is 0xFFFF until the stage has run.
+uint16_t profGet(ProfStage stage, ProfStat stat);
+
+// Restart measuring the minimum and maximum of all stages
+void profReset();
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,143 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Cooperative scheduler of periodic and event-driven tasks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sched.h"
+
+#include "profile.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+#include "trace.h"
+
+static Task*    tasks_     = NULL;
+static size_t   num_tasks_ = 0;
+static uint8_t  overruns_  = 0;
+static uint32_t loops_     = 0;
+
+static volatile uint8_t current_ = SCHED_IDLE;
+
+void schedInit(Task* tasks, size_t num) {
+  uint32_t now = millis();
+  tasks_       = tasks;
+  num_tasks_   = num;
+  for (size_t i = 0; i < num; i++) {
+    tasks[i].next += now;
+    tasks[i].waiting = tasks[i].waiting || tasks[i].period;
+  }
+}
+
+void schedAt(Task* task, uint32_t time) {
+  task->next    = time;
+  task->waiting = true;
+}
+
+void schedPeriod(Task* task, uint16_t period) {
+  uint32_t now = millis();
+  task->period = period;
+  while (timeReached(task->next - period, now)) {
+    task->next -= period;
+  }
+}
+
+static bool timeDue(const Task* task, uint32_t now) {
+  return task->waiting && timeReached(now, task->next);
+}
+
+// Find the highest priority task that is due, or NULL if none are
+static Task* nextDue(uint32_t now) {
+  for (size_t i = 0; i < num_tasks_; i++) {
+    Task* task = &tasks_[i];
+    if (timeDue(task, now) || (task->ready && task->ready())) {
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void runTask(Task* task, uint32_t now) {
+  if (timeDue(task, now)) {
+    if (now - task->next > task->deadline) {
+      overruns_++;
+      traceOverrun(task - tasks_, now - task->next);
+    }
+    if (task->period) {
+      // Skip any missed periods
+      do {
+        task->next += task->period;
+      } while (timeReached(now, task->next));
+    } else {
+      task->waiting = false;
+    }
+  }
+  current_ = task - tasks_;
+  task->run();
+  current_ = SCHED_IDLE;
+}
+
+void schedRun() {
+  // Each busy period, from the first task that is due until there are none,
+  // is profiled as one loop.
+  bool     busy       = false;
+  uint32_t busy_start = 0;
+  while (1) {
+    // Check for tasks with interrupts masked, so an interrupt that makes a
+    // task ready after the check still wakes the WFI.
+    __disable_irq();
+    uint32_t now  = millis();
+    Task*    task = nextDue(now);
+    if (!task) {
+      if (busy) {
+        profEnd(PROF_LOOP, busy_start);
+        busy = false;
+      }
+      __WFI();
+      __enable_irq();
+      continue;
+    }
+    __enable_irq();
+
+    if (!busy) {
+      busy_start = profStart();
+      busy       = true;
+      loops_++;
+    }
+    runTask(task, now);
+  }
+}
+
+bool schedStep() {
+  uint32_t now  = millis();
+  Task*    task = nextDue(now);
+  if (task) {
+    runTask(task, now);
+  }
+  return task != NULL;
+}
+
+uint8_t schedOverruns() {
+  return overruns_;
+}
+
+uint32_t schedLoops() {
+  return loops_;
+}
+
+uint8_t schedCurrent() {
+  return current_;
+}
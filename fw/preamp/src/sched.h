@@ -0,0 +1,73 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Cooperative scheduler of periodic and event-driven tasks
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A task runs every period ms, at the time given to schedAt(), and whenever
+ * its ready function returns true. Tasks are run to completion one at a time,
+ * highest priority (first in the table) first. A task that starts more than
+ * deadline ms after it was due counts as an overrun, and any periods it
+ * missed are skipped instead of being run late.
+ */
+typedef struct {
+  void (*run)(void);
+  bool (*ready)(void);  // Event check, may be NULL. Must not block.
+  uint16_t period;      // ms between runs, 0 to only run when scheduled
+  uint16_t deadline;    // ms a run may start late
+  uint32_t next;        // Time of the next run, initially the offset from start
+  bool     waiting;     // A run is scheduled at next
+} Task;
+
+// Start timing all periodic tasks from now, offset by their initial next time
+void schedInit(Task* tasks, size_t num);
+
+// Schedule a task's next run, replacing any not yet run
+void schedAt(Task* task, uint32_t time);
+
+// Change a periodic task's period. If the task is then due more than one new
+// period from now its next run is brought forward by whole new periods, so a
+// task whose periods are multiples of each other keeps its offset.
+void schedPeriod(Task* task, uint16_t period);
+
+// Run tasks forever, sleeping whenever none are due
+void schedRun();
+
+// Run the highest priority task that is due, returns false if none are. For
+// running the tasks from another loop, such as the host tests' board.
+bool schedStep();
+
+// Index in the task table of the task running now, SCHED_IDLE between tasks.
+// May be called from interrupts.
+#define SCHED_IDLE 0xFF
+uint8_t schedCurrent();
+
+// Number of task runs that started after their deadline. Wraps at 256.
+uint8_t schedOverruns();
+
+// Number of busy periods, from waking with a task due until no more are.
+// Wraps at 2^32.
+uint32_t schedLoops();
+
+#endif /* SCHED_H_ */
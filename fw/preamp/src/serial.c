@@ -22,10 +22,15 @@
 
 #include <string.h>  // memset
 
+#include "boot.h"
+#include "chain_enum.h"
+#include "ctrl_i2c.h"
 #include "stm32f0xx.h"
 #include "stm32f0xx_gpio.h"
 #include "stm32f0xx_rcc.h"
 #include "stm32f0xx_usart.h"
+#include "systick.h"
+#include "update.h"
 
 // Need at least 3 bytes for data: A + ADDR + \n.
 // Memory is 4-byte word aligned, so the following works well with the
@@ -38,15 +43,115 @@
 // Passthrough messages between UART1<->UART2
 bool uart_passthrough_ = false;
 
+// Forward a firmware image received on UART1 to UART2, and keep a copy
+static volatile bool uart_update_ = false;
+
+/* Bytes waiting to be sent on each UART, sent by its TXE interrupt. Bytes
+ * passed through are queued by the other UART's interrupt, so neither waits
+ * on the other. Both UART interrupts have the same priority so never
+ * interrupt each other, other callers must mask interrupts while queuing.
+ */
+#define UART_TX_SIZE 64  // Must be a power of 2
+
+typedef struct {
+  volatile uint8_t buf[UART_TX_SIZE];
+  volatile uint8_t head;   // Next slot to fill
+  volatile uint8_t tail;   // Next byte to send, by the TXE interrupt
+  volatile uint8_t drops;  // Bytes lost, wraps at 256
+} UartTx;
+
+static UartTx uart1_tx_;  // Up the chain, to the Pi
+static UartTx uart2_tx_;  // Down the chain, to the expansion unit
+
+// Queue a byte to send, dropping it if the buffer is full
+static void uartQueue(USART_TypeDef* usart, UartTx* tx, uint8_t data) {
+  if ((uint8_t)(tx->head - tx->tail) >= UART_TX_SIZE) {
+    tx->drops++;
+    return;
+  }
+  tx->buf[tx->head & (UART_TX_SIZE - 1)] = data;
+  tx->head++;
+  usart->CR1 |= USART_CR1_TXEIE;
+}
+
+// Queue a whole message or none of it, so a message is never cut short
+static void uartQueueMsg(USART_TypeDef* usart, UartTx* tx,
+                         const volatile uint8_t* msg, uint8_t len) {
+  if ((uint8_t)(tx->head - tx->tail) > UART_TX_SIZE - len) {
+    tx->drops += len;
+    return;
+  }
+  for (uint8_t i = 0; i < len; i++) {
+    uartQueue(usart, tx, msg[i]);
+  }
+}
+
+// Send the next queued byte from a TXE interrupt
+static void uartSendNext(USART_TypeDef* usart, UartTx* tx) {
+  if (tx->tail == tx->head) {
+    usart->CR1 &= ~USART_CR1_TXEIE;
+    return;
+  }
+  usart->TDR = tx->buf[tx->tail & (UART_TX_SIZE - 1)];
+  tx->tail++;
+}
+
+// Count a byte lost because a UART received another before the last was read
+static void checkOverrun(USART_TypeDef* usart, uint32_t isr, UartTx* tx) {
+  if (isr & USART_ISR_ORE) {
+    usart->ICR = USART_ICR_ORECF;
+    tx->drops++;
+  }
+}
+
+// Set while UART1 is waiting to detect a new baud rate, to then be copied to
+// UART2 so every UART in the chain runs at the Pi's rate
+static volatile bool baud_pending_ = false;
+
+/* Detect the baud rate from the start bit of the next character received on
+ * UART1. The character's LSB must be set, as are those of the 'A' starting
+ * each address message and the 0x7F that starts the STM32 bootloader
+ * protocol when flashing an expansion unit through passthrough.
+ */
+static void detectBaud() {
+  baud_pending_ = true;
+  USART1->RQR   = USART_RQR_ABRRQ;
+}
+
+// Change UART2's baud rate, BRR can only be written while it is disabled.
+// Both UARTs are clocked by PCLK so the same BRR gives the same rate.
+static void setUart2Brr(uint16_t brr) {
+#ifndef DEBUG_OVER_UART2
+  USART2->CR1 &= ~USART_CR1_UE;
+  USART2->BRR = brr;
+  USART2->CR1 |= USART_CR1_UE;
+#else
+  (void)brr;
+#endif
+}
+
 void setUartPassthrough(bool passthrough) {
+  if (passthrough != uart_passthrough_) {
+    // The flashing tool may use a different rate to the address messages
+    detectBaud();
+  }
   uart_passthrough_ = passthrough;
-  if (passthrough) {
-    USART_ITConfig(USART2, USART_IT_RXNE, ENABLE);
-    NVIC_EnableIRQ(USART2_IRQn);
-  } else {
-    USART_ITConfig(USART2, USART_IT_RXNE, DISABLE);
-    NVIC_DisableIRQ(USART2_IRQn);
+}
+
+void setUartUpdate(bool update) {
+  if (update && !uart_update_) {
+    // Detect the rate from the image's sync byte
+    detectBaud();
   }
+  uart_update_ = update;
+}
+
+uint8_t uartDownDrops() {
+  return uart2_tx_.drops;
+}
+
+uint8_t uartUpDrops() {
+  return uart1_tx_.drops;
 }
 
 // Serial buffer for UART handling of I2C addresses
@@ -57,7 +162,7 @@ typedef struct {
   // uint32_t start;              // Time of first character reception (ms)
 } SerialBuffer;
 volatile SerialBuffer uart1_rx_buf_;
-SerialBuffer          uart_tx_buf_;
+volatile SerialBuffer uart2_rx_buf_;  // Ready messages from the expansion unit
 
 void serialBufferReset(volatile SerialBuffer* sb) {
   memset((void*)sb, 0, sizeof(SerialBuffer));
@@ -109,7 +214,6 @@ void initUart1() {
   GPIO_Init(GPIOA, &GPIO_InitStructureUART);
 
   // Setup USART1
-  USART_Cmd(USART1, ENABLE);
   USART_InitTypeDef USART_InitStructure;
   USART_InitStructure.USART_BaudRate   = 9600;  // Auto-baud will override this
   USART_InitStructure.USART_WordLength = USART_WordLength_8b;
@@ -120,10 +224,12 @@ void initUart1() {
   USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
   USART_Init(USART1, &USART_InitStructure);
 
-  // Setup auto-baudrate detection
-  // Mode 0b01, aka "Falling Edge" mode, must start with 0b10...
-  // Since UART sents LSB first, the first character must be 0bXXXXXX01
-  // USART1->CR2 |= USART_AutoBaudRate_FallingEdge | USART_CR2_ABREN;
+  // Setup auto-baudrate detection, which measures the start bit of the first
+  // character received. "Falling Edge" mode would be more accurate but needs
+  // characters starting 0bXXXXXX01, which the bootloader's 0x7F doesn't.
+  USART_AutoBaudRateConfig(USART1, USART_AutoBaudRate_StartBit);
+  USART_AutoBaudRateCmd(USART1, ENABLE);
+  baud_pending_ = true;
 
   USART_Cmd(USART1, ENABLE);
 
@@ -154,7 +260,6 @@ void initUart2(uint16_t brr) {
   GPIO_Init(GPIOA, &GPIO_InitStructureUART2);
 
   // Setup USART2
-  USART_Cmd(USART2, ENABLE);
   USART_InitTypeDef USART_InitStructure2;
   USART_InitStructure2.USART_BaudRate   = 9600;
   USART_InitStructure2.USART_WordLength = USART_WordLength_8b;
@@ -164,15 +269,76 @@ void initUart2(uint16_t brr) {
       USART_HardwareFlowControl_None;
   USART_InitStructure2.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
   USART_Init(USART2, &USART_InitStructure2);
-  // USART2->BRR = brr;
-  (void)brr;
   USART_Cmd(USART2, ENABLE);
+  if (brr) {
+    setUart2Brr(brr);
+  }
+
+  // Both sending and receiving are interrupt driven
+  USART_ITConfig(USART2, USART_IT_RXNE, ENABLE);
+  NVIC_EnableIRQ(USART2_IRQn);
+#else
+  (void)brr;
+#endif
+}
+
+// This preamp's address, received over UART1, and the chain's enumeration
+static ChainEnum enum_;
+
+/* Once enumerated, each expansion unit sends its telemetry snapshot up the
+ * chain as 'T' + its address + the CTRL_I2C_SNAP_LEN bytes of the snapshot:
+ * when it changes but at most every TELEM_MIN_MS, and otherwise every
+ * TELEM_MAX_MS so its age shows it's still there. Units in between pass them
+ * up whole, and the first preamp keeps them for the Pi to read rather than
+ * passing them on. The snapshot can hold any byte, so there's no terminator.
+ * Instead the checksum ending the snapshot rejects a message received out of
+ * step, and a gap of TELEM_GAP_MS starts the next message afresh. At 9600 baud
+ * each message takes 14 ms, so 5 units sending every TELEM_MIN_MS use about a
+ * quarter of the link to the first preamp.
+ */
+#define TELEM_MSG_LEN (2 + CTRL_I2C_SNAP_LEN)
+#define TELEM_MIN_MS  250
+#define TELEM_MAX_MS  1000
+#define TELEM_GAP_MS  20
+#define MASTER_ADDR   0x10  // The address the Pi gives the first preamp
+
+static bool     telem_sent_ = false;  // Since the last address was received
+static uint8_t  telem_seq_;           // SNAP_SEQ of the last sent
+static uint32_t telem_sent_ms_;
+
+// Telemetry message being received from the expansion unit
+static volatile uint8_t  telem_rx_[TELEM_MSG_LEN];
+static volatile uint8_t  telem_rx_len_ = 0;
+static volatile uint32_t telem_rx_ms_;  // Time of the last byte received
+
+// Queue a 3-byte message with interrupts masked, so it isn't interleaved with
+// messages passed through by the UART interrupts
+static void sendMessage(USART_TypeDef* usart, UartTx* tx, uint8_t id,
+                        uint8_t addr) {
+#ifndef DEBUG_OVER_UART2
+  __disable_irq();
+  uartQueue(usart, tx, id);
+  uartQueue(usart, tx, addr);
+  uartQueue(usart, tx, '\n');
+  __enable_irq();
+#else
+  (void)usart;
+  (void)tx;
+  (void)id;
+  (void)addr;
 #endif
 }
 
+EnumState uartEnumState() {
+  return enum_.state;
+}
+
+uint8_t uartChainUnits() {
+  return enum_.units;
+}
+
 uint8_t checkForNewAddress() {
-  static size_t tx_len   = 0;
-  uint8_t       i2c_addr = 0;
+  uint8_t i2c_addr = 0;
 
   // TODO: Assume default slave address, wait a bit to see if new address is
   //       received, then either accept new address or use default.
@@ -180,62 +346,150 @@ uint8_t checkForNewAddress() {
   if (uart1_rx_buf_.done) {
     // "A" - address identifier. Defends against potential noise on the wire
     if (uart1_rx_buf_.data[0] == 'A') {
-      // Set expansion preamp's address, if it exists. Increment the address
-      // received by 0x10 to get the address for the next preamp.
-      uart_tx_buf_      = uart1_rx_buf_;
-      tx_len            = uart_tx_buf_.ind;
-      uart_tx_buf_.ind  = 0;
-      uart_tx_buf_.done = 0;
-      // initUart2(USART1->BRR);  // Use the same baud rate for both UARTs
       i2c_addr = uart1_rx_buf_.data[1];
     }
+    // Detect the rate again for the next message, in case it changes
     serialBufferReset(&uart1_rx_buf_);
+    detectBaud();
   }
-  // Forward address to next preamp
-  /*if (tx_len && USART1->ISR & USART_ISR_TXE && USART2->ISR & USART_ISR_TXE) {
-    uint16_t data = uart_tx_buf_.data[uart_tx_buf_.ind];
-    USART_SendData(USART1, data);
-    if (uart_tx_buf_.ind == 1) {
-      data += 0x10;  // New address for next preamp
-    }
-    USART_SendData(USART2, data);
-    uart_tx_buf_.ind++;
-    tx_len--;
-  }*/
-  if (i2c_addr) {
-    (void)tx_len;
-    while (!(USART2->ISR & USART_ISR_TXE)) {}
-    USART2->TDR = 'A';
-    while (!(USART2->ISR & USART_ISR_TXE)) {}
-    USART2->TDR = i2c_addr + 0x10;  // Add 0x10 to get next address
-    while (!(USART2->ISR & USART_ISR_TXE)) {}
-    USART2->TDR = 0x0A;  // '\n'
+  if (i2c_addr && enumAddress(&enum_, i2c_addr)) {
+    bootMark(BOOT_ADDR);
+    telem_sent_ = false;
+  } else {
+    i2c_addr = 0;
+  }
+  // Only reply once the address has been applied, on a later call
+  switch (enumCheck(&enum_, millis())) {
+    case ENUM_SEND_ADDR:
+      // Forward the address to the next preamp, adding 0x10 to get its address
+      sendMessage(USART2, &uart2_tx_, 'A', enum_.addr + 0x10);
+      break;
+    case ENUM_SEND_READY:
+      // Report this preamp and every one below it ready
+      sendMessage(USART1, &uart1_tx_, 'R', enum_.addr);
+      bootMark(BOOT_CHAIN);
+      break;
+    default:
+      break;
   }
   return i2c_addr;
 }
 
+void uartSendTelemetry() {
+  bool enumerated = enum_.state == ENUM_DONE || enum_.state == ENUM_LAST;
+  if (!enumerated || enum_.addr == MASTER_ADDR || uart_passthrough_ ||
+      uart_update_) {
+    return;
+  }
+  uint8_t msg[TELEM_MSG_LEN] = {'T', enum_.addr};
+  ctrlI2CSnapshot(&msg[2]);
+  uint32_t since = millis() - telem_sent_ms_;
+  uint32_t wait  = msg[2] != telem_seq_ ? TELEM_MIN_MS : TELEM_MAX_MS;
+  if (telem_sent_ && since < wait) {
+    return;
+  }
+  __disable_irq();
+  uartQueueMsg(USART1, &uart1_tx_, msg, TELEM_MSG_LEN);
+  __enable_irq();
+  telem_sent_    = true;
+  telem_seq_     = msg[2];
+  telem_sent_ms_ = millis();
+}
+
 // Handles the interrupt on UART data reception
 void USART1_IRQHandler(void) {
   uint32_t isr = USART1->ISR;
+  checkOverrun(USART1, isr, &uart2_tx_);
   if (isr & USART_ISR_ABRE) {
     // Auto-baud failed, clear read data and reset auto-baud
-    USART1->RQR |= USART_RQR_ABRRQ | USART_RQR_RXFRQ;
+    USART1->RQR = USART_RQR_RXFRQ;
+    detectBaud();
     serialBufferReset(&uart1_rx_buf_);
   } else if (isr & USART_ISR_RXNE) {
-    uint16_t m = USART_ReceiveData(USART1);
-    if (uart_passthrough_) {
-      USART_SendData(USART2, m);
+    if (baud_pending_ && (isr & USART_ISR_ABRF)) {
+      // A new rate was detected from this character, use it for UART2 too
+      baud_pending_ = false;
+      setUart2Brr(USART1->BRR);
+    }
+    uint8_t m = USART1->RDR;
+    if (uart_update_) {
+      uartQueue(USART2, &uart2_tx_, m);
+      updateReceive(m);
+    } else if (uart_passthrough_) {
+      uartQueue(USART2, &uart2_tx_, m);
     } else {
-      serialBufferAdd(&uart1_rx_buf_, (uint8_t)m);
+      serialBufferAdd(&uart1_rx_buf_, m);
+      if (uart1_rx_buf_.ind == 0) {
+        // Overflowed, likely received at the wrong rate
+        detectBaud();
+      }
     }
   }
+  if ((USART1->CR1 & USART_CR1_TXEIE) && (isr & USART_ISR_TXE)) {
+    uartSendNext(USART1, &uart1_tx_);
+  }
+}
+
+// Pass a ready message from the expansion unit up the chain
+static void handleReady(volatile SerialBuffer* sb) {
+  uint8_t addr = sb->data[1];
+  if (sb->ind == 3 && sb->data[0] == 'R' && enumReady(&enum_, addr)) {
+    uartQueue(USART1, &uart1_tx_, 'R');
+    uartQueue(USART1, &uart1_tx_, addr);
+    uartQueue(USART1, &uart1_tx_, '\n');
+  }
+  serialBufferReset(sb);
+}
+
+// Keep or pass up a telemetry message from the expansion unit, if its
+// snapshot is whole and it came from below this preamp
+static void handleTelem() {
+  uint8_t addr = telem_rx_[1];
+  uint8_t self = enum_.addr;
+  uint8_t sum  = 0;
+  for (uint8_t i = 2; i < TELEM_MSG_LEN; i++) {
+    sum += telem_rx_[i];
+  }
+  if (sum != 0 || !self || addr <= self || ((addr - self) & 0x0F)) {
+    return;
+  }
+  if (self == MASTER_ADDR) {
+    ctrlI2CChainTelem((addr - self) >> 4, &telem_rx_[2]);
+  } else {
+    uartQueueMsg(USART1, &uart1_tx_, telem_rx_, TELEM_MSG_LEN);
+  }
 }
 
 void USART2_IRQHandler(void) {
-  // Forward anything received on UART2 (expansion box)
-  // to UART1 (back up the chain to the controller board)
-  if (USART_GetITStatus(USART2, USART_IT_RXNE) != RESET) {
-    uint16_t m = USART_ReceiveData(USART2);
-    USART_SendData(USART1, m);
+  // Forward anything received on UART2 (expansion box) to UART1 (back up the
+  // chain to the controller board). Unless passing through, only whole ready
+  // and telemetry messages are forwarded so they're never interleaved with
+  // this preamp's.
+  uint32_t isr = USART2->ISR;
+  checkOverrun(USART2, isr, &uart1_tx_);
+  if (isr & USART_ISR_RXNE) {
+    uint8_t  m   = USART2->RDR;
+    uint32_t now = millis();
+    if (telem_rx_len_ && now - telem_rx_ms_ >= TELEM_GAP_MS) {
+      telem_rx_len_ = 0;
+    }
+    telem_rx_ms_ = now;
+    if (uart_passthrough_) {
+      uartQueue(USART1, &uart1_tx_, m);
+    } else if (telem_rx_len_ || (m == 'T' && uart2_rx_buf_.ind == 0)) {
+      telem_rx_[telem_rx_len_++] = m;
+      if (telem_rx_len_ == TELEM_MSG_LEN) {
+        handleTelem();
+        telem_rx_len_ = 0;
+      }
+    } else {
+      serialBufferAdd(&uart2_rx_buf_, m);
+      if (uart2_rx_buf_.done) {
+        handleReady(&uart2_rx_buf_);
+      }
+    }
+  }
+  if ((USART2->CR1 & USART_CR1_TXEIE) && (isr & USART_ISR_TXE)) {
+    uartSendNext(USART2, &uart2_tx_);
   }
 }
@@ -24,14 +24,43 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "chain_enum.h"
+
 // Uncomment the line below to use the debugger
 //#define DEBUG_OVER_UART2
 
 void setUartPassthrough(bool passthrough);
+
+// While updating, bytes received on UART1 are forwarded to UART2 and passed to
+// updateReceive() instead of being treated as address messages
+void setUartUpdate(bool update);
+
+// UART1 detects the Pi's baud rate from each address message, and from the
+// first character after passthrough is changed. UART2 then uses the same rate.
 void initUart1();
+
+// Start UART2 at 9600 baud, or with the given BRR value if non-zero
 void initUart2(uint16_t brr);
 
-// Returns new I2C address if one was received via USART1, otherwise 0
+// Returns new I2C address if one was received via USART1, otherwise 0. A
+// repeat of the address still being enumerated isn't new.
+// Forwards the next address to the expansion unit without waiting, and reports
+// ready up the chain once every expansion unit has. Call every millisecond.
 uint8_t checkForNewAddress();
 
+// Send this preamp's telemetry snapshot up the chain for the first preamp to
+// keep, if it's an enumerated expansion unit. Call every millisecond.
+void uartSendTelemetry();
+
+EnumState uartEnumState();
+
+// Number of expansion units below this preamp that have reported ready
+uint8_t uartChainUnits();
+
+// Bytes lost passing through, down to the expansion unit or up to the Pi,
+// because a transmit buffer was full or a byte was overwritten on receipt.
+// Wrap at 256.
+uint8_t uartDownDrops();
+uint8_t uartUpDrops();
+
 #endif /* SERIAL_H_ */
@@ -133,6 +133,8 @@
   */
 __I uint8_t AHBPrescTable[16] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9};
 
+uint32_t SystemInitCycles = 0;
+
 /**
   * @}
   */
@@ -143,6 +145,8 @@ __I uint8_t AHBPrescTable[16] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 6, 7, 8, 9}
 
 #ifdef USE_HSE
 static void SetSysClock(void);
+#elif SYSCLK_HZ == 48000000
+static void SetSysClockPll(void);
 #endif
 
 /**
@@ -162,6 +166,12 @@ static void SetSysClock(void);
   */
 void SystemInit (void)
 {
+  /* Count the cycles taken to configure the clock for the boot timeline,
+     SysTick is reconfigured by systickInit() later */
+  SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+  SysTick->VAL  = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
   /* Set HSION bit */
   RCC->CR |= (uint32_t)0x00000001;
 
@@ -197,7 +207,11 @@ void SystemInit (void)
   /* Configure the System clock frequency, AHB/APBx prescalers and Flash settings */
 #ifdef USE_HSE
   SetSysClock();
+#elif SYSCLK_HZ == 48000000
+  SetSysClockPll();
 #endif
+
+  SystemInitCycles = SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
 }
 
 /**
@@ -354,6 +368,43 @@ static void SetSysClock(void)
          configuration. User can add here some code to deal with this error */
   }
 }
+#elif SYSCLK_HZ == 48000000
+/**
+  * @brief  Runs the System clock from the PLL at 48 MHz, with HCLK = PCLK =
+  *         SYSCLK. The PLL is sourced from HSI / 2, HSE can't be used since
+  *         its pins PF0 and PF1 are used as GPIO.
+  * @param  None
+  * @retval None
+  */
+static void SetSysClockPll(void)
+{
+  /* Enable Prefetch Buffer and set Flash Latency, 1 WS is required above 24 MHz */
+  FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY;
+
+  /* HCLK = SYSCLK, PCLK = HCLK */
+  RCC->CFGR |= (uint32_t)(RCC_CFGR_HPRE_DIV1 | RCC_CFGR_PPRE_DIV1);
+
+  /* PLL configuration = HSI / 2 * 12 = 48 MHz */
+  RCC->CFGR &= (uint32_t)((uint32_t)~(RCC_CFGR_PLLSRC | RCC_CFGR_PLLXTPRE | RCC_CFGR_PLLMULL));
+  RCC->CFGR |= (uint32_t)(RCC_CFGR_PLLSRC_HSI_Div2 | RCC_CFGR_PLLMULL12);
+
+  /* Enable PLL */
+  RCC->CR |= RCC_CR_PLLON;
+
+  /* Wait till PLL is ready */
+  while((RCC->CR & RCC_CR_PLLRDY) == 0)
+  {
+  }
+
+  /* Select PLL as system clock source */
+  RCC->CFGR &= (uint32_t)((uint32_t)~(RCC_CFGR_SW));
+  RCC->CFGR |= (uint32_t)RCC_CFGR_SW_PLL;
+
+  /* Wait till PLL is used as system clock source */
+  while ((RCC->CFGR & (uint32_t)RCC_CFGR_SWS) != (uint32_t)RCC_CFGR_SWS_PLL)
+  {
+  }
+}
 #endif
 
 /**
@@ -20,12 +20,15 @@
 
 #include "systick.h"
 
+#include <stdbool.h>
 #include <stm32f0xx.h>
 
-// Initialize the system ticks. Change CPU_FREQ according to the frequency being
-// used. (E.g. 8 MHz, 48 MHz, etc)
+#include "sched.h"
+#include "watchdog.h"
+
+// Initialize the system ticks, from the core clock
 void systickInit() {
-  SysTick_Config(HSI_VALUE / SYSTICK_FREQ);
+  SysTick_Config(SYSCLK_HZ / SYSTICK_FREQ);
 }
 
 // The actual tick counter
@@ -33,6 +36,7 @@ volatile uint32_t systick_count_ = 0;
 
 void SysTick_Handler(void) {
   systick_count_++;
+  watchdogTick(schedCurrent());
 }
 
 // Return the system clock as a number of milliseconds
@@ -40,13 +44,62 @@ inline uint32_t millis(void) {
   return systick_count_;
 }
 
+/* Read the ms count and the cycles since it last advanced, consistently.
+ * SysTick->VAL counts down once per cycle and reloads each ms. When called
+ * with interrupts masked (or from a higher priority interrupt) the tick count
+ * can't advance, so a pending reload is counted here instead.
+ */
+static uint32_t readTick(uint32_t* ms_out) {
+  uint32_t ms;
+  uint32_t val;
+  bool     pending;
+  do {
+    ms      = systick_count_;
+    val     = SysTick->VAL;
+    pending = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+  } while (ms != systick_count_);
+  uint32_t reload = SysTick->LOAD + 1;
+  if (pending && val > reload / 2) {
+    // The counter reloaded before VAL was read
+    ms++;
+  }
+  *ms_out = ms;
+  return reload - 1 - val;
+}
+
+// Return the time in CPU cycles, wrapping every 2^32 cycles
+uint32_t cycles(void) {
+  uint32_t ms;
+  uint32_t cyc = readTick(&ms);
+  return ms * (SysTick->LOAD + 1) + cyc;
+}
+
+/* Return the time in microseconds, wrapping every 2^32 us (71 minutes) along
+ * with millis(). The cycles within a ms are converted without a division,
+ * which the Cortex-M0 would have to do in software: at 48 MHz dividing by 48
+ * is a multiply by 2^21 / 48, rounded up, exact for every cycle count < 48000.
+ */
+uint32_t micros(void) {
+  uint32_t ms;
+  uint32_t cyc = readTick(&ms);
+#if SYSCLK_HZ == 8000000
+  uint32_t us = cyc >> 3;
+#else
+  uint32_t us = (cyc * 43691) >> 21;
+#endif
+  return ms * 1000 + us;
+}
+
 // Synchronous delay in milliseconds
 void delayMs(uint32_t t) {
   uint32_t start = millis();
-  uint32_t end   = start + t;
-  if (start < end) {
-    while ((millis() >= start) && (millis() < end)) {}
-  } else {
-    while ((millis() >= start) || (millis() < end)) {}
-  }
+  while (millis() - start < t) {}
+}
+
+// Synchronous delay in microseconds, up to 2^32 cycles. Counted in cycles
+// rather than micros() so short delays aren't cut short by rounding.
+void delayUs(uint32_t t) {
+  uint32_t start = cycles();
+  uint32_t len   = t * (SYSCLK_HZ / 1000000);
+  while (cycles() - start < len) {}
 }
@@ -21,12 +21,31 @@
 #ifndef SYSTICK_H_
 #define SYSTICK_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// The system clock (HCLK = PCLK) set by SystemInit(), either 8 MHz directly
+// from HSI or 48 MHz from the PLL. Select with the SYSCLK_HZ CMake option.
+#ifndef SYSCLK_HZ
+#define SYSCLK_HZ 8000000
+#endif
+#if SYSCLK_HZ != 8000000 && SYSCLK_HZ != 48000000
+#error "SYSCLK_HZ must be 8000000 or 48000000"
+#endif
+
 #define SYSTICK_FREQ 1000  // 1000 Hz = 1 ms ticks
 
 void     systickInit();
 void     delayMs(uint32_t t);
+void     delayUs(uint32_t t);
 uint32_t millis(void);
+uint32_t micros(void);
+uint32_t cycles(void);
+
+// True once time t (from millis() or micros()) is reached, even across the
+// counter wrapping. Times must be within 2^31 of each other.
+static inline bool timeReached(uint32_t now, uint32_t t) {
+  return (int32_t)(now - t) >= 0;
+}
 
 #endif /* SYSTICK_H_ */
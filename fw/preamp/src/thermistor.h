@@ -23,31 +23,61 @@
 
 #include <stdint.h>
 
+// Table values reserved for a disconnected or shorted thermistor
+#define THERM_DISCONNECTED INT16_MIN
+#define THERM_SHORTED      INT16_MAX
+
 // NCP21XV103J03RA - 0805 SMD, R0 = 10k @ 25 degC, B = 3900K
+// Temperature in Q7.8 degC for each 8-bit ADC reading.
 // Table generated by generate_therm_tables.py script
-const uint8_t THERM_LUT_[] = {
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x02, 0x05, 0x08, 0x0A, 0x0D, 0x0F, 0x11, 0x13, 0x15, 0x17, 0x19, 0x1B,
-    0x1C, 0x1E, 0x20, 0x21, 0x23, 0x24, 0x26, 0x27, 0x28, 0x2A, 0x2B, 0x2C,
-    0x2E, 0x2F, 0x30, 0x31, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A,
-    0x3B, 0x3C, 0x3E, 0x3F, 0x40, 0x41, 0x42, 0x43, 0x43, 0x44, 0x45, 0x46,
-    0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F, 0x4F, 0x50, 0x51,
-    0x52, 0x53, 0x54, 0x55, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5A, 0x5B,
-    0x5C, 0x5D, 0x5E, 0x5E, 0x5F, 0x60, 0x61, 0x62, 0x62, 0x63, 0x64, 0x65,
-    0x66, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6E,
-    0x6F, 0x70, 0x71, 0x71, 0x72, 0x73, 0x74, 0x75, 0x75, 0x76, 0x77, 0x78,
-    0x79, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7D, 0x7E, 0x7F, 0x80, 0x81, 0x81,
-    0x82, 0x83, 0x84, 0x85, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8A, 0x8B,
-    0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96,
-    0x97, 0x98, 0x99, 0x9A, 0x9A, 0x9B, 0x9C, 0x9D, 0x9E, 0x9F, 0xA0, 0xA1,
-    0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAB, 0xAC, 0xAD, 0xAE,
-    0xAF, 0xB0, 0xB1, 0xB2, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xBA, 0xBB, 0xBC,
-    0xBD, 0xBF, 0xC0, 0xC1, 0xC3, 0xC4, 0xC6, 0xC7, 0xC9, 0xCA, 0xCC, 0xCD,
-    0xCF, 0xD0, 0xD2, 0xD4, 0xD5, 0xD7, 0xD9, 0xDB, 0xDD, 0xDF, 0xE0, 0xE3,
-    0xE5, 0xE7, 0xE9, 0xEB, 0xED, 0xF0, 0xF2, 0xF5, 0xF7, 0xFA, 0xFD, 0xFF,
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-    0xFF, 0xFF, 0xFF, 0xFF,
+const int16_t THERM_LUT_Q7_8_[] = {
+    -32768, -14034, -11765, -10343,  -9288,  -8440,  -7726,  -7107,
+     -6558,  -6065,  -5614,  -5200,  -4815,  -4456,  -4118,  -3799,
+     -3497,  -3209,  -2935,  -2672,  -2419,  -2176,  -1942,  -1715,
+     -1496,  -1284,  -1077,   -877,   -681,   -491,   -306,   -124,
+        53,    226,    396,    563,    726,    886,   1043,   1198,
+      1350,   1500,   1647,   1792,   1936,   2077,   2216,   2353,
+      2489,   2623,   2755,   2886,   3016,   3144,   3270,   3396,
+      3520,   3643,   3765,   3886,   4006,   4124,   4242,   4359,
+      4475,   4591,   4705,   4819,   4932,   5044,   5155,   5266,
+      5376,   5486,   5595,   5704,   5812,   5919,   6026,   6132,
+      6238,   6344,   6449,   6554,   6659,   6763,   6867,   6970,
+      7073,   7176,   7279,   7381,   7483,   7585,   7687,   7789,
+      7890,   7991,   8092,   8193,   8294,   8395,   8496,   8596,
+      8697,   8797,   8898,   8998,   9099,   9199,   9300,   9400,
+      9501,   9602,   9702,   9803,   9904,  10005,  10106,  10207,
+     10309,  10410,  10512,  10614,  10716,  10819,  10921,  11024,
+     11127,  11230,  11334,  11438,  11542,  11647,  11752,  11857,
+     11963,  12069,  12175,  12282,  12389,  12497,  12605,  12714,
+     12823,  12933,  13043,  13154,  13265,  13377,  13489,  13602,
+     13716,  13831,  13946,  14062,  14178,  14296,  14414,  14533,
+     14653,  14773,  14895,  15017,  15141,  15265,  15390,  15517,
+     15644,  15773,  15902,  16033,  16165,  16298,  16433,  16568,
+     16706,  16844,  16984,  17126,  17269,  17413,  17560,  17708,
+     17857,  18009,  18163,  18318,  18475,  18635,  18797,  18961,
+     19127,  19295,  19467,  19640,  19817,  19996,  20178,  20364,
+     20552,  20744,  20939,  21138,  21340,  21547,  21758,  21972,
+     22192,  22416,  22645,  22879,  23119,  23364,  23616,  23874,
+     24139,  24411,  24690,  24978,  25274,  25579,  25894,  26220,
+     26556,  26905,  27266,  27641,  28032,  28438,  28862,  29306,
+     29770,  30258,  30771,  31313,  31886,  32495,  32766,  32766,
+     32766,  32766,  32766,  32766,  32766,  32766,  32766,  32766,
+     32766,  32766,  32766,  32766,  32766,  32766,  32766,  32767,
 };
 
+/* Convert a UQ8.8 ADC reading to degC in Q7.8, interpolating between table
+ * entries. Readings below 1 are a disconnected thermistor and readings of
+ * 255 a short.
+ */
+static inline int16_t thermToQ7_8(uint16_t reading) {
+  uint8_t i    = reading >> 8;
+  uint8_t frac = reading & 0xFF;
+  if (i == 0 || i >= UINT8_MAX - 1) {
+    return THERM_LUT_Q7_8_[i];
+  }
+  int16_t lo = THERM_LUT_Q7_8_[i];
+  int16_t hi = THERM_LUT_Q7_8_[i + 1];
+  return lo + (((int32_t)(hi - lo) * frac) >> 8);
+}
+
 #endif /* THERMISTOR_H_ */
@@ -0,0 +1,120 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Trace of control register writes and internal I2C transactions
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "stm32f0xx.h"
+#include "systick.h"
+
+static TraceEntry        ring_[TRACE_LEN];
+static volatile uint16_t seq_  = 0;  // Sequence number of the next entry
+static volatile uint16_t read_ = 0;  // Of the next entry to read
+
+static uint8_t sat8(uint32_t val) {
+  return val > UINT8_MAX ? UINT8_MAX : val;
+}
+
+static void record(uint8_t type, uint8_t a, uint8_t b, uint8_t c) {
+  // Events are recorded from the main loop and from interrupts
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t    now = micros();
+  TraceEntry* e   = &ring_[seq_ & (TRACE_LEN - 1)];
+  e->seq          = seq_;
+  e->type         = type;
+  e->a            = a;
+  e->b            = b;
+  e->c            = c;
+  e->time[0]      = now >> 16;
+  e->time[1]      = now >> 8;
+  e->time[2]      = now;
+  seq_++;
+  __set_PRIMASK(primask);
+}
+
+void traceCtrlWrite(uint8_t reg, uint8_t val) {
+  record(TRACE_CTRL_WRITE, reg, val, 0);
+}
+
+void traceI2C2(uint8_t dev, uint8_t first, uint32_t status, uint32_t us) {
+  TraceResult result;
+  switch (status) {
+    case 0:
+      result = TRACE_OK;
+      break;
+    case I2C_ISR_NACKF:
+      result = TRACE_NACK;
+      break;
+    case I2C_ISR_ARLO:
+      result = TRACE_ARLO;
+      break;
+    case I2C_ISR_BERR:
+      result = TRACE_BERR;
+      break;
+    default:
+      result = TRACE_TIMEOUT;
+      break;
+  }
+  record(TRACE_I2C2 | result << 4, dev, first, sat8((us + 3) >> 2));
+}
+
+void traceOverrun(uint8_t task, uint32_t late_ms) {
+  record(TRACE_OVERRUN, task, sat8(late_ms), 0);
+}
+
+uint16_t traceSeq() {
+  return seq_;
+}
+
+uint8_t traceUnread() {
+  uint16_t unread = seq_ - read_;
+  return unread > TRACE_LEN ? TRACE_LEN : unread;
+}
+
+void traceRead(TraceEntry* entry) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if ((uint16_t)(seq_ - read_) > TRACE_LEN) {
+    // Overwritten, skip to the oldest entry kept
+    read_ = seq_ - TRACE_LEN;
+  }
+  if (read_ == seq_) {
+    *entry = (TraceEntry){.seq = read_, .type = TRACE_NONE};
+  } else {
+    *entry = ring_[read_ & (TRACE_LEN - 1)];
+  }
+  __set_PRIMASK(primask);
+}
+
+void traceAdvance() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (read_ != seq_) {
+    read_++;
+  }
+  __set_PRIMASK(primask);
+}
+
+void traceRewind() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  read_ = seq_ - (seq_ < TRACE_LEN ? seq_ : TRACE_LEN);
+  __set_PRIMASK(primask);
+}
@@ -0,0 +1,110 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Trace of control register writes and internal I2C transactions
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A ring of the most recent events, timestamped, for finding out after the
+ * fact what the preamp was doing when something went wrong. Only built with
+ * PREAMP_TRACE, otherwise every trace function is an empty inline and the
+ * TRACE_ registers read 0xFF.
+ */
+#define TRACE_LEN 128  // Entries kept, a power of 2
+
+typedef enum
+{
+  TRACE_NONE,        // No entry
+  TRACE_CTRL_WRITE,  // A: register, B: value
+  TRACE_I2C2,        // A: device, B: first byte sent, C: time in 4 us units
+  TRACE_OVERRUN,     // A: task index, B: ms late
+} TraceType;
+
+// Result of a TRACE_I2C2 transaction, in the upper 4 bits of its type
+typedef enum
+{
+  TRACE_OK,
+  TRACE_NACK,
+  TRACE_ARLO,
+  TRACE_BERR,
+  TRACE_TIMEOUT,
+} TraceResult;
+
+typedef struct {
+  uint8_t seq;      // Low byte of the entry's sequence number
+  uint8_t type;     // TraceType, and for TRACE_I2C2 a TraceResult in [7:4]
+  uint8_t a;        // Type specific, 8-bit values saturate at 0xFF
+  uint8_t b;
+  uint8_t c;
+  uint8_t time[3];  // micros() [23:0], high byte first
+} TraceEntry;
+
+#ifdef PREAMP_TRACE
+
+// Record events. Each may be called from the main loop or any interrupt.
+void traceCtrlWrite(uint8_t reg, uint8_t val);
+void traceI2C2(uint8_t dev, uint8_t first, uint32_t status, uint32_t us);
+void traceOverrun(uint8_t task, uint32_t late_ms);
+
+// Number of entries ever recorded, wrapping at 2^16
+uint16_t traceSeq();
+
+// Entries recorded but not yet read, at most TRACE_LEN
+uint8_t traceUnread();
+
+// Get the oldest unread entry, or a TRACE_NONE entry if there are none.
+// Entries overwritten before being read are skipped.
+void traceRead(TraceEntry* entry);
+
+// Mark the entry last returned by traceRead() as read
+void traceAdvance();
+
+// Start reading again from the oldest entry kept
+void traceRewind();
+
+#else
+
+static inline void traceCtrlWrite(uint8_t reg, uint8_t val) {
+  (void)reg;
+  (void)val;
+}
+
+static inline void traceI2C2(uint8_t dev, uint8_t first, uint32_t status,
+                             uint32_t us) {
+  (void)dev;
+  (void)first;
+  (void)status;
+  (void)us;
+}
+
+static inline void traceOverrun(uint8_t task, uint32_t late_ms) {
+  (void)task;
+  (void)late_ms;
+}
+
+static inline void traceAdvance() {}
+
+static inline void traceRewind() {}
+
+#endif /* PREAMP_TRACE */
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,256 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * In-application firmware update of a whole chain of preamps at once
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "update.h"
+
+#include "flash.h"
+#include "serial.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+#include "watchdog.h"
+
+#define UPDATE_SYNC       0x7F
+#define UPDATE_HEADER_LEN 8  // Length and CRC
+
+// Give up if the stream stops for this long
+#define UPDATE_TIMEOUT_MS 2000
+
+// Bytes received by the UART1 interrupt, waiting to be written to flash.
+// Programming a halfword takes ~50 us so this only fills if the flash stalls.
+#define UPDATE_RX_SIZE 128  // Must be a power of 2
+
+static volatile uint8_t rx_buf_[UPDATE_RX_SIZE];
+static volatile uint8_t rx_head_    = 0;  // Next slot to fill, by the interrupt
+static volatile uint8_t rx_tail_    = 0;  // Next byte to write to flash
+static volatile bool    rx_overrun_ = false;
+
+static volatile UpdateStatus status_ = UPDATE_IDLE;
+
+static uint32_t erase_addr_;  // Next staging page to erase
+static uint8_t  header_[UPDATE_HEADER_LEN];
+static uint32_t header_len_;
+static uint32_t image_len_;   // From the header
+static uint32_t image_crc_;   // From the header
+static uint32_t received_;    // Image bytes received
+static uint32_t crc_;         // Running CRC of the bytes received
+static uint16_t halfword_;    // Low byte waiting for its pair to be programmed
+static uint32_t last_rx_ms_;  // Time the last byte was received
+
+// Bitwise CRC-32 (as used by zlib), small enough that a table isn't worth
+// the flash at the rate bytes arrive
+static uint32_t crc32Byte(uint32_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint32_t i = 0; i < 8; i++) {
+    crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return crc;
+}
+
+static uint32_t readLe32(const uint8_t* buf) {
+  return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+// Stop updating, the UART returns to normal
+static void finish(UpdateStatus status) {
+  setUartUpdate(false);
+  flashLock();
+  status_ = status;
+}
+
+static void receiveByte(uint8_t data) {
+  last_rx_ms_ = millis();
+  if (status_ == UPDATE_READY) {
+    // Anything before the sync byte is noise
+    if (data == UPDATE_SYNC) {
+      status_ = UPDATE_RECEIVING;
+    }
+    return;
+  }
+
+  if (header_len_ < UPDATE_HEADER_LEN) {
+    header_[header_len_++] = data;
+    if (header_len_ == UPDATE_HEADER_LEN) {
+      image_len_ = readLe32(&header_[0]);
+      image_crc_ = readLe32(&header_[4]);
+      if (image_len_ == 0 || image_len_ > FLASH_APP_SIZE) {
+        finish(UPDATE_ERR_SIZE);
+      }
+    }
+    return;
+  }
+
+  // Flash is programmed a halfword at a time
+  crc_ = crc32Byte(crc_, data);
+  if (received_ & 1) {
+    halfword_ |= data << 8;
+    if (!flashProgram(FLASH_STAGING_START + received_ - 1, halfword_)) {
+      finish(UPDATE_ERR_FLASH);
+      return;
+    }
+  } else {
+    halfword_ = data;
+  }
+  received_++;
+
+  if (received_ == image_len_) {
+    uint32_t last = FLASH_STAGING_START + received_ - 1;
+    if ((received_ & 1) && !flashProgram(last, halfword_ | 0xFF00)) {
+      finish(UPDATE_ERR_FLASH);
+      return;
+    }
+    finish(~crc_ == image_crc_ ? UPDATE_DONE : UPDATE_ERR_CRC);
+  }
+}
+
+/* Copy the staged image over the running firmware and reset. Runs from RAM
+ * with interrupts disabled since the flash holding the firmware, including
+ * the vector table, is erased. Must not call anything in flash, so the flash
+ * accesses are repeated here rather than using flash.h. The watchdog is
+ * reloaded directly as each page is erased and each halfword programmed.
+ * Interrupted power here leaves the preamp to be recovered with the ROM
+ * bootloader, which the Pi can always start with BOOT0 and NRST.
+ */
+__attribute__((section(".RamFunc"), long_call, noinline, noreturn)) static void
+copyImage(uint32_t len) {
+  for (uint32_t addr = FLASH_APP_START; addr < FLASH_APP_START + len;
+       addr += FLASH_PAGE_SIZE) {
+    FLASH->CR |= FLASH_CR_PER;
+    FLASH->AR = addr;
+    FLASH->CR |= FLASH_CR_STRT;
+    while (FLASH->SR & FLASH_SR_BSY) {}
+    FLASH->CR &= ~FLASH_CR_PER;
+    IWDG->KR = WDG_KEY_RELOAD;
+  }
+  FLASH->CR |= FLASH_CR_PG;
+  for (uint32_t i = 0; i < len; i += 2) {
+    *(volatile uint16_t*)(FLASH_APP_START + i) =
+        *(volatile uint16_t*)(FLASH_STAGING_START + i);
+    while (FLASH->SR & FLASH_SR_BSY) {}
+    IWDG->KR = WDG_KEY_RELOAD;
+  }
+  FLASH->CR &= ~FLASH_CR_PG;
+
+  // Same as NVIC_SystemReset(), which may not be inlined
+  SCB->AIRCR = (0x5FA << SCB_AIRCR_VECTKEY_Pos) | SCB_AIRCR_SYSRESETREQ_Msk;
+  while (true) {}
+}
+
+void updateCommand(UpdateCmd cmd) {
+  switch (cmd) {
+    case UPDATE_CMD_START:
+      setUartUpdate(false);
+      __disable_irq();
+      rx_head_    = 0;
+      rx_tail_    = 0;
+      rx_overrun_ = false;
+      __enable_irq();
+      header_len_ = 0;
+      received_   = 0;
+      crc_        = 0xFFFFFFFF;
+      erase_addr_ = FLASH_STAGING_START;
+      flashUnlock();
+      status_ = UPDATE_ERASING;
+      break;
+
+    case UPDATE_CMD_APPLY:
+      if (status_ == UPDATE_DONE) {
+        __disable_irq();
+        flashUnlock();
+        copyImage(image_len_);
+      }
+      break;
+
+    case UPDATE_CMD_ABORT:
+    default:
+      finish(UPDATE_IDLE);
+      break;
+  }
+}
+
+void updateReceive(uint8_t data) {
+  if ((uint8_t)(rx_head_ - rx_tail_) >= UPDATE_RX_SIZE) {
+    rx_overrun_ = true;
+    return;
+  }
+  rx_buf_[rx_head_ & (UPDATE_RX_SIZE - 1)] = data;
+  rx_head_++;
+}
+
+void updateRun() {
+  switch (status_) {
+    case UPDATE_ERASING:
+      // A page per call, so I2C writes are still handled in between
+      if (!flashErasePage(erase_addr_)) {
+        finish(UPDATE_ERR_FLASH);
+        break;
+      }
+      erase_addr_ += FLASH_PAGE_SIZE;
+      if (erase_addr_ >= FLASH_STAGING_START + FLASH_APP_SIZE) {
+        last_rx_ms_ = millis();
+        status_     = UPDATE_READY;
+        setUartUpdate(true);
+      }
+      break;
+
+    case UPDATE_READY:
+    case UPDATE_RECEIVING:
+      if (rx_overrun_) {
+        finish(UPDATE_ERR_OVERRUN);
+        break;
+      }
+      // Only the bytes already received, so other tasks aren't starved
+      for (uint8_t head = rx_head_; rx_tail_ != head &&
+           (status_ == UPDATE_READY || status_ == UPDATE_RECEIVING);) {
+        uint8_t data = rx_buf_[rx_tail_ & (UPDATE_RX_SIZE - 1)];
+        rx_tail_++;
+        receiveByte(data);
+      }
+      // Waiting for the stream to start only ends with a command
+      if (status_ == UPDATE_RECEIVING &&
+          millis() - last_rx_ms_ > UPDATE_TIMEOUT_MS) {
+        finish(UPDATE_ERR_TIMEOUT);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+bool updatePending() {
+  return rx_tail_ != rx_head_;
+}
+
+UpdateStatus updateStatus() {
+  return status_;
+}
+
+bool updateBusy() {
+  return status_ == UPDATE_ERASING || status_ == UPDATE_READY ||
+         status_ == UPDATE_RECEIVING;
+}
+
+uint32_t updateLength() {
+  return received_;
+}
+
+uint32_t updateCrc() {
+  return ~crc_;
+}
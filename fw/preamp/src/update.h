@@ -0,0 +1,70 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * In-application firmware update of a whole chain of preamps at once
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef UPDATE_H_
+#define UPDATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A new image is streamed over UART1 and written to a staging area in flash,
+ * while every byte is also forwarded to the expansion unit, so all preamps in
+ * a chain receive it in a single pass. The stream is a sync byte (0x7F, for
+ * auto-baud), the image length and its CRC-32 (both 32-bit little-endian),
+ * then the image itself. Once all preamps report UPDATE_DONE the Pi applies
+ * the update, which copies the image over the running firmware and resets.
+ */
+typedef enum
+{
+  UPDATE_IDLE,         // Not updating, the UART is used normally
+  UPDATE_ERASING,      // Erasing the staging area, don't access I2C until READY
+  UPDATE_READY,        // Waiting for the stream to start
+  UPDATE_RECEIVING,    // Writing the image to the staging area
+  UPDATE_DONE,         // Image received and its CRC matches, ready to apply
+  UPDATE_ERR_CRC,      // Image received but its CRC doesn't match
+  UPDATE_ERR_SIZE,     // Image too large for the staging area
+  UPDATE_ERR_FLASH,    // Erasing or programming the flash failed
+  UPDATE_ERR_OVERRUN,  // Bytes arrived faster than they could be written
+  UPDATE_ERR_TIMEOUT,  // The stream stopped part way through the image
+} UpdateStatus;
+
+// Commands written to REG_UPDATE
+typedef enum
+{
+  UPDATE_CMD_ABORT = 0x00,
+  UPDATE_CMD_START = 0x01,  // Erase the staging area and wait for an image
+  UPDATE_CMD_APPLY = 0x02,  // Copy a received image over this firmware
+} UpdateCmd;
+
+void updateCommand(UpdateCmd cmd);
+
+// Called by the UART1 interrupt with each byte received while updating
+void updateReceive(uint8_t data);
+
+// Erase and program the flash, run periodically and whenever updatePending()
+void updateRun();
+bool updatePending();
+
+UpdateStatus updateStatus();
+bool         updateBusy();    // Using the flash, from START until finished
+uint32_t     updateLength();  // Bytes of the image received so far
+uint32_t     updateCrc();     // CRC-32 of the image received so far
+
+#endif /* UPDATE_H_ */
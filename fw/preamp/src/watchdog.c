@@ -0,0 +1,105 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Independent watchdog, kicked only while every critical task checks in
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "watchdog.h"
+
+#include <stdbool.h>
+
+#include "boot.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+
+#define WDG_KEY_ENABLE 0xCCCC
+#define WDG_KEY_ACCESS 0x5555
+
+#define WDG_PRESCALER 0x03  // LSI / 32
+#define WDG_RELOAD    ((40000 / 32) * WDG_TIMEOUT_MS / 1000)
+
+// Kicks normally happen every ADC period (8 ms). Once this long has passed
+// without one the preamp is assumed to be on its way to a reset.
+#define WDG_RECORD_MS 100
+
+#define WDG_MAGIC 0x57444F47
+
+// Kept through a reset, so not cleared by the startup code
+typedef struct {
+  uint32_t magic;
+  uint8_t  missed;
+  uint8_t  task;
+} WatchdogRecord;
+
+__attribute__((section(".noinit"))) static volatile WatchdogRecord record_;
+
+static volatile uint8_t  checked_    = 0;
+static volatile uint32_t last_kick_  = 0;
+static volatile bool     running_    = false;
+static uint8_t           last_reset_ = 0;
+
+void watchdogInit() {
+  if (bootResetCause() & RESET_CAUSE_IWDG) {
+    last_reset_ = record_.magic == WDG_MAGIC
+                      ? (record_.missed << 4) | (record_.task & 0x0F)
+                      : WDG_TASK_IDLE;
+  } else {
+    last_reset_ = 0;
+  }
+  record_.magic = 0;
+
+  // Stop the IWDG while a debugger has the core halted
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_DBGMCU, ENABLE);
+  DBGMCU->APB1FZ |= DBGMCU_APB1_FZ_DBG_IWDG_STOP;
+
+  // Starting the IWDG also starts the LSI
+  IWDG->KR  = WDG_KEY_ENABLE;
+  IWDG->KR  = WDG_KEY_ACCESS;
+  IWDG->PR  = WDG_PRESCALER;
+  IWDG->RLR = WDG_RELOAD;
+  while (IWDG->SR & (IWDG_SR_PVU | IWDG_SR_RVU)) {}
+  IWDG->KR = WDG_KEY_RELOAD;
+
+  checked_   = 0;
+  last_kick_ = millis();
+  running_   = true;
+}
+
+void watchdogCheckIn(uint8_t id) {
+  checked_ |= id;
+}
+
+void watchdogKick() {
+  if ((checked_ & WDG_ALL) != WDG_ALL) {
+    return;
+  }
+  IWDG->KR   = WDG_KEY_RELOAD;
+  checked_   = 0;
+  last_kick_ = millis();
+}
+
+void watchdogTick(uint8_t task) {
+  if (running_ && millis() - last_kick_ >= WDG_RECORD_MS) {
+    record_.missed = WDG_ALL & ~checked_;
+    record_.task   = task < WDG_TASK_IDLE ? task : WDG_TASK_IDLE;
+    record_.magic  = WDG_MAGIC;
+  }
+}
+
+uint8_t watchdogLastReset() {
+  return last_reset_;
+}
@@ -0,0 +1,68 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Independent watchdog, kicked only while every critical task checks in
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include <stdint.h>
+
+/* The IWDG resets the preamp if it isn't kicked for WDG_TIMEOUT_MS. Each
+ * critical task checks in as it makes progress, and the main loop's kick only
+ * reloads the IWDG once all of them have, so a wedged bus or a task that
+ * stops running resets the preamp even while the main loop still spins.
+ * Which check-ins were missing, and the task running, are kept in RAM across
+ * the reset and reported in REG_WATCHDOG.
+ */
+#define WDG_CTRL 0x01  // Controller I2C writes applied
+#define WDG_I2C2 0x02  // Internal I2C transfers completed
+#define WDG_ADC  0x04  // ADC reads finished, successful or not
+#define WDG_UART 0x08  // UART messages checked
+#define WDG_ALL  0x0F
+
+// LSI at 40 kHz (30 to 50 kHz) divided by 32, so 320 to 533 ms
+#define WDG_TIMEOUT_MS 400
+
+// Written to IWDG->KR to reload the counter, also used directly while the
+// firmware update runs from RAM
+#define WDG_KEY_RELOAD 0xAAAA
+
+// REG_WATCHDOG after a watchdog reset: the missed check-ins in [7:4] and the
+// scheduler's task index in [3:0], WDG_TASK_IDLE if none was running.
+// 0x00 after any other reset.
+#define WDG_TASK_IDLE 0x0F
+
+// Report the last watchdog reset, if that's what bootInit() found, then start
+// the IWDG. It can't be stopped, so call just before the main loop.
+void watchdogInit();
+
+// A critical task made progress, one of the WDG_ bits
+void watchdogCheckIn(uint8_t id);
+
+// Reload the IWDG if every task has checked in since the last reload
+void watchdogKick();
+
+// Called every ms from the SysTick interrupt with the running task, records
+// who is to blame while a reset is near
+void watchdogTick(uint8_t task);
+
+// REG_WATCHDOG
+uint8_t watchdogLastReset();
+
+#endif /* WATCHDOG_H_ */
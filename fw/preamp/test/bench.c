@@ -0,0 +1,187 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Internal bus traffic per control command, against a budget
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Each benchmark sends a control command the way the Pi would and counts the
+ * internal I2C transfers, bytes and GPIO port writes it causes. The budgets
+ * are what the firmware does today, so any increase in traffic fails until
+ * it's either fixed or the budget is raised along with the change causing it.
+ * The board's background traffic is paused for each command, then measured
+ * on its own.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "audio_mux.h"
+#include "board.h"
+#include "fake_hal.h"
+#include "port_defs.h"
+#include "profile.h"
+#include "test.h"
+
+typedef struct {
+  const char* name;
+  void (*setup)();  // Not measured
+  void (*run)();
+  bool   background;  // Run the periodic reads and LED and fan updates
+  size_t max_xfers;
+  size_t max_bytes;
+  size_t max_pin_writes;
+} Bench;
+
+// All zones unmuted on source 1, out of standby at -40 dB
+static void setupPlaying() {
+  AudioConfig cfg = {.standby = false};
+  memset(cfg.vols, 40, sizeof(cfg.vols));
+  setAudioConfig(&cfg);
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    setZoneRampRate(zone, 0);
+  }
+  boardRun(16);
+}
+
+static void setupStandby() {
+  setupPlaying();
+  boardWriteReg(REG_STANDBY, 0);
+}
+
+static void benchVolumeOne() {
+  boardWriteReg(REG_VOL_ZONE1, 30);
+}
+
+static void benchVolumeSame() {
+  boardWriteReg(REG_VOL_ZONE1, 40);
+}
+
+static void benchVolumeAll() {
+  const uint8_t vols[NUM_ZONES] = {30, 31, 32, 33, 34, 35};
+  boardWrite(REG_VOL_ZONE1, vols, sizeof(vols));
+}
+
+static void benchVolumeGroup() {
+  uint8_t vol = 20;
+  fakeCtrlWrite(0x70, REG_VOL_ZONE5, &vol, 1);
+  boardRun(1);
+}
+
+static void benchMuteAll() {
+  boardWriteReg(REG_MUTE, 0x3F);
+}
+
+static void benchSourceOne() {
+  boardWriteReg(REG_ZONE321, 0x01);
+}
+
+static void benchSourceAll() {
+  const uint8_t srcs[2] = {0x39, 0x39};
+  boardWrite(REG_ZONE321, srcs, sizeof(srcs));
+}
+
+static void benchStandbyExit() {
+  boardWriteReg(REG_STANDBY, 1);
+}
+
+static void benchCommit() {
+  const uint8_t cfg[12] = {0x0F, 0x39, 0x39, 0x00, 0x01, 10, 11, 12, 13, 14,
+                           15,   1};
+  boardWrite(REG_STAGE_SRC_AD, cfg, sizeof(cfg));
+}
+
+// Ramp zone 1 down 10 dB at 1 dB/ms
+static void benchRamp() {
+  const uint8_t ramp[1] = {1};
+  boardWrite(REG_VOL_RATE_ZONE1, ramp, sizeof(ramp));
+  boardWriteReg(REG_VOL_TARGET_ZONE1, 50);
+  boardRun(16);
+}
+
+static void benchStatusRead() {
+  uint8_t regs[REG_DIRTY - REG_POWER + 1];
+  fakeCtrlRead(BOARD_ADDR, REG_POWER, regs, sizeof(regs));
+  boardRun(1);
+}
+
+// Background traffic of a board left alone for a second
+static void benchIdle() {
+  boardRun(1000);
+}
+
+static const Bench benches_[] = {
+    {"volume, one zone", setupPlaying, benchVolumeOne, false, 1, 4, 0},
+    {"volume, unchanged", setupPlaying, benchVolumeSame, false, 0, 0, 0},
+    {"volume, all zones", setupPlaying, benchVolumeAll, false, 2, 16, 0},
+    {"volume, group address", setupPlaying, benchVolumeGroup, false, 1, 4, 0},
+    {"mute, all zones", setupPlaying, benchMuteAll, false, 0, 0, 6},
+    {"source, one zone", setupPlaying, benchSourceOne, false, 0, 0, 12},
+    {"source, all zones", setupPlaying, benchSourceAll, false, 0, 0, 25},
+    {"standby exit", setupStandby, benchStandbyExit, false, 2, 16, 3},
+    {"commit, full config", setupPlaying, benchCommit, false, 2, 16, 13},
+    {"ramp, 10 dB", setupPlaying, benchRamp, false, 10, 40, 0},
+    {"status read", setupPlaying, benchStatusRead, false, 0, 0, 0},
+    {"idle, 1 s", setupPlaying, benchIdle, true, 625, 2875, 0},
+};
+
+/* The scheduler's busy periods and the time applying control writes over all
+ * the benchmarks, read back from the PROF registers as the Pi would. The fake
+ * clock only advances for modeled bus time, not for the code itself, so on
+ * the host these show how long the tasks wait on the internal bus.
+ */
+static void printProfile() {
+  static const struct {
+    const char* name;
+    ProfStage   stage;
+  } stages[] = {
+      {"PROF_LOOP", PROF_LOOP},
+      {"PROF_CTRL_I2C", PROF_CTRL_I2C},
+  };
+  printf("\n%-24s %12s %12s %12s  (cycles at %u MHz)\n", "profile", "min",
+         "avg", "max", (unsigned)(SYSCLK_HZ / 1000000));
+  for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+    uint8_t regs[2 * PROF_NUM_STATS];
+    fakeCtrlRead(BOARD_ADDR, REG_PROF_FIRST + stages[i].stage * sizeof(regs),
+                 regs, sizeof(regs));
+    printf("%-24s %12u %12u %12u\n", stages[i].name, regs[0] << 8 | regs[1],
+           regs[2] << 8 | regs[3], regs[4] << 8 | regs[5]);
+  }
+}
+
+int runBenchmarks() {
+  int over = 0;
+  boardWriteReg(REG_PROF_RESET, 0);
+  printf("%-24s %12s %12s %12s\n", "command", "xfers", "bytes", "pin writes");
+  for (size_t i = 0; i < sizeof(benches_) / sizeof(benches_[0]); i++) {
+    const Bench* b = &benches_[i];
+    boardBackground(b->background);
+    b->setup();
+    fakeLogReset();
+    b->run();
+    size_t xfers = fakeXferCount();
+    size_t bytes = fakeXferBytes();
+    size_t pins  = fakePinWriteCount();
+    bool   fail  = xfers > b->max_xfers || bytes > b->max_bytes ||
+                pins > b->max_pin_writes;
+    printf("%-24s %5zu (%4zu) %5zu (%4zu) %5zu (%4zu)%s\n", b->name, xfers,
+           b->max_xfers, bytes, b->max_bytes, pins, b->max_pin_writes,
+           fail ? "  OVER BUDGET" : "");
+    over += fail ? 1 : 0;
+  }
+  printProfile();
+  return over;
+}
@@ -0,0 +1,204 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * A simulated preamp board, running the main loop against the fake HAL
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "board.h"
+
+#include <string.h>
+
+#include "audio_mux.h"
+#include "boot.h"
+#include "fake_hal.h"
+#include "i2c2.h"
+#include "idle.h"
+#include "int_i2c.h"
+#include "port_defs.h"
+#include "profile.h"
+#include "sched.h"
+#include "systick.h"
+#include "watchdog.h"
+
+AmpliPiState board_;
+
+static bool background_ = true;
+
+/* main.c's tasks, minus those for hardware the host doesn't have. The
+ * periodic ADC and Power Board reads, LED updates and fan control only run
+ * while the background is enabled.
+ */
+static void ctrlTask() {
+  uint32_t start = profStart();
+  ctrlI2CUpdate(&board_);
+  idleUpdate();
+  watchdogCheckIn(WDG_CTRL);
+  profEnd(PROF_CTRL_I2C, start);
+}
+
+static void i2c2Task() {
+  i2c2Update();
+  watchdogCheckIn(WDG_I2C2);
+}
+
+static void fanOnTask();
+
+static void rampTask() {
+  updateRamps();
+}
+
+static void uartTask() {
+  watchdogCheckIn(WDG_UART);
+}
+
+static void adcTask() {
+  if (background_) {
+    readAdc();
+  }
+}
+
+static void pwrInTask() {
+  if (background_) {
+    readPwrGpio();
+  }
+}
+
+static void ledTask() {
+  if (background_) {
+    writeLeds(&board_);
+  }
+}
+
+static void regsTask() {
+  idleUpdate();
+  watchdogKick();
+  board_.loop_overruns = schedOverruns();
+  board_.loops++;  // Each pass is one of schedLoops()'s busy periods
+  ctrlI2CUpdateRegs(&board_);
+}
+
+typedef enum
+{
+  TASK_CTRL,
+  TASK_I2C2,
+  TASK_FAN_ON,
+  TASK_RAMP,
+  TASK_UART,
+  TASK_ADC,
+  TASK_PWR_IN,
+  TASK_LEDS,
+  TASK_REGS,
+  NUM_TASKS,
+} TaskId;
+
+// The periods and offsets of main.c's task table
+static Task tasks_[NUM_TASKS] = {
+    [TASK_CTRL]   = {.run = ctrlTask, .ready = ctrlI2CPending, .period = 1},
+    [TASK_I2C2]   = {.run = i2c2Task, .ready = i2c2Pending, .period = 1},
+    [TASK_FAN_ON] = {.run = fanOnTask, .waiting = true},
+    [TASK_RAMP]   = {.run = rampTask, .period = 1},
+    [TASK_UART]   = {.run = uartTask, .period = 1, .deadline = 5},
+    [TASK_ADC]    = {.run = adcTask, .period = ADC_MS, .deadline = 2},
+    [TASK_PWR_IN] = {.run      = pwrInTask,
+                     .period   = PWR_IN_MS,
+                     .deadline = 1,
+                     .next     = 1},
+    [TASK_LEDS]   = {.run      = ledTask,
+                     .period   = LEDS_MS,
+                     .deadline = 4,
+                     .next     = 2},
+    [TASK_REGS]   = {.run = regsTask, .period = 1},
+};
+
+static void fanOnTask() {
+  if (background_) {
+    schedAt(&tasks_[TASK_FAN_ON], writePwrGpio(&board_));
+  }
+}
+
+static uint32_t now_ms_;
+
+void boardInit() {
+  fakeReset();
+  bootInit();
+  writePin(exp_nrst_, false);
+  writePin(exp_boot0_, false);
+  memset(&board_, 0, sizeof(board_));
+  profReset();
+  systickInit();
+  initZones();
+  initSources();
+  initInternalI2C(&board_);
+  writePin(exp_nrst_, true);
+  board_.expansion.nrst = true;
+
+  board_.i2c_addr = BOARD_ADDR;
+  ctrlI2CInit(&board_);
+  fakeI2C2Flush();
+  watchdogInit();
+  idleInit(&tasks_[TASK_ADC], &tasks_[TASK_PWR_IN], &tasks_[TASK_LEDS]);
+  schedInit(tasks_, NUM_TASKS);
+  now_ms_ = millis();
+}
+
+/* Each millisecond every task that's due is run by the scheduler, as
+ * schedRun() does between sleeps. Bus transfers complete within the
+ * millisecond they're queued in, faster than on the board, so the counts of
+ * transfers are exact but their timing isn't.
+ */
+void boardRun(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i++) {
+    // Each busy period is profiled as one loop, as by schedRun()
+    uint32_t start = profStart();
+    bool     busy  = false;
+    while (schedStep()) {
+      busy = true;
+    }
+    if (busy) {
+      profEnd(PROF_LOOP, start);
+    }
+    i2c2Update();
+
+    // Wait for the next tick, unless the bus already ran past it
+    now_ms_++;
+    if (!timeReached(millis(), now_ms_)) {
+      fakeAdvanceUs((uint32_t)((uint64_t)now_ms_ * 1000 - fakeMicros()));
+    }
+  }
+  fakeI2C2Flush();
+  ctrlI2CUpdateRegs(&board_);
+}
+
+void boardBackground(bool enable) {
+  background_ = enable;
+  schedAt(&tasks_[TASK_FAN_ON], millis());
+}
+
+void boardWrite(uint8_t reg, const uint8_t* data, size_t len) {
+  fakeCtrlWrite(BOARD_ADDR, reg, data, len);
+  boardRun(1);
+}
+
+void boardWriteReg(uint8_t reg, uint8_t val) {
+  boardWrite(reg, &val, 1);
+}
+
+uint8_t boardReadReg(uint8_t reg) {
+  uint8_t val;
+  fakeCtrlRead(BOARD_ADDR, reg, &val, 1);
+  return val;
+}
@@ -0,0 +1,56 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * A simulated preamp board, running the main loop against the fake HAL
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BOARD_H_
+#define BOARD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ctrl_i2c.h"
+
+// The first preamp's address once assigned by the controller
+#define BOARD_ADDR 0x10
+
+// The state otherwise owned by main.c
+extern AmpliPiState board_;
+
+/* Reset the fakes and initialize the modules as main.c does, with the
+ * address already assigned. The modules keep their state in statics that
+ * can't be reset, so this is done once and every test runs on the same
+ * board, setting up what it depends on.
+ */
+void boardInit();
+
+// Run the main loop for ms milliseconds, each task on main.c's schedule
+void boardRun(uint32_t ms);
+
+// Pause or resume the periodic ADC and Power Board reads, LED updates and
+// fan control, so only the traffic caused by a command is seen
+void boardBackground(bool enable);
+
+// Write registers over the controller bus, then run the main loop for 1 ms
+void boardWrite(uint8_t reg, const uint8_t* data, size_t len);
+void boardWriteReg(uint8_t reg, uint8_t val);
+
+uint8_t boardReadReg(uint8_t reg);
+
+#endif /* BOARD_H_ */
@@ -0,0 +1,67 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Host stand-in for the CMSIS Cortex-M0 core header
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Included by CMSIS/device/stm32f0xx.h in place of CMSIS/core/core_cm0.h,
+ * which is found first because CMSIS/core isn't on the host include path.
+ * Only what the modules built on the host use: the register qualifiers, and
+ * interrupt control that does nothing since the fake HAL calls interrupt
+ * handlers directly.
+ */
+
+#ifndef FAKE_CORE_CM0_H_
+#define FAKE_CORE_CM0_H_
+
+#include <stdint.h>
+
+#define __I  volatile const
+#define __O  volatile
+#define __IO volatile
+
+#define __STATIC_INLINE static inline
+
+static inline void __disable_irq(void) {}
+static inline void __enable_irq(void) {}
+
+static inline uint32_t __get_PRIMASK(void) {
+  return 0;
+}
+
+static inline void __set_PRIMASK(uint32_t primask) {
+  (void)primask;
+}
+
+static inline void __NOP(void) {}
+
+static inline void __WFI(void) {}
+
+static inline void NVIC_EnableIRQ(IRQn_Type irq) {
+  (void)irq;
+}
+
+static inline void NVIC_DisableIRQ(IRQn_Type irq) {
+  (void)irq;
+}
+
+static inline void NVIC_SetPriority(IRQn_Type irq, uint32_t priority) {
+  (void)irq;
+  (void)priority;
+}
+
+#endif /* FAKE_CORE_CM0_H_ */
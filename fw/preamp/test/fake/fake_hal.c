@@ -0,0 +1,231 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fake GPIO and controller I2C peripherals for running on a host
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fake_hal.h"
+
+#include <string.h>
+
+#include "stm32f0xx.h"
+
+FakeGpioPort   fake_gpio_[FAKE_NUM_GPIO];
+DBGMCU_TypeDef fake_dbgmcu_;
+I2C_TypeDef    fake_i2c1_;
+IWDG_TypeDef   fake_iwdg_;
+RCC_TypeDef    fake_rcc_;
+SYSCFG_TypeDef fake_syscfg_;
+
+uint32_t SystemCoreClock  = SYSCLK_HZ;
+uint32_t SystemInitCycles = 0;
+
+static FakePinWrite pin_log_[FAKE_LOG_SIZE];
+static size_t       pin_writes_ = 0;
+
+// Defined by fake_i2c2.c and fake_systick.c
+void fakeI2C2Reset();
+void fakeI2C2LogReset();
+void fakeSystickReset();
+
+void fakeReset() {
+  memset(fake_gpio_, 0, sizeof(fake_gpio_));
+  for (size_t i = 0; i < FAKE_NUM_GPIO; i++) {
+    fake_gpio_[i].regs.IDR = 0xFFFF;
+  }
+  memset(&fake_dbgmcu_, 0, sizeof(fake_dbgmcu_));
+  memset(&fake_i2c1_, 0, sizeof(fake_i2c1_));
+  memset(&fake_iwdg_, 0, sizeof(fake_iwdg_));
+  memset(&fake_syscfg_, 0, sizeof(fake_syscfg_));
+  // Powered on, which sets the pin reset flag too
+  memset(&fake_rcc_, 0, sizeof(fake_rcc_));
+  fake_rcc_.CSR = RCC_CSR_PORRSTF | RCC_CSR_PINRSTF;
+  fakeI2C2Reset();
+  fakeSystickReset();
+  fakeLogReset();
+}
+
+void fakeLogReset() {
+  pin_writes_ = 0;
+  fakeI2C2LogReset();
+}
+
+/* GPIO */
+
+void fakeGpioWrite(GPIO_TypeDef* port, uint32_t bsrr) {
+  size_t   i   = (FakeGpioPort*)port - fake_gpio_;
+  uint16_t set = bsrr & 0xFFFF;
+  uint16_t clr = (bsrr >> 16) & ~set;  // Setting takes priority
+  if (pin_writes_ < FAKE_LOG_SIZE) {
+    pin_log_[pin_writes_] = (FakePinWrite){.port = i, .set = set, .clr = clr};
+  }
+  pin_writes_++;
+  port->ODR = (port->ODR & ~clr) | set;
+  port->IDR = (port->IDR & ~clr) | set;
+}
+
+size_t fakePinWriteCount() {
+  return pin_writes_;
+}
+
+const FakePinWrite* fakePinWriteLog(size_t i) {
+  return i < pin_writes_ && i < FAKE_LOG_SIZE ? &pin_log_[i] : NULL;
+}
+
+void fakePinInput(Pin pp, bool level) {
+  if (level) {
+    pp.port->IDR |= pp.mask;
+  } else {
+    pp.port->IDR &= ~pp.mask;
+  }
+}
+
+/* StdPeriph functions used by the modules built on the host. Configuration is
+ * accepted and ignored, only the controller I2C data registers matter.
+ */
+
+void RCC_I2CCLKConfig(uint32_t RCC_I2CCLK) {
+  (void)RCC_I2CCLK;
+}
+
+void RCC_APB1PeriphClockCmd(uint32_t RCC_APB1Periph, FunctionalState NewState) {
+  (void)RCC_APB1Periph;
+  (void)NewState;
+}
+
+void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState) {
+  (void)RCC_APB2Periph;
+  (void)NewState;
+}
+
+void GPIO_Init(GPIO_TypeDef* GPIOx, GPIO_InitTypeDef* GPIO_InitStruct) {
+  (void)GPIOx;
+  (void)GPIO_InitStruct;
+}
+
+void GPIO_PinAFConfig(GPIO_TypeDef* GPIOx, uint16_t GPIO_PinSource,
+                      uint8_t GPIO_AF) {
+  (void)GPIOx;
+  (void)GPIO_PinSource;
+  (void)GPIO_AF;
+}
+
+void I2C_Init(I2C_TypeDef* I2Cx, I2C_InitTypeDef* I2C_InitStruct) {
+  I2Cx->OAR1 = I2C_InitStruct->I2C_OwnAddress1;
+}
+
+void I2C_Cmd(I2C_TypeDef* I2Cx, FunctionalState NewState) {
+  if (NewState) {
+    I2Cx->CR1 |= I2C_CR1_PE;
+  } else {
+    I2Cx->CR1 &= ~I2C_CR1_PE;
+  }
+}
+
+void I2C_ITConfig(I2C_TypeDef* I2Cx, uint32_t I2C_IT,
+                  FunctionalState NewState) {
+  if (NewState) {
+    I2Cx->CR1 |= I2C_IT;
+  } else {
+    I2Cx->CR1 &= ~I2C_IT;
+  }
+}
+
+void I2C_DualAddressCmd(I2C_TypeDef* I2Cx, FunctionalState NewState) {
+  if (NewState) {
+    I2Cx->OAR2 |= I2C_OAR2_OA2EN;
+  } else {
+    I2Cx->OAR2 &= ~I2C_OAR2_OA2EN;
+  }
+}
+
+void I2C_OwnAddress2Config(I2C_TypeDef* I2Cx, uint16_t Address, uint8_t Mask) {
+  (void)Mask;
+  I2Cx->OAR2 = (I2Cx->OAR2 & I2C_OAR2_OA2EN) | (Address & I2C_OAR2_OA2);
+}
+
+void I2C_SendData(I2C_TypeDef* I2Cx, uint8_t Data) {
+  I2Cx->TXDR = Data;
+}
+
+uint8_t I2C_ReceiveData(I2C_TypeDef* I2Cx) {
+  return I2Cx->RXDR;
+}
+
+/* Controller I2C bus, acting as the Pi. Each event sets I2C1's ISR the way
+ * the peripheral would and calls the interrupt handler. Writes to ICR and
+ * ISR by the handler have no effect, the next event replaces ISR.
+ */
+
+void I2C1_IRQHandler(void);
+
+static void ctrlEvent(uint32_t isr) {
+  fake_i2c1_.ISR = isr;
+  I2C1_IRQHandler();
+}
+
+// A START or repeated START addressed to the preamp. Like a STOP, this
+// clears any NACK requested for the last transaction.
+static void ctrlStart(uint8_t addr, bool read) {
+  fake_i2c1_.CR2 &= ~I2C_CR2_NACK;
+  uint32_t addcode = ((uint32_t)addr << 16) & I2C_ISR_ADDCODE;
+  ctrlEvent(I2C_ISR_ADDR | addcode | (read ? I2C_ISR_DIR : 0));
+}
+
+// Receive a byte, returns false if the preamp NACKed it
+static bool ctrlReceive(uint8_t data) {
+  bool nack       = fake_i2c1_.CR2 & I2C_CR2_NACK;
+  fake_i2c1_.CR2 &= ~I2C_CR2_NACK;
+  fake_i2c1_.RXDR = data;
+  ctrlEvent(I2C_ISR_RXNE);
+  return !nack;
+}
+
+static void ctrlStop() {
+  fake_i2c1_.CR2 &= ~I2C_CR2_NACK;
+  ctrlEvent(I2C_ISR_STOPF);
+}
+
+size_t fakeCtrlWrite(uint8_t addr, uint8_t reg, const uint8_t* data,
+                     size_t len) {
+  ctrlStart(addr, false);
+  size_t acked = 0;
+  if (ctrlReceive(reg)) {
+    while (acked < len && ctrlReceive(data[acked])) {
+      acked++;
+    }
+  }
+  ctrlStop();
+  return acked;
+}
+
+void fakeCtrlRead(uint8_t addr, uint8_t reg, uint8_t* data, size_t len) {
+  ctrlStart(addr, false);
+  ctrlReceive(reg);
+  ctrlStart(addr, true);
+
+  // Each byte is loaded into TXDR while the previous one is sent, so the
+  // byte after the last one read is loaded but never sent
+  for (size_t i = 0; i <= len; i++) {
+    ctrlEvent(I2C_ISR_TXIS | I2C_ISR_TXE);
+    if (i < len) {
+      data[i] = fake_i2c1_.TXDR;
+    }
+  }
+  ctrlEvent(I2C_ISR_NACKF);
+  ctrlStop();
+}
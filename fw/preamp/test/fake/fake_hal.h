@@ -0,0 +1,99 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fake GPIO, I2C and systick layer for running the preamp logic on a host
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAKE_HAL_H_
+#define FAKE_HAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ports.h"
+
+// Entries kept in each log, later entries are counted but not kept
+#define FAKE_LOG_SIZE 1024
+
+// Restore every fake to its power-on state and clear the logs. RCC_CSR reports
+// a power-on reset.
+void fakeReset();
+
+// Clear the pin and bus logs, e.g. between the commands being measured
+void fakeLogReset();
+
+/* GPIO. Every write to a port's BSRR (including writePin()) is logged, and
+ * applied to both its ODR and IDR so outputs read back what was written.
+ * All IDR bits start high, as if pulled up.
+ */
+typedef struct {
+  uint8_t  port;  // 0 for GPIOA through 5 for GPIOF
+  uint16_t set;
+  uint16_t clr;
+} FakePinWrite;
+
+size_t              fakePinWriteCount();
+const FakePinWrite* fakePinWriteLog(size_t i);
+void                fakePinInput(Pin pp, bool level);
+
+/* Internal I2C bus, replacing i2c2.c. Submitted transfers complete on the
+ * next i2c2Update() against simple models of the devices in port_defs.h:
+ * the TDA7448s, both MCP23008s, the MAX11601 and the MCP4017. Other devices,
+ * or any set to NACK, fail with I2C_ISR_NACKF. Each transfer advances the
+ * fake time by the time it would take on the bus at 400 kHz.
+ */
+#define FAKE_XFER_TX_LEN 8  // Bytes of each transfer's tx kept in the log
+
+typedef struct {
+  uint8_t  dev;
+  uint8_t  prio;
+  uint8_t  tx_len;
+  uint8_t  rx_len;
+  uint8_t  tx[FAKE_XFER_TX_LEN];
+  uint32_t status;
+} FakeXfer;
+
+size_t          fakeXferCount();
+const FakeXfer* fakeXferLog(size_t i);
+size_t          fakeXferDevCount(uint8_t dev);  // Transfers to a device
+size_t          fakeXferBytes();  // Bytes on the bus, including addresses
+
+// A device's registers: the MCP23008 registers, the TDA7448 subaddresses,
+// the ADC channels or the DPOT value at 0
+uint8_t* fakeDevRegs(uint8_t dev);
+void     fakeDevNack(uint8_t dev, bool nack);
+
+// Run i2c2Update() until every queued transfer and its callback is done
+void fakeI2C2Flush();
+
+// Time, advanced only by the fakes and the functions below
+uint64_t fakeMicros();
+void     fakeAdvanceUs(uint32_t us);
+void     fakeAdvanceMs(uint32_t ms);
+
+/* Controller I2C bus. Act as the Pi, driving I2C1_IRQHandler() through each
+ * event of a transaction. addr is the preamp's address shifted left by one,
+ * as in AmpliPiState.i2c_addr. Returns the number of data bytes ACKed.
+ */
+size_t fakeCtrlWrite(uint8_t addr, uint8_t reg, const uint8_t* data,
+                     size_t len);
+
+// Write a register address then read len bytes after a repeated start
+void fakeCtrlRead(uint8_t addr, uint8_t reg, uint8_t* data, size_t len);
+
+#endif /* FAKE_HAL_H_ */
@@ -0,0 +1,325 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fake internal I2C bus and devices, in place of i2c2.c on a host
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "fake_hal.h"
+#include "i2c2.h"
+#include "port_defs.h"
+#include "stm32f0xx.h"
+#include "trace.h"
+
+// Bus time of each byte at 400 kHz, 9 clocks
+#define FAKE_BYTE_NS 22500
+
+// Same queue depth as i2c2.c
+#define FAKE_QUEUE_SIZE 16
+
+typedef enum
+{
+  MODEL_TDA7448,  // Write-only, subaddress auto-increments if bit 4 is set
+  MODEL_MCP23008,
+  MODEL_MAX11601,  // Each read returns the channels scanned from 0
+  MODEL_MCP4017,   // A single register
+} FakeModel;
+
+typedef struct {
+  uint8_t   dev;
+  FakeModel model;
+  uint8_t   regs[16];
+  bool      nack;
+} FakeDev;
+
+// MCP23008 registers
+#define MCP_IODIR 0x00
+#define MCP_GPIO  0x09
+#define MCP_OLAT  0x0A
+
+static FakeDev devs_[] = {
+    {.dev = DEV_VOL1, .model = MODEL_TDA7448},
+    {.dev = DEV_VOL2, .model = MODEL_TDA7448},
+    {.dev = DEV_PWR_GPIO, .model = MODEL_MCP23008},
+    {.dev = DEV_LED_GPIO, .model = MODEL_MCP23008},
+    {.dev = DEV_ADC, .model = MODEL_MAX11601},
+    {.dev = DEV_DPOT, .model = MODEL_MCP4017},
+};
+
+#define NUM_DEVS (sizeof(devs_) / sizeof(devs_[0]))
+
+static I2C2Xfer* queues_[I2C2_NUM_PRIOS][FAKE_QUEUE_SIZE];
+static size_t    queued_[I2C2_NUM_PRIOS];
+static I2C2Xfer* done_[I2C2_NUM_PRIOS * FAKE_QUEUE_SIZE];
+static size_t    num_done_;
+
+static uint8_t   overruns_;
+static uint8_t   recoveries_;
+static I2C2Stats stats_[NUM_DEVS];
+
+static FakeXfer log_[FAKE_LOG_SIZE];
+static size_t   xfers_;
+static size_t   bytes_;
+static size_t   dev_xfers_[NUM_DEVS];
+
+static FakeDev* findDev(uint8_t dev) {
+  for (size_t i = 0; i < NUM_DEVS; i++) {
+    if (devs_[i].dev == dev) {
+      return &devs_[i];
+    }
+  }
+  return NULL;
+}
+
+void fakeI2C2LogReset() {
+  xfers_ = 0;
+  bytes_ = 0;
+  memset(dev_xfers_, 0, sizeof(dev_xfers_));
+}
+
+void fakeI2C2Reset() {
+  for (size_t i = 0; i < NUM_DEVS; i++) {
+    memset(devs_[i].regs, 0, sizeof(devs_[i].regs));
+    devs_[i].nack = false;
+  }
+  // MCP23008 pins start as inputs
+  findDev(DEV_PWR_GPIO)->regs[MCP_IODIR] = 0xFF;
+  findDev(DEV_LED_GPIO)->regs[MCP_IODIR] = 0xFF;
+  memset(queued_, 0, sizeof(queued_));
+  num_done_   = 0;
+  overruns_   = 0;
+  recoveries_ = 0;
+  memset(stats_, 0, sizeof(stats_));
+  fakeI2C2LogReset();
+}
+
+static void writeMcp(FakeDev* d, uint8_t reg, uint8_t val) {
+  reg &= 0x0F;
+  d->regs[reg] = val;
+  if (reg == MCP_GPIO || reg == MCP_OLAT) {
+    // Writing GPIO writes the output latch, and outputs read back from it
+    uint8_t dir       = d->regs[MCP_IODIR];
+    d->regs[MCP_OLAT] = val;
+    d->regs[MCP_GPIO] = (d->regs[MCP_GPIO] & dir) | (val & ~dir);
+  }
+}
+
+// Run a transfer against its device, returns 0 or I2C_ISR_NACKF
+static uint32_t runXfer(FakeDev* d, const I2C2Xfer* xfer) {
+  if (!d || d->nack) {
+    return I2C_ISR_NACKF;
+  }
+  switch (d->model) {
+    case MODEL_TDA7448: {
+      if (xfer->rx_len || xfer->tx_len == 0) {
+        return I2C_ISR_NACKF;
+      }
+      uint8_t sub = xfer->tx[0] & 0x0F;
+      for (size_t i = 1; i < xfer->tx_len; i++) {
+        d->regs[sub & 0x0F] = xfer->tx[i];
+        sub += xfer->tx[0] & 0x10 ? 1 : 0;
+      }
+      break;
+    }
+
+    case MODEL_MCP23008: {
+      uint8_t reg = xfer->tx_len ? xfer->tx[0] : 0;
+      for (size_t i = 1; i < xfer->tx_len; i++) {
+        writeMcp(d, reg++, xfer->tx[i]);
+      }
+      for (size_t i = 0; i < xfer->rx_len; i++) {
+        xfer->rx[i] = d->regs[reg++ & 0x0F];
+      }
+      break;
+    }
+
+    case MODEL_MAX11601:
+      for (size_t i = 0; i < xfer->rx_len; i++) {
+        xfer->rx[i] = d->regs[i & 0x03];
+      }
+      break;
+
+    case MODEL_MCP4017:
+      if (xfer->tx_len) {
+        d->regs[0] = xfer->tx[xfer->tx_len - 1];
+      }
+      for (size_t i = 0; i < xfer->rx_len; i++) {
+        xfer->rx[i] = d->regs[0];
+      }
+      break;
+  }
+  return 0;
+}
+
+// Complete a transfer as the I2C2 interrupt would, logging it
+static void complete(I2C2Xfer* xfer) {
+  FakeDev* d     = findDev(xfer->dev);
+  uint32_t nbyte = 1 + xfer->tx_len + (xfer->rx_len ? 1 + xfer->rx_len : 0);
+  uint32_t us    = (nbyte * FAKE_BYTE_NS + 999) / 1000;
+  fakeAdvanceUs(us);
+
+  xfer->state  = XFER_ACTIVE;
+  xfer->status = runXfer(d, xfer);
+  xfer->state  = XFER_DONE;
+  traceI2C2(xfer->dev, xfer->tx_len ? xfer->tx[0] : 0xFF, xfer->status, us);
+  done_[num_done_++] = xfer;
+
+  if (xfers_ < FAKE_LOG_SIZE) {
+    FakeXfer* e = &log_[xfers_];
+    *e          = (FakeXfer){
+        .dev    = xfer->dev,
+        .prio   = xfer->prio,
+        .tx_len = xfer->tx_len,
+        .rx_len = xfer->rx_len,
+        .status = xfer->status,
+    };
+    memcpy(e->tx, xfer->tx,
+           xfer->tx_len < FAKE_XFER_TX_LEN ? xfer->tx_len : FAKE_XFER_TX_LEN);
+  }
+  xfers_++;
+  bytes_ += nbyte;
+  if (d) {
+    size_t     i = d - devs_;
+    I2C2Stats* s = &stats_[i];
+    dev_xfers_[i]++;
+    s->dev = xfer->dev;
+    s->xfers++;
+    s->nacks += xfer->status ? 1 : 0;
+    s->max_us = us > s->max_us ? us : s->max_us;
+  }
+}
+
+void initI2C2() {}
+
+bool i2c2Submit(I2C2Xfer* xfer) {
+  size_t* n = &queued_[xfer->prio];
+  if (xfer->state != XFER_IDLE || *n >= FAKE_QUEUE_SIZE) {
+    overruns_++;
+    return false;
+  }
+  xfer->state               = XFER_QUEUED;
+  xfer->tries               = 0;
+  queues_[xfer->prio][(*n)++] = xfer;
+  return true;
+}
+
+uint8_t i2c2Overruns() {
+  return overruns_;
+}
+
+// Everything queued runs back-to-back, highest priority first, then the
+// callbacks run. Transfers submitted by callbacks run on the next call.
+void i2c2Update() {
+  for (size_t p = 0; p < I2C2_NUM_PRIOS; p++) {
+    for (size_t i = 0; i < queued_[p]; i++) {
+      complete(queues_[p][i]);
+    }
+    queued_[p] = 0;
+  }
+
+  size_t    n = num_done_;
+  I2C2Xfer* done[I2C2_NUM_PRIOS * FAKE_QUEUE_SIZE];
+  memcpy(done, done_, n * sizeof(done[0]));
+  num_done_ = 0;
+  for (size_t i = 0; i < n; i++) {
+    done[i]->state = XFER_IDLE;
+    if (done[i]->done) {
+      done[i]->done(done[i]);
+    }
+  }
+}
+
+void i2c2Recover() {
+  recoveries_++;
+}
+
+uint8_t i2c2Recoveries() {
+  return recoveries_;
+}
+
+const volatile I2C2Stats* i2c2Stats(uint8_t dev) {
+  FakeDev* d = findDev(dev);
+  return d && stats_[d - devs_].dev ? &stats_[d - devs_] : NULL;
+}
+
+void i2c2ResetStats() {
+  for (size_t i = 0; i < NUM_DEVS; i++) {
+    stats_[i].max_us = 0;
+  }
+}
+
+uint32_t i2c2Transfer(I2C2Xfer* xfer) {
+  while (xfer->state != XFER_IDLE) {
+    i2c2Update();
+  }
+  while (!i2c2Submit(xfer)) {
+    i2c2Update();
+  }
+  while (xfer->state != XFER_IDLE) {
+    i2c2Update();
+  }
+  return xfer->status;
+}
+
+bool i2c2Idle() {
+  for (size_t p = 0; p < I2C2_NUM_PRIOS; p++) {
+    if (queued_[p]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool i2c2Pending() {
+  return num_done_ != 0;
+}
+
+void fakeI2C2Flush() {
+  while (!i2c2Idle() || i2c2Pending()) {
+    i2c2Update();
+  }
+}
+
+size_t fakeXferCount() {
+  return xfers_;
+}
+
+const FakeXfer* fakeXferLog(size_t i) {
+  return i < xfers_ && i < FAKE_LOG_SIZE ? &log_[i] : NULL;
+}
+
+size_t fakeXferDevCount(uint8_t dev) {
+  FakeDev* d = findDev(dev);
+  return d ? dev_xfers_[d - devs_] : 0;
+}
+
+size_t fakeXferBytes() {
+  return bytes_;
+}
+
+uint8_t* fakeDevRegs(uint8_t dev) {
+  FakeDev* d = findDev(dev);
+  return d ? d->regs : NULL;
+}
+
+void fakeDevNack(uint8_t dev, bool nack) {
+  FakeDev* d = findDev(dev);
+  if (d) {
+    d->nack = nack;
+  }
+}
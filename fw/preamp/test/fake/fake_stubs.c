@@ -0,0 +1,82 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Stand-ins for the modules not built on a host
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The UART, flash and firmware update modules talk to hardware that isn't
+ * faked, so their functions used by the modules under test just report an
+ * idle, unchained preamp. Only the persist enable is remembered, so it reads
+ * back.
+ */
+
+#include <stdint.h>
+
+#include "persist.h"
+#include "serial.h"
+#include "update.h"
+#include "version.h"
+
+const uint8_t VERSION_MAJOR_ = 0;
+const uint8_t VERSION_MINOR_ = 0;
+const uint8_t GIT_HASH_[4]   = {0};
+
+static bool persist_ = false;
+
+void setUartPassthrough(bool passthrough) {
+  (void)passthrough;
+}
+
+uint8_t uartDownDrops() {
+  return 0;
+}
+
+uint8_t uartUpDrops() {
+  return 0;
+}
+
+uint8_t uartChainUnits() {
+  return 0;
+}
+
+EnumState uartEnumState() {
+  return ENUM_LAST;
+}
+
+void persistEnable(bool enable) {
+  persist_ = enable;
+}
+
+uint8_t persistStatus() {
+  return persist_ ? PERSIST_ENABLE : 0;
+}
+
+void updateCommand(UpdateCmd cmd) {
+  (void)cmd;
+}
+
+UpdateStatus updateStatus() {
+  return UPDATE_IDLE;
+}
+
+uint32_t updateLength() {
+  return 0;
+}
+
+uint32_t updateCrc() {
+  return 0;
+}
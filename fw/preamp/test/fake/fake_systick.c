@@ -0,0 +1,64 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Fake system time, in place of systick.c on a host
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fake_hal.h"
+#include "systick.h"
+
+// Only advanced by the fakes and the tests, so runs are repeatable
+static uint64_t now_us_ = 0;
+
+void fakeSystickReset() {
+  now_us_ = 0;
+}
+
+uint64_t fakeMicros() {
+  return now_us_;
+}
+
+void fakeAdvanceUs(uint32_t us) {
+  now_us_ += us;
+}
+
+void fakeAdvanceMs(uint32_t ms) {
+  now_us_ += (uint64_t)ms * 1000;
+}
+
+void systickInit() {}
+
+uint32_t millis(void) {
+  return now_us_ / 1000;
+}
+
+uint32_t micros(void) {
+  return now_us_;
+}
+
+uint32_t cycles(void) {
+  return now_us_ * (SYSCLK_HZ / 1000000);
+}
+
+// Busy-waits must advance time themselves
+void delayMs(uint32_t t) {
+  fakeAdvanceMs(t);
+}
+
+void delayUs(uint32_t t) {
+  fakeAdvanceUs(t);
+}
@@ -0,0 +1,72 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Host stand-in for the STM32F0 device header
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* The real device header provides every register definition and the
+ * StdPeriph declarations, then the peripherals used on the host are moved
+ * from their fixed addresses to plain memory in fake_hal.c.
+ */
+
+#ifndef FAKE_STM32F0XX_H_
+#define FAKE_STM32F0XX_H_
+
+#include_next <stm32f0xx.h>
+
+// GPIO ports keep their 0x400 spacing, ports.c finds a port's index from it
+typedef union {
+  GPIO_TypeDef regs;
+  uint8_t      page[0x400];
+} FakeGpioPort;
+
+#define FAKE_NUM_GPIO 6  // Ports A through F
+
+extern FakeGpioPort   fake_gpio_[FAKE_NUM_GPIO];
+extern DBGMCU_TypeDef fake_dbgmcu_;
+extern I2C_TypeDef    fake_i2c1_;
+extern IWDG_TypeDef   fake_iwdg_;
+extern RCC_TypeDef    fake_rcc_;
+extern SYSCFG_TypeDef fake_syscfg_;
+
+#undef GPIOA_BASE
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#undef GPIOE
+#undef GPIOF
+#undef DBGMCU
+#undef I2C1
+#undef IWDG
+#undef RCC
+#undef SYSCFG
+
+#define GPIOA_BASE ((uintptr_t)&fake_gpio_[0])
+#define GPIOA      (&fake_gpio_[0].regs)
+#define GPIOB      (&fake_gpio_[1].regs)
+#define GPIOC      (&fake_gpio_[2].regs)
+#define GPIOD      (&fake_gpio_[3].regs)
+#define GPIOE      (&fake_gpio_[4].regs)
+#define GPIOF      (&fake_gpio_[5].regs)
+#define DBGMCU     (&fake_dbgmcu_)
+#define I2C1       (&fake_i2c1_)
+#define IWDG       (&fake_iwdg_)
+#define RCC        (&fake_rcc_)
+#define SYSCFG     (&fake_syscfg_)
+
+#endif /* FAKE_STM32F0XX_H_ */
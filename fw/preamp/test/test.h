@@ -0,0 +1,60 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Minimal test and benchmark framework for the host build
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stddef.h>
+
+typedef struct {
+  const char* name;
+  void (*run)();
+} Test;
+
+// Tests of each module, each list ends with an entry with a NULL name
+extern const Test audio_mux_tests[];
+extern const Test chain_enum_tests[];
+extern const Test ctrl_i2c_tests[];
+extern const Test fans_tests[];
+extern const Test int_i2c_tests[];
+
+// Run the benchmarks, returns the number over their budget
+int runBenchmarks();
+
+// Record a failure of the current test, which carries on
+void testFail(const char* file, int line, const char* expr, long a, long b);
+
+#define CHECK(cond)                                 \
+  do {                                              \
+    if (!(cond)) {                                  \
+      testFail(__FILE__, __LINE__, #cond, 1, 0);    \
+    }                                               \
+  } while (0)
+
+#define CHECK_EQ(a, b)                                  \
+  do {                                                  \
+    long a_ = (long)(a);                                \
+    long b_ = (long)(b);                                \
+    if (a_ != b_) {                                     \
+      testFail(__FILE__, __LINE__, #a " == " #b, a_, b_); \
+    }                                                   \
+  } while (0)
+
+#endif /* TEST_H_ */
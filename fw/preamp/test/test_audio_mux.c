@@ -0,0 +1,213 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Tests of the zone volume, mute, source and standby control
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "audio_mux.h"
+#include "board.h"
+#include "fake_hal.h"
+#include "i2c2_shadow.h"
+#include "port_defs.h"
+#include "test.h"
+
+/* Out of standby with all zones at a known volume, muted and on source 1.
+ * The board's background traffic is paused, so only the volume ICs are
+ * written by these tests.
+ */
+static void setupZones(uint8_t vol) {
+  boardBackground(false);
+  AudioConfig cfg = {.mutes = (1 << NUM_ZONES) - 1, .standby = false};
+  memset(cfg.vols, vol, sizeof(cfg.vols));
+  setAudioConfig(&cfg);
+  boardRun(1);
+  fakeLogReset();
+}
+
+static void testVolumeOneZone() {
+  setupZones(40);
+  boardWriteReg(REG_VOL_ZONE2, 20);
+  CHECK_EQ(fakeXferCount(), 1);
+  const FakeXfer* x = fakeXferLog(0);
+  CHECK_EQ(x->dev, DEV_VOL1);
+  CHECK_EQ(x->tx_len, 3);
+  CHECK_EQ(x->tx[0], 0x10 | 2);  // Auto-increment from zone 2's left channel
+  CHECK_EQ(x->tx[1], 20);
+  CHECK_EQ(x->tx[2], 20);
+  CHECK_EQ(fakeDevRegs(DEV_VOL1)[2], 20);
+  CHECK_EQ(fakeDevRegs(DEV_VOL1)[3], 20);
+  CHECK_EQ(getZoneVolume(1), 20);
+}
+
+static void testVolumeUnchanged() {
+  setupZones(40);
+  boardWriteReg(REG_VOL_ZONE4, 40);
+  CHECK_EQ(fakeXferCount(), 0);
+}
+
+// A burst write of every zone's volume is sent once it's all been applied, in
+// one burst per IC
+static void testVolumeAllZones() {
+  setupZones(40);
+  const uint8_t vols[NUM_ZONES] = {1, 2, 3, 4, 5, 6};
+  boardWrite(REG_VOL_ZONE1, vols, sizeof(vols));
+  CHECK_EQ(fakeXferDevCount(DEV_VOL1), 1);
+  CHECK_EQ(fakeXferDevCount(DEV_VOL2), 1);
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    uint8_t dev = zone < 3 ? DEV_VOL1 : DEV_VOL2;
+    CHECK_EQ(fakeDevRegs(dev)[2 * (zone % 3)], vols[zone]);
+    CHECK_EQ(fakeDevRegs(dev)[2 * (zone % 3) + 1], vols[zone]);
+  }
+}
+
+// A whole configuration takes one burst per IC
+static void testVolumeConfig() {
+  setupZones(40);
+  AudioConfig cfg;
+  getAudioConfig(&cfg);
+  memset(cfg.vols, 20, sizeof(cfg.vols));
+  setAudioConfig(&cfg);
+  boardRun(1);
+  CHECK_EQ(fakeXferCount(), 2);
+  CHECK_EQ(fakeXferLog(0)->tx_len, 7);
+  CHECK_EQ(fakeXferLog(1)->tx_len, 7);
+}
+
+// Zones 1 and 3 change, zone 2 between them is sent again in the same burst
+static void testVolumeRange() {
+  setupZones(40);
+  AudioConfig cfg;
+  getAudioConfig(&cfg);
+  cfg.vols[0] = 10;
+  cfg.vols[2] = 30;
+  setAudioConfig(&cfg);
+  boardRun(1);
+  CHECK_EQ(fakeXferCount(), 1);
+  CHECK_EQ(fakeXferLog(0)->tx_len, 7);
+  CHECK_EQ(fakeXferLog(0)->tx[0], 0x10);
+}
+
+static void testStandbyExit() {
+  setupZones(40);
+  boardWriteReg(REG_STANDBY, 0);
+  CHECK(inStandby());
+  CHECK_EQ(fakeXferCount(), 0);
+
+  // Volume changes in standby are only sent once it's left
+  boardWriteReg(REG_VOL_ZONE6, 30);
+  CHECK_EQ(fakeXferCount(), 0);
+  memset(fakeDevRegs(DEV_VOL1), 0, 16);
+  memset(fakeDevRegs(DEV_VOL2), 0, 16);
+  boardWriteReg(REG_STANDBY, 1);
+  CHECK(!inStandby());
+  CHECK_EQ(fakeXferCount(), 2);
+  CHECK_EQ(fakeXferLog(0)->tx_len, 7);
+  CHECK_EQ(fakeXferLog(1)->tx_len, 7);
+  CHECK_EQ(fakeDevRegs(DEV_VOL1)[0], 40);
+  CHECK_EQ(fakeDevRegs(DEV_VOL2)[5], 30);
+}
+
+// In standby, like at startup, other writes don't send the unknown volumes
+static void testStandbyNoVolumes() {
+  setupZones(40);
+  boardWriteReg(REG_STANDBY, 0);
+  shadowInvalidateDev(DEV_VOL1);
+  shadowInvalidateDev(DEV_VOL2);
+  boardWriteReg(REG_PI_TEMP, 0x50);
+  CHECK_EQ(fakeXferCount(), 0);
+  boardWriteReg(REG_STANDBY, 1);
+  CHECK_EQ(fakeXferCount(), 2);
+}
+
+static void testMute() {
+  setupZones(40);
+  boardWriteReg(REG_MUTE, 0x3F & ~(1 << 2));
+  CHECK(isOn(2));
+  CHECK(!isOn(1));
+  CHECK_EQ(fakeXferCount(), 0);
+  CHECK(readPin(zone_mute_[2]));  // High to unmute
+  CHECK(!readPin(zone_mute_[1]));
+}
+
+// An unmuted zone is muted while its source is switched
+static void testSourceSwitch() {
+  setupZones(40);
+  boardWriteReg(REG_MUTE, 0x3F & ~(1 << 0));
+  fakeLogReset();
+  boardWriteReg(REG_ZONE321, 2);  // Zone 1 to source 3
+  CHECK_EQ(getZoneSource(0), 2);
+  CHECK(readPin(zone_src_[0][2]));
+  CHECK(!readPin(zone_src_[0][0]));
+
+  // Zone 1 is muted first, then unmuted after the last write to its mux
+  size_t mute_port = (FakeGpioPort*)zone_mute_[0].port - fake_gpio_;
+  size_t unmute    = 0;
+  size_t last_mux  = 0;
+  for (size_t i = 0; i < fakePinWriteCount(); i++) {
+    const FakePinWrite* w = fakePinWriteLog(i);
+    for (size_t src = 0; src < NUM_SRCS; src++) {
+      const Pin* mux = &zone_src_[0][src];
+      if (w->port == (FakeGpioPort*)mux->port - fake_gpio_ &&
+          (w->set | w->clr) & mux->mask) {
+        last_mux = i;
+      }
+    }
+    if (w->port == mute_port && w->set & zone_mute_[0].mask) {
+      unmute = i;
+    }
+  }
+  const FakePinWrite* first = fakePinWriteLog(0);
+  CHECK_EQ(first->port, mute_port);
+  CHECK_EQ(first->clr, zone_mute_[0].mask);
+  CHECK(last_mux > 0);
+  CHECK(unmute > last_mux);
+  CHECK(isOn(0));
+}
+
+// A committed configuration is applied with each zone muted while it switches
+static void testCommit() {
+  setupZones(40);
+  boardWriteReg(REG_MUTE, 0);
+  const uint8_t stage[4] = {0x0F, 0x15, 0x2A, 0x00};
+  boardWrite(REG_STAGE_SRC_AD, stage, sizeof(stage));
+  CHECK_EQ(getZoneSource(0), 0);
+  fakeLogReset();
+  boardWriteReg(REG_COMMIT, 1);
+  CHECK_EQ(boardReadReg(REG_ZONE321), 0x15);
+  CHECK_EQ(boardReadReg(REG_ZONE654), 0x2A);
+  CHECK_EQ(boardReadReg(REG_SRC_AD), 0x0F);
+  CHECK_EQ(fakeXferCount(), 0);
+  for (size_t zone = 0; zone < NUM_ZONES; zone++) {
+    CHECK(isOn(zone));
+  }
+}
+
+const Test audio_mux_tests[] = {
+    {"volume_one_zone", testVolumeOneZone},
+    {"volume_unchanged", testVolumeUnchanged},
+    {"volume_all_zones", testVolumeAllZones},
+    {"volume_config", testVolumeConfig},
+    {"volume_range", testVolumeRange},
+    {"standby_exit", testStandbyExit},
+    {"standby_no_volumes", testStandbyNoVolumes},
+    {"mute", testMute},
+    {"source_switch", testSourceSwitch},
+    {"commit", testCommit},
+    {NULL, NULL},
+};
@@ -0,0 +1,184 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Tests of the enumeration of a chain of preamps
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chain_enum.h"
+#include "test.h"
+
+/* A chain of preamps linked by their UARTs, each running the enumeration as
+ * checkForNewAddress() does every millisecond. A 3-byte message takes LINK_MS
+ * to arrive at 9600 baud, and is lost if its preamp hasn't started yet. Ready
+ * replies are passed up as they arrive, as the USART2 interrupt does.
+ */
+#define MAX_UNITS 6
+#define MAX_MSGS  32
+#define LINK_MS   4
+#define PI_MS     200  // Less than the Pi waits for the master's reply
+
+typedef struct {
+  uint32_t at;    // Time it arrives
+  int      unit;  // Preamp it's for, -1 for the Pi
+  char     id;    // 'A' down or 'R' up
+  uint8_t  addr;
+} Msg;
+
+typedef struct {
+  int       units;
+  uint32_t  start_ms[MAX_UNITS];  // Time each preamp starts up
+  ChainEnum e[MAX_UNITS];
+  Msg       msgs[MAX_MSGS];
+  int       num_msgs;
+  uint8_t   replies[MAX_MSGS];  // Ready replies received by the Pi, in order
+  int       num_replies;
+  uint32_t  master_ms;  // Time the master's reply reached the Pi
+} Chain;
+
+static void chainInit(Chain* c, int units) {
+  memset(c, 0, sizeof(*c));
+  c->units = units;
+}
+
+static void chainSend(Chain* c, uint32_t now, int unit, char id,
+                      uint8_t addr) {
+  if (c->num_msgs < MAX_MSGS) {
+    c->msgs[c->num_msgs++] = (Msg){now + LINK_MS, unit, id, addr};
+  }
+}
+
+static void chainDeliver(Chain* c, uint32_t now, Msg m) {
+  if (m.unit < 0) {
+    c->replies[c->num_replies++] = m.addr;
+    if (m.addr == 0x10) {
+      c->master_ms = now;
+    }
+  } else if (m.unit >= c->units || now < c->start_ms[m.unit]) {
+    // No preamp there, or it's still starting up
+  } else if (m.id == 'A') {
+    enumAddress(&c->e[m.unit], m.addr);
+  } else if (enumReady(&c->e[m.unit], m.addr)) {
+    chainSend(c, now, m.unit - 1, 'R', m.addr);
+  }
+}
+
+// Run the chain for PI_MS after the Pi sends the master its address
+static void chainRun(Chain* c) {
+  chainSend(c, 0, 0, 'A', 0x10);
+  for (uint32_t now = 0; now < PI_MS; now++) {
+    for (int i = 0; i < c->num_msgs;) {
+      if (c->msgs[i].at == now) {
+        Msg m = c->msgs[i];
+        memmove(&c->msgs[i], &c->msgs[i + 1],
+                (c->num_msgs - i - 1) * sizeof(Msg));
+        c->num_msgs--;
+        chainDeliver(c, now, m);
+      } else {
+        i++;
+      }
+    }
+    for (int u = 0; u < c->units; u++) {
+      ChainEnum* e = &c->e[u];
+      switch (enumCheck(e, now)) {
+        case ENUM_SEND_ADDR:
+          chainSend(c, now, u + 1, 'A', e->addr + 0x10);
+          break;
+        case ENUM_SEND_READY:
+          chainSend(c, now, u - 1, 'R', e->addr);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+// Every preamp replied once, from the bottom of the chain up
+static void checkEnumerated(Chain* c) {
+  CHECK_EQ(c->num_replies, c->units);
+  for (int u = 0; u < c->units; u++) {
+    uint8_t addr = 0x10 * (c->units - u);
+    CHECK_EQ(c->replies[u], addr);
+    CHECK_EQ(c->e[u].addr, 0x10 * (u + 1));
+    CHECK_EQ(c->e[u].state, u == c->units - 1 ? ENUM_LAST : ENUM_DONE);
+    CHECK_EQ(c->e[u].units, c->units - 1 - u);
+  }
+  CHECK(c->master_ms > 0);
+}
+
+static void testSingle() {
+  Chain c;
+  chainInit(&c, 1);
+  chainRun(&c);
+  checkEnumerated(&c);
+}
+
+static void testChain() {
+  for (int units = 2; units <= MAX_UNITS; units++) {
+    Chain c;
+    chainInit(&c, units);
+    chainRun(&c);
+    checkEnumerated(&c);
+  }
+}
+
+// The last unit misses the first address sent to it while starting up
+static void testLateStart() {
+  Chain c;
+  chainInit(&c, 3);
+  c.start_ms[2] = 10;
+  chainRun(&c);
+  checkEnumerated(&c);
+}
+
+// An expansion unit's chain takes longer to reply than the time between
+// tries, so the address it's enumerating is sent again and must be ignored
+static void testRepeatIgnored() {
+  ChainEnum e = {0};
+  CHECK(enumAddress(&e, 0x20));
+  CHECK_EQ(enumCheck(&e, 0), ENUM_SEND_ADDR);
+  CHECK(!enumAddress(&e, 0x20));
+  CHECK_EQ(e.tries, 1);
+  CHECK_EQ(enumCheck(&e, 1), ENUM_SEND_NONE);
+
+  // A different address starts again
+  CHECK(enumAddress(&e, 0x30));
+  CHECK_EQ(enumCheck(&e, 2), ENUM_SEND_ADDR);
+
+  // Once enumerated, the same address starts again as the chain was reset
+  CHECK(enumReady(&e, 0x40));
+  CHECK_EQ(enumCheck(&e, 3), ENUM_SEND_READY);
+  CHECK_EQ(e.state, ENUM_DONE);
+  CHECK(enumAddress(&e, 0x30));
+  CHECK_EQ(e.state, ENUM_WAITING);
+  CHECK_EQ(e.units, 0);
+
+  // Replies from above aren't passed up
+  CHECK(!enumReady(&e, 0x20));
+  CHECK(!enumReady(&e, 0x30));
+}
+
+const Test chain_enum_tests[] = {
+    {"enum_single", testSingle},
+    {"enum_chain", testChain},
+    {"enum_late_start", testLateStart},
+    {"enum_repeat_ignored", testRepeatIgnored},
+    {NULL, NULL},
+};
@@ -0,0 +1,376 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Tests of the controller I2C register interface
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_mux.h"
+#include "board.h"
+#include "boot.h"
+#include "ctrl_i2c.h"
+#include "fake_hal.h"
+#include "pec.h"
+#include "port_defs.h"
+#include "stm32f0xx.h"
+#include "systick.h"
+#include "test.h"
+#include "trace.h"
+#include "watchdog.h"
+
+// The group address every preamp also responds to
+#define GROUP_ADDR 0x70
+
+// A burst read returns the same values as reading each register alone
+static void testBurstRead() {
+  uint8_t burst[REG_FAN_VOLTS - REG_HV1_VOLTAGE + 1];
+  fakeCtrlRead(BOARD_ADDR, REG_HV1_VOLTAGE, burst, sizeof(burst));
+  for (size_t i = 0; i < sizeof(burst); i++) {
+    CHECK_EQ(burst[i], boardReadReg(REG_HV1_VOLTAGE + i));
+  }
+}
+
+static void testUnknownReg() {
+  CHECK_EQ(boardReadReg(0x1F), 0xFF);
+  CHECK_EQ(boardReadReg(0xF0), 0xFF);
+}
+
+// Older firmware reads the capability registers as unknown, 0xFF, so bit 7
+// of each is always clear
+static void testCapabilities() {
+  CHECK_EQ(boardReadReg(REG_CAPABILITIES) & 0x80, 0);
+  CHECK_EQ(boardReadReg(REG_CAPABILITIES_2) & 0x80, 0);
+}
+
+// Writes to read-only or unknown registers are ACKed but never queued
+static void testReadOnlyWrite() {
+  uint8_t hv1 = boardReadReg(REG_HV1_VOLTAGE);
+  uint8_t val = hv1 + 1;
+  CHECK_EQ(fakeCtrlWrite(BOARD_ADDR, REG_HV1_VOLTAGE, &val, 1), 1);
+  CHECK(!ctrlI2CPending());
+  CHECK_EQ(fakeCtrlWrite(BOARD_ADDR, 0x1F, &val, 1), 1);
+  CHECK(!ctrlI2CPending());
+  boardRun(1);
+  CHECK_EQ(boardReadReg(REG_HV1_VOLTAGE), hv1);
+}
+
+static void testGroupWrite() {
+  uint8_t vol = 33;
+  fakeCtrlWrite(GROUP_ADDR, REG_VOL_ZONE5, &vol, 1);
+  CHECK(ctrlI2CPending());
+  boardRun(1);
+  CHECK_EQ(getZoneVolume(4), 33);
+  CHECK_EQ(boardReadReg(REG_VOL_ZONE5), 33);
+}
+
+// Expansion control would reset or passthrough every preamp at once, so
+// it's unicast only
+static void testGroupExpansion() {
+  uint8_t exp = boardReadReg(REG_EXPANSION);
+  uint8_t val = 0;
+  fakeCtrlWrite(GROUP_ADDR, REG_EXPANSION, &val, 1);
+  CHECK(!ctrlI2CPending());
+  boardRun(1);
+  CHECK_EQ(boardReadReg(REG_EXPANSION), exp);
+  CHECK(readPin(exp_nrst_));
+}
+
+static void testGroupRead() {
+  uint8_t vals[2];
+  fakeCtrlRead(GROUP_ADDR, REG_VOL_ZONE1, vals, sizeof(vals));
+  CHECK_EQ(vals[0], 0xFF);
+  CHECK_EQ(vals[1], 0xFF);
+}
+
+// The low byte of a 16-bit register is latched when its high byte is read
+static void testHiresLatch() {
+  uint8_t hv1[2];
+  fakeDevRegs(DEV_ADC)[0] = 0x80;
+  boardRun(64);
+  fakeCtrlRead(BOARD_ADDR, REG_HV1_VOLTAGE_H, hv1, sizeof(hv1));
+  CHECK_EQ((hv1[0] << 8) | hv1[1], board_.hv1_f8);
+
+  // Between the two reads the value changes, the old low byte is still sent
+  fakeCtrlRead(BOARD_ADDR, REG_HV1_VOLTAGE_H, hv1, 1);
+  uint16_t old = board_.hv1_f8;
+  fakeDevRegs(DEV_ADC)[0] = 0x40;
+  boardRun(64);
+  CHECK(board_.hv1_f8 != old);
+  fakeCtrlRead(BOARD_ADDR, REG_HV1_VOLTAGE_L, &hv1[1], 1);
+  CHECK_EQ(hv1[1], old & 0xFF);
+}
+
+// Staged registers only take effect once committed
+static void testStageCommit() {
+  setZoneVolume(0, 50);
+  boardRun(1);
+  boardWriteReg(REG_STAGE_VOL_ZONE1, 5);
+  CHECK_EQ(boardReadReg(REG_STAGE_VOL_ZONE1), 5);
+  CHECK_EQ(getZoneVolume(0), 50);
+  boardWriteReg(REG_COMMIT, 1);
+  CHECK_EQ(getZoneVolume(0), 5);
+  CHECK_EQ(boardReadReg(REG_VOL_ZONE1), 5);
+}
+
+// When the command queue is full further bytes are NACKed
+static void testQueueFull() {
+  const uint8_t vols[NUM_ZONES] = {10, 10, 10, 10, 10, 10};
+  size_t acked = 0;
+  for (size_t i = 0; i < 8; i++) {
+    acked += fakeCtrlWrite(BOARD_ADDR, REG_VOL_ZONE1, vols, NUM_ZONES);
+  }
+  CHECK(acked < 8 * NUM_ZONES);
+  boardRun(1);
+  CHECK(!ctrlI2CPending());
+  CHECK_EQ(fakeCtrlWrite(BOARD_ADDR, REG_VOL_ZONE1, vols, NUM_ZONES),
+           NUM_ZONES);
+  boardRun(1);
+}
+
+static uint32_t be32(const uint8_t* b) {
+  return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | b[2] << 8 | b[3];
+}
+
+// The Pi can tell a preamp reset from its uptime, read as one 32-bit value
+static void testUptime() {
+  CHECK_EQ(boardReadReg(REG_RESET_CAUSE), RESET_CAUSE_POR | RESET_CAUSE_PIN);
+
+  uint8_t regs[REG_LOOPS_0 - REG_UPTIME_3 + 1];
+  fakeCtrlRead(BOARD_ADDR, REG_UPTIME_3, regs, sizeof(regs));
+  uint32_t uptime = be32(&regs[0]);
+  uint32_t loops  = be32(&regs[REG_LOOPS_3 - REG_UPTIME_3]);
+  CHECK_EQ(uptime, millis());
+  CHECK_EQ(loops, board_.loops);
+
+  boardRun(300);
+  fakeCtrlRead(BOARD_ADDR, REG_UPTIME_3, regs, sizeof(regs));
+  CHECK(be32(&regs[0]) - uptime >= 300);
+  CHECK_EQ(be32(&regs[REG_LOOPS_3 - REG_UPTIME_3]) - loops, 300);
+
+  // Read a byte at a time, the high byte latches the rest
+  uptime = (uint32_t)boardReadReg(REG_UPTIME_3) << 24;
+  boardRun(1);
+  uptime |= boardReadReg(REG_UPTIME_2) << 16;
+  uptime |= boardReadReg(REG_UPTIME_1) << 8;
+  boardRun(1);
+  uptime |= boardReadReg(REG_UPTIME_0);
+  CHECK_EQ(uptime, millis() - 2);
+}
+
+static uint32_t be24(const uint8_t* b) {
+  return (uint32_t)b[0] << 16 | b[1] << 8 | b[2];
+}
+
+// The trace shows a volume write then the transfer it caused
+static void testTrace() {
+  boardBackground(false);
+  boardWriteReg(REG_TRACE, 0);
+  uint8_t entry[REG_TRACE_DATA_LAST - REG_TRACE_DATA_FIRST + 1];
+  while (boardReadReg(REG_TRACE)) {
+    fakeCtrlRead(BOARD_ADDR, REG_TRACE_DATA_FIRST, entry, sizeof(entry));
+  }
+  uint16_t seq = boardReadReg(REG_TRACE_SEQ_H) << 8;
+  seq |= boardReadReg(REG_TRACE_SEQ_L);
+
+  boardWriteReg(REG_VOL_ZONE1, getZoneVolume(0) == 20 ? 21 : 20);
+  CHECK_EQ(boardReadReg(REG_TRACE), 2);
+
+  // A read stopping just before the last byte, which is loaded but never
+  // sent, leaves the entry unread
+  fakeCtrlRead(BOARD_ADDR, REG_TRACE_DATA_FIRST, entry, sizeof(entry) - 1);
+  CHECK_EQ(boardReadReg(REG_TRACE), 2);
+  fakeCtrlRead(BOARD_ADDR, REG_TRACE_DATA_FIRST, entry, sizeof(entry));
+  CHECK_EQ(entry[0], seq & 0xFF);
+  CHECK_EQ(entry[1], TRACE_CTRL_WRITE);
+  CHECK_EQ(entry[2], REG_VOL_ZONE1);
+  uint32_t written = be24(&entry[5]);
+
+  fakeCtrlRead(BOARD_ADDR, REG_TRACE_DATA_FIRST, entry, sizeof(entry));
+  CHECK_EQ(entry[0], (seq + 1) & 0xFF);
+  CHECK_EQ(entry[1], TRACE_I2C2 | TRACE_OK << 4);
+  CHECK_EQ(entry[2], DEV_VOL1);
+  CHECK(entry[4] > 0);
+  CHECK(((be24(&entry[5]) - written) & 0xFFFFFF) < 1000);
+
+  // Nothing more, an empty entry reads as TRACE_NONE
+  CHECK_EQ(boardReadReg(REG_TRACE), 0);
+  fakeCtrlRead(BOARD_ADDR, REG_TRACE_DATA_FIRST, entry, sizeof(entry));
+  CHECK_EQ(entry[1], TRACE_NONE);
+
+  // Rewinding reads them again
+  boardWriteReg(REG_TRACE, 0);
+  CHECK(boardReadReg(REG_TRACE) >= 2);
+}
+
+// The watchdog is only kicked while every task checks in, and after it resets
+// the preamp the Pi can read what stalled
+static void testWatchdog() {
+  CHECK_EQ(boardReadReg(REG_WATCHDOG), 0);
+  fake_iwdg_.KR = 0;
+  boardRun(10);
+  CHECK_EQ(fake_iwdg_.KR, WDG_KEY_RELOAD);
+
+  // Failed ADC reads still check in
+  fakeDevNack(DEV_ADC, true);
+  fake_iwdg_.KR = 0;
+  boardRun(10);
+  CHECK_EQ(fake_iwdg_.KR, WDG_KEY_RELOAD);
+  fakeDevNack(DEV_ADC, false);
+
+  // Without ADC reads there are no kicks. Once a reset is near, the SysTick
+  // interrupt records the missed check-in and the task it interrupted.
+  boardBackground(false);
+  fake_iwdg_.KR = 0;
+  for (int i = 0; i < WDG_TIMEOUT_MS; i++) {
+    boardRun(1);
+    watchdogTick(5);
+  }
+  CHECK_EQ(fake_iwdg_.KR, 0);
+
+  // Then the IWDG resets the preamp
+  fake_rcc_.CSR = RCC_CSR_IWDGRSTF | RCC_CSR_PINRSTF;
+  bootInit();
+  watchdogInit();
+  CHECK_EQ(boardReadReg(REG_RESET_CAUSE), RESET_CAUSE_IWDG | RESET_CAUSE_PIN);
+  CHECK_EQ(boardReadReg(REG_WATCHDOG), (WDG_ADC << 4) | 5);
+
+  // The record only describes the reset that followed it
+  fake_rcc_.CSR = RCC_CSR_PORRSTF | RCC_CSR_PINRSTF;
+  bootInit();
+  watchdogInit();
+  CHECK_EQ(boardReadReg(REG_WATCHDOG), 0);
+}
+
+static uint8_t pec(const uint8_t* bytes, size_t len) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < len; i++) {
+    crc = pecUpdate(crc, bytes[i]);
+  }
+  return crc;
+}
+
+// With PEC enabled writes are only applied with a correct PEC, and a read of
+// a register is followed by its PEC
+static void testPec() {
+  CHECK_EQ(boardReadReg(REG_CAPABILITIES_2) & 0x01, 0x01);
+  boardWriteReg(REG_PEC, 1);
+  CHECK_EQ(boardReadReg(REG_PEC), 1);
+
+  // The address, register and data, then the PEC of them all
+  uint8_t frame[] = {BOARD_ADDR, REG_VOL_ZONE1, 20, 21, 0};
+  frame[4]        = pec(frame, 4);
+  boardWrite(REG_VOL_ZONE1, &frame[2], 3);
+  CHECK_EQ(getZoneVolume(0), 20);
+  CHECK_EQ(getZoneVolume(1), 21);
+  CHECK_EQ(boardReadReg(REG_PEC_ERRORS), 0);
+
+  // A corrupted byte drops the whole write
+  frame[2] = 30;
+  frame[3] = 31;
+  frame[4] = pec(frame, 4);
+  frame[3] ^= 0x04;
+  boardWrite(REG_VOL_ZONE1, &frame[2], 3);
+  CHECK_EQ(getZoneVolume(0), 20);
+  CHECK_EQ(getZoneVolume(1), 21);
+  CHECK_EQ(boardReadReg(REG_PEC_ERRORS), 1);
+
+  // The read includes both addresses, then 0xFF for anything after the PEC
+  uint8_t read[] = {BOARD_ADDR, REG_VOL_ZONE2, BOARD_ADDR | 1, 21};
+  uint8_t got[3];
+  fakeCtrlRead(BOARD_ADDR, REG_VOL_ZONE2, got, sizeof(got));
+  CHECK_EQ(got[0], 21);
+  CHECK_EQ(got[1], pec(read, sizeof(read)));
+  CHECK_EQ(got[2], 0xFF);
+
+  // A 16-bit pair is read whole
+  uint8_t hires[5] = {BOARD_ADDR, REG_HV1_VOLTAGE_H, BOARD_ADDR | 1};
+  fakeCtrlRead(BOARD_ADDR, REG_HV1_VOLTAGE_H, &hires[3], 2);
+  fakeCtrlRead(BOARD_ADDR, REG_HV1_VOLTAGE_H, got, sizeof(got));
+  CHECK_EQ(got[0], hires[3]);
+  CHECK_EQ(got[1], hires[4]);
+  CHECK_EQ(got[2], pec(hires, sizeof(hires)));
+
+  // Disabling takes a checked write too, without one the byte is taken as a
+  // bad PEC
+  boardWriteReg(REG_PEC, 0);
+  CHECK_EQ(boardReadReg(REG_PEC), 1);
+  uint8_t off[] = {BOARD_ADDR, REG_PEC, 0, 0};
+  off[3]        = pec(off, 3);
+  boardWrite(REG_PEC, &off[2], 2);
+  CHECK_EQ(boardReadReg(REG_PEC), 0);
+  CHECK_EQ(boardReadReg(REG_PEC_ERRORS), 2);
+}
+
+// Each entry of the chain table
+#define CHAIN_ENTRY_LEN (1 + CTRL_I2C_SNAP_LEN)
+
+// Expansion unit snapshots received up the UART chain are read back in one
+// burst from REG_CHAIN, each after its age
+static void testChain() {
+  CHECK_EQ(boardReadReg(REG_CAPABILITIES_2) & 0x02, 0x02);
+
+  uint8_t snap[CTRL_I2C_SNAP_LEN] = {7, 0x11, 0x22, 0x33, 0x44, 0x55};
+  uint8_t sum                     = 0;
+  for (size_t i = 0; i < CTRL_I2C_SNAP_LEN - 1; i++) {
+    sum += snap[i];
+  }
+  snap[CTRL_I2C_SNAP_LEN - 1] = -sum;
+  ctrlI2CChainTelem(2, snap);
+  ctrlI2CChainTelem(CTRL_I2C_CHAIN_UNITS + 1, snap);  // Ignored
+  boardRun(300);
+
+  uint8_t chain[CTRL_I2C_CHAIN_UNITS * CHAIN_ENTRY_LEN + 1];
+  fakeCtrlRead(BOARD_ADDR, REG_CHAIN, chain, sizeof(chain));
+  for (size_t u = 0; u < CTRL_I2C_CHAIN_UNITS; u++) {
+    const uint8_t* entry = &chain[u * CHAIN_ENTRY_LEN];
+    if (u == 1) {
+      CHECK_EQ(entry[0], 300 / 128);
+      for (size_t i = 0; i < CTRL_I2C_SNAP_LEN; i++) {
+        CHECK_EQ(entry[1 + i], snap[i]);
+      }
+    } else {
+      for (size_t i = 0; i < CHAIN_ENTRY_LEN; i++) {
+        CHECK_EQ(entry[i], 0xFF);
+      }
+    }
+  }
+  CHECK_EQ(chain[sizeof(chain) - 1], 0xFF);  // Past the end
+
+  // Ages saturate, and each read starts from the first entry again
+  boardRun(40000);
+  fakeCtrlRead(BOARD_ADDR, REG_CHAIN, chain, 2 * CHAIN_ENTRY_LEN);
+  CHECK_EQ(chain[CHAIN_ENTRY_LEN], 0xFE);
+  CHECK_EQ(chain[CHAIN_ENTRY_LEN + 1], snap[0]);
+}
+
+const Test ctrl_i2c_tests[] = {
+    {"burst_read", testBurstRead},
+    {"unknown_reg", testUnknownReg},
+    {"capabilities", testCapabilities},
+    {"read_only_write", testReadOnlyWrite},
+    {"group_write", testGroupWrite},
+    {"group_expansion", testGroupExpansion},
+    {"group_read", testGroupRead},
+    {"hires_latch", testHiresLatch},
+    {"stage_commit", testStageCommit},
+    {"queue_full", testQueueFull},
+    {"uptime", testUptime},
+    {"trace", testTrace},
+    {"watchdog", testWatchdog},
+    {"pec", testPec},
+    {"chain", testChain},
+    {NULL, NULL},
+};
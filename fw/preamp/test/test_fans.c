@@ -0,0 +1,217 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Tests of the fan control calculations
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "fans.h"
+#include "idle.h"
+#include "port_defs.h"
+#include "test.h"
+
+#define C(x) ((int16_t)((x) * 256))  // degC in Q7.8
+
+static void testForced() {
+  FanState* f =
+      updateFans(C(20), C(20), C(20), 0, true, true, false, false, ADC_MS);
+  CHECK_EQ(f->ctrl, FAN_CTRL_FORCED);
+  CHECK_EQ(f->duty_f7, 128);
+}
+
+static void testMax6644() {
+  FanState* f =
+      updateFans(C(90), C(90), C(20), 0, false, false, false, false, ADC_MS);
+  CHECK_EQ(f->ctrl, FAN_CTRL_MAX6644);
+  CHECK_EQ(f->duty_f7, 0);
+  CHECK_EQ(f->volts_f4, 12 << 4);
+  CHECK(f->ovr_temp);
+}
+
+static void testPwmThresholds() {
+  FanState* f =
+      updateFans(C(30), C(30), C(40), 0, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->ctrl, FAN_CTRL_PWM);
+  CHECK_EQ(f->duty_f7, 0);
+  CHECK(!f->ovr_temp);
+
+  // Halfway between the amps' low and high thresholds: 30% + 0.5 * 70%
+  f = updateFans(C(52.5), C(30), C(40), 0, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 83);
+
+  // Between off and low the duty is kept, but capped at 30%
+  f = updateFans(C(42), C(30), C(40), 0, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 38);
+
+  // The hottest of the three decides
+  f = updateFans(C(30), C(56), C(40), 0, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 128);
+  f = updateFans(C(30), C(30), C(86), 0, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 128);
+  CHECK(f->ovr_temp);
+}
+
+static void testLinear() {
+  FanState* f =
+      updateFans(C(30), C(30), C(40), 0, false, true, true, false, ADC_MS);
+  CHECK_EQ(f->ctrl, FAN_CTRL_LINEAR);
+  CHECK_EQ(f->duty_f7, 0);
+  CHECK_EQ(f->dpot_val, 127);
+  uint8_t min_volts = f->volts_f4;
+
+  f = updateFans(C(52.5), C(30), C(40), 0, false, true, true, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 128);
+  CHECK(f->dpot_val > 0 && f->dpot_val < 127);
+  CHECK(f->volts_f4 > min_volts && f->volts_f4 < 12 << 4);
+
+  f = updateFans(C(65), C(30), C(40), 0, false, true, true, false, ADC_MS);
+  CHECK_EQ(f->dpot_val, 0);
+}
+
+// The DPOT table covers the whole fan voltage range, without reversing
+static void testDpotTable() {
+  CHECK_EQ(dpotValFromPercent(-1), 127);
+  CHECK_EQ(dpotValFromPercent(0), 127);
+  CHECK_EQ(dpotValFromPercent(1 << 8), 0);
+  CHECK_EQ(dpotValFromPercent(INT16_MAX), 0);
+  for (int16_t pcnt = 1; pcnt <= 1 << 8; pcnt++) {
+    CHECK(dpotValFromPercent(pcnt) <= dpotValFromPercent(pcnt - 1));
+  }
+}
+
+// Temps are scaled by each range without dividing, and reach exactly 100% at
+// the high thresholds
+static void testPercentScale() {
+  FanState* f =
+      updateFans(C(60), C(30), C(40), 0, false, true, true, false, ADC_MS);
+  CHECK_EQ(f->dpot_val, 0);
+  CHECK_EQ(f->volts_f4, 191);  // 11.99 V
+  f = updateFans(C(30), C(55), C(40), 0, false, true, true, false, ADC_MS);
+  CHECK_EQ(f->dpot_val, 0);
+  f = updateFans(C(30), C(30), C(80), 0, false, true, true, false, ADC_MS);
+  CHECK_EQ(f->dpot_val, 0);
+
+  // Just above the low threshold, barely on
+  f = updateFans(C(45.25), C(30), C(40), 0, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 39);
+}
+
+// A loud system starts the fans before the temps rise, a quiet one doesn't
+static void testFeedForward() {
+  // Every zone at full volume
+  uint8_t   load = NUM_ZONES * fanZoneLoad(0);
+  FanState* f =
+      updateFans(C(30), C(30), C(40), load, false, true, false, false, ADC_MS);
+  CHECK_EQ(load, 252);
+  CHECK(f->duty_f7 > 38);
+
+  // Quiet listening leaves them off
+  load = NUM_ZONES * fanZoneLoad(20);
+  f    =
+      updateFans(C(30), C(30), C(40), load, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 0);
+  CHECK_EQ(fanZoneLoad(79), 0);
+  CHECK_EQ(fanZoneLoad(0xFF), 0);
+
+  // The temps still win when they ask for more
+  f = updateFans(C(65), C(30), C(40), load, false, true, false, false, ADC_MS);
+  CHECK_EQ(f->duty_f7, 128);
+}
+
+// Held warm, integral control raises the fans past the fixed curve until
+// cooling off clears it
+static void testPi() {
+  FanState* f =
+      updateFans(C(55), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  uint8_t   fixed = f->duty_f7;
+  for (int i = 0; i < 1000; i++) {
+    f = updateFans(C(55), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  }
+  CHECK(f->duty_f7 > fixed);
+  CHECK(f->duty_f7 < 128);
+
+  f = updateFans(C(30), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  CHECK_EQ(f->duty_f7, 0);
+  f = updateFans(C(55), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  CHECK_EQ(f->duty_f7, fixed);
+}
+
+// The integral follows time rather than scans, so idling at the slower ADC
+// rate doesn't slow it down
+static void testPiInterval() {
+  updateFans(C(30), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  FanState* f;
+  for (int ms = 0; ms < 30000; ms += ADC_MS) {
+    f = updateFans(C(55), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  }
+  uint8_t normal = f->duty_f7;
+
+  updateFans(C(30), C(30), C(40), 0, false, true, false, true, ADC_MS);
+  for (int ms = 0; ms < 30000; ms += IDLE_ADC_MS) {
+    f = updateFans(C(55), C(30), C(40), 0, false, true, false, true,
+                   IDLE_ADC_MS);
+  }
+  CHECK_EQ(f->duty_f7, normal);
+}
+
+// Single DPOT steps from noise on the temps are ignored
+static void testDpotHysteresis() {
+  FanState* f =
+      updateFans(C(50), C(30), C(40), 0, false, true, true, false, ADC_MS);
+  uint8_t   dpot = f->dpot_val;
+  for (int16_t t = C(50) - 32; t <= C(50) + 32; t += 8) {
+    f = updateFans(t, C(30), C(40), 0, false, true, true, false, ADC_MS);
+    CHECK_EQ(f->dpot_val, dpot);
+  }
+  f = updateFans(C(55), C(30), C(40), 0, false, true, true, false, ADC_MS);
+  CHECK(f->dpot_val < dpot - 1);
+}
+
+/* The board's main loop also drives updateFanPwm() with the fake time, so
+ * these times are far past it. Periods start 4 ms after each multiple of 32.
+ */
+static void testPwm() {
+  uint32_t next;
+  CHECK(updateFanPwm(100010, 64, &next));
+  CHECK_EQ(next, 100004 + 16);
+  CHECK(!updateFanPwm(next, 64, &next));
+  CHECK_EQ(next, 100036);
+
+  // A new duty is only used from the next period
+  CHECK(!updateFanPwm(100030, 128, &next));
+  CHECK_EQ(next, 100036);
+  CHECK(updateFanPwm(100036, 128, &next));
+  CHECK_EQ(next, 100068);
+  CHECK(!updateFanPwm(100068, 0, &next));
+  CHECK_EQ(next, 100100);
+}
+
+const Test fans_tests[] = {
+    {"forced", testForced},
+    {"max6644", testMax6644},
+    {"pwm_thresholds", testPwmThresholds},
+    {"linear", testLinear},
+    {"dpot_table", testDpotTable},
+    {"percent_scale", testPercentScale},
+    {"feed_forward", testFeedForward},
+    {"pi", testPi},
+    {"pi_interval", testPiInterval},
+    {"dpot_hysteresis", testDpotHysteresis},
+    {"pwm", testPwm},
+    {NULL, NULL},
+};
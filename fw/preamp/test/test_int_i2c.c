@@ -0,0 +1,187 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Tests of the Power Board and LED Board control
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "audio_mux.h"
+#include "board.h"
+#include "fake_hal.h"
+#include "idle.h"
+#include "port_defs.h"
+#include "test.h"
+
+// MCP23008 registers
+#define MCP_GPIO 0x09
+#define MCP_OLAT 0x0A
+
+// Nothing is written to the expanders or DPOT while nothing changes, only
+// the ADC and Power Board inputs are read
+static void testIdle() {
+  boardRun(64);
+  fakeLogReset();
+  boardRun(64);
+  CHECK_EQ(fakeXferDevCount(DEV_LED_GPIO), 0);
+  CHECK_EQ(fakeXferDevCount(DEV_DPOT), 0);
+  CHECK_EQ(fakeXferDevCount(DEV_ADC), 64 / 8);
+  CHECK_EQ(fakeXferDevCount(DEV_PWR_GPIO), 64 / 2);
+}
+
+// Override the LEDs with a new value every ms for ms milliseconds, so every
+// LED update writes them
+static void changeLeds(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i++) {
+    boardWriteReg(REG_LED_VAL, (uint8_t)i);
+  }
+}
+
+// While every zone is muted and the amps are in standby, the ADC and Power
+// Board inputs are read and the LEDs updated at a low rate. Unmuting a zone
+// restores the normal rates straight away.
+static void testIdleMode() {
+  uint8_t mute    = boardReadReg(REG_MUTE);
+  uint8_t standby = boardReadReg(REG_STANDBY);
+  boardWriteReg(REG_STANDBY, 0);
+  boardWriteReg(REG_MUTE, 0x3F);
+  CHECK(isIdle());
+  boardWriteReg(REG_LED_CTRL, 1);
+  boardRun(64);
+  fakeLogReset();
+  changeLeds(256);
+  CHECK_EQ(fakeXferDevCount(DEV_LED_GPIO), 256 / IDLE_LEDS_MS);
+  CHECK_EQ(fakeXferDevCount(DEV_ADC), 256 / IDLE_ADC_MS);
+  CHECK_EQ(fakeXferDevCount(DEV_PWR_GPIO), 256 / IDLE_PWR_IN_MS);
+
+  boardWriteReg(REG_MUTE, 0x3E);
+  CHECK(!isIdle());
+  fakeLogReset();
+  changeLeds(64);
+  CHECK_EQ(fakeXferDevCount(DEV_LED_GPIO), 64 / LEDS_MS);
+  CHECK_EQ(fakeXferDevCount(DEV_ADC), 64 / ADC_MS);
+  CHECK_EQ(fakeXferDevCount(DEV_PWR_GPIO), 64 / PWR_IN_MS);
+
+  boardWriteReg(REG_LED_CTRL, 0);
+  boardWriteReg(REG_MUTE, mute);
+  boardWriteReg(REG_STANDBY, standby);
+  boardRun(8);
+}
+
+static void testLeds() {
+  boardWriteReg(REG_MUTE, 0x3F);
+  boardRun(8);
+  fakeLogReset();
+  boardWriteReg(REG_MUTE, 0x3E);
+  boardRun(8);
+  CHECK_EQ(fakeXferDevCount(DEV_LED_GPIO), 1);
+  LedGpio leds = {.data = fakeDevRegs(DEV_LED_GPIO)[MCP_OLAT]};
+  CHECK_EQ(leds.zones, 0x01);
+
+  const uint8_t ctrl[2] = {1, 0xA5};
+  boardWrite(REG_LED_CTRL, ctrl, sizeof(ctrl));
+  boardRun(8);
+  CHECK_EQ(fakeDevRegs(DEV_LED_GPIO)[MCP_OLAT], 0xA5);
+  boardWriteReg(REG_LED_CTRL, 0);
+  boardRun(8);
+  CHECK_EQ(fakeDevRegs(DEV_LED_GPIO)[MCP_OLAT], leds.data);
+}
+
+static void testPowerInputs() {
+  PwrGpio in = {.data = fakeDevRegs(DEV_PWR_GPIO)[MCP_GPIO]};
+  in.pg_12v  = 1;
+  fakeDevRegs(DEV_PWR_GPIO)[MCP_GPIO] = in.data;
+  boardRun(4);
+  PwrMsg msg = {.data = boardReadReg(REG_POWER)};
+  CHECK(msg.pg_12v);
+  CHECK(msg.en_12v);
+
+  in.pg_12v = 0;
+  fakeDevRegs(DEV_PWR_GPIO)[MCP_GPIO] = in.data;
+  boardRun(4);
+  msg.data = boardReadReg(REG_POWER);
+  CHECK(!msg.pg_12v);
+}
+
+// As in int_i2c.c. The Power Board revision changes once two checks agree,
+// and the first check after a change may still see the old revision.
+#define PWR_BOARD_CHECK_MS  10000
+#define PWR_BOARD_SWITCH_MS (3 * PWR_BOARD_CHECK_MS + 100)
+
+// Revisions, as in REG_PWR_BOARD
+#define PWR_BOARD_2A 1
+#define PWR_BOARD_3A 2
+#define PWR_BOARD_4A 3
+
+// With thermistors connected the fans are controlled from their temperatures,
+// once the Power Board revision has been checked again
+static void testAdc() {
+  CHECK_EQ(boardReadReg(REG_PWR_BOARD), PWR_BOARD_2A);
+  uint8_t* adc = fakeDevRegs(DEV_ADC);
+  adc[0]       = 0x80;  // HV1 ~36.9 V
+  adc[1]       = 0x80;
+  adc[3]       = 0x80;
+  boardRun(256);
+  CHECK(board_.hv1 >= 36 * 4 && board_.hv1 <= 37 * 4);
+  CHECK_EQ(boardReadReg(REG_HV1_VOLTAGE), board_.hv1);
+  CHECK_EQ(boardReadReg(REG_AMP_TEMP1), board_.amp_temp1);
+  CHECK_EQ(((FanMsg)boardReadReg(REG_FANS)).ctrl, FAN_CTRL_MAX6644);
+
+  // The fake DPOT ACKs, so fan voltage is controlled
+  boardRun(PWR_BOARD_SWITCH_MS);
+  CHECK_EQ(boardReadReg(REG_PWR_BOARD), PWR_BOARD_4A);
+  CHECK_EQ(((FanMsg)boardReadReg(REG_FANS)).ctrl, FAN_CTRL_LINEAR);
+
+  // Disconnected again, so later tests see the startup state
+  adc[0] = 0;
+  adc[1] = 0;
+  adc[3] = 0;
+  boardRun(1024);
+  CHECK_EQ(board_.hv1, 0);
+  boardRun(PWR_BOARD_SWITCH_MS);
+  CHECK_EQ(boardReadReg(REG_PWR_BOARD), PWR_BOARD_2A);
+  CHECK_EQ(((FanMsg)boardReadReg(REG_FANS)).ctrl, FAN_CTRL_MAX6644);
+}
+
+// Without a DPOT fan control uses FAN_ON PWM, and only each check of the
+// revision writes the DPOT
+static void testNoDpot() {
+  uint8_t* adc = fakeDevRegs(DEV_ADC);
+  adc[1]       = 0x80;
+  adc[3]       = 0x80;
+  fakeDevNack(DEV_DPOT, true);
+  boardRun(PWR_BOARD_SWITCH_MS);
+  CHECK_EQ(boardReadReg(REG_PWR_BOARD), PWR_BOARD_3A);
+  CHECK_EQ(((FanMsg)boardReadReg(REG_FANS)).ctrl, FAN_CTRL_PWM);
+  fakeLogReset();
+  boardRun(PWR_BOARD_CHECK_MS);
+  CHECK_EQ(fakeXferDevCount(DEV_DPOT), 1);
+
+  fakeDevNack(DEV_DPOT, false);
+  adc[1] = 0;
+  adc[3] = 0;
+  boardRun(PWR_BOARD_SWITCH_MS);
+  CHECK_EQ(boardReadReg(REG_PWR_BOARD), PWR_BOARD_2A);
+}
+
+const Test int_i2c_tests[] = {
+    {"idle", testIdle},
+    {"idle_mode", testIdleMode},
+    {"leds", testLeds},
+    {"power_inputs", testPowerInputs},
+    {"adc", testAdc},
+    {"no_dpot", testNoDpot},
+    {NULL, NULL},
+};
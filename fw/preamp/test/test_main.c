@@ -0,0 +1,68 @@
+/*
+ * AmpliPi Home Audio
+ * Copyright (C) 2021 MicroNova LLC
+ *
+ * Runs the host tests, or the benchmarks with --bench
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "board.h"
+#include "test.h"
+
+static const Test* const suites_[] = {
+    audio_mux_tests,
+    chain_enum_tests,
+    ctrl_i2c_tests,
+    fans_tests,
+    int_i2c_tests,
+};
+
+static const char* current_ = NULL;
+static int         failures_;
+
+void testFail(const char* file, int line, const char* expr, long a, long b) {
+  printf("%s:%d: %s: check failed: %s", file, line, current_, expr);
+  if (a != 1 || b != 0) {
+    printf(" (%ld != %ld)", a, b);
+  }
+  printf("\n");
+  failures_++;
+}
+
+int main(int argc, char** argv) {
+  boardInit();
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    return runBenchmarks() ? 1 : 0;
+  }
+
+  int failed = 0;
+  int run    = 0;
+  for (size_t s = 0; s < sizeof(suites_) / sizeof(suites_[0]); s++) {
+    for (const Test* t = suites_[s]; t->name; t++) {
+      current_  = t->name;
+      failures_ = 0;
+      boardBackground(true);
+      t->run();
+      printf("%-24s %s\n", t->name, failures_ ? "FAIL" : "ok");
+      failed += failures_ ? 1 : 0;
+      run++;
+    }
+  }
+  printf("%d of %d tests passed\n", run - failed, run);
+  return failed ? 1 : 0;
+}